@@ -0,0 +1,431 @@
+/*******************************************************************************
+ * File:          ftcli.c
+ * Description:   a command line client for ftserver built on libft. It takes
+ *   ftclient's arguments for listings, gets, changes of directory and
+ *   sessions and prints what ftclient prints, but runs every request of a
+ *   command from one event loop: the names of a -g and the commands of a -s
+ *   script are all sent at once, spread over a few sessions, and their
+ *   results are printed in order as they finish. ftcli always uses passive
+ *   mode, so client_port is ignored. Recursive gets, puts, ranged, delta and
+ *   compressed transfers and listing options are left to ftclient.
+ * Input:
+ *   argv[1] - name of host that ftserver is running on
+ *   argv[2] - port number that ftserver is listening on
+ *   argv[3] - port number for connection Q (ignored)
+ *   argv[4] - the command: -l, -la, -g, -c or -s
+ *   argv[5:] - the file names for -g, the directory for -c, the script for
+ *     -s, then options, see usage()
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "ftlib.h"
+
+#define TRUE 1
+#define FALSE 0
+#define DEFAULT_SESSIONS 4
+#define MAX_SESSIONS 64
+#define MAX_LINE_LENGTH 4200
+
+/* A command and what it is waiting for */
+struct request {
+  const char* command;
+  char* name;
+  // for -g, the file written, and whether name already existed
+  char* localName;
+  int renamed;
+  int fileFD;
+  int error;
+  struct ftOperation* operation;
+  uint64_t received;
+  int64_t sentAt;
+  int64_t finishedAt;
+};
+
+// the command line
+const char* HOST;
+const char* PORT;
+int SESSIONS = 0;
+int FLAGS = 0;
+
+
+/*******************************************************************************
+ *                       int64_t monotonicNanos()
+ * Description: reads the monotonic clock
+ * Input: none
+ * Output: the time in nanoseconds
+*******************************************************************************/
+int64_t monotonicNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+/*******************************************************************************
+ *                              void usage()
+ * Description: prints how to run ftcli and exits
+*******************************************************************************/
+void usage() {
+  fprintf(stderr,
+          "usage: ftcli <host> <port> <client_port> -l|-la|-g <name>...|-c <dir>|-s [script] [options]\n"
+          "  --sessions <n>       sessions to spread the requests over (default %d)\n"
+          "  --no-checksum        don't verify the data against ftserver's CRC-32\n"
+          "  --passive            accepted for ftclient compatibility; ftcli is always passive\n"
+          "Recursive gets, puts and the other ftclient options need ftclient.\n",
+          DEFAULT_SESSIONS);
+  exit(1);
+}
+
+
+/*******************************************************************************
+ *                 char* localFileName(const char* name)
+ * Description: picks the file a get is saved to, as ftclient does: the name
+ *   itself, or if that exists the first free name with _1, _2 and so on
+ *   added before the first dot
+ * Input: const char* name - the name of the file being got
+ * Output: the name to write, which the caller frees
+*******************************************************************************/
+char* localFileName(const char* name) {
+  const char* dot = strchr(name, '.');
+  int prefixLength = dot != NULL ? dot - name : (int)strlen(name);
+  char* result = strdup(name);
+  int suffix;
+
+  for (suffix = 1; result != NULL && access(result, F_OK) == 0; suffix++) {
+    free(result);
+    if (asprintf(&result, "%.*s_%d%s", prefixLength, name, suffix, dot != NULL ? dot : "") < 0) {
+      result = NULL;
+    }
+  }
+  if (result == NULL) {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(1);
+  }
+  return result;
+}
+
+
+/*******************************************************************************
+ *     void finished(struct ftOperation* operation, void* argument)
+ * Description: the callback recording when a request's operation finished
+ * Input:
+ *   struct ftOperation* operation - the operation
+ *   void* argument - the request
+ * Output: none
+*******************************************************************************/
+void finished(struct ftOperation* operation, void* argument) {
+  ((struct request*)argument)->finishedAt = monotonicNanos();
+}
+
+
+/*******************************************************************************
+ *  void startRequest(struct ftClient* client, struct request* request)
+ * Description: starts a request's operation without waiting for it. A get
+ *   opens the local file first, so gets of the same name in one command are
+ *   each saved under a name of their own
+ * Input:
+ *   struct ftClient* client - the client
+ *   struct request* request - the request
+ * Output: none
+*******************************************************************************/
+void startRequest(struct ftClient* client, struct request* request) {
+  request->fileFD = -1;
+  request->sentAt = monotonicNanos();
+  if (strcmp(request->command, "-g") == 0) {
+    request->localName = localFileName(request->name);
+    request->renamed = strcmp(request->localName, request->name) != 0;
+    request->fileFD = open(request->localName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (request->fileFD < 0) {
+      request->error = errno;
+      return;
+    }
+    request->operation = ftGetFile(client, request->name, request->fileFD);
+  }
+  else if (strcmp(request->command, "-c") == 0) {
+    request->operation = ftChangeDirectory(client, request->name);
+  }
+  else {
+    request->operation = ftList(client, strcmp(request->command, "-la") == 0, NULL, 0);
+  }
+  if (request->operation == NULL) {
+    fprintf(stderr, "ERROR starting %s %s: %s\n", request->command, request->name, strerror(errno));
+    exit(1);
+  }
+  ftSetCallback(request->operation, finished, request);
+}
+
+
+/*******************************************************************************
+ *                 void printListing(struct ftOperation* list)
+ * Description: prints the entries of a listing as ftclient does, one per line
+ *   with its type, size and modification time. Directory names end in /
+ * Input: struct ftOperation* list - the finished listing
+ * Output: none
+*******************************************************************************/
+void printListing(struct ftOperation* list) {
+  static const char types[] = "?-dl?";
+  struct ftEntry entry;
+  size_t position = 0;
+  char modified[32];
+
+  while (ftNextEntry(ftData(list), ftReceived(list), &position, &entry)) {
+    strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M", localtime(&entry.modified));
+    printf("%c %12llu  %s  %.*s%s\n", types[entry.type <= FT_ENTRY_OTHER ? entry.type : 0],
+           (unsigned long long)entry.size, modified, (int)entry.nameLength, entry.name,
+           entry.type == FT_ENTRY_DIRECTORY ? "/" : "");
+  }
+}
+
+
+/*******************************************************************************
+ *       int reportRequest(struct ftClient* client, struct request* request)
+ * Description: waits for a request to finish and prints its result as
+ *   ftclient would. A get that fails before any data arrives removes the
+ *   file it created
+ * Input:
+ *   struct ftClient* client - the client
+ *   struct request* request - the request
+ * Output: TRUE if the request succeeded
+*******************************************************************************/
+int reportRequest(struct ftClient* client, struct request* request) {
+  struct ftOperation* operation = request->operation;
+  int isGet = strcmp(request->command, "-g") == 0;
+  int status;
+
+  if (isGet && request->renamed) {
+    printf("%s already exists.\nWriting to %s instead...\n", request->name, request->localName);
+  }
+  if (operation == NULL) {
+    printf("%s: %s\n", request->localName, strerror(request->error));
+    return FALSE;
+  }
+  status = ftWait(client, operation);
+  if (request->fileFD >= 0) {
+    close(request->fileFD);
+  }
+  if (isGet && ftReceived(operation) == 0 && status != FT_OK) {
+    unlink(request->localName);
+  }
+  if (status == FT_CONNECTION_LOST && isGet && ftReceived(operation) > 0) {
+    printf("Transfer interrupted after %llu Bytes. Use ftclient --resume to continue.\n",
+           (unsigned long long)ftReceived(operation));
+  }
+  else if (status == FT_CONNECTION_LOST) {
+    printf("ftserver closed the session\n");
+  }
+  else if (status == FT_CHECKSUM_MISMATCH) {
+    printf("Checksum mismatch: the data is corrupt.\nGet %s again to replace it.\n", request->localName);
+  }
+  else if (status == FT_WRITE_FAILED) {
+    printf("%s: %s\n", request->localName, ftMessage(operation));
+  }
+  else if (status != FT_OK) {
+    printf("%s\n", ftMessage(operation)[0] != '\0' ? ftMessage(operation) : "Request failed");
+  }
+  else if (isGet) {
+    if (ftHoles(operation) > 0) {
+      printf("Skipped %llu Bytes of holes, which were left sparse.\n", (unsigned long long)ftHoles(operation));
+    }
+    if (ftVerified(operation)) {
+      printf("Checksum verified (CRC-32).\n");
+    }
+    printf("File transfer complete.\n");
+  }
+  else if (strcmp(request->command, "-c") != 0) {
+    printListing(operation);
+  }
+  request->received = ftReceived(operation);
+  ftRelease(operation);
+  return status == FT_OK;
+}
+
+
+/*******************************************************************************
+ *  int readScript(const char* scriptName, struct request** requests)
+ * Description: reads the commands of a session, one per line, in the same
+ *   form as on the command line, for example "-g notes.txt". Commands only
+ *   ftclient runs are skipped
+ * Input:
+ *   const char* scriptName - the file to read, or "" or "-" for stdin
+ *   struct request** requests - set to the commands read
+ * Output: the number of commands read
+*******************************************************************************/
+int readScript(const char* scriptName, struct request** requests) {
+  FILE* source = stdin;
+  char line[MAX_LINE_LENGTH];
+  int count = 0, capacity = 0;
+
+  if (scriptName[0] != '\0' && strcmp(scriptName, "-") != 0) {
+    source = fopen(scriptName, "r");
+    if (source == NULL) {
+      fprintf(stderr, "ERROR opening %s: %s\n", scriptName, strerror(errno));
+      exit(1);
+    }
+  }
+  *requests = NULL;
+  while (fgets(line, sizeof(line), source) != NULL) {
+    char* command = line + strspn(line, " \t\r\n");
+    char* name = command + strcspn(command, " \t\r\n");
+    char* end;
+    if (*command == '\0') {
+      continue;
+    }
+    if (*name != '\0') {
+      *name++ = '\0';
+    }
+    name += strspn(name, " \t");
+    for (end = name + strlen(name); end > name && strchr(" \t\r\n", end[-1]) != NULL; end--) {
+    }
+    *end = '\0';
+    if (strcmp(command, "-r") == 0 || strcmp(command, "-p") == 0) {
+      printf("Skipping %s %s: ftcli does not support %s; use ftclient\n", command, name, command);
+    }
+    else if (strcmp(command, "-l") != 0 && strcmp(command, "-la") != 0 && strcmp(command, "-g") != 0 &&
+             strcmp(command, "-c") != 0) {
+      printf("Skipping unrecognized command: %s%s%s\n", command, *name != '\0' ? " " : "", name);
+    }
+    else if ((command[1] == 'g' || command[1] == 'c') && *name == '\0') {
+      printf("The %s command requires a file or folder name be supplied\n", command);
+    }
+    else {
+      if (count == capacity) {
+        capacity = capacity == 0 ? 64 : capacity * 2;
+        *requests = realloc(*requests, capacity * sizeof(struct request));
+        if (*requests == NULL) {
+          fprintf(stderr, "ERROR: out of memory\n");
+          exit(1);
+        }
+      }
+      memset(&(*requests)[count], '\0', sizeof(struct request));
+      (*requests)[count].command = command[1] == 'g' ? "-g" : command[1] == 'c' ? "-c" :
+                                   command[2] == 'a' ? "-la" : "-l";
+      (*requests)[count].name = strdup(name);
+      count++;
+    }
+  }
+  if (source != stdin) {
+    fclose(source);
+  }
+  return count;
+}
+
+
+/*******************************************************************************
+ *                    int main(int argc, char* argv[])
+ * Description: parses the command line, opens the sessions, starts every
+ *   request of the command at once and reports each in order
+*******************************************************************************/
+int main(int argc, char* argv[]) {
+  struct request* requests = NULL;
+  int count = 0, succeeded = 0, i;
+  uint64_t received = 0;
+  const char* command;
+  const char* scriptName = "";
+
+  if (argc < 5) {
+    usage();
+  }
+  HOST = argv[1];
+  PORT = argv[2];
+  command = argv[4];
+  if (strcmp(command, "-r") == 0 || strcmp(command, "-p") == 0) {
+    printf("ftcli does not support %s; use ftclient\n", command);
+    exit(1);
+  }
+  requests = calloc(argc, sizeof(struct request));
+  for (i = 5; i < argc; i++) {
+    if (strcmp(argv[i], "--sessions") == 0 && i + 1 < argc) {
+      SESSIONS = atoi(argv[++i]);
+      if (SESSIONS < 1 || SESSIONS > MAX_SESSIONS) {
+        fprintf(stderr, "--sessions must be 1 to %d\n", MAX_SESSIONS);
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "--no-checksum") == 0) {
+      FLAGS |= FT_NO_CHECKSUM;
+    }
+    else if (strcmp(argv[i], "--passive") == 0) {
+    }
+    else if (strncmp(argv[i], "--", 2) == 0) {
+      printf("ftcli does not support %s; use ftclient\n", argv[i]);
+      exit(1);
+    }
+    else if (strcmp(command, "-s") == 0 && count == 0 && scriptName[0] == '\0') {
+      scriptName = argv[i];
+    }
+    else if ((strcmp(command, "-g") == 0 || (strcmp(command, "-c") == 0 && count == 0)) &&
+             strpbrk(argv[i], "*?[") == NULL) {
+      requests[count].command = command;
+      requests[count].name = argv[i];
+      count++;
+    }
+    else if (strcmp(command, "-g") == 0) {
+      printf("ftcli does not expand globs such as %s; use ftclient\n", argv[i]);
+      exit(1);
+    }
+    else {
+      usage();
+    }
+  }
+  if (strcmp(command, "-l") == 0 || strcmp(command, "-la") == 0) {
+    requests[count++].command = command;
+  }
+  else if (strcmp(command, "-s") == 0) {
+    free(requests);
+    count = readScript(scriptName, &requests);
+  }
+  else if (strcmp(command, "-g") != 0 && strcmp(command, "-c") != 0) {
+    printf("Invalid command\n\n");
+    exit(1);
+  }
+  else if (count == 0) {
+    printf("The %s command requires a file or folder name be supplied\n\n", command);
+    exit(1);
+  }
+
+  int64_t start = monotonicNanos();
+  if (count > 0) {
+    if (SESSIONS == 0) {
+      SESSIONS = count < DEFAULT_SESSIONS ? count : DEFAULT_SESSIONS;
+    }
+    struct ftClient* client = ftOpen(HOST, PORT, SESSIONS, FLAGS);
+    if (client == NULL) {
+      printf("An exception occured in establishing connection P\n");
+      exit(1);
+    }
+    for (i = 0; i < count; i++) {
+      startRequest(client, &requests[i]);
+    }
+    for (i = 0; i < count; i++) {
+      succeeded += reportRequest(client, &requests[i]);
+      received += requests[i].received;
+    }
+    ftClose(client);
+  }
+
+  if (strcmp(command, "-g") == 0 && count > 1) {
+    printf("Received %d of %d files, %llu Bytes.\n", succeeded, count, (unsigned long long)received);
+    if (succeeded == count) {
+      printf("Batch transfer complete.\n");
+    }
+  }
+  if (strcmp(command, "-s") == 0 && count > 0) {
+    double elapsed = (monotonicNanos() - start) / 1e9, latency = 0;
+    for (i = 0; i < count; i++) {
+      latency += (requests[i].finishedAt - requests[i].sentAt) / 1e9;
+    }
+    printf("Completed %d requests in %.3f seconds (%.2f ms per request, %.2f ms mean latency)\n",
+           count, elapsed, elapsed * 1000 / count, latency * 1000 / count);
+  }
+  printf("\n");
+  return succeeded == count ? 0 : 1;
+}
@@ -0,0 +1,1473 @@
+/*******************************************************************************
+ * File:          ftlib.c
+ * Description:   libft, a client library for ftserver; ftlib.h shows how it
+ *   is used. Each session is a connection P for requests and responses and
+ *   a connection Q for data, both non-blocking and watched by the client's
+ *   epoll instance. Requests are pipelined: a new operation goes to the
+ *   session with the fewest operations in flight and is sent straight away,
+ *   and ftserver answers each session's requests in order. Frames on
+ *   connection Q carry the id of the request they answer, so DATA payloads
+ *   are written into the right operation's buffer or file as they arrive.
+ *   The rest of a large payload is read from the socket straight into the
+ *   caller's buffer, without passing through the library's.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <zlib.h>
+#include "ftlib.h"
+
+#define TRUE 1
+#define FALSE 0
+#define PROTOCOL_MAGIC 0x4654
+#define PROTOCOL_VERSION 1
+#define FRAME_HEADER_LENGTH 20
+#define ATTRIBUTE_HEADER_LENGTH 6
+#define DATA_OFFSET_LENGTH 8
+#define HOLE_PAYLOAD_LENGTH 16
+#define ENTRY_HEADER_LENGTH 19
+#define FRAME_HELLO 1
+#define FRAME_LIST 2
+#define FRAME_GET 3
+#define FRAME_CD 4
+#define FRAME_RESPONSE 32
+#define FRAME_DATA 34
+#define FRAME_END 35
+#define FRAME_HOLE 38
+#define STATUS_OK 0
+#define ATTR_CAPABILITIES 1
+#define ATTR_DATA_PORT 2
+#define ATTR_NAME 3
+#define ATTR_LENGTH 5
+#define ATTR_SHOW_HIDDEN 7
+#define ATTR_FILE_SIZE 8
+#define ATTR_MESSAGE 9
+#define ATTR_CHECKSUM 21
+#define ATTR_DIGEST 22
+#define CAP_CHECKSUM 0x10
+#define CAP_PASSIVE 0x100
+#define CAP_SPARSE 0x200
+#define CLIENT_CAPABILITIES (CAP_CHECKSUM | CAP_PASSIVE | CAP_SPARSE)
+#define CHECKSUM_CRC32 1
+#define MAX_SESSIONS 64
+#define MAX_NAME_LENGTH 4096
+#define MAX_REQUEST_LENGTH (FRAME_HEADER_LENGTH + 3 * ATTRIBUTE_HEADER_LENGTH + MAX_NAME_LENGTH + 2)
+#define MAX_MESSAGE_LENGTH 256
+#define MAX_EVENTS 64
+// frames other than DATA are read whole into a session's input buffer, so
+// they may be at most MAX_FRAME_LENGTH bytes. A DATA payload with at least
+// DIRECT_READ_LENGTH bytes still to come is read straight into the caller's
+// buffer
+#define MAX_FRAME_LENGTH (64 * 1024)
+#define INPUT_BUFFER_LENGTH (256 * 1024)
+#define DIRECT_READ_LENGTH (64 * 1024)
+#define MIN_BUFFER_LENGTH (64 * 1024)
+
+/* Bytes read from a connection and not yet used, from start to end */
+struct input {
+  unsigned char* bytes;
+  size_t start;
+  size_t end;
+};
+
+struct session;
+
+/* What a connection's epoll events point to */
+struct endpoint {
+  struct session* session;
+  int isQ;
+};
+
+/* A request and what has come back for it so far */
+struct ftOperation {
+  struct ftClient* client;
+  // the FRAME_ type of the request, its id, and the session a GET or LIST
+  // was sent on. A change of directory is sent on every session
+  int type;
+  uint32_t id;
+  struct session* session;
+  // FT_PENDING until the operation finishes. responseStatus is the worst
+  // status ftserver answered with and failure anything the library found
+  int status;
+  int responseStatus;
+  int failure;
+  char message[MAX_MESSAGE_LENGTH];
+  // the responses still to come, and whether data follows them on
+  // connection Q and has ended
+  int waitingResponses;
+  int expectData;
+  int ended;
+  // where the data goes: the caller's buffer, one the library allocated and
+  // grows, or a file
+  unsigned char* buffer;
+  size_t capacity;
+  int ownsBuffer;
+  int fileFD;
+  // the file's size, the bytes received (counting holes), the bytes of
+  // holes, and one past the last byte received
+  uint64_t fileSize;
+  uint64_t received;
+  uint64_t holes;
+  uint64_t end;
+  // the CRC-32 of the data so far, if one was asked for, and whether it
+  // matched the one ftserver sent
+  int checksum;
+  uint32_t digest;
+  int verified;
+  int released;
+  ftCallback callback;
+  void* argument;
+};
+
+/* One session: connections P and Q, the requests waiting to be sent on P,
+   and the operations waiting for answers, in the order they were sent */
+struct session {
+  struct ftClient* client;
+  int p;
+  int q;
+  int failed;
+  struct endpoint pEndpoint;
+  struct endpoint qEndpoint;
+  unsigned char* output;
+  size_t outputLength;
+  size_t outputSent;
+  size_t outputCapacity;
+  int watchingOutput;
+  struct input pInput;
+  struct input qInput;
+  // the DATA frame being read from connection Q: the operation it answers,
+  // where its next byte belongs and how many bytes are left
+  struct ftOperation* current;
+  uint64_t position;
+  uint64_t remaining;
+  struct ftOperation** flight;
+  size_t flightCount;
+  size_t flightCapacity;
+};
+
+struct ftClient {
+  int epollFD;
+  int flags;
+  uint32_t capabilities;
+  struct session sessions[MAX_SESSIONS];
+  int sessionCount;
+  uint32_t nextId;
+  // operations not yet finished, and those finished by the current ftPoll()
+  int inFlight;
+  int completed;
+};
+
+
+/*******************************************************************************
+ *      void putUint16/putUint32/putUint64(unsigned char*, value)
+ *      uint64_t getUint(const unsigned char* source, int size)
+ * Description: store and load integers in network byte order
+*******************************************************************************/
+static void putUint16(unsigned char* destination, uint16_t value) {
+  destination[0] = value >> 8;
+  destination[1] = value;
+}
+
+static void putUint32(unsigned char* destination, uint32_t value) {
+  putUint16(destination, value >> 16);
+  putUint16(destination + 2, value);
+}
+
+static void putUint64(unsigned char* destination, uint64_t value) {
+  putUint32(destination, value >> 32);
+  putUint32(destination + 4, value);
+}
+
+static uint64_t getUint(const unsigned char* source, int size) {
+  uint64_t value = 0;
+  int i;
+  for (i = 0; i < size; i++) {
+    value = (value << 8) | source[i];
+  }
+  return value;
+}
+
+
+/*******************************************************************************
+ *  size_t addAttribute(unsigned char* frame, size_t length, int tag,
+ *                      const void* value, size_t valueLength)
+ *  size_t addUintAttribute(unsigned char* frame, size_t length, int tag,
+ *                          uint64_t value, int size)
+ * Description: append an attribute to a request being built
+ * Input:
+ *   unsigned char* frame - the request
+ *   size_t length - its length so far
+ *   int tag - the ATTR_ tag
+ *   value - the value, as bytes or as a size byte integer
+ * Output: the new length of the request
+*******************************************************************************/
+static size_t addAttribute(unsigned char* frame, size_t length, int tag, const void* value, size_t valueLength) {
+  putUint16(frame + length, tag);
+  putUint32(frame + length + 2, valueLength);
+  memcpy(frame + length + ATTRIBUTE_HEADER_LENGTH, value, valueLength);
+  return length + ATTRIBUTE_HEADER_LENGTH + valueLength;
+}
+
+static size_t addUintAttribute(unsigned char* frame, size_t length, int tag, uint64_t value, int size) {
+  unsigned char bytes[8];
+  putUint64(bytes, value);
+  return addAttribute(frame, length, tag, bytes + 8 - size, size);
+}
+
+
+/*******************************************************************************
+ *  void putFrameHeader(unsigned char* frame, int type, uint32_t requestId,
+ *                      uint64_t length)
+ * Description: writes the header of a request whose payload is length bytes
+ * Input:
+ *   unsigned char* frame - the request
+ *   int type - the FRAME_ type
+ *   uint32_t requestId - the id the answer will carry
+ *   uint64_t length - the number of payload bytes
+ * Output: none
+*******************************************************************************/
+static void putFrameHeader(unsigned char* frame, int type, uint32_t requestId, uint64_t length) {
+  putUint16(frame, PROTOCOL_MAGIC);
+  frame[2] = PROTOCOL_VERSION;
+  frame[3] = type;
+  putUint16(frame + 4, 0);
+  putUint16(frame + 6, 0);
+  putUint32(frame + 8, requestId);
+  putUint64(frame + 12, length);
+}
+
+
+/*******************************************************************************
+ *  int findAttribute(const unsigned char* payload, size_t length, int tag,
+ *                    const unsigned char** value, size_t* valueLength)
+ * Description: looks for an attribute in the payload of a frame
+ * Input:
+ *   const unsigned char* payload - the attributes
+ *   size_t length - their length
+ *   int tag - the ATTR_ tag to look for
+ *   value, valueLength - filled in with the attribute's value
+ * Output: TRUE if the attribute was found
+*******************************************************************************/
+static int findAttribute(const unsigned char* payload, size_t length, int tag,
+                         const unsigned char** value, size_t* valueLength) {
+  size_t position = 0;
+  while (position + ATTRIBUTE_HEADER_LENGTH <= length) {
+    size_t attributeLength = getUint(payload + position + 2, 4);
+    if (attributeLength > length - position - ATTRIBUTE_HEADER_LENGTH) {
+      return FALSE;
+    }
+    if (getUint(payload + position, 2) == tag) {
+      *value = payload + position + ATTRIBUTE_HEADER_LENGTH;
+      *valueLength = attributeLength;
+      return TRUE;
+    }
+    position += ATTRIBUTE_HEADER_LENGTH + attributeLength;
+  }
+  return FALSE;
+}
+
+static uint64_t getUintAttribute(const unsigned char* payload, size_t length, int tag, uint64_t defaultValue) {
+  const unsigned char* value;
+  size_t valueLength;
+  if (!findAttribute(payload, length, tag, &value, &valueLength) || valueLength > 8) {
+    return defaultValue;
+  }
+  return getUint(value, valueLength);
+}
+
+
+/*******************************************************************************
+ *             uint32_t crc32Zeros(uint32_t crc, off_t length)
+ * Description: adds a run of zero bytes to a running CRC-32 without reading
+ *   them, as ftserver does for the holes of a sparse file
+ * Input:
+ *   uint32_t crc - the CRC of the bytes before the zeros
+ *   off_t length - the number of zeros
+ * Output: the CRC including the zeros
+*******************************************************************************/
+static uint32_t crc32Zeros(uint32_t crc, off_t length) {
+  return ~crc32_combine(~crc & 0xffffffff, 0, length);
+}
+
+
+/*******************************************************************************
+ *           int connectTo(const char* host, const char* port)
+ * Description: opens a TCP connection, trying each address of the host
+ * Input:
+ *   const char* host - the host name or address
+ *   const char* port - the port number
+ * Output: the connected socket, or -1
+*******************************************************************************/
+static int connectTo(const char* host, const char* port) {
+  struct addrinfo hints, *addresses, *address;
+  int fd = -1;
+  memset(&hints, '\0', sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &addresses) != 0) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  for (address = addresses; address != NULL && fd < 0; address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+    if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  return fd;
+}
+
+
+/*******************************************************************************
+ *  int openSession(struct ftClient*, struct session*, const char* host,
+ *                  const char* port)
+ * Description: opens a passive-mode session: sends a HELLO on connection P,
+ *   waits for ftserver's, and connects connection Q to the port it names.
+ *   Both connections are then made non-blocking and added to the client's
+ *   epoll instance
+ * Input:
+ *   struct ftClient* client - the client
+ *   struct session* session - the session to open
+ *   const char* host, port - where ftserver listens
+ * Output: TRUE if the session is open, FALSE otherwise
+*******************************************************************************/
+static int openSession(struct ftClient* client, struct session* session, const char* host, const char* port) {
+  unsigned char hello[MAX_FRAME_LENGTH];
+  size_t length = FRAME_HEADER_LENGTH, received = 0;
+  struct epoll_event event;
+  int one = 1;
+
+  session->client = client;
+  session->q = -1;
+  session->p = connectTo(host, port);
+  if (session->p < 0) {
+    return FALSE;
+  }
+  setsockopt(session->p, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  length = addUintAttribute(hello, length, ATTR_CAPABILITIES, CLIENT_CAPABILITIES, 4);
+  length = addUintAttribute(hello, length, ATTR_DATA_PORT, 0, 2);
+  putFrameHeader(hello, FRAME_HELLO, 0, length - FRAME_HEADER_LENGTH);
+  if (send(session->p, hello, length, MSG_NOSIGNAL) != (ssize_t)length) {
+    return FALSE;
+  }
+
+  // read ftserver's HELLO whole
+  length = FRAME_HEADER_LENGTH;
+  while (received < length) {
+    ssize_t count = recv(session->p, hello + received, length - received, 0);
+    if (count <= 0 && !(count < 0 && errno == EINTR)) {
+      errno = ECONNRESET;
+      return FALSE;
+    }
+    received += count > 0 ? count : 0;
+    if (received == FRAME_HEADER_LENGTH) {
+      uint64_t payload = getUint(hello + 12, 8);
+      if (getUint(hello, 2) != PROTOCOL_MAGIC || hello[3] != FRAME_HELLO ||
+          payload > MAX_FRAME_LENGTH - FRAME_HEADER_LENGTH) {
+        errno = EPROTO;
+        return FALSE;
+      }
+      length += payload;
+    }
+  }
+  const unsigned char* attributes = hello + FRAME_HEADER_LENGTH;
+  size_t attributeLength = length - FRAME_HEADER_LENGTH;
+  uint64_t dataPort = getUintAttribute(attributes, attributeLength, ATTR_DATA_PORT, 0);
+  client->capabilities = getUintAttribute(attributes, attributeLength, ATTR_CAPABILITIES, 0);
+  if (getUint(hello + 4, 2) != STATUS_OK || !(client->capabilities & CAP_PASSIVE) || dataPort == 0) {
+    errno = EPROTONOSUPPORT;
+    return FALSE;
+  }
+
+  struct sockaddr_storage address;
+  socklen_t addressLength = sizeof(address);
+  if (getpeername(session->p, (struct sockaddr*)&address, &addressLength) < 0) {
+    return FALSE;
+  }
+  if (address.ss_family == AF_INET6) {
+    ((struct sockaddr_in6*)&address)->sin6_port = htons(dataPort);
+  }
+  else {
+    ((struct sockaddr_in*)&address)->sin_port = htons(dataPort);
+  }
+  session->q = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (session->q < 0 || connect(session->q, (struct sockaddr*)&address, addressLength) < 0) {
+    return FALSE;
+  }
+
+  session->pInput.bytes = malloc(INPUT_BUFFER_LENGTH);
+  session->qInput.bytes = malloc(INPUT_BUFFER_LENGTH);
+  if (session->pInput.bytes == NULL || session->qInput.bytes == NULL) {
+    errno = ENOMEM;
+    return FALSE;
+  }
+  fcntl(session->p, F_SETFL, fcntl(session->p, F_GETFL) | O_NONBLOCK);
+  fcntl(session->q, F_SETFL, fcntl(session->q, F_GETFL) | O_NONBLOCK);
+  session->pEndpoint.session = session;
+  session->pEndpoint.isQ = FALSE;
+  session->qEndpoint.session = session;
+  session->qEndpoint.isQ = TRUE;
+  event.events = EPOLLIN;
+  event.data.ptr = &session->pEndpoint;
+  if (epoll_ctl(client->epollFD, EPOLL_CTL_ADD, session->p, &event) < 0) {
+    return FALSE;
+  }
+  event.data.ptr = &session->qEndpoint;
+  return epoll_ctl(client->epollFD, EPOLL_CTL_ADD, session->q, &event) == 0;
+}
+
+
+/*******************************************************************************
+ *                  void closeSession(struct session* session)
+ * Description: closes a session's connections and frees its buffers
+ * Input: struct session* session - the session
+ * Output: none
+*******************************************************************************/
+static void closeSession(struct session* session) {
+  if (session->p >= 0) {
+    close(session->p);
+  }
+  if (session->q >= 0) {
+    close(session->q);
+  }
+  session->p = -1;
+  session->q = -1;
+  free(session->pInput.bytes);
+  free(session->qInput.bytes);
+  free(session->output);
+  free(session->flight);
+  session->pInput.bytes = NULL;
+  session->qInput.bytes = NULL;
+  session->output = NULL;
+  session->flight = NULL;
+}
+
+
+/*******************************************************************************
+ * struct ftClient* ftOpen(const char* host, const char* port, int sessions,
+ *                         int flags)
+ * Description: connects to ftserver and opens sessions with it in passive
+ *   mode, so no port has to be listened on. This is the only call that
+ *   blocks: it returns once every session is open. Operations are spread
+ *   over the sessions, so more sessions let more requests be served at once
+ * Input:
+ *   const char* host - the name or address of ftserver's host
+ *   const char* port - the port ftserver listens on
+ *   int sessions - the number of sessions, 1 to 64
+ *   int flags - FT_NO_CHECKSUM, or 0
+ * Output: the client, or NULL with errno set if a session couldn't be opened
+*******************************************************************************/
+struct ftClient* ftOpen(const char* host, const char* port, int sessions, int flags) {
+  int i;
+  if (sessions < 1 || sessions > MAX_SESSIONS) {
+    errno = EINVAL;
+    return NULL;
+  }
+  struct ftClient* client = calloc(1, sizeof(struct ftClient));
+  if (client == NULL) {
+    return NULL;
+  }
+  client->flags = flags;
+  client->epollFD = epoll_create1(EPOLL_CLOEXEC);
+  for (i = 0; i < MAX_SESSIONS; i++) {
+    client->sessions[i].p = -1;
+    client->sessions[i].q = -1;
+  }
+  for (i = 0; i < sessions && client->epollFD >= 0; i++) {
+    client->sessionCount++;
+    if (!openSession(client, &client->sessions[i], host, port)) {
+      break;
+    }
+  }
+  if (client->epollFD < 0 || i < sessions) {
+    int error = errno;
+    ftClose(client);
+    errno = error;
+    return NULL;
+  }
+  return client;
+}
+
+
+/*******************************************************************************
+ *                 void ftClose(struct ftClient* client)
+ * Description: ends every session and frees the client. Operations still
+ *   in flight are freed too; finished ones the caller hasn't released are
+ *   not, and must still be released. Must not be called from a callback
+ * Input: struct ftClient* client - the client
+ * Output: none
+*******************************************************************************/
+void ftClose(struct ftClient* client) {
+  int i;
+  size_t j;
+  for (i = 0; i < client->sessionCount; i++) {
+    struct session* session = &client->sessions[i];
+    for (j = 0; j < session->flightCount; j++) {
+      struct ftOperation* operation = session->flight[j];
+      // a change of directory is in every session's list, so it is freed
+      // by the last one
+      if (operation->type == FRAME_CD && --operation->waitingResponses > 0) {
+        continue;
+      }
+      if (operation->ownsBuffer) {
+        free(operation->buffer);
+      }
+      free(operation);
+    }
+    closeSession(session);
+  }
+  if (client->epollFD >= 0) {
+    close(client->epollFD);
+  }
+  free(client);
+}
+
+
+/*******************************************************************************
+ *                int ftDescriptor(struct ftClient* client)
+ * Description: gives the file descriptor that becomes readable when the
+ *   client has something to do, so it can be watched by the caller's own
+ *   event loop, which then calls ftPoll() with a timeout of 0
+ * Input: struct ftClient* client - the client
+ * Output: the descriptor
+*******************************************************************************/
+int ftDescriptor(struct ftClient* client) {
+  return client->epollFD;
+}
+
+
+/*******************************************************************************
+ *     void watchOutput(struct session* session, int watch)
+ * Description: asks epoll to report when connection P can take more of the
+ *   requests waiting to be sent, or stops asking
+ * Input:
+ *   struct session* session - the session
+ *   int watch - TRUE to watch for room to send
+ * Output: none
+*******************************************************************************/
+static void watchOutput(struct session* session, int watch) {
+  struct epoll_event event;
+  if (session->watchingOutput == watch) {
+    return;
+  }
+  event.events = EPOLLIN | (watch ? EPOLLOUT : 0);
+  event.data.ptr = &session->pEndpoint;
+  epoll_ctl(session->client->epollFD, EPOLL_CTL_MOD, session->p, &event);
+  session->watchingOutput = watch;
+}
+
+
+/*******************************************************************************
+ *              int flushOutput(struct session* session)
+ * Description: sends as much of the requests waiting for connection P as
+ *   the socket will take
+ * Input: struct session* session - the session
+ * Output: TRUE unless the connection failed
+*******************************************************************************/
+static int flushOutput(struct session* session) {
+  while (session->outputSent < session->outputLength) {
+    ssize_t sent = send(session->p, session->output + session->outputSent,
+                        session->outputLength - session->outputSent, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent < 0 && errno == EAGAIN) {
+      watchOutput(session, TRUE);
+      return TRUE;
+    }
+    if (sent < 0) {
+      return FALSE;
+    }
+    session->outputSent += sent;
+  }
+  session->outputLength = 0;
+  session->outputSent = 0;
+  watchOutput(session, FALSE);
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ * int growBuffer(unsigned char** bytes, size_t* capacity, size_t needed)
+ * Description: makes a buffer the library allocated big enough to hold
+ *   needed bytes, at least doubling it each time it grows
+ * Input:
+ *   unsigned char** bytes - the buffer, which may be moved
+ *   size_t* capacity - its size, which is updated
+ *   size_t needed - the size it must be
+ * Output: TRUE on success, FALSE if memory ran out
+*******************************************************************************/
+static int growBuffer(unsigned char** bytes, size_t* capacity, size_t needed) {
+  if (needed <= *capacity) {
+    return TRUE;
+  }
+  size_t size = *capacity < MIN_BUFFER_LENGTH ? MIN_BUFFER_LENGTH : *capacity;
+  while (size < needed) {
+    size *= 2;
+  }
+  unsigned char* grown = realloc(*bytes, size);
+  if (grown == NULL) {
+    return FALSE;
+  }
+  *bytes = grown;
+  *capacity = size;
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ *  void addToFlight(struct session* session, struct ftOperation* operation)
+ *  void removeFromFlight(struct session*, struct ftOperation* operation)
+ *  struct ftOperation* findInFlight(struct session*, uint32_t id)
+ * Description: keep the list of a session's operations that are waiting
+ *   for answers, in the order they were sent
+*******************************************************************************/
+static int addToFlight(struct session* session, struct ftOperation* operation) {
+  if (session->flightCount == session->flightCapacity) {
+    size_t capacity = session->flightCapacity == 0 ? 16 : session->flightCapacity * 2;
+    struct ftOperation** flight = realloc(session->flight, capacity * sizeof(struct ftOperation*));
+    if (flight == NULL) {
+      return FALSE;
+    }
+    session->flight = flight;
+    session->flightCapacity = capacity;
+  }
+  session->flight[session->flightCount++] = operation;
+  return TRUE;
+}
+
+static void removeFromFlight(struct session* session, struct ftOperation* operation) {
+  size_t i;
+  for (i = 0; i < session->flightCount; i++) {
+    if (session->flight[i] == operation) {
+      memmove(session->flight + i, session->flight + i + 1,
+              (session->flightCount - i - 1) * sizeof(struct ftOperation*));
+      session->flightCount--;
+      break;
+    }
+  }
+  if (session->current == operation) {
+    session->current = NULL;
+  }
+}
+
+static struct ftOperation* findInFlight(struct session* session, uint32_t id) {
+  size_t i;
+  for (i = 0; i < session->flightCount; i++) {
+    if (session->flight[i]->id == id) {
+      return session->flight[i];
+    }
+  }
+  return NULL;
+}
+
+
+/*******************************************************************************
+ *       void freeOperation(struct ftOperation* operation)
+ * Description: frees an operation and the buffer the library allocated for it
+ * Input: struct ftOperation* operation - the operation
+ * Output: none
+*******************************************************************************/
+static void freeOperation(struct ftOperation* operation) {
+  if (operation->ownsBuffer) {
+    free(operation->buffer);
+  }
+  free(operation);
+}
+
+
+/*******************************************************************************
+ *    void checkFinished(struct ftClient*, struct ftOperation* operation)
+ * Description: finishes an operation once every response has arrived and
+ *   any data that follows has ended. Its status is set, and then it is
+ *   freed if the caller released it early, or its callback is called
+ * Input:
+ *   struct ftClient* client - the client
+ *   struct ftOperation* operation - the operation
+ * Output: none
+*******************************************************************************/
+static void checkFinished(struct ftClient* client, struct ftOperation* operation) {
+  if (operation->waitingResponses > 0 || (operation->expectData && !operation->ended)) {
+    return;
+  }
+  if (operation->session != NULL) {
+    removeFromFlight(operation->session, operation);
+    operation->session = NULL;
+  }
+  operation->status = operation->failure != FT_OK ? operation->failure : operation->responseStatus;
+  client->inFlight--;
+  client->completed++;
+  if (operation->released) {
+    freeOperation(operation);
+  }
+  else if (operation->callback != NULL) {
+    operation->callback(operation, operation->argument);
+  }
+}
+
+
+/*******************************************************************************
+ *     void failSession(struct ftClient* client, struct session* session)
+ * Description: gives up on a session whose connection failed or closed.
+ *   Every operation waiting on it finishes with FT_CONNECTION_LOST, and new
+ *   operations go to the other sessions
+ * Input:
+ *   struct ftClient* client - the client
+ *   struct session* session - the session
+ * Output: none
+*******************************************************************************/
+static void failSession(struct ftClient* client, struct session* session) {
+  close(session->p);
+  close(session->q);
+  session->p = -1;
+  session->q = -1;
+  session->failed = TRUE;
+  session->remaining = 0;
+  while (session->flightCount > 0) {
+    struct ftOperation* operation = session->flight[0];
+    removeFromFlight(session, operation);
+    if (operation->failure == FT_OK) {
+      operation->failure = FT_CONNECTION_LOST;
+    }
+    // a GET or LIST has had its only response if it is waiting for data
+    if (operation->type == FRAME_CD || operation->expectData == FALSE) {
+      operation->waitingResponses--;
+    }
+    operation->expectData = FALSE;
+    operation->session = NULL;
+    checkFinished(client, operation);
+  }
+}
+
+
+/*******************************************************************************
+ *  void storeData(struct ftOperation*, uint64_t position,
+ *                 const unsigned char* bytes, size_t length, int inPlace)
+ * Description: writes bytes of an operation's data where they belong in its
+ *   buffer or file and adds them to its digest. Data that doesn't fit the
+ *   caller's buffer, or can't be written to its file, fails the operation
+ *   and is dropped from then on
+ * Input:
+ *   struct ftOperation* operation - the operation, or NULL to drop the bytes
+ *   uint64_t position - where the bytes belong in the file
+ *   const unsigned char* bytes - the bytes
+ *   size_t length - the number of bytes
+ *   int inPlace - TRUE if the bytes were read straight into the buffer
+ * Output: none
+*******************************************************************************/
+static void storeData(struct ftOperation* operation, uint64_t position, const unsigned char* bytes,
+                      size_t length, int inPlace) {
+  if (operation == NULL || operation->failure != FT_OK) {
+    return;
+  }
+  if (operation->fileFD >= 0) {
+    size_t written = 0;
+    while (written < length) {
+      ssize_t count = pwrite(operation->fileFD, bytes + written, length - written, position + written);
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      if (count <= 0) {
+        operation->failure = FT_WRITE_FAILED;
+        snprintf(operation->message, sizeof(operation->message), "%s", strerror(errno));
+        return;
+      }
+      written += count;
+    }
+  }
+  else if (!inPlace) {
+    if (position + length > operation->capacity &&
+        (!operation->ownsBuffer || !growBuffer(&operation->buffer, &operation->capacity, position + length))) {
+      operation->failure = FT_BUFFER_TOO_SMALL;
+      return;
+    }
+    memcpy(operation->buffer + position, bytes, length);
+  }
+  if (operation->checksum) {
+    operation->digest = crc32(operation->digest, bytes, length);
+  }
+  operation->received += length;
+  if (position + length > operation->end) {
+    operation->end = position + length;
+  }
+}
+
+
+/*******************************************************************************
+ *  void storeHole(struct ftOperation*, uint64_t position, uint64_t length)
+ * Description: accounts for a hole of a sparse file. Holes aren't written to
+ *   a file, so they stay holes; in a buffer they are zeroed
+ * Input:
+ *   struct ftOperation* operation - the operation
+ *   uint64_t position - where the hole starts
+ *   uint64_t length - its length
+ * Output: none
+*******************************************************************************/
+static void storeHole(struct ftOperation* operation, uint64_t position, uint64_t length) {
+  if (operation->failure != FT_OK) {
+    return;
+  }
+  if (operation->fileFD < 0) {
+    if (position + length > operation->capacity &&
+        (!operation->ownsBuffer || !growBuffer(&operation->buffer, &operation->capacity, position + length))) {
+      operation->failure = FT_BUFFER_TOO_SMALL;
+      return;
+    }
+    memset(operation->buffer + position, '\0', length);
+  }
+  if (operation->checksum) {
+    operation->digest = crc32Zeros(operation->digest, length);
+  }
+  operation->received += length;
+  operation->holes += length;
+  if (position + length > operation->end) {
+    operation->end = position + length;
+  }
+}
+
+
+/*******************************************************************************
+ *  void endData(struct ftClient*, struct ftOperation*,
+ *               const unsigned char* payload, size_t length)
+ * Description: handles the END frame closing an operation's data. The
+ *   digest in it is checked against the data received, and a file whose
+ *   last bytes were a hole is extended to its full length
+ * Input:
+ *   struct ftClient* client - the client
+ *   struct ftOperation* operation - the operation
+ *   const unsigned char* payload - the END frame's attributes
+ *   size_t length - their length
+ * Output: none
+*******************************************************************************/
+static void endData(struct ftClient* client, struct ftOperation* operation,
+                    const unsigned char* payload, size_t length) {
+  const unsigned char* value;
+  size_t valueLength;
+  struct stat info;
+
+  if (operation->checksum && findAttribute(payload, length, ATTR_DIGEST, &value, &valueLength) &&
+      valueLength == 4) {
+    operation->verified = getUint(value, 4) == operation->digest;
+    if (!operation->verified && operation->failure == FT_OK) {
+      operation->failure = FT_CHECKSUM_MISMATCH;
+    }
+  }
+  if (operation->fileFD >= 0 && operation->holes > 0 && fstat(operation->fileFD, &info) == 0 &&
+      (uint64_t)info.st_size < operation->end && ftruncate(operation->fileFD, operation->end) < 0 &&
+      operation->failure == FT_OK) {
+    operation->failure = FT_WRITE_FAILED;
+  }
+  operation->ended = TRUE;
+  checkFinished(client, operation);
+}
+
+
+/*******************************************************************************
+ *       void handleResponse(struct ftClient*, struct session*,
+ *                           const unsigned char* frame, size_t length)
+ * Description: handles a RESPONSE read from connection P. A failed request
+ *   or a change of directory needs nothing more; a GET or LIST that
+ *   succeeded waits for its data, for which a buffer is allocated if the
+ *   caller didn't give one
+ * Input:
+ *   struct ftClient* client - the client
+ *   struct session* session - the session it arrived on
+ *   const unsigned char* frame - the whole frame
+ *   size_t length - its length
+ * Output: none
+*******************************************************************************/
+static void handleResponse(struct ftClient* client, struct session* session, const unsigned char* frame,
+                           size_t length) {
+  struct ftOperation* operation = findInFlight(session, getUint(frame + 8, 4));
+  const unsigned char* payload = frame + FRAME_HEADER_LENGTH;
+  size_t payloadLength = length - FRAME_HEADER_LENGTH;
+  const unsigned char* value;
+  size_t valueLength;
+  int status = getUint(frame + 4, 2);
+
+  if (operation == NULL || frame[3] != FRAME_RESPONSE) {
+    return;
+  }
+  if (status != STATUS_OK && operation->responseStatus == STATUS_OK) {
+    operation->responseStatus = status;
+    if (findAttribute(payload, payloadLength, ATTR_MESSAGE, &value, &valueLength)) {
+      snprintf(operation->message, sizeof(operation->message), "%.*s", (int)valueLength, (const char*)value);
+    }
+  }
+  operation->waitingResponses--;
+  if (operation->type == FRAME_CD) {
+    removeFromFlight(session, operation);
+    checkFinished(client, operation);
+    return;
+  }
+  operation->expectData = status == STATUS_OK;
+  if (operation->expectData && operation->type == FRAME_GET) {
+    uint64_t dataLength = getUintAttribute(payload, payloadLength, ATTR_LENGTH, 0);
+    operation->fileSize = getUintAttribute(payload, payloadLength, ATTR_FILE_SIZE, 0);
+    if (operation->fileFD < 0 && dataLength > operation->capacity && operation->failure == FT_OK &&
+        (!operation->ownsBuffer || !growBuffer(&operation->buffer, &operation->capacity, dataLength))) {
+      operation->failure = FT_BUFFER_TOO_SMALL;
+    }
+  }
+  checkFinished(client, operation);
+}
+
+
+/*******************************************************************************
+ *            int receiveMore(int fd, struct input* input)
+ * Description: reads what has arrived on a connection onto the end of its
+ *   input, moving what is left of the input to the front if it is full
+ * Input:
+ *   int fd - the connection
+ *   struct input* input - its input
+ * Output: 1 if bytes were read, 0 if none have arrived, or -1 if the
+ *   connection failed or closed
+*******************************************************************************/
+static int receiveMore(int fd, struct input* input) {
+  if (input->start == input->end) {
+    input->start = 0;
+    input->end = 0;
+  }
+  else if (input->end == INPUT_BUFFER_LENGTH) {
+    memmove(input->bytes, input->bytes + input->start, input->end - input->start);
+    input->end -= input->start;
+    input->start = 0;
+  }
+  while (TRUE) {
+    ssize_t received = recv(fd, input->bytes + input->end, INPUT_BUFFER_LENGTH - input->end, 0);
+    if (received > 0) {
+      input->end += received;
+      return 1;
+    }
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    return received < 0 && errno == EAGAIN ? 0 : -1;
+  }
+}
+
+
+/*******************************************************************************
+ *  int readConnectionP(struct ftClient* client, struct session* session)
+ * Description: reads and handles the responses that have arrived on a
+ *   session's connection P
+ * Input:
+ *   struct ftClient* client - the client
+ *   struct session* session - the session
+ * Output: TRUE unless the connection failed or closed
+*******************************************************************************/
+static int readConnectionP(struct ftClient* client, struct session* session) {
+  struct input* input = &session->pInput;
+  while (TRUE) {
+    size_t available = input->end - input->start;
+    unsigned char* frame = input->bytes + input->start;
+    if (available >= FRAME_HEADER_LENGTH) {
+      uint64_t length = getUint(frame + 12, 8);
+      if (getUint(frame, 2) != PROTOCOL_MAGIC || length > MAX_FRAME_LENGTH) {
+        return FALSE;
+      }
+      if (available >= FRAME_HEADER_LENGTH + length) {
+        input->start += FRAME_HEADER_LENGTH + length;
+        handleResponse(client, session, frame, FRAME_HEADER_LENGTH + length);
+        continue;
+      }
+    }
+    int result = receiveMore(session->p, input);
+    if (result <= 0) {
+      return result == 0;
+    }
+  }
+}
+
+
+/*******************************************************************************
+ *  int readConnectionQ(struct ftClient* client, struct session* session)
+ * Description: reads and handles the data that has arrived on a session's
+ *   connection Q. DATA payloads are stored as they arrive; when a large
+ *   part of one is still to come and it goes to the caller's buffer, it is
+ *   received straight into that buffer. HOLE and END frames are read whole
+ * Input:
+ *   struct ftClient* client - the client
+ *   struct session* session - the session
+ * Output: TRUE unless the connection failed or closed
+*******************************************************************************/
+static int readConnectionQ(struct ftClient* client, struct session* session) {
+  struct input* input = &session->qInput;
+  int result;
+
+  while (TRUE) {
+    size_t available = input->end - input->start;
+    unsigned char* frame = input->bytes + input->start;
+    struct ftOperation* operation = session->current;
+
+    if (session->remaining > 0 && available > 0) {
+      size_t take = available < session->remaining ? available : session->remaining;
+      storeData(operation, session->position, frame, take, FALSE);
+      input->start += take;
+      session->position += take;
+      session->remaining -= take;
+      continue;
+    }
+    if (session->remaining > 0) {
+      if (operation != NULL && operation->fileFD < 0 && operation->failure == FT_OK &&
+          session->remaining >= DIRECT_READ_LENGTH &&
+          session->position + session->remaining <= operation->capacity) {
+        ssize_t received = recv(session->q, operation->buffer + session->position, session->remaining, 0);
+        if (received > 0) {
+          storeData(operation, session->position, operation->buffer + session->position, received, TRUE);
+          session->position += received;
+          session->remaining -= received;
+          continue;
+        }
+        result = received < 0 && errno == EINTR ? 1 : received < 0 && errno == EAGAIN ? 0 : -1;
+      }
+      else {
+        result = receiveMore(session->q, input);
+      }
+      if (result <= 0) {
+        return result == 0;
+      }
+      continue;
+    }
+
+    if (available >= FRAME_HEADER_LENGTH) {
+      int type = frame[3];
+      uint64_t length = getUint(frame + 12, 8);
+      if (getUint(frame, 2) != PROTOCOL_MAGIC ||
+          (type == FRAME_DATA ? length < DATA_OFFSET_LENGTH : length > MAX_FRAME_LENGTH)) {
+        return FALSE;
+      }
+      operation = findInFlight(session, getUint(frame + 8, 4));
+      if (type == FRAME_DATA && available >= FRAME_HEADER_LENGTH + DATA_OFFSET_LENGTH) {
+        session->current = operation;
+        session->position = getUint(frame + FRAME_HEADER_LENGTH, 8);
+        session->remaining = length - DATA_OFFSET_LENGTH;
+        input->start += FRAME_HEADER_LENGTH + DATA_OFFSET_LENGTH;
+        continue;
+      }
+      if (type != FRAME_DATA && available >= FRAME_HEADER_LENGTH + length) {
+        input->start += FRAME_HEADER_LENGTH + length;
+        if (operation != NULL && type == FRAME_HOLE && length == HOLE_PAYLOAD_LENGTH) {
+          storeHole(operation, getUint(frame + FRAME_HEADER_LENGTH, 8),
+                    getUint(frame + FRAME_HEADER_LENGTH + 8, 8));
+        }
+        else if (operation != NULL && type == FRAME_END) {
+          endData(client, operation, frame + FRAME_HEADER_LENGTH, length);
+        }
+        continue;
+      }
+    }
+    result = receiveMore(session->q, input);
+    if (result <= 0) {
+      return result == 0;
+    }
+  }
+}
+
+
+/*******************************************************************************
+ *      int ftPoll(struct ftClient* client, int timeoutMillis)
+ * Description: runs one turn of the client's event loop: waits up to
+ *   timeoutMillis for any session to be ready, then sends what requests it
+ *   can and reads what has arrived. Operations that finish have their
+ *   callbacks called from here
+ * Input:
+ *   struct ftClient* client - the client
+ *   int timeoutMillis - how long to wait, 0 not to, or -1 to wait until
+ *     something happens
+ * Output: the number of operations that finished, or -1 with errno set
+*******************************************************************************/
+int ftPoll(struct ftClient* client, int timeoutMillis) {
+  struct epoll_event events[MAX_EVENTS];
+  int i;
+
+  client->completed = 0;
+  int count = epoll_wait(client->epollFD, events, MAX_EVENTS, timeoutMillis);
+  if (count < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+  for (i = 0; i < count; i++) {
+    struct endpoint* endpoint = events[i].data.ptr;
+    struct session* session = endpoint->session;
+    int healthy = TRUE;
+    if (session->failed) {
+      continue;
+    }
+    if (events[i].events & EPOLLOUT) {
+      healthy = flushOutput(session);
+    }
+    if (healthy && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+      healthy = endpoint->isQ ? readConnectionQ(client, session) : readConnectionP(client, session);
+    }
+    if (!healthy) {
+      failSession(client, session);
+    }
+  }
+  return client->completed;
+}
+
+
+/*******************************************************************************
+ *    int ftWait(struct ftClient* client, struct ftOperation* operation)
+ *    int ftWaitAll(struct ftClient* client)
+ * Description: run the event loop until an operation, or every operation in
+ *   flight, has finished. Other operations carry on meanwhile
+ * Input:
+ *   struct ftClient* client - the client
+ *   struct ftOperation* operation - the operation to wait for
+ * Output: the operation's status, or 0 once all have finished; -1 with
+ *   errno set if the event loop failed
+*******************************************************************************/
+int ftWait(struct ftClient* client, struct ftOperation* operation) {
+  while (operation->status == FT_PENDING) {
+    if (ftPoll(client, -1) < 0) {
+      return -1;
+    }
+  }
+  return operation->status;
+}
+
+int ftWaitAll(struct ftClient* client) {
+  while (client->inFlight > 0) {
+    if (ftPoll(client, -1) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/*******************************************************************************
+ *  struct ftOperation* newOperation(struct ftClient* client, int type)
+ * Description: allocates an operation for a new request
+ * Input:
+ *   struct ftClient* client - the client
+ *   int type - the FRAME_ type of the request
+ * Output: the operation, or NULL if memory ran out
+*******************************************************************************/
+static struct ftOperation* newOperation(struct ftClient* client, int type) {
+  struct ftOperation* operation = calloc(1, sizeof(struct ftOperation));
+  if (operation == NULL) {
+    return NULL;
+  }
+  operation->client = client;
+  operation->type = type;
+  operation->id = ++client->nextId;
+  operation->status = FT_PENDING;
+  operation->fileFD = -1;
+  operation->checksum = !(client->flags & FT_NO_CHECKSUM) && (client->capabilities & CAP_CHECKSUM);
+  return operation;
+}
+
+
+/*******************************************************************************
+ *  int sendRequest(struct ftClient*, struct session*, struct ftOperation*,
+ *                  const char* name, int showHidden)
+ * Description: queues an operation's request on a session's connection P
+ *   and sends what it can of it
+ * Input:
+ *   struct ftClient* client - the client
+ *   struct session* session - the session
+ *   struct ftOperation* operation - the operation
+ *   const char* name - the file or directory, for a GET or CD
+ *   int showHidden - for a LIST, whether to list hidden entries
+ * Output: TRUE if the request was queued, FALSE if memory ran out. A
+ *   connection that fails is given up on, which finishes the operation
+*******************************************************************************/
+static int sendRequest(struct ftClient* client, struct session* session, struct ftOperation* operation,
+                       const char* name, int showHidden) {
+  unsigned char request[MAX_REQUEST_LENGTH];
+  size_t length = FRAME_HEADER_LENGTH;
+
+  if (operation->type == FRAME_LIST) {
+    length = addUintAttribute(request, length, ATTR_SHOW_HIDDEN, showHidden != 0, 1);
+  }
+  else {
+    length = addAttribute(request, length, ATTR_NAME, name, strlen(name));
+  }
+  if (operation->type != FRAME_CD && operation->checksum) {
+    length = addUintAttribute(request, length, ATTR_CHECKSUM, CHECKSUM_CRC32, 1);
+  }
+  putFrameHeader(request, operation->type, operation->id, length - FRAME_HEADER_LENGTH);
+  if (!growBuffer(&session->output, &session->outputCapacity, session->outputLength + length) ||
+      !addToFlight(session, operation)) {
+    return FALSE;
+  }
+  memcpy(session->output + session->outputLength, request, length);
+  session->outputLength += length;
+  if (!session->watchingOutput && !flushOutput(session)) {
+    failSession(client, session);
+  }
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ *  struct ftOperation* startOperation(struct ftClient*, int type,
+ *                                     const char* name, int showHidden)
+ * Description: starts a GET or LIST on the session with the fewest
+ *   operations in flight, or a CD on every session, so they all stay in the
+ *   same directory
+ * Input:
+ *   struct ftClient* client - the client
+ *   int type - FRAME_GET, FRAME_LIST or FRAME_CD
+ *   const char* name - the file or directory, for a GET or CD
+ *   int showHidden - for a LIST, whether to list hidden entries
+ * Output: the operation, or NULL with errno set. If every session has
+ *   failed the operation is returned finished with FT_CONNECTION_LOST
+*******************************************************************************/
+static struct ftOperation* startOperation(struct ftClient* client, int type, const char* name,
+                                          int showHidden) {
+  struct session* chosen = NULL;
+  int i;
+
+  if (name != NULL && strlen(name) > MAX_NAME_LENGTH) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  struct ftOperation* operation = newOperation(client, type);
+  if (operation == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < client->sessionCount; i++) {
+    struct session* session = &client->sessions[i];
+    if (!session->failed && (chosen == NULL || session->flightCount < chosen->flightCount)) {
+      chosen = session;
+    }
+  }
+  if (chosen == NULL) {
+    operation->status = FT_CONNECTION_LOST;
+    return operation;
+  }
+  client->inFlight++;
+  if (type != FRAME_CD) {
+    operation->session = chosen;
+    operation->waitingResponses = 1;
+    if (!sendRequest(client, chosen, operation, name, showHidden)) {
+      client->inFlight--;
+      free(operation);
+      errno = ENOMEM;
+      return NULL;
+    }
+    return operation;
+  }
+
+  // a CD counts every session as answering before anything is sent, so it
+  // can't finish while it is still being sent to the others
+  for (i = 0; i < client->sessionCount; i++) {
+    operation->waitingResponses += !client->sessions[i].failed;
+  }
+  operation->waitingResponses++;
+  for (i = 0; i < client->sessionCount; i++) {
+    struct session* session = &client->sessions[i];
+    if (session->failed) {
+      continue;
+    }
+    if (!sendRequest(client, session, operation, name, 0)) {
+      operation->failure = FT_CONNECTION_LOST;
+      operation->waitingResponses--;
+    }
+  }
+  operation->waitingResponses--;
+  checkFinished(client, operation);
+  return operation;
+}
+
+
+/*******************************************************************************
+ *  struct ftOperation* ftGet(struct ftClient* client, const char* name,
+ *                            void* buffer, size_t capacity)
+ * Description: starts getting a file into memory. If the file is bigger
+ *   than the caller's buffer the operation fails with FT_BUFFER_TOO_SMALL.
+ *   With a NULL buffer the library allocates one the size of the file,
+ *   which ftData() gives and ftRelease() frees
+ * Input:
+ *   struct ftClient* client - the client
+ *   const char* name - the file, relative to the sessions' directory
+ *   void* buffer - where to put the file, or NULL
+ *   size_t capacity - the size of buffer
+ * Output: the operation, or NULL with errno set
+*******************************************************************************/
+struct ftOperation* ftGet(struct ftClient* client, const char* name, void* buffer, size_t capacity) {
+  struct ftOperation* operation = startOperation(client, FRAME_GET, name, FALSE);
+  if (operation != NULL) {
+    operation->buffer = buffer;
+    operation->capacity = buffer != NULL ? capacity : 0;
+    operation->ownsBuffer = buffer == NULL;
+  }
+  return operation;
+}
+
+
+/*******************************************************************************
+ *  struct ftOperation* ftGetFile(struct ftClient* client, const char* name,
+ *                                int fileFD)
+ * Description: starts getting a file into a file the caller has opened for
+ *   writing. The bytes are written at their offsets, and the holes of a
+ *   sparse file are left as holes
+ * Input:
+ *   struct ftClient* client - the client
+ *   const char* name - the file, relative to the sessions' directory
+ *   int fileFD - the file to write
+ * Output: the operation, or NULL with errno set
+*******************************************************************************/
+struct ftOperation* ftGetFile(struct ftClient* client, const char* name, int fileFD) {
+  struct ftOperation* operation = startOperation(client, FRAME_GET, name, FALSE);
+  if (operation != NULL) {
+    operation->fileFD = fileFD;
+  }
+  return operation;
+}
+
+
+/*******************************************************************************
+ *  struct ftOperation* ftList(struct ftClient* client, int showHidden,
+ *                             void* buffer, size_t capacity)
+ * Description: starts listing the sessions' directory. The listing is a
+ *   series of entries, which ftNextEntry() reads. With a NULL buffer the
+ *   library allocates one and grows it to fit
+ * Input:
+ *   struct ftClient* client - the client
+ *   int showHidden - whether to list hidden entries
+ *   void* buffer - where to put the listing, or NULL
+ *   size_t capacity - the size of buffer
+ * Output: the operation, or NULL with errno set
+*******************************************************************************/
+struct ftOperation* ftList(struct ftClient* client, int showHidden, void* buffer, size_t capacity) {
+  struct ftOperation* operation = startOperation(client, FRAME_LIST, NULL, showHidden);
+  if (operation != NULL) {
+    operation->buffer = buffer;
+    operation->capacity = buffer != NULL ? capacity : 0;
+    operation->ownsBuffer = buffer == NULL;
+  }
+  return operation;
+}
+
+
+/*******************************************************************************
+ *  struct ftOperation* ftChangeDirectory(struct ftClient*, const char* name)
+ * Description: starts changing the directory of every session. Operations
+ *   started afterwards are answered from the new directory
+ * Input:
+ *   struct ftClient* client - the client
+ *   const char* name - the directory
+ * Output: the operation, or NULL with errno set
+*******************************************************************************/
+struct ftOperation* ftChangeDirectory(struct ftClient* client, const char* name) {
+  return startOperation(client, FRAME_CD, name, FALSE);
+}
+
+
+/*******************************************************************************
+ *  void ftSetCallback(struct ftOperation*, ftCallback, void* argument)
+ * Description: has ftPoll() call a function when an operation finishes.
+ *   The function may start operations and release this one
+ * Input:
+ *   struct ftOperation* operation - the operation
+ *   ftCallback callback - the function
+ *   void* argument - passed to the function
+ * Output: none
+*******************************************************************************/
+void ftSetCallback(struct ftOperation* operation, ftCallback callback, void* argument) {
+  operation->callback = callback;
+  operation->argument = argument;
+}
+
+
+/*******************************************************************************
+ *  int ftStatus / const char* ftMessage / void* ftData /
+ *  uint64_t ftReceived / ftHoles / ftFileSize / int ftVerified
+ *                        (struct ftOperation* operation)
+ * Description: give the results of an operation: its FT_ status, ftserver's
+ *   message if it failed, the buffer the data is in, the bytes received
+ *   (counting holes), the bytes of holes, the size of the file, and whether
+ *   the data matched ftserver's CRC-32
+*******************************************************************************/
+int ftStatus(struct ftOperation* operation) {
+  return operation->status;
+}
+
+const char* ftMessage(struct ftOperation* operation) {
+  return operation->message;
+}
+
+void* ftData(struct ftOperation* operation) {
+  return operation->buffer;
+}
+
+uint64_t ftReceived(struct ftOperation* operation) {
+  return operation->received;
+}
+
+uint64_t ftHoles(struct ftOperation* operation) {
+  return operation->holes;
+}
+
+uint64_t ftFileSize(struct ftOperation* operation) {
+  return operation->fileSize;
+}
+
+int ftVerified(struct ftOperation* operation) {
+  return operation->verified;
+}
+
+
+/*******************************************************************************
+ *             void ftRelease(struct ftOperation* operation)
+ * Description: frees an operation. One still in flight is freed when it
+ *   finishes, without its callback being called
+ * Input: struct ftOperation* operation - the operation
+ * Output: none
+*******************************************************************************/
+void ftRelease(struct ftOperation* operation) {
+  if (operation->status == FT_PENDING) {
+    operation->released = TRUE;
+    return;
+  }
+  freeOperation(operation);
+}
+
+
+/*******************************************************************************
+ *  int ftNextEntry(const void* listing, size_t length, size_t* position,
+ *                  struct ftEntry* entry)
+ * Description: reads the entry of a listing at position and moves position
+ *   past it
+ * Input:
+ *   const void* listing - the listing, as given by ftData()
+ *   size_t length - its length, as given by ftReceived()
+ *   size_t* position - where to read, 0 for the first entry
+ *   struct ftEntry* entry - filled in with the entry
+ * Output: TRUE if an entry was read, FALSE at the end of the listing
+*******************************************************************************/
+int ftNextEntry(const void* listing, size_t length, size_t* position, struct ftEntry* entry) {
+  const unsigned char* bytes = (const unsigned char*)listing + *position;
+  if (*position + ENTRY_HEADER_LENGTH > length) {
+    return FALSE;
+  }
+  size_t nameLength = getUint(bytes + 17, 2);
+  if (*position + ENTRY_HEADER_LENGTH + nameLength > length) {
+    return FALSE;
+  }
+  entry->type = bytes[0];
+  entry->size = getUint(bytes + 1, 8);
+  entry->modified = getUint(bytes + 9, 8);
+  entry->name = (const char*)bytes + ENTRY_HEADER_LENGTH;
+  entry->nameLength = nameLength;
+  *position += ENTRY_HEADER_LENGTH + nameLength;
+  return TRUE;
+}
@@ -0,0 +1,97 @@
+/*******************************************************************************
+ * File:          ftlib.h
+ * Description:   the interface of libft, a client library for ftserver that
+ *   programs link against instead of running ftclient. A client holds a few
+ *   passive-mode sessions with one ftserver and runs every request on them
+ *   from a single epoll event loop, without threads. Requests return at once
+ *   with an operation that finishes in a later ftPoll(); the received data
+ *   is written straight into a buffer or file the caller supplies.
+ *
+ *   struct ftClient* client = ftOpen("fileserver", "30020", 4, 0);
+ *   struct ftOperation* get = ftGet(client, "report.csv", buffer, size);
+ *   if (ftWait(client, get) == FT_OK) {
+ *     ... ftReceived(get) bytes are in buffer ...
+ *   }
+ *   ftRelease(get);
+ *   ftClose(client);
+*******************************************************************************/
+#ifndef FTLIB_H
+#define FTLIB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* the statuses an operation ends with. The first seven are the statuses of
+   ftserver's responses; the rest are found by the library. FT_PENDING is
+   the status of an operation that hasn't finished */
+#define FT_PENDING -1
+#define FT_OK 0
+#define FT_NOT_FOUND 1
+#define FT_INVALID_RANGE 2
+#define FT_BAD_REQUEST 3
+#define FT_UNSUPPORTED 4
+#define FT_VERSION_MISMATCH 5
+#define FT_IO_ERROR 6
+#define FT_CONNECTION_LOST 16
+#define FT_BUFFER_TOO_SMALL 17
+#define FT_CHECKSUM_MISMATCH 18
+#define FT_WRITE_FAILED 19
+
+/* flags for ftOpen() */
+// don't ask ftserver for a CRC-32 of the data to verify it against
+#define FT_NO_CHECKSUM 0x1
+
+/* listing entry types */
+#define FT_ENTRY_FILE 1
+#define FT_ENTRY_DIRECTORY 2
+#define FT_ENTRY_SYMLINK 3
+#define FT_ENTRY_OTHER 4
+
+struct ftClient;
+struct ftOperation;
+
+/* Called from ftPoll() when an operation finishes */
+typedef void (*ftCallback)(struct ftOperation* operation, void* argument);
+
+/* One entry of a listing, as read by ftNextEntry(). name points into the
+   listing and is not NUL-terminated */
+struct ftEntry {
+  int type;
+  uint64_t size;
+  time_t modified;
+  const char* name;
+  size_t nameLength;
+};
+
+/* opening and closing a client */
+struct ftClient* ftOpen(const char* host, const char* port, int sessions, int flags);
+void ftClose(struct ftClient* client);
+int ftDescriptor(struct ftClient* client);
+
+/* starting operations */
+struct ftOperation* ftGet(struct ftClient* client, const char* name, void* buffer, size_t capacity);
+struct ftOperation* ftGetFile(struct ftClient* client, const char* name, int fileFD);
+struct ftOperation* ftList(struct ftClient* client, int showHidden, void* buffer, size_t capacity);
+struct ftOperation* ftChangeDirectory(struct ftClient* client, const char* name);
+void ftSetCallback(struct ftOperation* operation, ftCallback callback, void* argument);
+
+/* running the event loop */
+int ftPoll(struct ftClient* client, int timeoutMillis);
+int ftWait(struct ftClient* client, struct ftOperation* operation);
+int ftWaitAll(struct ftClient* client);
+
+/* the results of an operation */
+int ftStatus(struct ftOperation* operation);
+const char* ftMessage(struct ftOperation* operation);
+void* ftData(struct ftOperation* operation);
+uint64_t ftReceived(struct ftOperation* operation);
+uint64_t ftHoles(struct ftOperation* operation);
+uint64_t ftFileSize(struct ftOperation* operation);
+int ftVerified(struct ftOperation* operation);
+void ftRelease(struct ftOperation* operation);
+
+/* reading listings */
+int ftNextEntry(const void* listing, size_t length, size_t* position, struct ftEntry* entry);
+
+#endif
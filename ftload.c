@@ -0,0 +1,1001 @@
+/*******************************************************************************
+ * File:          ftload.c
+ * Description:   a load generator for ftserver. It runs any number of client
+ *   sessions at once, each on its own thread, that send a weighted mix of
+ *   LIST, GET and CD requests one after another for a set time, and reports
+ *   the requests per second, the data received per second and the latency
+ *   percentiles of the run as one line of JSON. GETs pick files of the
+ *   requested sizes, which are created in the data directory first. With
+ *   --server, ftload starts ftserver in the data directory on loopback and
+ *   stops it again afterwards, which is what `make bench` does.
+ * Input:
+ *   argv[1] - name of host that ftserver is running on
+ *   argv[2] - port number that ftserver is listening on
+ *   argv[3:] - options, see usage()
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
+#include <netdb.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <sys/resource.h>
+
+#define TRUE 1
+#define FALSE 0
+#define PROTOCOL_MAGIC 0x4654
+#define PROTOCOL_VERSION 1
+#define FRAME_HEADER_LENGTH 20
+#define ATTRIBUTE_HEADER_LENGTH 6
+#define FRAME_HELLO 1
+#define FRAME_LIST 2
+#define FRAME_GET 3
+#define FRAME_CD 4
+#define FRAME_RESPONSE 32
+#define FRAME_DATA 34
+#define FRAME_END 35
+#define STATUS_OK 0
+#define ATTR_CAPABILITIES 1
+#define ATTR_DATA_PORT 2
+#define ATTR_NAME 3
+#define ATTR_SHOW_HIDDEN 7
+#define ATTR_COMPRESSION 16
+#define ATTR_COMPRESSION_LEVEL 17
+#define ATTR_CHECKSUM 21
+#define CAP_COMPRESS 0x8
+#define CAP_CHECKSUM 0x10
+#define CAP_PASSIVE 0x100
+#define COMPRESS_DEFLATE 0x1
+#define CHECKSUM_CRC32 1
+#define OP_GET 0
+#define OP_LIST 1
+#define OP_CD 2
+#define OPS 3
+#define MAX_SIZE_CLASSES 16
+#define MAX_CLIENTS 4096
+#define DEFAULT_CLIENTS 16
+#define DEFAULT_DURATION 10.0
+#define DEFAULT_WARMUP 1.0
+#define DEFAULT_FILES_PER_SIZE 4
+#define MAX_REQUEST_LENGTH 512
+// the subdirectory of the data directory CDs go into and back out of
+#define CD_DIRECTORY "ftload-cd"
+// frames other than DATA are read whole; DATA payloads are read and dropped
+// RECEIVE_BUFFER_LENGTH bytes at a time
+#define MAX_FRAME_LENGTH (64 * 1024)
+#define RECEIVE_BUFFER_LENGTH (256 * 1024)
+// how long a server started with --server has to start listening
+#define SERVER_START_SECONDS 10
+
+/* A size of file GETs ask for, and how often relative to the other sizes */
+struct sizeClass {
+  off_t size;
+  unsigned weight;
+};
+
+/* The latencies of one kind of request made by one client, in microseconds,
+   and the DATA bytes received answering them */
+struct opStats {
+  uint32_t* latencies;
+  size_t count;
+  size_t capacity;
+  uint64_t errors;
+  uint64_t bytes;
+};
+
+/* One client: its session with ftserver and what it measured */
+struct client {
+  int index;
+  pthread_t thread;
+  int p;
+  int q;
+  uint64_t random;
+  uint32_t requestId;
+  unsigned char* buffer;
+  struct opStats ops[OPS];
+  int64_t lastFinish;
+  int failed;
+  int inSubdirectory;
+};
+
+char* HOST = NULL;
+char* PORT = NULL;
+int CLIENTS = DEFAULT_CLIENTS;
+// how long requests are measured for, after a warmup whose requests are not
+// counted. A request count ends the run early instead
+double DURATION = DEFAULT_DURATION;
+double WARMUP = DEFAULT_WARMUP;
+uint64_t REQUESTS = 0;
+// the relative weights of GET, LIST and CD requests
+unsigned MIX[OPS] = {1, 0, 0};
+struct sizeClass SIZES[MAX_SIZE_CLASSES] = {{4096, 1}};
+int SIZE_COUNT = 1;
+int FILES_PER_SIZE = DEFAULT_FILES_PER_SIZE;
+char* DATA_DIRECTORY = ".";
+char* LABEL = "ftload";
+int COMPRESS = FALSE;
+int CHECKSUM = FALSE;
+// the ftserver to start, and the options to start it with
+char* SERVER_PATH = NULL;
+char** SERVER_ARGS = NULL;
+int SERVER_ARG_COUNT = 0;
+
+// when measured requests start and stop, in CLOCK_MONOTONIC nanoseconds,
+// and the number of measured requests so far
+int64_t MEASURE_START = 0;
+int64_t MEASURE_END = 0;
+uint64_t MEASURED = 0;
+pthread_barrier_t STARTED;
+
+
+/*******************************************************************************
+ *                       int64_t monotonicNanos()
+ * Description: reads the monotonic clock
+ * Input: none
+ * Output: the time in nanoseconds
+*******************************************************************************/
+int64_t monotonicNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+/*******************************************************************************
+ *      void putUint16/putUint32/putUint64(unsigned char*, value)
+ *      uint64_t getUint(const unsigned char* source, int size)
+ * Description: store and load integers in network byte order
+*******************************************************************************/
+void putUint16(unsigned char* destination, uint16_t value) {
+  destination[0] = value >> 8;
+  destination[1] = value;
+}
+
+void putUint32(unsigned char* destination, uint32_t value) {
+  putUint16(destination, value >> 16);
+  putUint16(destination + 2, value);
+}
+
+void putUint64(unsigned char* destination, uint64_t value) {
+  putUint32(destination, value >> 32);
+  putUint32(destination + 4, value);
+}
+
+uint64_t getUint(const unsigned char* source, int size) {
+  uint64_t value = 0;
+  int i;
+  for (i = 0; i < size; i++) {
+    value = (value << 8) | source[i];
+  }
+  return value;
+}
+
+
+/*******************************************************************************
+ *  size_t addAttribute(unsigned char* frame, size_t length, int tag,
+ *                      const void* value, size_t valueLength)
+ *  size_t addUintAttribute(unsigned char* frame, size_t length, int tag,
+ *                          uint64_t value, int size)
+ * Description: append an attribute to a request being built
+ * Input:
+ *   unsigned char* frame - the request, MAX_REQUEST_LENGTH bytes of storage
+ *   size_t length - the length of the request so far
+ *   int tag - the ATTR_ tag
+ *   value - the value, as bytes or as a size byte integer
+ * Output: the new length of the request
+*******************************************************************************/
+size_t addAttribute(unsigned char* frame, size_t length, int tag, const void* value, size_t valueLength) {
+  putUint16(frame + length, tag);
+  putUint32(frame + length + 2, valueLength);
+  memcpy(frame + length + ATTRIBUTE_HEADER_LENGTH, value, valueLength);
+  return length + ATTRIBUTE_HEADER_LENGTH + valueLength;
+}
+
+size_t addUintAttribute(unsigned char* frame, size_t length, int tag, uint64_t value, int size) {
+  unsigned char bytes[8];
+  putUint64(bytes, value);
+  return addAttribute(frame, length, tag, bytes + 8 - size, size);
+}
+
+
+/*******************************************************************************
+ *  void putFrameHeader(unsigned char* frame, int type, uint32_t requestId,
+ *                      uint64_t length)
+ * Description: writes the header of a request whose payload is length bytes
+ * Input:
+ *   unsigned char* frame - the request
+ *   int type - the FRAME_ type
+ *   uint32_t requestId - the id the answer will carry
+ *   uint64_t length - the number of payload bytes
+ * Output: none
+*******************************************************************************/
+void putFrameHeader(unsigned char* frame, int type, uint32_t requestId, uint64_t length) {
+  putUint16(frame, PROTOCOL_MAGIC);
+  frame[2] = PROTOCOL_VERSION;
+  frame[3] = type;
+  putUint16(frame + 4, 0);
+  putUint16(frame + 6, 0);
+  putUint32(frame + 8, requestId);
+  putUint64(frame + 12, length);
+}
+
+
+/*******************************************************************************
+ *            int sendAll(int fd, const unsigned char* bytes, size_t length)
+ *            int receiveAll(int fd, unsigned char* bytes, size_t length)
+ * Description: send or receive exactly length bytes on a blocking socket
+ * Output: TRUE on success, FALSE if the connection failed or closed
+*******************************************************************************/
+int sendAll(int fd, const unsigned char* bytes, size_t length) {
+  while (length > 0) {
+    ssize_t sent = send(fd, bytes, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return FALSE;
+    }
+    bytes += sent;
+    length -= sent;
+  }
+  return TRUE;
+}
+
+int receiveAll(int fd, unsigned char* bytes, size_t length) {
+  while (length > 0) {
+    ssize_t received = recv(fd, bytes, length, 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return FALSE;
+    }
+    bytes += received;
+    length -= received;
+  }
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ *  int64_t readFrame(struct client* client, int fd, int* type, int* status,
+ *                    uint64_t* dataBytes)
+ * Description: reads one frame. DATA payloads are dropped as they arrive and
+ *   counted; any other payload is read into the client's buffer
+ * Input:
+ *   struct client* client - the client, whose buffer is used
+ *   int fd - the connection to read from
+ *   int* type, int* status - filled in with the frame's type and status
+ *   uint64_t* dataBytes - incremented by the length of a DATA payload
+ * Output: the length of the payload, or -1 if the connection failed
+*******************************************************************************/
+int64_t readFrame(struct client* client, int fd, int* type, int* status, uint64_t* dataBytes) {
+  unsigned char header[FRAME_HEADER_LENGTH];
+  if (!receiveAll(fd, header, FRAME_HEADER_LENGTH) || getUint(header, 2) != PROTOCOL_MAGIC) {
+    return -1;
+  }
+  *type = header[3];
+  *status = getUint(header + 4, 2);
+  uint64_t length = getUint(header + 12, 8);
+  if (*type == FRAME_DATA) {
+    uint64_t remaining = length;
+    while (remaining > 0) {
+      ssize_t received = recv(fd, client->buffer, remaining < RECEIVE_BUFFER_LENGTH ? remaining : RECEIVE_BUFFER_LENGTH, 0);
+      if (received < 0 && errno == EINTR) {
+        continue;
+      }
+      if (received <= 0) {
+        return -1;
+      }
+      remaining -= received;
+    }
+    *dataBytes += length;
+    return length;
+  }
+  if (length > MAX_FRAME_LENGTH || !receiveAll(fd, client->buffer, length)) {
+    return -1;
+  }
+  return length;
+}
+
+
+/*******************************************************************************
+ *           int connectTo(const char* host, const char* port)
+ * Description: opens a TCP connection, trying each address of the host
+ * Input:
+ *   const char* host - the host name or address
+ *   const char* port - the port number
+ * Output: the connected socket, or -1
+*******************************************************************************/
+int connectTo(const char* host, const char* port) {
+  struct addrinfo hints, *addresses, *address;
+  int fd = -1;
+  memset(&hints, '\0', sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &addresses) != 0) {
+    return -1;
+  }
+  for (address = addresses; address != NULL && fd < 0; address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+    if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  return fd;
+}
+
+
+/*******************************************************************************
+ *                int openSession(struct client* client)
+ * Description: opens a passive-mode session: sends a HELLO on connection P,
+ *   and connects connection Q to the port ftserver answers with. Passive
+ *   mode needs no listening port per client, so any number can run at once
+ * Input: struct client* client - the client
+ * Output: TRUE if the session is open, FALSE otherwise
+*******************************************************************************/
+int openSession(struct client* client) {
+  unsigned char hello[MAX_REQUEST_LENGTH];
+  size_t length = FRAME_HEADER_LENGTH;
+  int type, status, one = 1;
+  uint64_t dataBytes = 0;
+
+  client->p = connectTo(HOST, PORT);
+  if (client->p < 0) {
+    return FALSE;
+  }
+  setsockopt(client->p, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  length = addUintAttribute(hello, length, ATTR_CAPABILITIES, CAP_COMPRESS | CAP_CHECKSUM | CAP_PASSIVE, 4);
+  length = addUintAttribute(hello, length, ATTR_DATA_PORT, 0, 2);
+  putFrameHeader(hello, FRAME_HELLO, 0, length - FRAME_HEADER_LENGTH);
+  if (!sendAll(client->p, hello, length)) {
+    return FALSE;
+  }
+  int64_t payload = readFrame(client, client->p, &type, &status, &dataBytes);
+  if (payload < 0 || type != FRAME_HELLO || status != STATUS_OK) {
+    return FALSE;
+  }
+
+  // find the data port among the attributes and connect to it
+  int dataPort = -1;
+  int64_t position = 0;
+  while (position + ATTRIBUTE_HEADER_LENGTH <= payload) {
+    int tag = getUint(client->buffer + position, 2);
+    uint32_t valueLength = getUint(client->buffer + position + 2, 4);
+    if (tag == ATTR_DATA_PORT && valueLength <= 8) {
+      dataPort = getUint(client->buffer + position + ATTRIBUTE_HEADER_LENGTH, valueLength);
+    }
+    position += ATTRIBUTE_HEADER_LENGTH + valueLength;
+  }
+  struct sockaddr_storage address;
+  socklen_t addressLength = sizeof(address);
+  if (dataPort <= 0 || getpeername(client->p, (struct sockaddr*)&address, &addressLength) < 0) {
+    return FALSE;
+  }
+  if (address.ss_family == AF_INET6) {
+    ((struct sockaddr_in6*)&address)->sin6_port = htons(dataPort);
+  }
+  else {
+    ((struct sockaddr_in*)&address)->sin_port = htons(dataPort);
+  }
+  client->q = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  return client->q >= 0 && connect(client->q, (struct sockaddr*)&address, addressLength) == 0;
+}
+
+
+/*******************************************************************************
+ *            uint64_t nextRandom(struct client* client)
+ * Description: xorshift64*, a fast generator good enough to pick requests
+ * Input: struct client* client - the client, whose state is advanced
+ * Output: a pseudo-random number
+*******************************************************************************/
+uint64_t nextRandom(struct client* client) {
+  client->random ^= client->random >> 12;
+  client->random ^= client->random << 25;
+  client->random ^= client->random >> 27;
+  return client->random * 2685821657736338717ULL;
+}
+
+
+/*******************************************************************************
+ *   void fileName(char* name, size_t length, int sizeClass, int index)
+ * Description: names one of the files GETs ask for
+ * Input:
+ *   char* name - where to write the name
+ *   size_t length - the space there
+ *   int sizeClass - the index of its size in SIZES
+ *   int index - which of the FILES_PER_SIZE files of that size
+ * Output: none
+*******************************************************************************/
+void fileName(char* name, size_t length, int sizeClass, int index) {
+  snprintf(name, length, "ftload-%lld-%d.dat", (long long)SIZES[sizeClass].size, index);
+}
+
+
+/*******************************************************************************
+ *  int runRequest(struct client* client, int op, uint64_t* dataBytes)
+ * Description: sends one request and reads its answer: the RESPONSE on
+ *   connection P and, for a successful LIST or GET, the DATA frames and END
+ *   frame on connection Q
+ * Input:
+ *   struct client* client - the client
+ *   int op - OP_GET, OP_LIST or OP_CD
+ *   uint64_t* dataBytes - incremented by the DATA bytes received
+ * Output: the status of the response, or -1 if the session failed
+*******************************************************************************/
+int runRequest(struct client* client, int op, uint64_t* dataBytes) {
+  unsigned char request[MAX_REQUEST_LENGTH];
+  size_t length = FRAME_HEADER_LENGTH;
+  int frameType = op == OP_GET ? FRAME_GET : op == OP_LIST ? FRAME_LIST : FRAME_CD;
+  int type, status, endStatus;
+
+  if (op == OP_GET) {
+    unsigned pick = nextRandom(client) % (SIZES[SIZE_COUNT - 1].weight);
+    int sizeClass = 0;
+    while (pick >= SIZES[sizeClass].weight) {
+      sizeClass++;
+    }
+    char name[64];
+    fileName(name, sizeof(name), sizeClass, nextRandom(client) % FILES_PER_SIZE);
+    length = addAttribute(request, length, ATTR_NAME, name, strlen(name));
+  }
+  else if (op == OP_LIST) {
+    length = addUintAttribute(request, length, ATTR_SHOW_HIDDEN, 0, 1);
+  }
+  else {
+    // each session has its own working directory, so CDs alternate between
+    // going into CD_DIRECTORY, which holds the same files, and back out
+    const char* directory = client->inSubdirectory ? ".." : CD_DIRECTORY;
+    length = addAttribute(request, length, ATTR_NAME, directory, strlen(directory));
+  }
+  if (op != OP_CD && COMPRESS) {
+    length = addUintAttribute(request, length, ATTR_COMPRESSION, COMPRESS_DEFLATE, 1);
+    length = addUintAttribute(request, length, ATTR_COMPRESSION_LEVEL, 1, 1);
+  }
+  if (op != OP_CD && CHECKSUM) {
+    length = addUintAttribute(request, length, ATTR_CHECKSUM, CHECKSUM_CRC32, 1);
+  }
+  putFrameHeader(request, frameType, ++client->requestId, length - FRAME_HEADER_LENGTH);
+  if (!sendAll(client->p, request, length) ||
+      readFrame(client, client->p, &type, &status, dataBytes) < 0 || type != FRAME_RESPONSE) {
+    return -1;
+  }
+  if (op == OP_CD && status == STATUS_OK) {
+    client->inSubdirectory = !client->inSubdirectory;
+  }
+  if (op == OP_CD || status != STATUS_OK) {
+    return status;
+  }
+  do {
+    if (readFrame(client, client->q, &type, &endStatus, dataBytes) < 0) {
+      return -1;
+    }
+  } while (type != FRAME_END);
+  return endStatus;
+}
+
+
+/*******************************************************************************
+ *        void recordLatency(struct opStats* stats, int64_t nanos)
+ * Description: adds a request's latency to the stats of its kind
+ * Input:
+ *   struct opStats* stats - the stats
+ *   int64_t nanos - how long the request took
+ * Output: none
+*******************************************************************************/
+void recordLatency(struct opStats* stats, int64_t nanos) {
+  if (stats->count == stats->capacity) {
+    stats->capacity = stats->capacity == 0 ? 4096 : stats->capacity * 2;
+    stats->latencies = realloc(stats->latencies, stats->capacity * sizeof(uint32_t));
+    if (stats->latencies == NULL) {
+      fprintf(stderr, "ERROR: out of memory\n");
+      exit(1);
+    }
+  }
+  stats->latencies[stats->count++] = nanos / 1000 > UINT32_MAX ? UINT32_MAX : nanos / 1000;
+}
+
+
+/*******************************************************************************
+ *                     void* runClient(void* argument)
+ * Description: one client thread. Opens its session, waits for the others,
+ *   then sends requests one at a time until the run ends. Requests that
+ *   start during the warmup are not measured
+ * Input: void* argument - the client
+ * Output: NULL
+*******************************************************************************/
+void* runClient(void* argument) {
+  struct client* client = argument;
+  unsigned total = MIX[OP_GET] + MIX[OP_LIST] + MIX[OP_CD];
+
+  client->failed = !openSession(client);
+  pthread_barrier_wait(&STARTED);
+  pthread_barrier_wait(&STARTED);
+  while (!client->failed) {
+    int64_t start = monotonicNanos();
+    if (start >= MEASURE_END || (REQUESTS > 0 && __atomic_load_n(&MEASURED, __ATOMIC_RELAXED) >= REQUESTS)) {
+      break;
+    }
+    unsigned pick = nextRandom(client) % total;
+    int op = pick < MIX[OP_GET] ? OP_GET : pick < MIX[OP_GET] + MIX[OP_LIST] ? OP_LIST : OP_CD;
+    uint64_t dataBytes = 0;
+    int status = runRequest(client, op, &dataBytes);
+    int64_t finish = monotonicNanos();
+    if (start < MEASURE_START) {
+      client->failed = status < 0;
+      continue;
+    }
+    struct opStats* stats = &client->ops[op];
+    if (status < 0) {
+      stats->errors++;
+      client->failed = TRUE;
+    }
+    else {
+      stats->errors += status != STATUS_OK;
+      stats->bytes += dataBytes;
+      recordLatency(stats, finish - start);
+      client->lastFinish = finish;
+      __atomic_add_fetch(&MEASURED, 1, __ATOMIC_RELAXED);
+    }
+  }
+  if (client->p >= 0) {
+    close(client->p);
+  }
+  if (client->q >= 0) {
+    close(client->q);
+  }
+  return NULL;
+}
+
+
+/*******************************************************************************
+ *                 int compareLatencies(const void*, const void*)
+ * Description: orders latencies for qsort()
+*******************************************************************************/
+int compareLatencies(const void* a, const void* b) {
+  uint32_t first = *(const uint32_t*)a, second = *(const uint32_t*)b;
+  return first < second ? -1 : first > second;
+}
+
+
+/*******************************************************************************
+ *      double percentile(uint32_t* sorted, size_t count, double fraction)
+ * Description: the nearest-rank percentile of sorted latencies
+ * Input:
+ *   uint32_t* sorted - the latencies in microseconds, in ascending order
+ *   size_t count - the number of latencies
+ *   double fraction - the percentile, from 0 to 1
+ * Output: the latency in milliseconds, or 0 if there are none
+*******************************************************************************/
+double percentile(uint32_t* sorted, size_t count, double fraction) {
+  if (count == 0) {
+    return 0;
+  }
+  size_t rank = (size_t)ceil(fraction * count);
+  return sorted[rank > 0 ? rank - 1 : 0] / 1000.0;
+}
+
+
+/*******************************************************************************
+ *  void printStats(const char* name, struct opStats* stats, double seconds)
+ * Description: prints the JSON object describing one kind of request, or all
+ *   of them. The latencies are sorted in place
+ * Input:
+ *   const char* name - the key of the object
+ *   struct opStats* stats - the merged stats
+ *   double seconds - how long requests were measured for
+ * Output: none
+*******************************************************************************/
+void printStats(const char* name, struct opStats* stats, double seconds) {
+  uint64_t total = 0;
+  size_t i;
+  qsort(stats->latencies, stats->count, sizeof(uint32_t), compareLatencies);
+  for (i = 0; i < stats->count; i++) {
+    total += stats->latencies[i];
+  }
+  printf("\"%s\":{\"requests\":%zu,\"errors\":%llu,\"req_per_s\":%.1f,\"mb_per_s\":%.2f,"
+         "\"latency_ms\":{\"mean\":%.3f,\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}}",
+         name, stats->count, (unsigned long long)stats->errors, stats->count / seconds,
+         stats->bytes / seconds / 1e6, stats->count > 0 ? total / 1000.0 / stats->count : 0,
+         percentile(stats->latencies, stats->count, 0.5), percentile(stats->latencies, stats->count, 0.99),
+         percentile(stats->latencies, stats->count, 0.999),
+         stats->count > 0 ? stats->latencies[stats->count - 1] / 1000.0 : 0);
+}
+
+
+/*******************************************************************************
+ *            void mergeStats(struct opStats* into, struct opStats* from)
+ * Description: adds one set of stats to another
+*******************************************************************************/
+void mergeStats(struct opStats* into, struct opStats* from) {
+  size_t i;
+  for (i = 0; i < from->count; i++) {
+    recordLatency(into, (int64_t)from->latencies[i] * 1000);
+  }
+  into->errors += from->errors;
+  into->bytes += from->bytes;
+}
+
+
+/*******************************************************************************
+ *                     void createCdDirectory()
+ * Description: makes the subdirectory CDs go into and hard links the data
+ *   files into it, so GETs and LISTs from a session in the subdirectory find
+ *   the same files. Links already to the right file are kept
+ * Input: none
+ * Output: none
+*******************************************************************************/
+void createCdDirectory() {
+  char name[64], path[PATH_MAX], linkPath[PATH_MAX];
+  struct stat info, linked;
+  int i, j;
+  snprintf(path, sizeof(path), "%s/%s", DATA_DIRECTORY, CD_DIRECTORY);
+  mkdir(path, 0755);
+  for (i = 0; i < SIZE_COUNT && MIX[OP_GET] > 0; i++) {
+    for (j = 0; j < FILES_PER_SIZE; j++) {
+      fileName(name, sizeof(name), i, j);
+      snprintf(path, sizeof(path), "%s/%s", DATA_DIRECTORY, name);
+      snprintf(linkPath, sizeof(linkPath), "%s/%s/%s", DATA_DIRECTORY, CD_DIRECTORY, name);
+      if (stat(path, &info) == 0 && stat(linkPath, &linked) == 0 &&
+          info.st_dev == linked.st_dev && info.st_ino == linked.st_ino) {
+        continue;
+      }
+      unlink(linkPath);
+      if (link(path, linkPath) < 0) {
+        fprintf(stderr, "ERROR: could not link %s: %s\n", linkPath, strerror(errno));
+        exit(1);
+      }
+    }
+  }
+}
+
+
+/*******************************************************************************
+ *                     void createDataFiles()
+ * Description: makes sure the data directory holds FILES_PER_SIZE files of
+ *   every size GETs ask for. The files hold CSV-like text, so compressed runs
+ *   compress about as well as real data would. Files already of the right
+ *   size are kept
+ * Input: none
+ * Output: none
+*******************************************************************************/
+void createDataFiles() {
+  char name[64], path[PATH_MAX], line[128];
+  int i, j;
+  mkdir(DATA_DIRECTORY, 0755);
+  for (i = 0; i < SIZE_COUNT; i++) {
+    for (j = 0; j < FILES_PER_SIZE; j++) {
+      struct stat info;
+      fileName(name, sizeof(name), i, j);
+      snprintf(path, sizeof(path), "%s/%s", DATA_DIRECTORY, name);
+      if (stat(path, &info) == 0 && info.st_size == SIZES[i].size) {
+        continue;
+      }
+      FILE* file = fopen(path, "w");
+      if (file == NULL) {
+        fprintf(stderr, "ERROR: could not create %s: %s\n", path, strerror(errno));
+        exit(1);
+      }
+      off_t written = 0;
+      long row = 0;
+      while (written < SIZES[i].size) {
+        int length = snprintf(line, sizeof(line), "%ld,%d,sensor-%03ld,%.4f,%s\n", row, j, row % 997,
+                              sin(row * 0.01) * 100, row % 3 == 0 ? "ok" : "degraded");
+        if (length > SIZES[i].size - written) {
+          length = SIZES[i].size - written;
+        }
+        fwrite(line, 1, length, file);
+        written += length;
+        row++;
+      }
+      fclose(file);
+    }
+  }
+}
+
+
+/*******************************************************************************
+ *                       pid_t startServer()
+ * Description: starts ftserver in the data directory on PORT, with its output
+ *   discarded, and waits until a session can be opened with it
+ * Input: none
+ * Output: the server's process id
+*******************************************************************************/
+pid_t startServer() {
+  char server[PATH_MAX];
+  int i;
+  if (realpath(SERVER_PATH, server) == NULL) {
+    fprintf(stderr, "ERROR: %s not found\n", SERVER_PATH);
+    exit(1);
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "ERROR starting %s: %s\n", server, strerror(errno));
+    exit(1);
+  }
+  if (pid == 0) {
+    char** args = calloc(SERVER_ARG_COUNT + 3, sizeof(char*));
+    args[0] = server;
+    args[1] = PORT;
+    for (i = 0; i < SERVER_ARG_COUNT; i++) {
+      args[i + 2] = SERVER_ARGS[i];
+    }
+    int devNull = open("/dev/null", O_WRONLY);
+    if (chdir(DATA_DIRECTORY) != 0 || devNull < 0) {
+      _exit(127);
+    }
+    dup2(devNull, STDOUT_FILENO);
+    execv(server, args);
+    _exit(127);
+  }
+
+  struct client probe;
+  memset(&probe, '\0', sizeof(probe));
+  probe.buffer = malloc(RECEIVE_BUFFER_LENGTH);
+  for (i = 0; i < SERVER_START_SECONDS * 20 && probe.buffer != NULL; i++) {
+    probe.p = probe.q = -1;
+    int opened = openSession(&probe);
+    if (probe.p >= 0) {
+      close(probe.p);
+    }
+    if (probe.q >= 0) {
+      close(probe.q);
+    }
+    if (opened) {
+      free(probe.buffer);
+      return pid;
+    }
+    if (waitpid(pid, NULL, WNOHANG) == pid) {
+      break;
+    }
+    usleep(50000);
+  }
+  fprintf(stderr, "ERROR: %s did not start listening on port %s\n", server, PORT);
+  kill(pid, SIGKILL);
+  exit(1);
+}
+
+
+/*******************************************************************************
+ *                    off_t parseSize(const char* text)
+ * Description: parses a size such as 4096, 64K, 1M or 2G
+ * Input: const char* text - the size
+ * Output: the size in bytes, or -1 if it is invalid
+*******************************************************************************/
+off_t parseSize(const char* text) {
+  char* end;
+  long long size = strtoll(text, &end, 10);
+  if (end == text || size < 0) {
+    return -1;
+  }
+  switch (*end) {
+    case 'K': size <<= 10; end++; break;
+    case 'M': size <<= 20; end++; break;
+    case 'G': size <<= 30; end++; break;
+  }
+  return *end == '\0' || *end == '=' ? size : -1;
+}
+
+
+/*******************************************************************************
+ *                              void usage()
+ * Description: prints how to run ftload and exits
+*******************************************************************************/
+void usage() {
+  fprintf(stderr,
+          "usage: ftload <host> <port> [options] [-- <ftserver options>]\n"
+          "  --clients <n>        concurrent sessions (default %d)\n"
+          "  --duration <s>       seconds to measure for (default %.0f)\n"
+          "  --warmup <s>         seconds of unmeasured requests first (default %.0f)\n"
+          "  --requests <n>       stop after n measured requests instead\n"
+          "  --mix get=<w>,list=<w>,cd=<w>  relative weights of the requests (default get=1)\n"
+          "  --sizes <size>=<w>,...  file sizes GETs ask for and their weights (default 4K=1)\n"
+          "  --files-per-size <n> files of each size to spread GETs over (default %d)\n"
+          "  --dir <path>         where the files are created (default .)\n"
+          "  --compress           ask for deflate compression\n"
+          "  --checksum           ask for CRC-32 checksums\n"
+          "  --label <name>       the name of the run in the JSON output\n"
+          "  --server <ftserver>  start this ftserver in --dir for the run\n",
+          DEFAULT_CLIENTS, DEFAULT_DURATION, DEFAULT_WARMUP, DEFAULT_FILES_PER_SIZE);
+  exit(1);
+}
+
+
+/*******************************************************************************
+ *                void parseArgs(int argc, char* argv[])
+ * Description: applies the command line. Arguments after -- are passed to
+ *   the ftserver started with --server
+ * Input: int argc, char* argv[] - the command line
+ * Output: none. Exits with the usage on an invalid argument
+*******************************************************************************/
+void parseArgs(int argc, char* argv[]) {
+  int i;
+  if (argc < 3) {
+    usage();
+  }
+  HOST = argv[1];
+  PORT = argv[2];
+  for (i = 3; i < argc; i++) {
+    char* value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(argv[i], "--") == 0) {
+      SERVER_ARGS = argv + i + 1;
+      SERVER_ARG_COUNT = argc - i - 1;
+      break;
+    }
+    else if (strcmp(argv[i], "--compress") == 0) {
+      COMPRESS = TRUE;
+      continue;
+    }
+    else if (strcmp(argv[i], "--checksum") == 0) {
+      CHECKSUM = TRUE;
+      continue;
+    }
+    else if (value == NULL) {
+      usage();
+    }
+    else if (strcmp(argv[i], "--clients") == 0) {
+      CLIENTS = atoi(value);
+    }
+    else if (strcmp(argv[i], "--duration") == 0) {
+      DURATION = atof(value);
+    }
+    else if (strcmp(argv[i], "--warmup") == 0) {
+      WARMUP = atof(value);
+    }
+    else if (strcmp(argv[i], "--requests") == 0) {
+      REQUESTS = strtoull(value, NULL, 10);
+    }
+    else if (strcmp(argv[i], "--files-per-size") == 0) {
+      FILES_PER_SIZE = atoi(value);
+    }
+    else if (strcmp(argv[i], "--dir") == 0) {
+      DATA_DIRECTORY = value;
+    }
+    else if (strcmp(argv[i], "--label") == 0) {
+      LABEL = value;
+    }
+    else if (strcmp(argv[i], "--server") == 0) {
+      SERVER_PATH = value;
+    }
+    else if (strcmp(argv[i], "--mix") == 0) {
+      char* item;
+      memset(MIX, '\0', sizeof(MIX));
+      for (item = strtok(value, ","); item != NULL; item = strtok(NULL, ",")) {
+        char* weight = strchr(item, '=');
+        int op = strncmp(item, "get=", 4) == 0 ? OP_GET : strncmp(item, "list=", 5) == 0 ? OP_LIST :
+                 strncmp(item, "cd=", 3) == 0 ? OP_CD : -1;
+        if (op < 0 || weight == NULL) {
+          usage();
+        }
+        MIX[op] = atoi(weight + 1);
+      }
+    }
+    else if (strcmp(argv[i], "--sizes") == 0) {
+      char* item;
+      unsigned cumulative = 0;
+      SIZE_COUNT = 0;
+      for (item = strtok(value, ","); item != NULL; item = strtok(NULL, ",")) {
+        char* weight = strchr(item, '=');
+        if (SIZE_COUNT == MAX_SIZE_CLASSES || parseSize(item) < 0) {
+          usage();
+        }
+        // weights are stored as running totals so a pick is one scan
+        cumulative += weight != NULL ? atoi(weight + 1) : 1;
+        SIZES[SIZE_COUNT].size = parseSize(item);
+        SIZES[SIZE_COUNT++].weight = cumulative;
+      }
+    }
+    else {
+      usage();
+    }
+    i++;
+  }
+  if (CLIENTS < 1 || CLIENTS > MAX_CLIENTS || DURATION <= 0 || WARMUP < 0 || FILES_PER_SIZE < 1 ||
+      SIZE_COUNT == 0 || SIZES[SIZE_COUNT - 1].weight == 0 || MIX[OP_GET] + MIX[OP_LIST] + MIX[OP_CD] == 0) {
+    usage();
+  }
+}
+
+
+/*******************************************************************************
+ *                    int main(int argc, char* argv[])
+ * Description: creates the data files, starts ftserver if asked to, runs the
+ *   clients and prints the results as one line of JSON
+*******************************************************************************/
+int main(int argc, char* argv[]) {
+  struct rlimit limit;
+  pid_t server = 0;
+  int i, op;
+
+  parseArgs(argc, argv);
+  signal(SIGPIPE, SIG_IGN);
+  // every client holds two sockets
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  if (MIX[OP_GET] > 0) {
+    createDataFiles();
+  }
+  if (MIX[OP_CD] > 0) {
+    createCdDirectory();
+  }
+  if (SERVER_PATH != NULL) {
+    server = startServer();
+  }
+
+  struct client* clients = calloc(CLIENTS, sizeof(struct client));
+  if (clients == NULL) {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(1);
+  }
+  pthread_barrier_init(&STARTED, NULL, CLIENTS + 1);
+  for (i = 0; i < CLIENTS; i++) {
+    clients[i].index = i;
+    clients[i].p = clients[i].q = -1;
+    clients[i].random = 0x9E3779B97F4A7C15ULL * (i + 1);
+    clients[i].buffer = malloc(RECEIVE_BUFFER_LENGTH);
+    if (clients[i].buffer == NULL || pthread_create(&clients[i].thread, NULL, runClient, &clients[i]) != 0) {
+      fprintf(stderr, "ERROR starting client %d\n", i);
+      exit(1);
+    }
+  }
+  // the run starts once every session is open
+  pthread_barrier_wait(&STARTED);
+  MEASURE_START = monotonicNanos() + (int64_t)(WARMUP * 1e9);
+  MEASURE_END = REQUESTS > 0 ? INT64_MAX : MEASURE_START + (int64_t)(DURATION * 1e9);
+  pthread_barrier_wait(&STARTED);
+
+  struct opStats merged[OPS], all;
+  int64_t lastFinish = MEASURE_START;
+  int failed = 0;
+  memset(merged, '\0', sizeof(merged));
+  memset(&all, '\0', sizeof(all));
+  for (i = 0; i < CLIENTS; i++) {
+    pthread_join(clients[i].thread, NULL);
+    failed += clients[i].failed;
+    if (clients[i].lastFinish > lastFinish) {
+      lastFinish = clients[i].lastFinish;
+    }
+    for (op = 0; op < OPS; op++) {
+      mergeStats(&merged[op], &clients[i].ops[op]);
+      mergeStats(&all, &clients[i].ops[op]);
+      free(clients[i].ops[op].latencies);
+    }
+    free(clients[i].buffer);
+  }
+  if (server > 0) {
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+  }
+
+  double seconds = REQUESTS > 0 ? (lastFinish - MEASURE_START) / 1e9 : DURATION;
+  char* names[OPS] = {"get", "list", "cd"};
+  printf("{\"label\":\"%s\",\"clients\":%d,\"seconds\":%.3f,\"failed_sessions\":%d,", LABEL, CLIENTS,
+         seconds, failed);
+  printStats("total", &all, seconds > 0 ? seconds : 1);
+  for (op = 0; op < OPS; op++) {
+    if (MIX[op] > 0) {
+      printf(",");
+      printStats(names[op], &merged[op], seconds > 0 ? seconds : 1);
+    }
+  }
+  printf("}\n");
+  return failed == CLIENTS ? 1 : 0;
+}
@@ -20,6 +20,7 @@
  *   This allows each user to send multiple messages at a time and to receive
  *   a message at any time.
 *******************************************************************************/
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <stdlib.h>
 #include <sys/wait.h>
@@ -27,43 +28,944 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <limits.h>
 #include <assert.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fnmatch.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <sys/stat.h>
 #include <arpa/inet.h>
 #include <netdb.h> 
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <linux/pkt_sched.h>
+#include <netinet/tcp.h>
+#include <math.h>
+#include <zlib.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define TRUE 1
 #define FALSE 0
 #define MAX_PORT_NUMBER 65535
 #define MIN_PORT_NUMBER 1
 #define BUFFER_LENGTH 1024
-#define MAX_COMMAND_LENGTH 10
 #define MAX_FILE_NAME_LENGTH 255
-#define LIST_CODE 5322345
-#define TRANSFER_CODE 9912349
-#define CD_CODE 126649
+#define DEFAULT_CHUNK_SIZE (1024 * 1024)
+#define MIN_CHUNK_SIZE 4096
+#define MAX_CHUNK_SIZE (64 * 1024 * 1024)
+#define TRANSMIT_SENDFILE 1
+#define TRANSMIT_SPLICE 2
+#define TRANSMIT_COPY 3
+#define TRANSMIT_URING 4
+#define TRANSMIT_MEMORY 5
+#define MAX_EVENTS 256
+#define LISTING_BLOCK_SIZE (64 * 1024)
+#define ROLE_LISTEN 1
+#define ROLE_P 2
+#define ROLE_Q 3
+#define ROLE_WAKE 4
+#define ROLE_INOTIFY 5
+#define ROLE_RING 6
+#define ROLE_DATA_LISTEN 7
+#define STATE_HELLO 1
+#define STATE_CONNECT_Q 2
+#define STATE_SEND 3
+#define STATE_IDLE 4
+#define STATE_CLOSING 5
+#define STATE_CLOSED 6
+#define MAX_WORKERS 256
+#define SHUTDOWN_GRACE_SECONDS 30
+#define MAX_STRIPES 16
+#define DEFAULT_LISTING_CACHE_ENTRIES 64
+#define MAX_LISTING_CACHE_ENTRIES 65536
+#define INOTIFY_BUFFER_LENGTH (64 * 1024)
+#define LISTING_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | \
+                              IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+// the bytes of hot files each worker's file cache may hold, split between
+// the workers. Files bigger than MAX_CACHED_FILE_SIZE are never cached
+#define DEFAULT_FILE_CACHE_SIZE (256 * 1024 * 1024)
+#define MAX_CACHED_FILE_SIZE (16 * 1024 * 1024)
+#define MAX_CACHED_FILES 256
+#define FILE_WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+// the directories each worker keeps open for changes of directory
+#define DIRECTORY_CACHE_ENTRIES 16
+#define STRIPE_ALIGNMENT (64 * 1024)
+// bytes of directory entries read per getdents64() call
+#define LISTING_BATCH_SIZE (128 * 1024)
+// a listing bigger than this is sent but not cached
+#define MAX_CACHED_LISTING_SIZE (16 * 1024 * 1024)
+// cached entries are prefixed with their directory position
+#define CACHED_ENTRY_PREFIX_LENGTH 8
+// a recursive get sends its archive in batches of about TREE_BATCH_SIZE
+// bytes. Files up to TREE_SMALL_FILE_SIZE are read into the batch; bigger
+// ones are sent with transmitChunk()
+#define TREE_BATCH_SIZE (256 * 1024)
+#define TREE_SMALL_FILE_SIZE (64 * 1024)
+#define TREE_DIRENT_BUFFER_SIZE (32 * 1024)
+// a batch get sends its files in batches the same way. While one file is
+// sent, the first BATCH_READAHEAD bytes of the next are read into the page
+// cache. Its globs may match at most MAX_BATCH_FILES files
+#define BATCH_READAHEAD (4 * 1024 * 1024)
+#define MAX_BATCH_FILES 65536
+#define TAR_BLOCK_SIZE 512
+#define TAR_MAX_OCTAL_SIZE 077777777777ULL
+// files whose samples have more entropy than this, in bits per byte, are
+// taken to be compressed already and sent as they are
+#define COMPRESSION_ENTROPY_LIMIT 7.5
+#define ENTROPY_SAMPLES 4
+#define ENTROPY_SAMPLE_SIZE (16 * 1024)
+#define DEFAULT_COMPRESSION_LEVEL Z_BEST_SPEED
+// whole-file digests remembered between requests, shared by the workers.
+// The cache is a direct-mapped table, so a new file evicts the one in its slot
+#define DIGEST_CACHE_ENTRIES 65536
+#define DIGEST_FILE_MAGIC "FTDIGST1"
+// ranges shorter than this are hashed with zlib's crc32() alone
+#define CRC_SIMD_MINIMUM_LENGTH 64
+// a delta get carries a signature for each block of ftclient's copy of the
+// file: the block's Adler-32 and CRC-32
+#define DELTA_SIGNATURE_LENGTH 8
+#define DELTA_MAX_BLOCKS 65536
+#define DELTA_MIN_BLOCK_SIZE 512
+#define DELTA_MAX_BLOCK_SIZE (8 * 1024 * 1024)
+#define DELTA_HASH_BITS 17
+// literal bytes go out in DATA frames of at most DELTA_LITERAL_LIMIT bytes,
+// and each turn of the event loop scans at most DELTA_SCAN_LIMIT bytes
+#define DELTA_LITERAL_LIMIT (1024 * 1024)
+#define DELTA_SCAN_LIMIT (16 * 1024 * 1024)
+#define ADLER_BASE 65521
+// an upload is spliced from connection Q into its file through a pipe of
+// UPLOAD_PIPE_SIZE bytes. The END frame closing it may carry at most
+// MAX_UPLOAD_TRAILER bytes of attributes
+#define UPLOAD_PIPE_SIZE (1024 * 1024)
+#define MAX_UPLOAD_TRAILER 256
+#define UPLOAD_TEMPLATE ".ftput.XXXXXX"
+// with --io-uring each worker reads file ranges into registered buffers and
+// sends them through its own io_uring, submitting the operations of every
+// transfer together once per turn of the event loop. A transfer holds one of
+// the URING_SLOTS buffers while its range is being sent
+#define URING_ENTRIES 256
+#define URING_SLOTS 64
+#define URING_BUFFER_SIZE (256 * 1024)
+// the user data of an operation is its slot times URING_OPS plus its kind
+#define URING_OP_UPDATE 0
+#define URING_OP_READ 1
+#define URING_OP_SEND 2
+#define URING_OP_CLEAR 3
+#define URING_OPS 4
+// with --rate or --client-rate, connection Q sends are charged to token
+// buckets that hold up to a tenth of a second of the rate, and at least
+// MIN_RATE_BURST bytes. A stripe that is out of tokens waits until a
+// hundredth of a second of the rate, and at least MIN_RATE_QUANTUM bytes,
+// has built up. Clients are tracked by IP address in CLIENT_BUCKETS
+// buckets, searched CLIENT_BUCKET_PROBES at a time
+#define MIN_RATE 1024
+#define RATE_BURST_DIVISOR 10
+#define RATE_QUANTUM_DIVISOR 100
+#define MIN_RATE_BURST (64 * 1024)
+#define MIN_RATE_QUANTUM (4 * 1024)
+// stripes whose waits end within THROTTLE_SLACK nanoseconds of each other
+// are woken together, so they take turns rather than racing for the tokens
+#define THROTTLE_SLACK 1000000
+#define CLIENT_BUCKETS 4096
+#define CLIENT_BUCKET_PROBES 8
+// listings, changes of directory and transfers of at most SMALL_TRANSFER_SIZE
+// bytes are interactive; bigger transfers, trees and batches are bulk.
+// Interactive requests are served first in each turn of the event loop and
+// may overdraw the rate limits by a burst
+#define CLASS_INTERACTIVE 0
+#define CLASS_BULK 1
+#define REQUEST_CLASSES 2
+#define SMALL_TRANSFER_SIZE (1024 * 1024)
+// holes in a sparse file shorter than MIN_HOLE_LENGTH are sent as zeros
+// rather than described, so a fragmented file doesn't become a frame per block
+#define MIN_HOLE_LENGTH (64 * 1024)
+// request latencies are counted in buckets of powers of two microseconds
+#define LATENCY_BUCKETS 40
+// the kinds of request counted separately in a worker's metrics
+#define KIND_LIST 0
+#define KIND_GET 1
+#define KIND_TREE 2
+#define KIND_BATCH 3
+#define KIND_CD 4
+#define KIND_PUT 5
+#define REQUEST_KINDS 6
+// the statuses of responses, counted to tell errors apart by type
+#define STATUSES 7
+// log messages at a level above LOG_LEVEL are dropped before they are
+// formatted. A worker's messages go through a ring of LOG_RING_SLOTS lines of
+// up to LOG_LINE_LENGTH bytes, which the logger thread empties every
+// LOG_FLUSH_MILLIS. Messages that find the ring full are counted and dropped
+#define LOG_NONE 0
+#define LOG_ERROR 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#define LOG_RING_SLOTS 1024
+#define LOG_LINE_LENGTH 256
+#define LOG_FLUSH_MILLIS 10
+// the bytes of JSON a stats socket reply may hold
+#define STATS_REPLY_LENGTH (64 * 1024)
 
-char LIST_ALL_COMMAND[4] = "-la";
-char LIST_COMMAND[3] = "-l";
-char TRANSFER_COMMAND[3] = "-g";
-char MESSAGE_DIVIDER = '#';
-char CD_COMMAND[3] = "-c";
-int SHOW_HIDDEN = FALSE;
+/* Every message on connections P and Q is a frame: a FRAME_HEADER_LENGTH byte
+   header followed by length bytes of payload. All integers are in network
+   byte order. The header is
+     magic (2) | version (1) | type (1) | status (2) | flags (2) |
+     request id (4) | payload length (8)
+   The payload of a request or response frame is a list of attributes, each
+     tag (2) | value length (4) | value
+   The payload of a DATA frame is the offset of its bytes in the file (8)
+   followed by the bytes themselves. A HOLE frame stands for a run of zeros
+   in a sparse file, with the offset (8) and length (8) of the run. The
+   data of a LIST is a series of entries, each
+     type (1) | size (8) | modification time (8) | name length (2) | name */
+#define PROTOCOL_MAGIC 0x4654
+#define PROTOCOL_VERSION 1
+#define FRAME_HEADER_LENGTH 20
+#define ATTRIBUTE_HEADER_LENGTH 6
+#define DATA_OFFSET_LENGTH 8
+// the payload of a HOLE frame: offset (8) | length (8)
+#define HOLE_PAYLOAD_LENGTH 16
+#define MAX_REQUEST_PAYLOAD (64 * 1024 + DELTA_MAX_BLOCKS * DELTA_SIGNATURE_LENGTH)
+#define INPUT_BLOCK_SIZE 4096
+#define MAX_INPUT_LENGTH (FRAME_HEADER_LENGTH + MAX_REQUEST_PAYLOAD)
+// STRIPE frame with a STRIPE_INDEX attribute, then a HOLE frame and a DATA
+// frame header
+#define STRIPE_HEADER_LENGTH (3 * FRAME_HEADER_LENGTH + ATTRIBUTE_HEADER_LENGTH + 2 + \
+                              HOLE_PAYLOAD_LENGTH + DATA_OFFSET_LENGTH)
+// END frame with the three compression stats attributes
+#define STRIPE_TRAILER_LENGTH (FRAME_HEADER_LENGTH + 3 * (ATTRIBUTE_HEADER_LENGTH + 8) + \
+                               ATTRIBUTE_HEADER_LENGTH + 4)
+// frame header flags
+#define FLAG_COMPRESSED 0x1
+#define ENTRY_HEADER_LENGTH 19
 
-//global variables for signal-handler exit
-char* sendString;
-char* buffer;
+/* listing entry types */
+#define ENTRY_FILE 1
+#define ENTRY_DIRECTORY 2
+#define ENTRY_SYMLINK 3
+#define ENTRY_OTHER 4
+
+/* listing sort orders sent in ATTR_SORT. SORT_REVERSE may be added to any */
+#define SORT_NONE 0
+#define SORT_NAME 1
+#define SORT_SIZE 2
+#define SORT_MTIME 3
+#define SORT_KEY_MASK 0x7f
+#define SORT_REVERSE 0x80
+
+/* frame types. HELLO opens a session in both directions; LIST, GET, CD and
+   PUT are requests sent on connection P and each is answered by a RESPONSE
+   on connection P. Data for a request travels on connection Q as DATA frames
+   closed by an END frame. Each extra connection of a striped get begins
+   with a STRIPE frame. The data of a PUT travels the other way, and ftserver
+   answers it with an END frame of its own once the file is stored. A batch
+   get sends each of its files as a FILE frame followed by the file's DATA
+   frames and END frame, and closes the batch with one more END frame */
+#define FRAME_HELLO 1
+#define FRAME_LIST 2
+#define FRAME_GET 3
+#define FRAME_CD 4
+#define FRAME_PUT 5
+#define FRAME_RESPONSE 32
+#define FRAME_STRIPE 33
+#define FRAME_DATA 34
+#define FRAME_END 35
+#define FRAME_COPY 36
+#define FRAME_FILE 37
+#define FRAME_HOLE 38
+
+/* response status codes */
+#define STATUS_OK 0
+#define STATUS_NOT_FOUND 1
+#define STATUS_INVALID_RANGE 2
+#define STATUS_BAD_REQUEST 3
+#define STATUS_UNSUPPORTED 4
+#define STATUS_VERSION_MISMATCH 5
+#define STATUS_IO_ERROR 6
+
+/* attribute tags */
+#define ATTR_CAPABILITIES 1
+#define ATTR_DATA_PORT 2
+#define ATTR_NAME 3
+#define ATTR_OFFSET 4
+#define ATTR_LENGTH 5
+#define ATTR_STRIPES 6
+#define ATTR_SHOW_HIDDEN 7
+#define ATTR_FILE_SIZE 8
+#define ATTR_MESSAGE 9
+#define ATTR_STRIPE_INDEX 10
+#define ATTR_FILTER 11
+#define ATTR_SORT 12
+#define ATTR_CURSOR 13
+#define ATTR_PAGE_SIZE 14
+#define ATTR_RECURSIVE 15
+#define ATTR_COMPRESSION 16
+#define ATTR_COMPRESSION_LEVEL 17
+#define ATTR_RAW_LENGTH 18
+#define ATTR_COMPRESSED_LENGTH 19
+#define ATTR_CPU_TIME 20
+#define ATTR_CHECKSUM 21
+#define ATTR_DIGEST 22
+#define ATTR_BLOCK_SIZE 23
+#define ATTR_SIGNATURES 24
+#define ATTR_NAMES 25
+#define ATTR_FILES 26
+
+/* capability bits exchanged in HELLO. A feature is only used when both ends
+   advertise it */
+#define CAP_RANGE 0x1
+#define CAP_STRIPES 0x2
+#define CAP_TREE 0x4
+#define CAP_COMPRESS 0x8
+#define CAP_CHECKSUM 0x10
+#define CAP_DELTA 0x20
+#define CAP_PUT 0x40
+#define CAP_BATCH 0x80
+#define CAP_PASSIVE 0x100
+#define CAP_SPARSE 0x200
+#define SERVER_CAPABILITIES (CAP_RANGE | CAP_STRIPES | CAP_TREE | CAP_COMPRESS | CAP_CHECKSUM | \
+                             CAP_DELTA | CAP_PUT | CAP_BATCH | CAP_PASSIVE | CAP_SPARSE)
+
+/* compression algorithms. A request lists the ones ftclient accepts and the
+   response names the one used */
+#define COMPRESS_NONE 0
+#define COMPRESS_DEFLATE 0x1
+
+/* Checksum algorithms a request may ask for. The digest of the bytes sent on
+   each connection Q goes in the END frame that follows them */
+#define CHECKSUM_NONE 0
+#define CHECKSUM_CRC32 1
+
+// number of bytes handed to the kernel per transmit call in transmitChunk()
+size_t CHUNK_SIZE = DEFAULT_CHUNK_SIZE;
+// number of worker threads, each with its own listen socket and event loop
+int WORKERS = 1;
+// whether worker i is pinned to CPU i (modulo the number of CPUs)
+int PIN_CPUS = FALSE;
+// number of directory listings each worker keeps in memory. 0 disables the
+// cache
+int LISTING_CACHE_ENTRIES = DEFAULT_LISTING_CACHE_ENTRIES;
+// the bytes of file contents the workers keep in memory together. 0 disables
+// the file cache
+size_t FILE_CACHE_SIZE = DEFAULT_FILE_CACHE_SIZE;
+// the file whole-file digests are saved in so they outlive the server, or
+// NULL to keep them in memory only
+char* DIGEST_CACHE_PATH = NULL;
+// whether file ranges are sent through io_uring instead of sendfile, on the
+// workers whose kernel supports it
+int USE_IO_URING = FALSE;
+// the bytes per second sent on connections Q to all clients together, and to
+// each client IP address. 0 means no limit
+uint64_t RATE_LIMIT = 0;
+uint64_t CLIENT_RATE_LIMIT = 0;
+// the most detailed LOG_ level printed
+int LOG_LEVEL = LOG_INFO;
+// the Unix socket a JSON snapshot of the metrics is read from, or NULL
+char* STATS_SOCKET_PATH = NULL;
+// the directory the server was started in, which every session starts in and
+// none can leave, open with O_PATH and as an absolute path. Without
+// openat2(2) names that climb out with ".." are still refused, but symlinks
+// out of it are followed
+int ROOT_FD = -1;
+char ROOT_PATH[PATH_MAX];
+int HAVE_OPENAT2 = TRUE;
+
+
+/* A growable byte buffer. sent counts the bytes at the front that have
+   already been written to a socket, or consumed by the parser for input */
+struct buffer {
+  char* bytes;
+  size_t length;
+  size_t sent;
+  size_t capacity;
+};
+
+/* A frame that has fully arrived on connection P. The payload points into the
+   session's input buffer and is only valid until the next read */
+struct frame {
+  int type;
+  int status;
+  int flags;
+  uint32_t requestId;
+  uint64_t length;
+  unsigned char* payload;
+};
+
+/* A decoded LIST, GET or CD request */
+struct request {
+  int type;
+  uint32_t id;
+  char name[PATH_MAX + 1];
+  // the part of the file requested by a get. A length of 0 means through the
+  // end of the file
+  off_t offset;
+  off_t length;
+  int stripes;
+  // the size of the file a PUT uploads
+  off_t fileSize;
+  // a GET of a directory and everything under it
+  int recursive;
+  // the compression algorithms ftclient accepts and the level it asks for
+  int compression;
+  int compressionLevel;
+  // the CHECKSUM_ algorithm ftclient wants the data verified with
+  int checksum;
+  // the block signatures of ftclient's copy of the file for a delta get.
+  // They point into the request frame, so are only valid while it is run
+  uint32_t blockSize;
+  unsigned char* signatures;
+  size_t signatureLength;
+  // the NUL-terminated names and globs of a batch get, which also point
+  // into the request frame
+  unsigned char* names;
+  size_t namesLength;
+  // the listing options of a LIST: a glob names must match, the sort order,
+  // where the page starts and the most entries to send (0 for all)
+  int showHidden;
+  char filter[MAX_FILE_NAME_LENGTH + 1];
+  int sort;
+  uint64_t cursor;
+  uint32_t pageSize;
+};
+
+/* A file descriptor registered with epoll. The epoll event data points at one
+   of these so the event loop knows which session and which connection the
+   event belongs to */
+struct endpoint {
+  int fd;
+  int role;
+  int index;
+  uint32_t events;
+  struct session* owner;
+};
+
+/* A deflate stream compressing the data sent on one stripe, with what it has
+   saved and cost so far. output holds compressed file frames waiting to be
+   sent and input is scratch space for compressing frames in place */
+struct compressor {
+  z_stream stream;
+  uint64_t rawLength;
+  uint64_t compressedLength;
+  uint64_t cpuTime;
+  struct buffer output;
+  struct buffer input;
+};
+
+/* One connection Q. Stripe 0 is the session's connection Q, which stays open
+   for the whole session. A striped get opens stripes 1 and up for the one
+   request and sends a different part of the file on each. Every stripe sends
+   its header frames, then (stripe 0 only) the session's data buffer, then its
+   range of the file, then its trailer frame */
+struct stripe {
+  struct endpoint q;
+  int connected;
+  // in passive mode, whether the stripe is waiting for ftclient to connect
+  int accepting;
+  off_t offset;
+  off_t end;
+  // the end of the extent of data being sent. In a sparse file it stops
+  // short of end at the next hole, which is described rather than sent
+  off_t dataEnd;
+  int method;
+  unsigned char header[STRIPE_HEADER_LENGTH];
+  size_t headerLength;
+  size_t headerSent;
+  unsigned char trailer[STRIPE_TRAILER_LENGTH];
+  size_t trailerLength;
+  size_t trailerSent;
+  // the deflate stream if the request is compressed, and whether the file
+  // range goes through it. dataBase is added to file offsets to give the
+  // offsets in the DATA frames
+  struct compressor* compressor;
+  int compressFile;
+  off_t dataBase;
+  // the CRC-32 of the bytes sent on the stripe so far, if the request asked
+  // for a checksum. A digest taken from the digest cache is already complete
+  int checksum;
+  uint32_t digest;
+  int digestKnown;
+  // the io_uring slot sending the stripe's range, or -1
+  int ringSlot;
+  // when a stripe held back by a rate limit may send again, or 0
+  int64_t throttledUntil;
+};
+
+/* An unsorted listing being streamed from its directory one getdents64()
+   batch at a time. sent counts the listing bytes sent so far and remaining
+   the entries left in the page, if it has a size. A plain listing of the
+   whole directory is collected into build for the cache as it goes */
+struct listStream {
+  int fd;
+  uint64_t sent;
+  uint32_t remaining;
+  struct listing* build;
+};
+
+/* A directory tree being sent as a tar archive by a recursive get. The tree
+   is walked breadth first: the directory being read is open with its
+   current batch of entries, and the paths of the directories found but not
+   yet read wait in pending, relative to the root and NUL-terminated */
+struct treeWalk {
+  int rootFD;
+  char root[MAX_FILE_NAME_LENGTH + 1];
+  int directoryFD;
+  char directory[PATH_MAX];
+  char dirents[TREE_DIRENT_BUFFER_SIZE] __attribute__((aligned(8)));
+  ssize_t direntLength;
+  ssize_t direntPosition;
+  struct buffer pending;
+  // bytes of the archive queued so far, and the padding owed after the
+  // last large file
+  uint64_t archiveOffset;
+  size_t padding;
+  uint64_t files;
+  uint64_t bytes;
+  int done;
+};
+
+/* A batch get sending several files back to back on connection Q. The
+   names its globs matched wait in names, NUL-terminated, and names.sent is
+   the next one to open. Small files are read into the data buffer in
+   batches and a large one is sent on its own, as for a tree. Each file is
+   opened as soon as the one before it starts, and its first
+   BATCH_READAHEAD bytes are read ahead while that one is still sending */
+struct batchGet {
+  struct buffer names;
+  uint32_t count;
+  int nextFD;
+  char* nextName;
+  struct stat nextInfo;
+  // whether the END frame of the large file being sent is still owed
+  int endOwed;
+  uint64_t files;
+  uint64_t bytes;
+  uint64_t missing;
+  int done;
+};
+
+/* A delta get being scanned. ftclient sent the signatures of the blocks of
+   its old copy of the file, which are indexed by Adler-32 in a hash table.
+   The file is scanned with a rolling Adler-32 for those blocks: a block
+   ftclient has is sent as a COPY frame and everything in between as literal
+   DATA. Only blocks at or after the scan position may be copied, so that
+   ftclient can rebuild the file in place without overwriting a block it
+   still needs. The window holds the file from the pending literal onwards,
+   and adjacent copies are merged into one pending copy */
+struct deltaScan {
+  uint32_t blockSize;
+  uint32_t blockCount;
+  uint32_t* weak;
+  uint32_t* strong;
+  int32_t* heads;
+  int32_t* next;
+  char* window;
+  size_t windowCapacity;
+  off_t windowStart;
+  size_t windowLength;
+  off_t position;
+  off_t literalStart;
+  off_t end;
+  // the rolling Adler-32 of the block at position, once it is known
+  uint32_t a;
+  uint32_t b;
+  int rolling;
+  off_t copyTarget;
+  off_t copySource;
+  off_t copyLength;
+  uint64_t copied;
+  uint64_t literal;
+  int done;
+};
+
+/* A file being uploaded by a PUT. ftclient sends it on connection Q as DATA
+   frames closed by an END frame. Frame headers are read into frame; the
+   bytes of each DATA frame are spliced from the socket into a pipe and from
+   the pipe into a temporary file next to the target, so they never pass
+   through the server's memory. DATA frames must arrive in order, each
+   starting where the last ended. The temporary file is renamed over the
+   target once all of it has arrived. An upload that failed to write is
+   drained to its END frame so connection Q stays in step */
+struct upload {
+  int fd;
+  char path[sizeof(UPLOAD_TEMPLATE)];
+  off_t size;
+  int pipeFDs[2];
+  unsigned char frame[FRAME_HEADER_LENGTH + MAX_UPLOAD_TRAILER];
+  size_t frameLength;
+  // where the rest of the current DATA frame goes and how much is left, and
+  // the bytes waiting in the pipe
+  off_t offset;
+  uint64_t remaining;
+  size_t piped;
+  uint64_t received;
+  // the CRC-32 of the bytes received
+  int checksum;
+  uint32_t digest;
+  int failed;
+  int done;
+};
+
+/* Everything the server knows about one client session. Each session owns its
+   own buffers so that any number of them can be in flight at once */
+struct session {
+  struct endpoint p;
+  int state;
+  char clientIP[INET6_ADDRSTRLEN];
+  int hostPort;
+  int clientPort;
+  // where connection P came from, which connections Q are opened to in
+  // active mode and must come from in passive mode
+  struct sockaddr_storage clientAddress;
+  socklen_t clientAddressLength;
+  // in passive mode, the socket ftclient connects its connections Q to
+  struct endpoint dataListener;
+  // the capabilities both ends advertised in HELLO
+  uint32_t capabilities;
+  // frames received on connection P, which may hold several pipelined
+  // requests
+  struct buffer input;
+  int requestsClosed;
+  // the request being carried out
+  struct request request;
+  // frames waiting to be sent on connection P
+  struct buffer reply;
+  // bytes waiting to be sent on connection Q
+  struct buffer data;
+  // the connection(s) Q and the file being sent on them
+  struct stripe stripes[MAX_STRIPES];
+  int stripeCount;
+  int fileFD;
+  off_t fileSize;
+  // the worker's cached copy of the file, if it is sent from memory
+  struct cachedFile* cachedFile;
+  // the session's working directory, open with O_PATH, which its names are
+  // resolved from, and its absolute path when it was opened
+  int directoryFD;
+  char directory[PATH_MAX];
+  // the file's metadata when it was opened, and whether the digest of the
+  // whole file should be added to the digest cache once it has been sent
+  struct stat fileInfo;
+  int cacheDigest;
+  // whether the file's holes are sent as HOLE frames
+  int sparse;
+  // the listing, directory tree or batch of files being streamed on
+  // connection Q, if any
+  struct listStream list;
+  struct treeWalk* tree;
+  struct batchGet* batch;
+  // the scan of a delta get, if any
+  struct deltaScan* delta;
+  // the file being uploaded by a PUT, if any
+  struct upload* upload;
+  // the CLASS_ and KIND_ of the request, when it started and whether its
+  // first byte has been sent on connection Q, for its latencies, and when
+  // connection P was accepted, until the first byte of the session is sent
+  int requestClass;
+  int requestKind;
+  int64_t requestStart;
+  int firstByteSent;
+  int64_t acceptedAt;
+  // the client's IP address as an IPv6 address, and the index of its bucket
+  // in RATE_LIMITS when it was last found, or -1
+  struct in6_addr clientKey;
+  int bucket;
+  // the server's list of open sessions
+  struct session* prev;
+  struct session* next;
+};
+
+/* A cached listing of one directory, including its hidden entries. The
+   directory is watched with inotify and the listing is dropped as soon as
+   anything in it changes. A listing is building while a session streams the
+   directory into it, and stale if the directory changed meanwhile */
+struct listing {
+  char* path;
+  int watch;
+  int building;
+  int stale;
+  struct buffer entries;
+  struct listing* prev;
+  struct listing* next;
+};
+
+/* A hot file held in a worker's file cache. Its contents are copied into
+   anonymous memory, so the file can be truncated under the server without
+   faulting it, and it stays open so that requests sent from the copy work
+   like any other. The file is watched with inotify, or checked with stat()
+   when it can't be, and dropped as soon as it changes. Sessions sending it
+   hold a reference, so a file dropped from the cache is freed by the last */
+struct cachedFile {
+  char* path;
+  int fd;
+  struct stat info;
+  char* bytes;
+  int watch;
+  // the sampled entropy of the whole file, or -1 until a compressed get
+  double entropy;
+  int users;
+  int cached;
+  struct cachedFile* prev;
+  struct cachedFile* next;
+};
+
+/* A directory a worker keeps open, so that changing into it again doesn't
+   walk its path. It is only used while the directory is still at path */
+struct cachedDirectory {
+  char* path;
+  int fd;
+  uint64_t used;
+};
+
+/* The latencies of a kind of request: how many finished, their total and
+   longest, and how many took each power of two microseconds */
+struct histogram {
+  uint64_t count;
+  uint64_t totalMicros;
+  uint64_t maxMicros;
+  uint64_t buckets[LATENCY_BUCKETS];
+};
+
+/* A worker's counters and latencies. Only the worker writes them, so they
+   take no lock; the main thread and the stats socket read them with relaxed
+   atomic loads and add up the workers' */
+struct metrics {
+  uint64_t connections;
+  // requests, and the bytes sent on connections Q for them, by KIND_
+  uint64_t requests[REQUEST_KINDS];
+  uint64_t bytesSent[REQUEST_KINDS];
+  uint64_t bytesReceived;
+  // the bytes of sparse files' holes described by HOLE frames instead of sent
+  uint64_t holeBytes;
+  // error responses by STATUS_, and transfers cut short by a lost
+  // connection or a file that failed while it was sent
+  uint64_t errors[STATUSES];
+  uint64_t connectionErrors;
+  uint64_t fileErrors;
+  // from accepting connection P to the first byte sent on a connection Q,
+  // and from starting a request to its first byte on connection Q
+  struct histogram acceptToFirstByte;
+  struct histogram firstByte[REQUEST_KINDS];
+  // from starting a request to handing its last byte to the kernel, by
+  // KIND_ and by CLASS_
+  struct histogram duration[REQUEST_KINDS];
+  struct histogram classes[REQUEST_CLASSES];
+  uint64_t fileCacheHits;
+  uint64_t fileCacheMisses;
+  uint64_t fileCacheEvictions;
+  uint64_t fileCacheInvalidations;
+  uint64_t directoryCacheHits;
+  uint64_t directoryCacheMisses;
+};
+
+/* One line waiting in a worker's log ring */
+struct logLine {
+  int level;
+  char text[LOG_LINE_LENGTH];
+};
+
+/* A worker's log messages on their way to the logger thread. The worker
+   alone advances head and the logger thread alone advances tail, so the
+   ring needs no lock */
+struct logRing {
+  struct logLine lines[LOG_RING_SLOTS];
+  uint64_t head;
+  uint64_t tail;
+  // the lines dropped because the ring was full, and how many of them the
+  // logger thread has reported
+  uint64_t dropped;
+  uint64_t reported;
+};
+
+/* The state of one worker's event loop */
+struct server {
+  int workerIndex;
+  pthread_t thread;
+  int epollFD;
+  int portNumber;
+  int sessionCount;
+  struct session* sessions;
+  // sessions closed during the current batch of events, freed after it
+  struct session* closed;
+  struct endpoint listener;
+  // an eventfd the main thread writes to when the server should shut down
+  struct endpoint wake;
+  int draining;
+  // scratch space for transmitChunk() when the kernel can't send zero-copy
+  char* copyBuffer;
+  // the pipe transmitChunk() splices through, opened on first use
+  int splicePipe[2];
+  // the worker's listing cache, most recently used first, and the inotify
+  // instance that invalidates it
+  struct listing* listings;
+  int listingCount;
+  struct endpoint inotify;
+  // the worker's file cache, most recently used first, and the bytes it
+  // holds, which the main thread reads for printFileCacheStats()
+  struct cachedFile* cachedFiles;
+  int cachedFileCount;
+  size_t cachedFileBytes;
+  // the directories the worker's sessions changed into most recently, and
+  // a clock that orders their use
+  struct cachedDirectory directories[DIRECTORY_CACHE_ENTRIES];
+  uint64_t directoryClock;
+  // the worker's counters and latencies, and the ring its log messages go
+  // through
+  struct metrics metrics;
+  struct logRing* log;
+  // scratch space for getdents64()
+  char* direntBuffer;
+  // the method file ranges are sent with first, and the worker's io_uring if
+  // it sends with one
+  int transmitMethod;
+  struct ring* ring;
+  // the earliest time a stripe held back by a rate limit may send again, or 0
+  int64_t throttleDeadline;
+};
+
+/* One registered buffer of a worker's io_uring and the stripe sending
+   through it. Its two registered files are the stripe's file and socket.
+   Each chunk of the range is read into the buffer and sent by a linked
+   pair of operations, and pending counts those not yet completed. A stripe
+   that goes away leaves the slot without an owner until they complete */
+struct ringSlot {
+  struct stripe* owner;
+  char* buffer;
+  int files[2];
+  int registered;
+  size_t length;
+  size_t sent;
+  int pending;
+  // the errno of an operation that failed, or -1 if the file was truncated
+  int failed;
+};
+
+/* A worker's io_uring: the submission and completion rings it shares with
+   the kernel, and the registered buffers. tail counts the submission entries
+   filled in so far; the kernel takes them at the next submitRing() */
+struct ring {
+  struct endpoint endpoint;
+  void* sqRing;
+  size_t sqRingSize;
+  void* cqRing;
+  size_t cqRingSize;
+  struct io_uring_sqe* sqes;
+  size_t sqesSize;
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned* sqMask;
+  unsigned* sqArray;
+  unsigned sqEntries;
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned* cqMask;
+  struct io_uring_cqe* cqes;
+  unsigned tail;
+  char* buffers;
+  int clearFiles[2];
+  struct ringSlot slots[URING_SLOTS];
+};
+
+/* The digest of a whole file, recognised by its device, inode, size and
+   modification and change times so that a changed file is never matched.
+   These are also the records of the digest file, after its magic */
+struct digestEntry {
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  int64_t mtime;
+  int64_t ctime;
+  uint32_t digest;
+  uint32_t used;
+};
+
+/* The digest cache shared by the workers, and the digest file new entries
+   are appended to */
+struct digestCache {
+  pthread_mutex_t lock;
+  struct digestEntry* entries;
+  int fd;
+};
+struct digestCache DIGEST_CACHE = {PTHREAD_MUTEX_INITIALIZER, NULL, -1};
+
+/* A token bucket. It fills at the rate up to its burst, and bytes are taken
+   from it once they have been sent, so it may go below zero. A client's
+   bucket is recognised by the client's IP address */
+struct tokenBucket {
+  int64_t tokens;
+  int64_t updated;
+  struct in6_addr client;
+  int used;
+};
+
+/* The rate limits shared by the workers: the bucket for all clients together
+   and an open-addressed table of per-client buckets */
+struct rateLimits {
+  pthread_mutex_t lock;
+  struct tokenBucket total;
+  struct tokenBucket clients[CLIENT_BUCKETS];
+};
+struct rateLimits RATE_LIMITS = {PTHREAD_MUTEX_INITIALIZER};
+
+/* The metrics and log ring of the worker running on this thread, or NULL on
+   the main thread */
+__thread struct metrics* WORKER_METRICS = NULL;
+__thread struct logRing* WORKER_LOG = NULL;
+
+/* The threads that report on the workers: the logger thread, which writes
+   out their log rings, and the thread that answers on STATS_SOCKET_PATH */
+struct reporters {
+  int stop;
+  pthread_t logger;
+  int logging;
+  pthread_t stats;
+  int statsFD;
+};
+struct reporters REPORTERS = {FALSE, 0, FALSE, 0, -1};
 
 
 /*******************************************************************************
  *                void validateArgs(int argc, char* argv[])
  * Description: ensures that the supplied command-line arguments to this program
- *   are valid. There should only be one argument, a port number on which to run
- *   the server. It must be an integer between 1 and 65535
+ *   are valid. The first argument is the port number on which to run the
+ *   server. It must be an integer between 1 and 65535. It may be followed by
+ *   these options:
+ *     --chunk-size <bytes> - the number of bytes sent per transmit call when
+ *                            sending a file (4096 to 67108864)
+ *     --workers <count>    - the number of worker threads to run (1 to 256)
+ *     --pin-cpus           - pin each worker thread to its own CPU
+ *     --listing-cache <entries> - the number of listings each worker caches
+ *     --file-cache <bytes> - the bytes of hot files the workers keep in
+ *                            memory together (0 disables the cache)
+ *     --digest-cache <file> - save whole-file digests in file so they are
+ *                            kept across restarts
+ *     --io-uring           - send files through io_uring where the kernel
+ *                            supports it
+ *     --rate <bytes/s>     - limit the rate files and listings are sent at,
+ *                            for all clients together
+ *     --client-rate <bytes/s> - limit the rate for each client IP address
+ *     --log-level <level>  - the most detailed messages logged: none, error,
+ *                            info (the default) or debug
+ *     --stats-socket <path> - answer on a Unix socket at path with a JSON
+ *                            snapshot of the metrics
  * Input:
  *   int argc - the number of arguments supplied to the process
  *   char* argv[] - an array of pointers to char containing the passed-in 
@@ -71,11 +973,12 @@ char* buffer;
  * Output:
  *   none
  * Postconditions: the program is terminated if the arguments are invalid.
- *   Otherwise, execution continues normally
+ *   Otherwise, execution continues normally and any options are applied
 *******************************************************************************/
 void validateArgs(int argc, char* argv[]) {
-  if (argc != 2) {
-    fprintf(stderr, "ERROR: %d arguments supplied. Expected 1\n", argc -1);
+  if (argc < 2) {
+    fprintf(stderr, "ERROR: %d arguments supplied. Expected at least 1\n", argc -1);
+    fprintf(stderr, "usage: %s <port> [--chunk-size <bytes>] [--workers <count>] [--pin-cpus] [--listing-cache <entries>] [--file-cache <bytes>] [--digest-cache <file>] [--io-uring] [--rate <bytes/s>] [--client-rate <bytes/s>] [--log-level <none|error|info|debug>] [--stats-socket <path>]\n", argv[0]);
     exit(1);
   }
 
@@ -84,455 +987,6950 @@ void validateArgs(int argc, char* argv[]) {
     fprintf(stderr, "ERROR: %s is not a valid port number.\n", argv[1]);
     exit(1);
   }
-}
 
-
-/*******************************************************************************
- *                   void catchSIGINT(int sigNumber)
- * Description: This function is the SIGINT handler. It frees dynamically
- *   allocated memory and terminates the process
- * Input: sigNumber - the signal number that caused the interrupt
- * Output: none
- * Preconditions: the process receives a SIGINT from the user
- * Postconditions: the process exits gracefully
-*******************************************************************************/
-void catchSIGINT(int sigNumber){
-  // free all dynamically allocated memory
-  free(sendString);
-  free(buffer);
-  exit(0);
+  int i;
+  for (i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--chunk-size") == 0 && i + 1 < argc) {
+      long chunkSize = atol(argv[++i]);
+      if (chunkSize < MIN_CHUNK_SIZE || chunkSize > MAX_CHUNK_SIZE) {
+        fprintf(stderr, "ERROR: %s is not a valid chunk size.\n", argv[i]);
+        exit(1);
+      }
+      CHUNK_SIZE = (size_t)chunkSize;
+    }
+    else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      WORKERS = atoi(argv[++i]);
+      if (WORKERS < 1 || WORKERS > MAX_WORKERS) {
+        fprintf(stderr, "ERROR: %s is not a valid number of workers.\n", argv[i]);
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "--pin-cpus") == 0) {
+      PIN_CPUS = TRUE;
+    }
+    else if (strcmp(argv[i], "--digest-cache") == 0 && i + 1 < argc) {
+      DIGEST_CACHE_PATH = argv[++i];
+    }
+    else if (strcmp(argv[i], "--io-uring") == 0) {
+      USE_IO_URING = TRUE;
+    }
+    else if ((strcmp(argv[i], "--rate") == 0 || strcmp(argv[i], "--client-rate") == 0) && i + 1 < argc) {
+      uint64_t* limit = strcmp(argv[i], "--rate") == 0 ? &RATE_LIMIT : &CLIENT_RATE_LIMIT;
+      char* end;
+      *limit = strtoull(argv[++i], &end, 10);
+      if (*end != '\0' || *limit < MIN_RATE) {
+        fprintf(stderr, "ERROR: %s is not a valid rate.\n", argv[i]);
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "--file-cache") == 0 && i + 1 < argc) {
+      char* end;
+      FILE_CACHE_SIZE = strtoull(argv[++i], &end, 10);
+      if (*end != '\0' || argv[i][0] == '-') {
+        fprintf(stderr, "ERROR: %s is not a valid file cache size.\n", argv[i]);
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+      char* levels[] = {"none", "error", "info", "debug"};
+      i++;
+      for (LOG_LEVEL = LOG_DEBUG; LOG_LEVEL >= LOG_NONE; LOG_LEVEL--) {
+        if (strcmp(argv[i], levels[LOG_LEVEL]) == 0) {
+          break;
+        }
+      }
+      if (LOG_LEVEL < LOG_NONE) {
+        fprintf(stderr, "ERROR: %s is not a valid log level.\n", argv[i]);
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "--stats-socket") == 0 && i + 1 < argc) {
+      STATS_SOCKET_PATH = argv[++i];
+      if (strlen(STATS_SOCKET_PATH) >= sizeof(((struct sockaddr_un*)NULL)->sun_path)) {
+        fprintf(stderr, "ERROR: %s is too long for a socket path.\n", argv[i]);
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "--listing-cache") == 0 && i + 1 < argc) {
+      LISTING_CACHE_ENTRIES = atoi(argv[++i]);
+      if (LISTING_CACHE_ENTRIES < 0 || LISTING_CACHE_ENTRIES > MAX_LISTING_CACHE_ENTRIES) {
+        fprintf(stderr, "ERROR: %s is not a valid number of cached listings.\n", argv[i]);
+        exit(1);
+      }
+    }
+    else {
+      fprintf(stderr, "ERROR: unrecognized option %s\n", argv[i]);
+      exit(1);
+    }
+  }
 }
 
-/*******************************************************************************
- *                    void catchSIGPIPE(int sigNumber)
- * Description: This function is the signal handler for the SIGPIPE signal that
- *   arrives when ftclient shuts down before closing one/both of the connections
- * Input: sigNumber - the signal number that caused the interrupt
- * Output: None
- * Preconditions: the process receives a SIGIO due to a prematurely closed
- *   connection
- * Postconditions: the process exits gracefully
-*******************************************************************************/
-void catchSIGPIPE(int sigNumber){
-  // free all dynamically allocated memory
-  fprintf(stderr, "sigpipe encountered\n");
-  free(buffer);
-  free(sendString);
-  exit(3);
-}
+
 
 
 /*******************************************************************************
 *                     void setSignalHandler()
 * This code is adapted from my CS344 smallsh program (assignment 3). And that
 * code was adapted from CS344 lectures in block 3 by Benjamin Brewster
-* 
-* Description: this function sets up the signal handler for SIGINT and SIGIO
+*
+* Description: this function ignores SIGPIPE and blocks SIGINT, SIGTERM and
+*   SIGUSR1. A client that closes its connections early must only end its own
+*   session, which happens when send() reports EPIPE. The other signals are
+*   blocked so that the worker threads inherit a mask without them and the
+*   main thread can collect them with sigwait() in waitForShutdown()
 * Input: None
 * Output: None
 * Preconditions: None
-* Postconditions: The process has signal handlers in place that will catch 
-* SIGINT and SIGPIPE signals and handle them accordingly
+* Postconditions: SIGPIPE is ignored and SIGINT, SIGTERM and SIGUSR1 are
+*   blocked
 *******************************************************************************/
 void setSignalHandler() {
-  // SIGINT
-  struct sigaction SIGINT_action = {{0}};
-  SIGINT_action.sa_handler = catchSIGINT;
-  sigfillset(&SIGINT_action.sa_mask);
-  SIGINT_action.sa_flags = 0;
-  sigaction(SIGINT, &SIGINT_action, NULL);
-
   //SIGPIPE
   struct sigaction SIGPIPE_action = {{0}};
-  SIGPIPE_action.sa_handler = catchSIGPIPE;
+  SIGPIPE_action.sa_handler = SIG_IGN;
   sigfillset(&SIGPIPE_action.sa_mask);
   SIGPIPE_action.sa_flags = 0;
   sigaction(SIGPIPE, &SIGPIPE_action, NULL);
+
+  // SIGINT, SIGTERM and SIGUSR1
+  sigset_t shutdownSignals;
+  sigemptyset(&shutdownSignals);
+  sigaddset(&shutdownSignals, SIGINT);
+  sigaddset(&shutdownSignals, SIGTERM);
+  sigaddset(&shutdownSignals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &shutdownSignals, NULL);
+}
+
+
+/*******************************************************************************
+ *                       void raiseFileLimit()
+ * Description: raises the soft limit on open file descriptors to the hard
+ *   limit. Every session holds two sockets and possibly a file open, so the
+ *   default soft limit of 1024 would cap the server at a few hundred clients
+ * Input: none
+ * Output: none
+*******************************************************************************/
+void raiseFileLimit() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+
+/*******************************************************************************
+ *                          void openRoot()
+ * Description: opens the directory the server was started in as the root
+ *   that sessions start in and are confined to, and checks whether the
+ *   kernel has openat2(2) to enforce it
+ * Input: none
+ * Output: none
+ * Postconditions: ROOT_FD and ROOT_PATH are set, or the program is terminated
+*******************************************************************************/
+void openRoot() {
+  struct open_how how;
+
+  ROOT_FD = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (ROOT_FD < 0 || getcwd(ROOT_PATH, sizeof(ROOT_PATH)) == NULL) {
+    fprintf(stderr, "ERROR opening the working directory: %s\n", strerror(errno));
+    exit(1);
+  }
+  memset(&how, '\0', sizeof(how));
+  how.flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+  how.resolve = RESOLVE_BENEATH;
+  int probe = syscall(SYS_openat2, ROOT_FD, ".", &how, sizeof(how));
+  if (probe < 0 && errno == ENOSYS) {
+    fprintf(stderr, "ERROR: openat2 is unavailable, symlinks out of %s will be followed\n", ROOT_PATH);
+    HAVE_OPENAT2 = FALSE;
+  }
+  if (probe >= 0) {
+    close(probe);
+  }
+}
+
+
+/*******************************************************************************
+ *            void logMessage(int level, const char* format, ...)
+ * Description: logs a line, without its newline, if LOG_LEVEL lets its level
+ *   through. On a worker the line is formatted into the worker's log ring and
+ *   written out by the logger thread, so the event loop never blocks on the
+ *   terminal; if the ring is full the line is counted and dropped. On the
+ *   main thread the line is written at once. Errors go to stderr and
+ *   everything else to stdout
+ * Input:
+ *   int level - the LOG_ level of the line
+ *   const char* format, ... - the line, as for printf()
+ * Output: none
+*******************************************************************************/
+void logMessage(int level, const char* format, ...) {
+  struct logRing* ring = WORKER_LOG;
+  va_list arguments;
+
+  if (level > LOG_LEVEL) {
+    return;
+  }
+  va_start(arguments, format);
+  if (ring == NULL) {
+    FILE* stream = level == LOG_ERROR ? stderr : stdout;
+    vfprintf(stream, format, arguments);
+    fputc('\n', stream);
+    fflush(stream);
+  }
+  else if (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+  }
+  else {
+    struct logLine* line = &ring->lines[ring->head % LOG_RING_SLOTS];
+    line->level = level;
+    vsnprintf(line->text, LOG_LINE_LENGTH, format, arguments);
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+  }
+  va_end(arguments);
+}
+
+
+/*******************************************************************************
+ *             int drainLogs(struct server* workers, int count)
+ * Description: writes out the lines waiting in the workers' log rings, and
+ *   reports lines that were dropped since the last call
+ * Input:
+ *   struct server* workers - the array of workers
+ *   int count - the number of workers
+ * Output: the number of lines written
+*******************************************************************************/
+int drainLogs(struct server* workers, int count) {
+  int written = 0;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    struct logRing* ring = workers[i].log;
+    if (ring == NULL) {
+      continue;
+    }
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    for (; tail < head; tail++) {
+      struct logLine* line = &ring->lines[tail % LOG_RING_SLOTS];
+      FILE* stream = line->level == LOG_ERROR ? stderr : stdout;
+      fputs(line->text, stream);
+      fputc('\n', stream);
+      written++;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped > ring->reported) {
+      fprintf(stderr, "ERROR: worker %d dropped %llu log line(s)\n", i,
+              (unsigned long long)(dropped - ring->reported));
+      ring->reported = dropped;
+    }
+  }
+  if (written > 0) {
+    fflush(stdout);
+    fflush(stderr);
+  }
+  return written;
+}
+
+
+/*******************************************************************************
+ *                    void* runLogger(void* argument)
+ * Description: the logger thread. Empties the workers' log rings every
+ *   LOG_FLUSH_MILLIS, so their lines are written in batches, until it is
+ *   told to stop, and then empties them one last time
+ * Input: void* argument - the array of WORKERS workers
+ * Output: NULL once it has stopped
+*******************************************************************************/
+void* runLogger(void* argument) {
+  struct server* workers = argument;
+  struct timespec pause = {0, LOG_FLUSH_MILLIS * 1000000L};
+
+  while (!__atomic_load_n(&REPORTERS.stop, __ATOMIC_ACQUIRE)) {
+    drainLogs(workers, WORKERS);
+    nanosleep(&pause, NULL);
+  }
+  drainLogs(workers, WORKERS);
+  return NULL;
+}
+
+
+/*******************************************************************************
+ *              void countMetric(uint64_t* counter, uint64_t amount)
+ * Description: adds to one of the running worker's counters. Only the worker
+ *   writes its counters, so a relaxed load and store are enough for other
+ *   threads to read whole values, without the cost of a locked add
+ * Input:
+ *   uint64_t* counter - the counter
+ *   uint64_t amount - what to add
+ * Output: none
+*******************************************************************************/
+void countMetric(uint64_t* counter, uint64_t amount) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+
+/*******************************************************************************
+ *       void recordHistogram(struct histogram* histogram, uint64_t micros)
+ * Description: adds a latency to one of the running worker's histograms
+ * Input:
+ *   struct histogram* histogram - the histogram
+ *   uint64_t micros - the latency in microseconds
+ * Output: none
+*******************************************************************************/
+void recordHistogram(struct histogram* histogram, uint64_t micros) {
+  int bucket = micros > 1 ? 63 - __builtin_clzll(micros) : 0;
+
+  bucket = bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+  countMetric(&histogram->count, 1);
+  countMetric(&histogram->totalMicros, micros);
+  countMetric(&histogram->buckets[bucket], 1);
+  if (micros > histogram->maxMicros) {
+    __atomic_store_n(&histogram->maxMicros, micros, __ATOMIC_RELAXED);
+  }
+}
+
+
+/*******************************************************************************
+ *                     void setNoDelay(int socketFD)
+ * Description: turns off Nagle's algorithm on a connection. Frames that are
+ *   followed by more of the same response are sent with MSG_MORE, so the
+ *   last one of a response can go out at once instead of waiting for the
+ *   ACK of the one before, which ftclient may delay by up to 40 ms
+ * Input: int socketFD - the connection
+ * Output: none
+*******************************************************************************/
+void setNoDelay(int socketFD) {
+  int one = 1;
+  setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 }
 
 
 /*******************************************************************************
- *          void activateListenSocket(int*, int*, struct sockaddr_in*)
+ *             void activateListenSocket(int*, int* portNumber)
  * Sources cited: The code for this function is adapted from my CS344 OTP
  *   project, and the code for that was adapted from lecture materials for CS344
- *   provided by Benjamin Brewster
+ *   provided by Benjamin Brewster. man 3 getaddrinfo, man 7 ipv6
  *
- * Description: This function creates, binds, and activates a socket for 
- *   connection P.
+ * Description: This function creates, binds, and activates a non-blocking
+ *   socket for connection P. The addresses to listen on come from
+ *   getaddrinfo(3). An IPv6 socket is preferred, with IPV6_V6ONLY turned off
+ *   so that it takes IPv4 clients too; a host without IPv6 gets an IPv4
+ *   socket. When more than one worker is running, every worker binds its own
+ *   socket to the port with SO_REUSEPORT and the kernel spreads incoming
+ *   connections across them
  * Input:
  *   int* listenSocketFD - pointer to int that will hold the file descriptor for
  *     connection P
  *   int* portNumber - pointer to int that holds the port number to listen on
- *   struct sockaddr_in* - pointer to a struct sockaddr_in that will be
- *     populated with the data needed to open/run the socket
  * Output:
  *   none
  * Preconditions: none
  * Postconditions: ftserver is listening on a socket, connection P, for incoming
  *   connections from ftclient
 *******************************************************************************/
-void activateListenSocket(int* listenSocketFD, 
-                     int* portNumber, 
-                     struct sockaddr_in* serverAddress) {
-  /* All socket programming code is adapted from my CS344 OTP assignment which 
+void activateListenSocket(int* listenSocketFD, int* portNumber) {
+  /* All socket programming code is adapted from my CS344 OTP assignment which
      was, in turn, adapted from Ben Brewster's CS344 lectures */
+  struct addrinfo hints;
+  struct addrinfo* addresses;
+  struct addrinfo* address;
+  char port[8];
+  int pass;
 
-  /* set up the address struct for the server socket */
-  memset((char*)serverAddress, '\0', sizeof(*serverAddress));
-  serverAddress->sin_family = AF_INET;
-  serverAddress->sin_port = htons(*portNumber);
-  serverAddress->sin_addr.s_addr = INADDR_ANY;
-
-  /* set up the socket */
-  *listenSocketFD = socket(AF_INET, SOCK_STREAM, 0);
-  if (listenSocketFD < 0) {
-    fprintf(stderr, "ERROR opening socket\n");
+  /* find the wildcard addresses of the port */
+  memset(&hints, '\0', sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  snprintf(port, sizeof(port), "%d", *portNumber);
+  int result = getaddrinfo(NULL, port, &hints, &addresses);
+  if (result != 0) {
+    fprintf(stderr, "ERROR finding an address to listen on: %s\n", gai_strerror(result));
     exit(1);
   }
-      
-  /* attempt to bind the socket for listening for connections */
-  if (bind(*listenSocketFD, (struct sockaddr*)serverAddress, sizeof(*serverAddress)) < 0) {
+
+  /* set up the socket, trying the IPv6 addresses first */
+  *listenSocketFD = -1;
+  for (pass = 0; pass < 2 && *listenSocketFD < 0; pass++) {
+    for (address = addresses; address != NULL && *listenSocketFD < 0; address = address->ai_next) {
+      if ((address->ai_family == AF_INET6) != (pass == 0)) {
+        continue;
+      }
+      int socketFD = socket(address->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (socketFD < 0) {
+        continue;
+      }
+      int enable = 1;
+      int disable = 0;
+      setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+      if (address->ai_family == AF_INET6) {
+        setsockopt(socketFD, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(disable));
+      }
+      if (WORKERS > 1 && setsockopt(socketFD, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+        fprintf(stderr, "ERROR setting SO_REUSEPORT\n");
+        exit(1);
+      }
+      /* attempt to bind the socket for listening for connections */
+      if (bind(socketFD, address->ai_addr, address->ai_addrlen) < 0) {
+        close(socketFD);
+        continue;
+      }
+      *listenSocketFD = socketFD;
+    }
+  }
+  freeaddrinfo(addresses);
+  if (*listenSocketFD < 0) {
     fprintf(stderr, "ERROR on binding socket\n");
     exit(1);
   }
-  listen(*listenSocketFD, 5);
+  listen(*listenSocketFD, SOMAXCONN);
+}
+
+
+/*******************************************************************************
+ *   void formatAddress(struct sockaddr_storage*, char* text, size_t length)
+ * Description: writes the IP address of a socket address as text. An IPv4
+ *   client of a dual-stack socket is shown as a plain IPv4 address rather
+ *   than as an IPv4-mapped IPv6 one
+ * Input:
+ *   struct sockaddr_storage* address - the address
+ *   char* text - where to write it, at least INET6_ADDRSTRLEN bytes
+ *   size_t length - the size of text
+ * Output: none
+*******************************************************************************/
+void formatAddress(struct sockaddr_storage* address, char* text, size_t length) {
+  if (address->ss_family == AF_INET6) {
+    struct in6_addr* ip = &((struct sockaddr_in6*)address)->sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(ip)) {
+      inet_ntop(AF_INET, &ip->s6_addr[12], text, length);
+    }
+    else {
+      inet_ntop(AF_INET6, ip, text, length);
+    }
+  }
+  else {
+    inet_ntop(AF_INET, &((struct sockaddr_in*)address)->sin_addr, text, length);
+  }
+}
+
+
+/*******************************************************************************
+ *      int sameHost(struct sockaddr_storage* a, struct sockaddr_storage* b)
+ * Description: tells whether two socket addresses have the same IP address,
+ *   whatever their ports
+ * Input: struct sockaddr_storage* a, b - the addresses
+ * Output: TRUE if the IP addresses match
+*******************************************************************************/
+int sameHost(struct sockaddr_storage* a, struct sockaddr_storage* b) {
+  if (a->ss_family != b->ss_family) {
+    return FALSE;
+  }
+  if (a->ss_family == AF_INET6) {
+    return memcmp(&((struct sockaddr_in6*)a)->sin6_addr, &((struct sockaddr_in6*)b)->sin6_addr,
+                  sizeof(struct in6_addr)) == 0;
+  }
+  return ((struct sockaddr_in*)a)->sin_addr.s_addr == ((struct sockaddr_in*)b)->sin_addr.s_addr;
 }
 
 
 /*******************************************************************************
- *                 void openConnectionQ(char*, int)
+ *     int openConnectionQ(struct sockaddr_storage*, socklen_t, int)
  * Sources cited: The code for this function is adapted from my CS344 OTP
  *   project, and the code for that was adapted from lecture materials for CS344
  *   provided by Benjamin Brewster
  *
- * Description: This function creates, binds, and activates a socket for 
- *   connection Q. It then connects the socket to the listening ftclient process
- *   and returns the socket connection file descriptor
+ * Description: This function creates a non-blocking socket for connection Q
+ *   and starts connecting it to the listening ftclient process. ftclient is
+ *   reached at the address connection P came from, so no name is looked up.
+ *   The connection completes in the background; the socket becomes writable
+ *   when it does
  * Input:
- *   char* clientName - the host name or IP address of the ftclient
- *   int portNumber - the port number that client is listening on
+ *   struct sockaddr_storage* clientAddress - the address of connection P's
+ *     peer
+ *   socklen_t addressLength - the length of the address
+ *   int clientPort - the port number that client is listening on
+ * Output:
+ *   the socket file descriptor, or -1 if the connection could not be started
 *******************************************************************************/
-int openConnectionQ(char* clientName, int clientPort) {
-
-  struct sockaddr_in clientAddress;
-  struct hostent* clientInfo;
+int openConnectionQ(struct sockaddr_storage* clientAddress, socklen_t addressLength, int clientPort) {
+  struct sockaddr_storage address = *clientAddress;
 
-  // populate the client address sockaddr_in struct with the correct data
-  memset((char*)&clientAddress, '\0', sizeof(clientAddress));
-  clientAddress.sin_family = AF_INET;
-  clientAddress.sin_port = htons(clientPort);
-  clientInfo = gethostbyname(clientName);
-  if (clientInfo == NULL) {
-    fprintf(stderr, "ERROR: Could not connect to client on connection Q\n");
-    exit(2);
+  // the same host, at the port ftclient listens on
+  if (address.ss_family == AF_INET6) {
+    ((struct sockaddr_in6*)&address)->sin6_port = htons(clientPort);
+  }
+  else {
+    ((struct sockaddr_in*)&address)->sin_port = htons(clientPort);
   }
-  memcpy((char*)&clientAddress.sin_addr.s_addr, (char*)clientInfo->h_addr, clientInfo->h_length);
 
   // create a socket
-  int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+  int socketFD = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (socketFD < 0) {
-    fprintf(stderr, "ERROR: Could not open socket connection Q\n");
-    exit(2);
+    logMessage(LOG_ERROR, "ERROR: Could not open socket connection Q");
+    return -1;
   }
+  setNoDelay(socketFD);
 
-  // use the socket and clientAddress struct to open a TCP connection to ftclient
+  // use the socket and client address to open a TCP connection to ftclient
   // on connection Q
-  if (connect(socketFD, (struct sockaddr*)&clientAddress, sizeof(clientAddress)) < 0) {
-    fprintf(stderr, "ERROR: Could not connect on socket connetion Q\n");
-    fprintf(stderr, "%d: %s\n", errno, strerror(errno));
-    exit(2);
+  if (connect(socketFD, (struct sockaddr*)&address, addressLength) < 0 && errno != EINPROGRESS) {
+    logMessage(LOG_ERROR, "ERROR: Could not connect on socket connetion Q: %s", strerror(errno));
+    close(socketFD);
+    return -1;
   }
   return socketFD;
 }
- 
 
 
+/*******************************************************************************
+ *                  off_t min(off_t a, off_t b)
+ * Description: returns the smaller of a and b
+*******************************************************************************/
+off_t min(off_t a, off_t b) {
+  if (a < b) {
+    return a;
+  }
+  return b;
+}
 
 
 /*******************************************************************************
- *     void parseCommands(char* buffer, char* command, char* fileName)
- * Description: This function parses the commands that were sent from the client
- *   process. It sets command and fileName to point to their respective
- *   information
+ *          void growBuffer(struct buffer* buffer, size_t length)
+ * Description: makes room for length more bytes at the end of a buffer so
+ *   they can be written there directly
  * Input:
- *   - char* buffer - this is a pointer to a char array that contains the string
- *                    of characters received from the client process
- *   - char** command - this is a pointer to an uninitialized char*
- *   - char** fileName - a pointer to an uninitialized char*
- * Output:
- *   - none
- * Preconditions:
- *   - buffer points to an array of characters received from client
- * Postconditions:
- *   - the contents of buffer are modified to create 2 sub-strings as follows:
- *   - *command points to the command that was sent
- *   - *fileName points to the fileName that was sent
- *   - Instances of MESSAGE_DIVIDER that are encountered are replaced with '\0'
-*******************************************************************************/
-void parseCommands(char* buffer, char** command, char** fileName, int* qClientPort) {
-  char* curr = buffer;
-  *command = buffer;
-  *fileName = NULL;
-  char* qClientPortStr = NULL;
-  
-  while(*curr != '\0') {
-    if (*curr == MESSAGE_DIVIDER) {
-      if (*fileName == NULL) {
-        *curr = '\0';
-        *fileName = curr + 1;
-      }
-      else if (qClientPortStr == NULL){
-        *curr = '\0';
-        qClientPortStr = curr + 1;
-      }
-      else {
-        *curr = '\0';
-      }
+ *   struct buffer* buffer - the buffer to grow
+ *   size_t length - the number of bytes to make room for
+ * Output: none
+*******************************************************************************/
+void growBuffer(struct buffer* buffer, size_t length) {
+  if (buffer->length + length > buffer->capacity) {
+    size_t capacity = buffer->capacity == 0 ? LISTING_BLOCK_SIZE : buffer->capacity;
+    while (buffer->length + length > capacity) {
+      capacity *= 2;
     }
-    curr += 1;
+    buffer->bytes = realloc(buffer->bytes, capacity);
+    assert(buffer->bytes != NULL);
+    buffer->capacity = capacity;
   }
-  *qClientPort = atoi(qClientPortStr);
 }
 
 
 /*******************************************************************************
- *                         int getCommandCode(char* command)
- * Description: analyzes the command received from ftclient and determines
- *   whether the command is -l (list) or -g (get) or -c (cd)
- * Input: char* command - a c-string containing the entire message recieved from
- *   ftclient
- * Output: the integer code for the given command
- * Preconditions: a message was received that contains a valid command from 
- *   ftclient
- * Postconditions: none
+ *     void appendBuffer(struct buffer* buffer, const void* bytes, size_t)
+ * Description: appends bytes to a buffer, growing it as needed
+ * Input:
+ *   struct buffer* buffer - the buffer to append to
+ *   const void* bytes - the bytes to append
+ *   size_t length - the number of bytes to append
+ * Output: none
 *******************************************************************************/
-int getCommandCode(char* command) {
-  if(strcmp(command, TRANSFER_COMMAND) == 0) {
-    return TRANSFER_CODE;
-  }
-  if(strcmp(command, LIST_COMMAND) == 0) {
-    SHOW_HIDDEN = FALSE;
-    return LIST_CODE;
-  }
-  if(strcmp(command, LIST_ALL_COMMAND) == 0) {
-    SHOW_HIDDEN = TRUE; 
-    return LIST_CODE;
-  }
-  if(strcmp(command, CD_COMMAND) == 0) {
-    return CD_CODE;
-  }
-  return -1;
+void appendBuffer(struct buffer* buffer, const void* bytes, size_t length) {
+  growBuffer(buffer, length);
+  memcpy(buffer->bytes + buffer->length, bytes, length);
+  buffer->length += length;
 }
 
 
 /*******************************************************************************
- *                void sendDirectoryContents(int, int, char*, int)
- * Sources cited: https://www.geeksforgeeks.org/c-program-list-files-sub-directories-directory/
- * 
- * Description: This function sends a listing of the files in the current
- *   directory to ftclient on connection Q
+ *          void appendZeros(struct buffer* buffer, size_t length)
+ * Description: appends length zero bytes to a buffer
  * Input:
- *   int connectionP_FD - the file descriptor for the connection P socket
- *   int connectionQ_FD - the file descriptor for the connection Q socket
- *   char* clientIP - a c-string containing the host name or IP address of
- *     the host machine that ftclient is running on
- *   int clientPort - the port number that ftclient is listening on for
- *     connection Q
- * Output:
- *   none
+ *   struct buffer* buffer - the buffer to append to
+ *   size_t length - the number of zero bytes
+ * Output: none
 *******************************************************************************/
-void sendDirectoryContents(int connectionP_FD, int connectionQ_FD, char* clientIP, int clientPort, int hostPort) {
-  printf("List directory requested on port %d\n", hostPort); fflush(stdout);
+void appendZeros(struct buffer* buffer, size_t length) {
+  growBuffer(buffer, length);
+  memset(buffer->bytes + buffer->length, '\0', length);
+  buffer->length += length;
+}
 
-  // open directory information
-  struct dirent* directoryEntry;
-  DIR *dir = opendir(".");
-  // get a safe amount of memory for filenames
-  sendString = malloc(sizeof(char) * (MAX_FILE_NAME_LENGTH + 512));
-  memset(sendString, '\0', MAX_FILE_NAME_LENGTH + 512);
-  if(dir == NULL) {
-    strcpy(sendString, "Error opening directory");
-    send(connectionP_FD, sendString, strlen(sendString), 0);
-  }
-  else {
-    printf("Sending directory contents to %s:%d\n", clientIP, clientPort); fflush(stdout);
-    // read the name of each file or directory in turn
-    while((directoryEntry = readdir(dir)) != NULL) {
-      memset(sendString, '\0', MAX_FILE_NAME_LENGTH + 512);
-      strcpy(sendString, directoryEntry->d_name);
-      if(directoryEntry->d_type == DT_DIR) {
-        strcat(sendString, "/");
-      }
-      // don't send hidden files or . and ..
-      if(SHOW_HIDDEN || sendString[0] != '.') {
-        sendString[strlen(sendString)] = '\n';
-        // send the name of the directory/file
-        send(connectionQ_FD, sendString, strlen(sendString), 0);
-      }
-    }
-    // close the directory
-    closedir(dir);
-    // close the connection
-    close(connectionQ_FD);
-  }
-  free(sendString);
-  sendString = NULL;
+
+/*******************************************************************************
+ *                 void resetBuffer(struct buffer* buffer)
+ * Description: empties a buffer, keeping its memory for reuse
+ * Input: struct buffer* buffer - the buffer to empty
+ * Output: none
+*******************************************************************************/
+void resetBuffer(struct buffer* buffer) {
+  buffer->length = 0;
+  buffer->sent = 0;
 }
 
 
-int min(int a, int b) {
-  if (a < b) {
-    return a;
-  }
-  return b;
+/*******************************************************************************
+ *                 void freeBuffer(struct buffer* buffer)
+ * Description: releases a buffer's memory
+ * Input: struct buffer* buffer - the buffer to release
+ * Output: none
+*******************************************************************************/
+void freeBuffer(struct buffer* buffer) {
+  free(buffer->bytes);
+  memset(buffer, '\0', sizeof(*buffer));
 }
 
 
 /*******************************************************************************
- *             void sendFile(int, int, char*, int, int)
- * sources cited: https://www.programmingsimplified.com/c-program-read-file
- *                https://stackoverflow.com/questions/25634483/send-binary-file-over-tcp-ip-connection
- * 
- * Description: this function reads a file and sends it over connection Q to
- *   ftclient
- * Input: 
- *   int connectionP_FD - the file descriptor for connection P
- *   int connectionQ_FD - the file descriptor for connection Q
- *   char* filename - the name of the file to be sent
- *   char* clientiP - the IP address of the client
- *   int clientPort - so it can be displayed
- *   int hostPort - so it can be displayed
- * Output:
- *   none
- * Preconditions:
- *   - connectionP and connectionQ have been established
- *   - a file by the name of filename exists in the current directory
- * Postconditions:
- *   - filename is sent over connectionQ to ftclient
+ *      void putUint16/putUint32/putUint64(unsigned char*, value)
+ *      uint64_t getUint(const unsigned char* source, int size)
+ * Description: store and load integers in network byte order
 *******************************************************************************/
-void sendFile(int connectionP_FD, int connectionQ_FD, char* filename, char* clientIP, int clientPort, int hostPort){
-  printf("File \"%s\" requested on port %d.\n", filename, hostPort);
-  fflush(stdout);
+void putUint16(unsigned char* destination, uint16_t value) {
+  destination[0] = value >> 8;
+  destination[1] = value;
+}
 
-  FILE* filePtr;
-  // open the file to be sent in read/binary mode
-  filePtr = fopen(filename, "r+b");
-  // send an error message if the file cannot be sent
-  if(filePtr == NULL) {
-    printf("Requested file not found. Sending error message to %s:%d\n", clientIP, hostPort);
-    fflush(stdout);
-    char* errorMsg = "File not found\n";
-    send(connectionP_FD, errorMsg, strlen(errorMsg), 0);
-  }
-  // otherwise send the file in chunks until it's all sent
-  else {
-    fseek(filePtr, 0, SEEK_END);
-    long filesize = ftell(filePtr);
-    printf("Sending \"%s\" (%ld Bytes) to %s:%d\n", filename, filesize, clientIP, clientPort);
-    fflush(stdout);
-    rewind(filePtr);
-    if (filesize == EOF) {
-      fprintf(stderr, "ERROR: file read error\n");
-      exit(1);
-    }
-    if (filesize > 0) {
-      do {
-        size_t sendAmt = min(filesize, BUFFER_LENGTH);
-        sendAmt = fread(buffer, 1, sendAmt, filePtr);
-        int notSent = sendAmt;
-        unsigned char* sendPtr = (unsigned char*)buffer;
-        while (notSent > 0) {
-          int sent = send(connectionQ_FD, sendPtr, notSent, 0);
-          notSent -= sent;
-          sendPtr += sent;
-        }
-        filesize -= sendAmt;
-      }while(filesize > 0);
-    }
-    fclose(filePtr);
-  }
+void putUint32(unsigned char* destination, uint32_t value) {
+  putUint16(destination, value >> 16);
+  putUint16(destination + 2, value);
 }
 
+void putUint64(unsigned char* destination, uint64_t value) {
+  putUint32(destination, value >> 32);
+  putUint32(destination + 4, value);
+}
 
-void sendError(int connectionP_FD, char* message) { 
-  int num_bytes = strlen(message);
-  while (num_bytes > 0) {
-    int sent = send(connectionP_FD, message, strlen(message), 0);
-    num_bytes -= sent;
-    message += sent;
+uint64_t getUint(const unsigned char* source, int size) {
+  uint64_t value = 0;
+  int i;
+  for (i = 0; i < size; i++) {
+    value = (value << 8) | source[i];
   }
+  return value;
 }
 
+
 /*******************************************************************************
- *                void processClientRequest(int, char*)
- * Description: This is the jumping off point once a command has been received
- *   from ftclient. This function determines what the command is, connects
- *   on connection Q, determines what data should be sent back and begins the
- *   transfer accordingly
+ *   void putFrameHeader(unsigned char* destination, int type, int status,
+ *                       uint32_t requestId, uint64_t length)
+ * Description: writes a FRAME_HEADER_LENGTH byte frame header
  * Input:
- *   int connectionP_FD - the file descriptor for connection P
- *   char* clientIP - the hostname or IP address that ftclient is running on
- *   int hostPort - the host port number for displaying status messages
+ *   unsigned char* destination - FRAME_HEADER_LENGTH bytes of storage
+ *   int type - the FRAME_ type
+ *   int status - the STATUS_ code
+ *   uint32_t requestId - the request the frame belongs to
+ *   uint64_t length - the length of the payload that follows the header
  * Output: none
- * Preconditions: ftclient has connected on connection P and has sent a message
- *   string to ftserver
- * Postconditions: the rest of the actions dictated by the command sent from
- *   ftclient have been handled
 *******************************************************************************/
-void processClientRequest(int connectionP_FD, char* clientIP, int hostPort) {
-  /* allocate memory for buffer, and create variables for command and file name */
-  char* command;
-  char* fileName;
-  int charsRead,
-      commandCode,
-      clientPort,
-      connectionQ_FD;
+void putFrameHeader(unsigned char* destination, int type, int status,
+                    uint32_t requestId, uint64_t length) {
+  putUint16(destination, PROTOCOL_MAGIC);
+  destination[2] = PROTOCOL_VERSION;
+  destination[3] = type;
+  putUint16(destination + 4, status);
+  putUint16(destination + 6, 0);
+  putUint32(destination + 8, requestId);
+  putUint64(destination + 12, length);
+}
 
-  memset(buffer, '\0', BUFFER_LENGTH);
-  charsRead = recv(connectionP_FD, buffer, BUFFER_LENGTH, 0);
-  if (charsRead <= 0) {
-    exit(1);
-  }
-  parseCommands(buffer, &command, &fileName, &clientPort);
-  connectionQ_FD = openConnectionQ(clientIP, clientPort);
-  commandCode = getCommandCode(command);
-  switch (commandCode) {
-    case TRANSFER_CODE:
-      sendFile(connectionP_FD, connectionQ_FD, fileName, clientIP, clientPort, hostPort);
-      break;
-    case LIST_CODE:
-      sendDirectoryContents(connectionP_FD, connectionQ_FD, clientIP, clientPort, hostPort);
-      break;
-    case CD_CODE:
-      printf("Change directory request received from %s:%d\n", clientIP, hostPort);
-      fflush(stdout);
-      if(chdir(fileName) != 0) {
-        printf("Error switching to requested directory. Sending error message to %s:%d\n", clientIP, hostPort);
-        fflush(stdout);
-        sendError(connectionP_FD, "Error changing directory");
-      }
-      else {
-        printf("Working directory changed to %s\n", fileName);
-        fflush(stdout);
-      }
-      break;
-    default:;
-      char errorMsg[16] = "Invalid command";
-      send(connectionP_FD, errorMsg, strlen(errorMsg), 0);
-      break;
-  }
 
-  close(connectionP_FD);
-  close(connectionQ_FD);
-  
-}
 /*******************************************************************************
- *                    int main(int argc, char* argv[])
- * Description: this is the main function that runs ftserver. It takes a port 
- *   number passed in fromt he command line and opens a socket, listening on the
- *   supplied port number. When it recieves a connection, it runs the ft 
- *   protol as specified in Programming Assignment #2 CS372
- *   
+ *  size_t beginFrame(struct buffer*, int type, int status, uint32_t requestId)
+ *  void addAttribute(struct buffer*, int tag, const void* value, size_t length)
+ *  void addUintAttribute(struct buffer*, int tag, uint64_t value, int size)
+ *  void finishFrame(struct buffer* buffer, size_t start)
+ * Description: build a frame of attributes at the end of a buffer. beginFrame
+ *   writes the header and returns where it starts; once the attributes have
+ *   been added, finishFrame fills in the payload length
+*******************************************************************************/
+size_t beginFrame(struct buffer* buffer, int type, int status, uint32_t requestId) {
+  unsigned char header[FRAME_HEADER_LENGTH];
+  size_t start = buffer->length;
+  putFrameHeader(header, type, status, requestId, 0);
+  appendBuffer(buffer, header, FRAME_HEADER_LENGTH);
+  return start;
+}
+
+void addAttribute(struct buffer* buffer, int tag, const void* value, size_t length) {
+  unsigned char header[ATTRIBUTE_HEADER_LENGTH];
+  putUint16(header, tag);
+  putUint32(header + 2, length);
+  appendBuffer(buffer, header, ATTRIBUTE_HEADER_LENGTH);
+  appendBuffer(buffer, value, length);
+}
+
+void addUintAttribute(struct buffer* buffer, int tag, uint64_t value, int size) {
+  unsigned char bytes[8];
+  int i;
+  for (i = size - 1; i >= 0; i--) {
+    bytes[i] = value & 0xff;
+    value >>= 8;
+  }
+  addAttribute(buffer, tag, bytes, size);
+}
+
+void finishFrame(struct buffer* buffer, size_t start) {
+  putUint64((unsigned char*)buffer->bytes + start + 12,
+            buffer->length - start - FRAME_HEADER_LENGTH);
+}
+
+
+/*******************************************************************************
+ *  int findAttribute(struct frame*, int tag, unsigned char** value, size_t*)
+ * Description: looks for an attribute in a frame's payload
+ * Input:
+ *   struct frame* frame - the frame to search
+ *   int tag - the ATTR_ tag to look for
+ *   unsigned char** value - set to the attribute's value if found
+ *   size_t* length - set to the length of the value if found
+ * Output: TRUE if the attribute was found, otherwise FALSE
+*******************************************************************************/
+int findAttribute(struct frame* frame, int tag, unsigned char** value, size_t* length) {
+  uint64_t position = 0;
+  while (position + ATTRIBUTE_HEADER_LENGTH <= frame->length) {
+    int attributeTag = getUint(frame->payload + position, 2);
+    uint64_t attributeLength = getUint(frame->payload + position + 2, 4);
+    position += ATTRIBUTE_HEADER_LENGTH;
+    if (position + attributeLength > frame->length) {
+      return FALSE;
+    }
+    if (attributeTag == tag) {
+      *value = frame->payload + position;
+      *length = attributeLength;
+      return TRUE;
+    }
+    position += attributeLength;
+  }
+  return FALSE;
+}
+
+
+/*******************************************************************************
+ *   uint64_t getUintAttribute(struct frame*, int tag, uint64_t defaultValue)
+ * Description: reads an integer attribute of 1, 2, 4 or 8 bytes
+ * Input:
+ *   struct frame* frame - the frame to search
+ *   int tag - the ATTR_ tag to look for
+ *   uint64_t defaultValue - the value to use when the attribute is missing
+ * Output: the attribute's value, or defaultValue
+*******************************************************************************/
+uint64_t getUintAttribute(struct frame* frame, int tag, uint64_t defaultValue) {
+  unsigned char* value;
+  size_t length;
+  if (!findAttribute(frame, tag, &value, &length) || length > 8) {
+    return defaultValue;
+  }
+  return getUint(value, length);
+}
+
+
+/*******************************************************************************
+ *            int takeFrame(struct session* session, struct frame* frame)
+ * Description: determines whether a whole frame has arrived on connection P
+ *   and if so decodes its header and consumes it from the input buffer. TCP
+ *   may deliver a frame over several reads, or several pipelined frames in
+ *   one read; anything after the frame is kept for the next call
+ * Input:
+ *   struct session* session - the session receiving frames
+ *   struct frame* frame - set to the frame taken
+ * Output: TRUE if a frame was taken, FALSE if more bytes are needed, or -1
+ *   if the bytes are not a valid frame. A frame with the right magic number
+ *   but another protocol version is returned with type set to -1
+*******************************************************************************/
+int takeFrame(struct session* session, struct frame* frame) {
+  struct buffer* input = &session->input;
+  unsigned char* header = (unsigned char*)input->bytes + input->sent;
+  size_t available = input->length - input->sent;
+
+  // reject other protocols as soon as the magic number is wrong rather than
+  // waiting for a whole header that may never come
+  if (available >= 2 && getUint(header, 2) != PROTOCOL_MAGIC) {
+    return -1;
+  }
+  if (available < FRAME_HEADER_LENGTH) {
+    return FALSE;
+  }
+  frame->type = header[3];
+  frame->status = getUint(header + 4, 2);
+  frame->flags = getUint(header + 6, 2);
+  frame->requestId = getUint(header + 8, 4);
+  frame->length = getUint(header + 12, 8);
+  if (frame->length > MAX_REQUEST_PAYLOAD) {
+    return -1;
+  }
+  if (available < FRAME_HEADER_LENGTH + frame->length) {
+    return FALSE;
+  }
+  if (header[2] != PROTOCOL_VERSION) {
+    frame->type = -1;
+  }
+  frame->payload = header + FRAME_HEADER_LENGTH;
+  input->sent += FRAME_HEADER_LENGTH + frame->length;
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ *   void queueResponse(struct session*, int status, char* message)
+ * Description: queues a RESPONSE frame for the current request on connection
+ *   P. Responses to failed requests carry a message for the user
+ * Input:
+ *   struct session* session - the session to reply to
+ *   int status - the STATUS_ code
+ *   char* message - a c-string describing the error, or NULL
+ * Output: none
+*******************************************************************************/
+void queueResponse(struct session* session, int status, char* message) {
+  if (status != STATUS_OK && status < STATUSES) {
+    countMetric(&WORKER_METRICS->errors[status], 1);
+  }
+  size_t start = beginFrame(&session->reply, FRAME_RESPONSE, status, session->request.id);
+  if (message != NULL) {
+    addAttribute(&session->reply, ATTR_MESSAGE, message, strlen(message));
+  }
+  if (status == STATUS_OK && session->stripes[0].compressor != NULL) {
+    addUintAttribute(&session->reply, ATTR_COMPRESSION, COMPRESS_DEFLATE, 1);
+  }
+  if (status == STATUS_OK && session->stripes[0].checksum) {
+    addUintAttribute(&session->reply, ATTR_CHECKSUM, CHECKSUM_CRC32, 1);
+  }
+  finishFrame(&session->reply, start);
+}
+
+
+/*******************************************************************************
+ *       void queueData(struct session* session, struct stripe* stripe,
+ *                      off_t offset, uint64_t length)
+ * Description: prepares a stripe to send one DATA frame holding length bytes
+ *   that belong at offset. The bytes themselves come from the session's data
+ *   buffer or file
+ * Input:
+ *   struct session* session - the session sending the data
+ *   struct stripe* stripe - the stripe to send on
+ *   off_t offset - the position of the bytes in the file
+ *   uint64_t length - the number of bytes
+ * Output: none
+*******************************************************************************/
+void queueData(struct session* session, struct stripe* stripe, off_t offset, uint64_t length) {
+  unsigned char* header = stripe->header + stripe->headerLength;
+  putFrameHeader(header, FRAME_DATA, STATUS_OK, session->request.id, DATA_OFFSET_LENGTH + length);
+  putUint64(header + FRAME_HEADER_LENGTH, offset);
+  stripe->headerLength += FRAME_HEADER_LENGTH + DATA_OFFSET_LENGTH;
+}
+
+
+#if defined(__x86_64__)
+/*******************************************************************************
+ *   uint32_t crc32Pclmul(const unsigned char* bytes, size_t length,
+ *                        uint32_t crc)
+ * sources cited: Gopal et al., "Fast CRC Computation for Generic Polynomials
+ *                  Using PCLMULQDQ Instruction", Intel, 2009
+ *                https://chromium.googlesource.com/chromium/src/third_party/zlib/+/HEAD/crc32_simd.c
+ *
+ * Description: computes the CRC-32 of bytes with carry-less multiplication.
+ *   Four 128-bit lanes fold 64 bytes per step, and what is left is folded
+ *   into 32 bits with a Barrett reduction. This runs more than twice as
+ *   fast as the table-driven crc32() in zlib. The function is optimized even
+ *   though the rest of the server is built for debugging, since unoptimized
+ *   intrinsics are no faster than zlib
+ * Input:
+ *   const unsigned char* bytes - the bytes to hash
+ *   size_t length - a multiple of 16, at least CRC_SIMD_MINIMUM_LENGTH
+ *   uint32_t crc - the inverted CRC of the bytes before these
+ * Output: the inverted CRC including these bytes
+*******************************************************************************/
+__attribute__((target("pclmul,sse4.1"), optimize("O2")))
+uint32_t crc32Pclmul(const unsigned char* bytes, size_t length, uint32_t crc) {
+  // the folding constants and the polynomial, bit-reflected
+  static const uint64_t k1k2[] __attribute__((aligned(16))) = {0x0154442bd4, 0x01c6e41596};
+  static const uint64_t k3k4[] __attribute__((aligned(16))) = {0x01751997d0, 0x00ccaa009e};
+  static const uint64_t k5k0[] __attribute__((aligned(16))) = {0x0163cd6124, 0x0000000000};
+  static const uint64_t poly[] __attribute__((aligned(16))) = {0x01db710641, 0x01f7011641};
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+  x1 = _mm_loadu_si128((__m128i*)(bytes + 0x00));
+  x2 = _mm_loadu_si128((__m128i*)(bytes + 0x10));
+  x3 = _mm_loadu_si128((__m128i*)(bytes + 0x20));
+  x4 = _mm_loadu_si128((__m128i*)(bytes + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+  x0 = _mm_load_si128((__m128i*)k1k2);
+  bytes += 64;
+  length -= 64;
+
+  // fold 64 bytes at a time into the four lanes
+  while (length >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    y5 = _mm_loadu_si128((__m128i*)(bytes + 0x00));
+    y6 = _mm_loadu_si128((__m128i*)(bytes + 0x10));
+    y7 = _mm_loadu_si128((__m128i*)(bytes + 0x20));
+    y8 = _mm_loadu_si128((__m128i*)(bytes + 0x30));
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+    bytes += 64;
+    length -= 64;
+  }
+
+  // fold the lanes into one, then any 16 byte blocks left
+  x0 = _mm_load_si128((__m128i*)k3k4);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+  while (length >= 16) {
+    x2 = _mm_loadu_si128((__m128i*)bytes);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    bytes += 16;
+    length -= 16;
+  }
+
+  // fold 128 bits to 64, then reduce to 32
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x0 = _mm_loadl_epi64((__m128i*)k5k0);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, x0, 0x00), x2);
+  x0 = _mm_load_si128((__m128i*)poly);
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return _mm_extract_epi32(x1, 1);
+}
+#endif
+
+
+/*******************************************************************************
+ *   uint32_t crc32Update(uint32_t crc, const void* bytes, size_t length)
+ * Description: adds bytes to a running CRC-32, the same checksum as zlib's
+ *   crc32() and Python's zlib.crc32(). On CPUs with PCLMULQDQ the bulk of
+ *   the bytes goes through crc32Pclmul(), and zlib hashes the few left over
+ * Input:
+ *   uint32_t crc - the CRC of the bytes before these, 0 to start
+ *   const void* bytes - the bytes to hash
+ *   size_t length - the number of bytes
+ * Output: the CRC including these bytes
+*******************************************************************************/
+uint32_t crc32Update(uint32_t crc, const void* bytes, size_t length) {
+  const unsigned char* next = bytes;
+#if defined(__x86_64__)
+  if (length >= CRC_SIMD_MINIMUM_LENGTH &&
+      __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+    size_t blocks = length & ~(size_t)15;
+    crc = ~crc32Pclmul(next, blocks, ~crc);
+    next += blocks;
+    length -= blocks;
+  }
+#endif
+  return crc32(crc, next, length);
+}
+
+
+/*******************************************************************************
+ *          uint32_t crc32Zeros(uint32_t crc, off_t length)
+ * sources cited: https://github.com/madler/zlib/blob/master/crc32.c
+ *
+ * Description: adds a run of zero bytes to a running CRC-32 without reading
+ *   them, so a hole of any size costs a few multiplications. Appending zeros
+ *   multiplies the CRC register by x^(8 * length), which crc32_combine() does
+ *   when the CRC of the second part is 0; the register is the CRC inverted
+ * Input:
+ *   uint32_t crc - the CRC of the bytes before the zeros
+ *   off_t length - the number of zeros
+ * Output: the CRC including the zeros
+*******************************************************************************/
+uint32_t crc32Zeros(uint32_t crc, off_t length) {
+  return ~crc32_combine(~crc & 0xffffffff, 0, length);
+}
+
+
+/*******************************************************************************
+ *   void updateDigest(struct stripe*, const void* bytes, size_t length)
+ * Description: adds bytes sent on a stripe to its digest, if the request
+ *   asked for a checksum and the digest isn't already known
+ * Input:
+ *   struct stripe* stripe - the stripe the bytes are sent on
+ *   const void* bytes - the bytes, before any compression
+ *   size_t length - the number of bytes
+ * Output: none
+*******************************************************************************/
+void updateDigest(struct stripe* stripe, const void* bytes, size_t length) {
+  if (stripe->checksum && !stripe->digestKnown) {
+    stripe->digest = crc32Update(stripe->digest, bytes, length);
+  }
+}
+
+
+/*******************************************************************************
+ *  int digestFileRange(struct server*, struct session*, struct stripe*,
+ *                      off_t offset, size_t length)
+ * Description: adds a range of the file that transmitChunk() just sent to
+ *   the stripe's digest. sendfile and splice never bring the bytes into the
+ *   server, so they are read back from the page cache they were just sent
+ *   from; the copy method leaves them in the copy buffer already
+ * Input:
+ *   struct server* server - the event loop, whose copy buffer is used
+ *   struct session* session - the session sending the file
+ *   struct stripe* stripe - the stripe the range was sent on
+ *   off_t offset - the start of the range
+ *   size_t length - the number of bytes sent, at most CHUNK_SIZE
+ * Output: TRUE on success, FALSE if the file could not be read
+*******************************************************************************/
+int digestFileRange(struct server* server, struct session* session, struct stripe* stripe,
+                    off_t offset, size_t length) {
+  size_t done = 0;
+  if (!stripe->checksum || stripe->digestKnown) {
+    return TRUE;
+  }
+  if (stripe->method == TRANSMIT_COPY) {
+    updateDigest(stripe, server->copyBuffer, length);
+    return TRUE;
+  }
+  if (stripe->method == TRANSMIT_MEMORY) {
+    updateDigest(stripe, session->cachedFile->bytes + offset, length);
+    return TRUE;
+  }
+  while (done < length) {
+    ssize_t readAmt = pread(session->fileFD, server->copyBuffer, length - done, offset + done);
+    if (readAmt <= 0) {
+      logMessage(LOG_ERROR, "ERROR: file checksum error: %s", readAmt < 0 ? strerror(errno) : "file truncated");
+      countMetric(&WORKER_METRICS->fileErrors, 1);
+      return FALSE;
+    }
+    updateDigest(stripe, server->copyBuffer, readAmt);
+    done += readAmt;
+  }
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ *               void startChecksum(struct session* session)
+ * Description: starts a digest on each stripe of a request, if ftclient asked
+ *   for a checksum and both ends negotiated them
+ * Input: struct session* session - the session, with stripeCount set
+ * Output: none
+*******************************************************************************/
+void startChecksum(struct session* session) {
+  int i;
+  if (!(session->capabilities & CAP_CHECKSUM) || session->request.checksum != CHECKSUM_CRC32) {
+    return;
+  }
+  for (i = 0; i < session->stripeCount; i++) {
+    session->stripes[i].checksum = TRUE;
+    session->stripes[i].digest = 0;
+    session->stripes[i].digestKnown = FALSE;
+  }
+}
+
+
+/*******************************************************************************
+ *          struct digestEntry* findDigestSlot(struct stat* info)
+ * Description: finds the slot of the digest cache a file belongs in
+ * Input: struct stat* info - the file's metadata
+ * Output: the slot. The caller holds the cache's lock
+*******************************************************************************/
+struct digestEntry* findDigestSlot(struct stat* info) {
+  uint64_t hash = ((uint64_t)info->st_ino ^ (uint64_t)info->st_dev * 0x9e3779b97f4a7c15ULL) *
+                  0x9e3779b97f4a7c15ULL;
+  return &DIGEST_CACHE.entries[(hash >> 32) % DIGEST_CACHE_ENTRIES];
+}
+
+
+/*******************************************************************************
+ *       void describeFile(struct digestEntry* entry, struct stat* info)
+ * Description: fills in the fields of a digest cache entry that identify a
+ *   file. The change time is included along with the modification time, as
+ *   only the latter can be set back by hand
+ * Input:
+ *   struct digestEntry* entry - the entry to fill in
+ *   struct stat* info - the file's metadata
+ * Output: none
+*******************************************************************************/
+void describeFile(struct digestEntry* entry, struct stat* info) {
+  memset(entry, '\0', sizeof(*entry));
+  entry->device = info->st_dev;
+  entry->inode = info->st_ino;
+  entry->size = info->st_size;
+  entry->mtime = info->st_mtim.tv_sec * 1000000000LL + info->st_mtim.tv_nsec;
+  entry->ctime = info->st_ctim.tv_sec * 1000000000LL + info->st_ctim.tv_nsec;
+  entry->used = TRUE;
+}
+
+
+/*******************************************************************************
+ *          int lookupDigest(struct stat* info, uint32_t* digest)
+ * Description: looks up the digest of a whole file in the digest cache
+ * Input:
+ *   struct stat* info - the file's metadata
+ *   uint32_t* digest - set to the file's CRC-32 if it is cached
+ * Output: TRUE if the digest was found
+*******************************************************************************/
+int lookupDigest(struct stat* info, uint32_t* digest) {
+  struct digestEntry key;
+  int found;
+  describeFile(&key, info);
+  pthread_mutex_lock(&DIGEST_CACHE.lock);
+  struct digestEntry* entry = findDigestSlot(info);
+  found = entry->used && entry->device == key.device && entry->inode == key.inode &&
+          entry->size == key.size && entry->mtime == key.mtime && entry->ctime == key.ctime;
+  if (found) {
+    *digest = entry->digest;
+  }
+  pthread_mutex_unlock(&DIGEST_CACHE.lock);
+  return found;
+}
+
+
+/*******************************************************************************
+ *          void storeDigest(struct stat* info, uint32_t digest)
+ * Description: adds the digest of a whole file to the digest cache, and to
+ *   the end of the digest file if there is one
+ * Input:
+ *   struct stat* info - the file's metadata
+ *   uint32_t digest - the CRC-32 of the whole file
+ * Output: none
+*******************************************************************************/
+void storeDigest(struct stat* info, uint32_t digest) {
+  pthread_mutex_lock(&DIGEST_CACHE.lock);
+  struct digestEntry* entry = findDigestSlot(info);
+  describeFile(entry, info);
+  entry->digest = digest;
+  if (DIGEST_CACHE.fd >= 0 && write(DIGEST_CACHE.fd, entry, sizeof(*entry)) != sizeof(*entry)) {
+    logMessage(LOG_ERROR, "ERROR: could not save to the digest file: %s", strerror(errno));
+  }
+  pthread_mutex_unlock(&DIGEST_CACHE.lock);
+}
+
+
+/*******************************************************************************
+ *                        void loadDigestCache()
+ * Description: creates the digest cache and, with --digest-cache, fills it
+ *   from the digest file. Entries are only ever appended to the file, so it
+ *   is rewritten here with just the entries that are still in the cache. A
+ *   record cut short by a crash is dropped the same way
+ * Input: none
+ * Output: none
+*******************************************************************************/
+void loadDigestCache() {
+  char magic[sizeof(DIGEST_FILE_MAGIC) - 1];
+  struct digestEntry record;
+  int i;
+
+  DIGEST_CACHE.entries = calloc(DIGEST_CACHE_ENTRIES, sizeof(struct digestEntry));
+  assert(DIGEST_CACHE.entries != NULL);
+  if (DIGEST_CACHE_PATH == NULL) {
+    return;
+  }
+  int fd = open(DIGEST_CACHE_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: could not open the digest file %s: %s\n", DIGEST_CACHE_PATH, strerror(errno));
+    return;
+  }
+  ssize_t readAmt = read(fd, magic, sizeof(magic));
+  if (readAmt > 0 && (readAmt != sizeof(magic) || memcmp(magic, DIGEST_FILE_MAGIC, sizeof(magic)) != 0)) {
+    fprintf(stderr, "ERROR: %s is not a digest file\n", DIGEST_CACHE_PATH);
+    close(fd);
+    return;
+  }
+  while (readAmt > 0 && read(fd, &record, sizeof(record)) == sizeof(record)) {
+    if (record.used) {
+      struct stat info;
+      info.st_dev = record.device;
+      info.st_ino = record.inode;
+      *findDigestSlot(&info) = record;
+    }
+  }
+
+  // compact the file down to the live entries
+  if (ftruncate(fd, 0) < 0 || pwrite(fd, DIGEST_FILE_MAGIC, sizeof(magic), 0) != sizeof(magic) ||
+      lseek(fd, sizeof(magic), SEEK_SET) < 0) {
+    fprintf(stderr, "ERROR: could not rewrite the digest file %s: %s\n", DIGEST_CACHE_PATH, strerror(errno));
+    close(fd);
+    return;
+  }
+  for (i = 0; i < DIGEST_CACHE_ENTRIES; i++) {
+    if (DIGEST_CACHE.entries[i].used) {
+      write(fd, &DIGEST_CACHE.entries[i], sizeof(struct digestEntry));
+    }
+  }
+  DIGEST_CACHE.fd = fd;
+}
+
+
+/*******************************************************************************
+ *               void saveFileDigest(struct session* session)
+ * Description: adds the digest of a whole file that was just sent to the
+ *   digest cache. The stripes' digests cover consecutive ranges of the file
+ *   and are combined into one. Nothing is saved if the file changed while it
+ *   was being sent, since the bytes hashed may then belong to either version
+ * Input: struct session* session - the session that sent the file
+ * Output: none
+*******************************************************************************/
+void saveFileDigest(struct session* session) {
+  struct stat now;
+  int i;
+  if (fstat(session->fileFD, &now) < 0 || now.st_size != session->fileInfo.st_size ||
+      now.st_mtim.tv_sec != session->fileInfo.st_mtim.tv_sec ||
+      now.st_mtim.tv_nsec != session->fileInfo.st_mtim.tv_nsec ||
+      now.st_ctim.tv_sec != session->fileInfo.st_ctim.tv_sec ||
+      now.st_ctim.tv_nsec != session->fileInfo.st_ctim.tv_nsec) {
+    return;
+  }
+  uint32_t digest = session->stripes[0].digest;
+  for (i = 1; i < session->stripeCount; i++) {
+    digest = crc32_combine(digest, session->stripes[i].digest,
+                           session->stripes[i].end - session->stripes[i - 1].end);
+  }
+  storeDigest(&now, digest);
+}
+
+
+/*******************************************************************************
+ *                      int64_t monotonicNanos()
+ * Description: reads the monotonic clock
+ * Input: none
+ * Output: the time in nanoseconds
+*******************************************************************************/
+int64_t monotonicNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+/*******************************************************************************
+ *                     int64_t rateBurst(uint64_t rate)
+ * Description: gives the most tokens a bucket filling at a rate may hold
+ * Input: uint64_t rate - the rate in bytes per second
+ * Output: the burst in bytes
+*******************************************************************************/
+int64_t rateBurst(uint64_t rate) {
+  return rate / RATE_BURST_DIVISOR > MIN_RATE_BURST ? rate / RATE_BURST_DIVISOR : MIN_RATE_BURST;
+}
+
+
+/*******************************************************************************
+ *     void refillBucket(struct tokenBucket*, uint64_t rate, int64_t now)
+ * Description: adds the tokens a bucket has earned since it was last
+ *   updated. A bucket that has never been used starts full
+ * Input:
+ *   struct tokenBucket* bucket - the bucket
+ *   uint64_t rate - the rate it fills at, in bytes per second
+ *   int64_t now - the time from monotonicNanos()
+ * Output: none
+*******************************************************************************/
+void refillBucket(struct tokenBucket* bucket, uint64_t rate, int64_t now) {
+  int64_t burst = rateBurst(rate);
+  if (bucket->updated == 0) {
+    bucket->tokens = burst;
+  }
+  else {
+    bucket->tokens += (int64_t)((double)(now - bucket->updated) * rate / 1e9);
+  }
+  if (bucket->tokens > burst) {
+    bucket->tokens = burst;
+  }
+  bucket->updated = now;
+}
+
+
+/*******************************************************************************
+ *    struct tokenBucket* findClientBucket(struct session*, int64_t now)
+ * Description: finds the bucket of a session's client IP address, starting
+ *   a new one if it has none. A new bucket takes an unused slot, or else a
+ *   full one whose client has been idle, or else the longest unused one. The
+ *   caller holds RATE_LIMITS.lock
+ * Input:
+ *   struct session* session - the session
+ *   int64_t now - the time from monotonicNanos()
+ * Output: the refilled bucket
+*******************************************************************************/
+struct tokenBucket* findClientBucket(struct session* session, int64_t now) {
+  struct tokenBucket* bucket;
+  struct tokenBucket* spare = NULL;
+  uint32_t hash = 2166136261u;
+  int i;
+
+  if (session->bucket >= 0) {
+    bucket = &RATE_LIMITS.clients[session->bucket];
+    if (bucket->used && memcmp(&bucket->client, &session->clientKey, sizeof(struct in6_addr)) == 0) {
+      refillBucket(bucket, CLIENT_RATE_LIMIT, now);
+      return bucket;
+    }
+  }
+  for (i = 0; i < (int)sizeof(struct in6_addr); i++) {
+    hash = (hash ^ session->clientKey.s6_addr[i]) * 16777619u;
+  }
+  for (i = 0; i < CLIENT_BUCKET_PROBES; i++) {
+    int index = (hash + i) % CLIENT_BUCKETS;
+    bucket = &RATE_LIMITS.clients[index];
+    if (bucket->used && memcmp(&bucket->client, &session->clientKey, sizeof(struct in6_addr)) == 0) {
+      session->bucket = index;
+      refillBucket(bucket, CLIENT_RATE_LIMIT, now);
+      return bucket;
+    }
+    if (bucket->used) {
+      refillBucket(bucket, CLIENT_RATE_LIMIT, now);
+    }
+    if (spare == NULL || !bucket->used ||
+        (spare->used && (bucket->tokens >= rateBurst(CLIENT_RATE_LIMIT) || bucket->updated < spare->updated))) {
+      spare = bucket;
+      session->bucket = index;
+    }
+  }
+  memset(spare, '\0', sizeof(struct tokenBucket));
+  spare->used = TRUE;
+  spare->client = session->clientKey;
+  refillBucket(spare, CLIENT_RATE_LIMIT, now);
+  return spare;
+}
+
+
+/*******************************************************************************
+ *  off_t sendAllowance(struct server*, struct session*, struct stripe*)
+ * Description: tells how many bytes a stripe may send now under the rate
+ *   limits. Interactive requests may overdraw the buckets by a burst, so a
+ *   listing or a small get goes ahead of bulk transfers that are using up
+ *   the rate. A stripe that may not send is held back until enough tokens
+ *   have built up, and the event loop wakes it then
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session sending
+ *   struct stripe* stripe - the stripe about to send
+ * Output: the number of bytes that may be sent, or 0 if the stripe has to wait
+*******************************************************************************/
+off_t sendAllowance(struct server* server, struct session* session, struct stripe* stripe) {
+  struct tokenBucket* buckets[2];
+  uint64_t rates[2];
+  int count = 0;
+  off_t allowance = INT64_MAX;
+  int64_t wait = 0;
+  int i;
+
+  if (RATE_LIMIT == 0 && CLIENT_RATE_LIMIT == 0) {
+    return allowance;
+  }
+  int64_t now = monotonicNanos();
+  pthread_mutex_lock(&RATE_LIMITS.lock);
+  if (RATE_LIMIT > 0) {
+    refillBucket(&RATE_LIMITS.total, RATE_LIMIT, now);
+    buckets[count] = &RATE_LIMITS.total;
+    rates[count++] = RATE_LIMIT;
+  }
+  if (CLIENT_RATE_LIMIT > 0) {
+    buckets[count] = findClientBucket(session, now);
+    rates[count++] = CLIENT_RATE_LIMIT;
+  }
+  for (i = 0; i < count; i++) {
+    int64_t floor = session->requestClass == CLASS_INTERACTIVE ? -rateBurst(rates[i]) : 0;
+    int64_t available = buckets[i]->tokens - floor;
+    int64_t quantum = rates[i] / RATE_QUANTUM_DIVISOR > MIN_RATE_QUANTUM ?
+                      rates[i] / RATE_QUANTUM_DIVISOR : MIN_RATE_QUANTUM;
+    if (available < quantum) {
+      int64_t delay = (int64_t)((double)(quantum - available) * 1e9 / rates[i]);
+      wait = delay > wait ? delay : wait;
+    }
+    allowance = min(allowance, available);
+  }
+  pthread_mutex_unlock(&RATE_LIMITS.lock);
+
+  if (wait > 0) {
+    stripe->throttledUntil = now + wait;
+    if (server->throttleDeadline == 0 || stripe->throttledUntil < server->throttleDeadline) {
+      server->throttleDeadline = stripe->throttledUntil;
+    }
+    return 0;
+  }
+  stripe->throttledUntil = 0;
+  return allowance;
+}
+
+
+/*******************************************************************************
+ *                 int requestKind(struct request* request)
+ * Description: tells which kind of request a request is, for the metrics
+ * Input: struct request* request - the request, with its attributes read
+ * Output: the KIND_ of the request, or -1 if it is not a valid request
+*******************************************************************************/
+int requestKind(struct request* request) {
+  switch (request->type) {
+    case FRAME_LIST:
+      return KIND_LIST;
+    case FRAME_GET:
+      return request->recursive ? KIND_TREE : request->names != NULL ? KIND_BATCH : KIND_GET;
+    case FRAME_CD:
+      return KIND_CD;
+    case FRAME_PUT:
+      return KIND_PUT;
+  }
+  return -1;
+}
+
+
+/*******************************************************************************
+ *          void recordSent(struct session* session, size_t length)
+ * Description: counts bytes of a session's request sent on connection Q.
+ *   The first of them also times how long the request took to start
+ *   sending, and for the session's first request, how long since
+ *   connection P was accepted
+ * Input:
+ *   struct session* session - the session
+ *   size_t length - the number of bytes sent
+ * Output: none
+*******************************************************************************/
+void recordSent(struct session* session, size_t length) {
+  if (length == 0 || session->requestKind < 0) {
+    return;
+  }
+  countMetric(&WORKER_METRICS->bytesSent[session->requestKind], length);
+  if (!session->firstByteSent) {
+    int64_t now = monotonicNanos();
+    session->firstByteSent = TRUE;
+    recordHistogram(&WORKER_METRICS->firstByte[session->requestKind],
+                    (now - session->requestStart) / 1000);
+    if (session->acceptedAt != 0) {
+      recordHistogram(&WORKER_METRICS->acceptToFirstByte, (now - session->acceptedAt) / 1000);
+      session->acceptedAt = 0;
+    }
+  }
+}
+
+
+/*******************************************************************************
+ *         void chargeBandwidth(struct session* session, size_t length)
+ * Description: takes bytes sent on a connection Q from the rate limits'
+ *   buckets, after counting them in the worker's metrics
+ * Input:
+ *   struct session* session - the session that sent them
+ *   size_t length - the number of bytes
+ * Output: none
+*******************************************************************************/
+void chargeBandwidth(struct session* session, size_t length) {
+  recordSent(session, length);
+  if ((RATE_LIMIT == 0 && CLIENT_RATE_LIMIT == 0) || length == 0) {
+    return;
+  }
+  pthread_mutex_lock(&RATE_LIMITS.lock);
+  if (RATE_LIMIT > 0) {
+    RATE_LIMITS.total.tokens -= length;
+  }
+  if (CLIENT_RATE_LIMIT > 0) {
+    findClientBucket(session, monotonicNanos())->tokens -= length;
+  }
+  pthread_mutex_unlock(&RATE_LIMITS.lock);
+}
+
+
+/*******************************************************************************
+ *            int classifyRequest(struct session* session)
+ * Description: decides the scheduling class of the request a session just
+ *   started from what it is sending or receiving
+ * Input: struct session* session - the session
+ * Output: CLASS_BULK for large transfers, trees and batches, otherwise
+ *   CLASS_INTERACTIVE
+*******************************************************************************/
+int classifyRequest(struct session* session) {
+  off_t size = 0;
+  int i;
+
+  if (session->tree != NULL || session->batch != NULL) {
+    return CLASS_BULK;
+  }
+  if (session->upload != NULL) {
+    size = session->request.fileSize;
+  }
+  else if (session->delta != NULL) {
+    size = session->fileSize;
+  }
+  else if (session->fileFD >= 0) {
+    for (i = 0; i < session->stripeCount; i++) {
+      size += session->stripes[i].end - session->stripes[i].offset;
+    }
+  }
+  return size > SMALL_TRANSFER_SIZE ? CLASS_BULK : CLASS_INTERACTIVE;
+}
+
+
+/*******************************************************************************
+ *          void setSocketPriority(int socketFD, int requestClass)
+ * Description: gives a socket the queueing priority of a request class, so
+ *   the network interface's queue lets interactive packets ahead of bulk ones
+ * Input:
+ *   int socketFD - the socket
+ *   int requestClass - the CLASS_ of the request it carries
+ * Output: none
+*******************************************************************************/
+void setSocketPriority(int socketFD, int requestClass) {
+  int priority = requestClass == CLASS_BULK ? TC_PRIO_BULK : TC_PRIO_INTERACTIVE;
+  setsockopt(socketFD, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(priority));
+}
+
+
+/*******************************************************************************
+ *       void setRequestClass(struct session* session, int requestClass)
+ * Description: puts a session's request in a scheduling class and gives its
+ *   connections Q the class's priority
+ * Input:
+ *   struct session* session - the session
+ *   int requestClass - the CLASS_ of its request
+ * Output: none
+*******************************************************************************/
+void setRequestClass(struct session* session, int requestClass) {
+  int i;
+  if (session->requestClass == requestClass) {
+    return;
+  }
+  session->requestClass = requestClass;
+  for (i = 0; i < session->stripeCount; i++) {
+    if (session->stripes[i].q.fd >= 0) {
+      setSocketPriority(session->stripes[i].q.fd, requestClass);
+    }
+  }
+}
+
+
+/*******************************************************************************
+ *              void recordLatency(struct session* session)
+ * Description: adds the time a session's request took, from being started
+ *   until its last byte was handed to the kernel, to the latencies of its
+ *   kind and class
+ * Input: struct session* session - the session whose request finished
+ * Output: none
+*******************************************************************************/
+void recordLatency(struct session* session) {
+  uint64_t micros = (monotonicNanos() - session->requestStart) / 1000;
+
+  recordHistogram(&WORKER_METRICS->classes[session->requestClass], micros);
+  if (session->requestKind >= 0) {
+    recordHistogram(&WORKER_METRICS->duration[session->requestKind], micros);
+  }
+}
+
+
+/*******************************************************************************
+ *     void addCounters(uint64_t* totals, uint64_t* counters, int count)
+ * Description: adds a worker's counters, read while the worker runs, to
+ *   totals
+ * Input:
+ *   uint64_t* totals - the totals
+ *   uint64_t* counters - the worker's counters
+ *   int count - the number of counters
+ * Output: none
+*******************************************************************************/
+void addCounters(uint64_t* totals, uint64_t* counters, int count) {
+  int i;
+  for (i = 0; i < count; i++) {
+    totals[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+  }
+}
+
+
+/*******************************************************************************
+ *   void addHistogram(struct histogram* total, struct histogram* histogram)
+ * Description: adds a worker's latencies, read while the worker runs, to a
+ *   total
+ * Input:
+ *   struct histogram* total - the total
+ *   struct histogram* histogram - the worker's latencies
+ * Output: none
+*******************************************************************************/
+void addHistogram(struct histogram* total, struct histogram* histogram) {
+  uint64_t maxMicros = __atomic_load_n(&histogram->maxMicros, __ATOMIC_RELAXED);
+  addCounters(&total->count, &histogram->count, 1);
+  addCounters(&total->totalMicros, &histogram->totalMicros, 1);
+  addCounters(total->buckets, histogram->buckets, LATENCY_BUCKETS);
+  total->maxMicros = maxMicros > total->maxMicros ? maxMicros : total->maxMicros;
+}
+
+
+/*******************************************************************************
+ *   void sumMetrics(struct server* workers, int count, struct metrics* total)
+ * Description: adds up the metrics of all the workers
+ * Input:
+ *   struct server* workers - the array of workers
+ *   int count - the number of workers
+ *   struct metrics* total - filled in with the totals
+ * Output: none
+*******************************************************************************/
+void sumMetrics(struct server* workers, int count, struct metrics* total) {
+  int i, j;
+
+  memset(total, '\0', sizeof(*total));
+  for (i = 0; i < count; i++) {
+    struct metrics* metrics = &workers[i].metrics;
+    addCounters(&total->connections, &metrics->connections, 1);
+    addCounters(total->requests, metrics->requests, REQUEST_KINDS);
+    addCounters(total->bytesSent, metrics->bytesSent, REQUEST_KINDS);
+    addCounters(&total->bytesReceived, &metrics->bytesReceived, 1);
+    addCounters(&total->holeBytes, &metrics->holeBytes, 1);
+    addCounters(total->errors, metrics->errors, STATUSES);
+    addCounters(&total->connectionErrors, &metrics->connectionErrors, 1);
+    addCounters(&total->fileErrors, &metrics->fileErrors, 1);
+    addHistogram(&total->acceptToFirstByte, &metrics->acceptToFirstByte);
+    for (j = 0; j < REQUEST_KINDS; j++) {
+      addHistogram(&total->firstByte[j], &metrics->firstByte[j]);
+      addHistogram(&total->duration[j], &metrics->duration[j]);
+    }
+    for (j = 0; j < REQUEST_CLASSES; j++) {
+      addHistogram(&total->classes[j], &metrics->classes[j]);
+    }
+    addCounters(&total->fileCacheHits, &metrics->fileCacheHits, 1);
+    addCounters(&total->fileCacheMisses, &metrics->fileCacheMisses, 1);
+    addCounters(&total->fileCacheEvictions, &metrics->fileCacheEvictions, 1);
+    addCounters(&total->fileCacheInvalidations, &metrics->fileCacheInvalidations, 1);
+    addCounters(&total->directoryCacheHits, &metrics->directoryCacheHits, 1);
+    addCounters(&total->directoryCacheMisses, &metrics->directoryCacheMisses, 1);
+  }
+}
+
+
+/*******************************************************************************
+ *  double latencyPercentile(struct histogram* latency, double fraction)
+ * Description: estimates a percentile of some latencies from their
+ *   histogram, as the upper bound of the bucket it falls in
+ * Input:
+ *   struct histogram* latency - the latencies
+ *   double fraction - the percentile, as a fraction
+ * Output: the latency in milliseconds
+*******************************************************************************/
+double latencyPercentile(struct histogram* latency, double fraction) {
+  uint64_t seen = 0;
+  int bucket;
+  for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+    seen += latency->buckets[bucket];
+    if (seen >= fraction * latency->count) {
+      break;
+    }
+  }
+  double bound = (double)(2ULL << bucket) / 1000;
+  return bound < latency->maxMicros / 1000.0 ? bound : latency->maxMicros / 1000.0;
+}
+
+
+/*******************************************************************************
+ *        void printLatencyRow(char* name, struct histogram* latency)
+ * Description: prints one row of the table printed by printLatencyStats()
+ * Input:
+ *   char* name - the name of the row
+ *   struct histogram* latency - the latencies
+ * Output: none
+*******************************************************************************/
+void printLatencyRow(char* name, struct histogram* latency) {
+  if (latency->count == 0) {
+    printf("  %-15s %9d %9s %9s %9s %9s\n", name, 0, "-", "-", "-", "-");
+    return;
+  }
+  printf("  %-15s %9llu %9.2f %9.2f %9.2f %9.2f\n", name, (unsigned long long)latency->count,
+         (double)latency->totalMicros / latency->count / 1000, latencyPercentile(latency, 0.5),
+         latencyPercentile(latency, 0.99), latency->maxMicros / 1000.0);
+}
+
+
+/*******************************************************************************
+ *          void printLatencyStats(struct server* workers, int count)
+ * Description: prints how many requests of each class and kind have
+ *   finished and how long they took, so the fairness of the scheduling can
+ *   be checked under load, and how many failed. Printed on SIGUSR1 and at
+ *   shutdown
+ * Input:
+ *   struct server* workers - the array of workers
+ *   int count - the number of workers
+ * Output: none
+*******************************************************************************/
+void printLatencyStats(struct server* workers, int count) {
+  char* classNames[REQUEST_CLASSES] = {"interactive", "bulk"};
+  char* kindNames[REQUEST_KINDS] = {"list", "get", "tree", "batch", "cd", "put"};
+  struct metrics total;
+  int i;
+
+  sumMetrics(workers, count, &total);
+  printf("Request latency (ms)    count      mean       p50       p99       max\n");
+  for (i = 0; i < REQUEST_CLASSES; i++) {
+    printLatencyRow(classNames[i], &total.classes[i]);
+  }
+  for (i = 0; i < REQUEST_KINDS; i++) {
+    printLatencyRow(kindNames[i], &total.duration[i]);
+  }
+  printf("Errors: %llu not found, %llu invalid range, %llu bad request, %llu unsupported, "
+         "%llu version mismatch, %llu I/O, %llu connections lost, %llu file errors\n",
+         (unsigned long long)total.errors[STATUS_NOT_FOUND],
+         (unsigned long long)total.errors[STATUS_INVALID_RANGE],
+         (unsigned long long)total.errors[STATUS_BAD_REQUEST],
+         (unsigned long long)total.errors[STATUS_UNSUPPORTED],
+         (unsigned long long)total.errors[STATUS_VERSION_MISMATCH],
+         (unsigned long long)total.errors[STATUS_IO_ERROR],
+         (unsigned long long)total.connectionErrors, (unsigned long long)total.fileErrors);
+  fflush(stdout);
+}
+
+
+/*******************************************************************************
+ *        void printFileCacheStats(struct server* workers, int count)
+ * Description: prints how often gets found their file in the workers' file
+ *   caches, how many files left them, and how much memory they hold.
+ *   Printed on SIGUSR1 and at shutdown
+ * Input:
+ *   struct server* workers - the array of workers
+ *   int count - the number of workers
+ * Output: none
+*******************************************************************************/
+void printFileCacheStats(struct server* workers, int count) {
+  struct metrics total;
+  size_t resident = 0;
+  int i;
+
+  if (FILE_CACHE_SIZE == 0) {
+    return;
+  }
+  sumMetrics(workers, count, &total);
+  for (i = 0; i < count; i++) {
+    resident += __atomic_load_n(&workers[i].cachedFileBytes, __ATOMIC_RELAXED);
+  }
+  printf("File cache: %llu hits, %llu misses (%.1f%% hit rate), %llu evicted, %llu invalidated, "
+         "%zu of %zu bytes resident\n", (unsigned long long)total.fileCacheHits,
+         (unsigned long long)total.fileCacheMisses,
+         total.fileCacheHits + total.fileCacheMisses > 0 ?
+           100.0 * total.fileCacheHits / (total.fileCacheHits + total.fileCacheMisses) : 0.0,
+         (unsigned long long)total.fileCacheEvictions, (unsigned long long)total.fileCacheInvalidations,
+         resident, FILE_CACHE_SIZE);
+  fflush(stdout);
+}
+
+
+/*******************************************************************************
+ *       void appendText(struct buffer* buffer, const char* format, ...)
+ * Description: appends formatted text to a buffer
+ * Input:
+ *   struct buffer* buffer - the buffer
+ *   const char* format, ... - the text, as for printf()
+ * Output: none
+*******************************************************************************/
+void appendText(struct buffer* buffer, const char* format, ...) {
+  va_list arguments;
+  va_start(arguments, format);
+  int length = vsnprintf(NULL, 0, format, arguments);
+  va_end(arguments);
+  growBuffer(buffer, length + 1);
+  va_start(arguments, format);
+  vsnprintf(buffer->bytes + buffer->length, length + 1, format, arguments);
+  va_end(arguments);
+  buffer->length += length;
+}
+
+
+/*******************************************************************************
+ *    void appendLatencyJson(struct buffer* output, struct histogram* latency)
+ * Description: appends some latencies to a JSON snapshot, as an object of
+ *   their count and their mean, percentiles and longest in milliseconds
+ * Input:
+ *   struct buffer* output - the snapshot being built
+ *   struct histogram* latency - the latencies
+ * Output: none
+*******************************************************************************/
+void appendLatencyJson(struct buffer* output, struct histogram* latency) {
+  if (latency->count == 0) {
+    appendText(output, "{\"count\":0}");
+    return;
+  }
+  appendText(output, "{\"count\":%llu,\"mean\":%.3f,\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}",
+             (unsigned long long)latency->count, (double)latency->totalMicros / latency->count / 1000,
+             latencyPercentile(latency, 0.5), latencyPercentile(latency, 0.99),
+             latencyPercentile(latency, 0.999), latency->maxMicros / 1000.0);
+}
+
+
+/*******************************************************************************
+ *   void formatStats(struct server* workers, int count, struct buffer* output)
+ * Description: builds a JSON snapshot of the workers' metrics, on one line:
+ *   their requests by kind with the bytes sent and the latencies to the
+ *   first byte and to the end, errors by type, the file and directory cache
+ *   counters and the log lines dropped
+ * Input:
+ *   struct server* workers - the array of workers
+ *   int count - the number of workers
+ *   struct buffer* output - the buffer to build the snapshot in
+ * Output: none
+*******************************************************************************/
+void formatStats(struct server* workers, int count, struct buffer* output) {
+  char* classNames[REQUEST_CLASSES] = {"interactive", "bulk"};
+  char* kindNames[REQUEST_KINDS] = {"list", "get", "tree", "batch", "cd", "put"};
+  char* statusNames[STATUSES] = {"ok", "not_found", "invalid_range", "bad_request", "unsupported",
+                                 "version_mismatch", "io_error"};
+  struct metrics total;
+  uint64_t dropped = 0;
+  size_t resident = 0;
+  int i;
+
+  sumMetrics(workers, count, &total);
+  for (i = 0; i < count; i++) {
+    resident += __atomic_load_n(&workers[i].cachedFileBytes, __ATOMIC_RELAXED);
+    if (workers[i].log != NULL) {
+      dropped += __atomic_load_n(&workers[i].log->dropped, __ATOMIC_RELAXED);
+    }
+  }
+  appendText(output, "{\"workers\":%d,\"connections\":%llu,\"bytes_received\":%llu,\"hole_bytes\":%llu,"
+             "\"accept_to_first_byte_ms\":", count, (unsigned long long)total.connections,
+             (unsigned long long)total.bytesReceived, (unsigned long long)total.holeBytes);
+  appendLatencyJson(output, &total.acceptToFirstByte);
+  appendText(output, ",\"requests\":{");
+  for (i = 0; i < REQUEST_KINDS; i++) {
+    appendText(output, "%s\"%s\":{\"count\":%llu,\"bytes_sent\":%llu,\"first_byte_ms\":", i > 0 ? "," : "",
+               kindNames[i], (unsigned long long)total.requests[i], (unsigned long long)total.bytesSent[i]);
+    appendLatencyJson(output, &total.firstByte[i]);
+    appendText(output, ",\"duration_ms\":");
+    appendLatencyJson(output, &total.duration[i]);
+    appendText(output, "}");
+  }
+  appendText(output, "},\"classes\":{");
+  for (i = 0; i < REQUEST_CLASSES; i++) {
+    appendText(output, "%s\"%s\":", i > 0 ? "," : "", classNames[i]);
+    appendLatencyJson(output, &total.classes[i]);
+  }
+  appendText(output, "},\"errors\":{");
+  for (i = STATUS_OK + 1; i < STATUSES; i++) {
+    appendText(output, "\"%s\":%llu,", statusNames[i], (unsigned long long)total.errors[i]);
+  }
+  appendText(output, "\"connection_lost\":%llu,\"file\":%llu},", (unsigned long long)total.connectionErrors,
+             (unsigned long long)total.fileErrors);
+  appendText(output, "\"file_cache\":{\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu,\"invalidations\":%llu,"
+             "\"bytes\":%zu,\"limit\":%zu},", (unsigned long long)total.fileCacheHits,
+             (unsigned long long)total.fileCacheMisses, (unsigned long long)total.fileCacheEvictions,
+             (unsigned long long)total.fileCacheInvalidations, resident, FILE_CACHE_SIZE);
+  appendText(output, "\"directory_cache\":{\"hits\":%llu,\"misses\":%llu},\"log_dropped\":%llu}\n",
+             (unsigned long long)total.directoryCacheHits, (unsigned long long)total.directoryCacheMisses,
+             (unsigned long long)dropped);
+}
+
+
+/*******************************************************************************
+ *        double byteEntropy(const unsigned char* bytes, size_t length)
+ * Description: measures the entropy of some bytes, which estimates how well
+ *   they compress. Text and CSV come out well under 6 bits per byte; data
+ *   that is already compressed or encrypted is close to 8
+ * Input:
+ *   const unsigned char* bytes - the bytes
+ *   size_t length - the number of bytes
+ * Output: the entropy in bits per byte
+*******************************************************************************/
+double byteEntropy(const unsigned char* bytes, size_t length) {
+  uint64_t counts[256];
+  double entropy = 0;
+  size_t i;
+
+  memset(counts, '\0', sizeof(counts));
+  for (i = 0; i < length; i++) {
+    counts[bytes[i]]++;
+  }
+  for (i = 0; i < 256 && length > 0; i++) {
+    if (counts[i] > 0) {
+      double p = (double)counts[i] / length;
+      entropy -= p * log2(p);
+    }
+  }
+  return entropy;
+}
+
+
+/*******************************************************************************
+ *        double sampleEntropy(int fileFD, off_t start, off_t end)
+ * Description: estimates how compressible part of a file is from the entropy
+ *   of a few samples spread across it
+ * Input:
+ *   int fileFD - the file
+ *   off_t start, end - the range that will be sent
+ * Output: the entropy of the samples in bits per byte
+*******************************************************************************/
+double sampleEntropy(int fileFD, off_t start, off_t end) {
+  unsigned char sample[ENTROPY_SAMPLES * ENTROPY_SAMPLE_SIZE];
+  size_t total = 0;
+  int i;
+
+  for (i = 0; i < ENTROPY_SAMPLES; i++) {
+    off_t position = start + (end - start) / ENTROPY_SAMPLES * i;
+    ssize_t readAmt = pread(fileFD, sample + total, min(end - position, ENTROPY_SAMPLE_SIZE), position);
+    total += readAmt > 0 ? readAmt : 0;
+  }
+  return byteEntropy(sample, total);
+}
+
+
+/*******************************************************************************
+ *        int chooseCompression(struct session* session)
+ * Description: picks the compression for a request from the algorithms
+ *   ftclient asked for and the ones the server supports
+ * Input: struct session* session - the session making the request
+ * Output: the COMPRESS_ algorithm to use, or COMPRESS_NONE
+*******************************************************************************/
+int chooseCompression(struct session* session) {
+  if (!(session->capabilities & CAP_COMPRESS)) {
+    return COMPRESS_NONE;
+  }
+  return session->request.compression & COMPRESS_DEFLATE;
+}
+
+
+/*******************************************************************************
+ *      void startCompressor(struct session*, struct stripe* stripe)
+ * sources cited: https://zlib.net/manual.html
+ *
+ * Description: opens a deflate stream for the data sent on one stripe. Each
+ *   compressed frame ends with a sync flush, so ftclient can inflate every
+ *   frame as soon as it arrives
+ * Input:
+ *   struct session* session - the session, whose request gives the level
+ *   struct stripe* stripe - the stripe to compress
+ * Output: none
+*******************************************************************************/
+void startCompressor(struct session* session, struct stripe* stripe) {
+  int level = session->request.compressionLevel;
+  if (level < Z_BEST_SPEED || level > Z_BEST_COMPRESSION) {
+    level = DEFAULT_COMPRESSION_LEVEL;
+  }
+  stripe->compressor = calloc(1, sizeof(struct compressor));
+  assert(stripe->compressor != NULL);
+  int result = deflateInit(&stripe->compressor->stream, level);
+  assert(result == Z_OK);
+}
+
+
+/*******************************************************************************
+ *              void stopCompressor(struct stripe* stripe)
+ * Description: closes a stripe's deflate stream, if it has one
+ * Input: struct stripe* stripe - the stripe
+ * Output: none
+*******************************************************************************/
+void stopCompressor(struct stripe* stripe) {
+  if (stripe->compressor == NULL) {
+    return;
+  }
+  deflateEnd(&stripe->compressor->stream);
+  freeBuffer(&stripe->compressor->output);
+  freeBuffer(&stripe->compressor->input);
+  free(stripe->compressor);
+  stripe->compressor = NULL;
+  stripe->compressFile = FALSE;
+}
+
+
+/*******************************************************************************
+ *  void compressBytes(struct compressor*, struct buffer* output,
+ *                     const void* bytes, size_t length)
+ * Description: deflates bytes onto the end of a buffer and flushes the
+ *   stream, keeping count of the bytes in and out and of the CPU time spent
+ * Input:
+ *   struct compressor* compressor - the stripe's deflate stream
+ *   struct buffer* output - the buffer to append to
+ *   const void* bytes - the bytes to compress
+ *   size_t length - the number of bytes
+ * Output: none
+*******************************************************************************/
+void compressBytes(struct compressor* compressor, struct buffer* output,
+                   const void* bytes, size_t length) {
+  struct timespec before, after;
+  z_stream* stream = &compressor->stream;
+  size_t start = output->length;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &before);
+  stream->next_in = (unsigned char*)bytes;
+  stream->avail_in = length;
+  do {
+    growBuffer(output, deflateBound(stream, stream->avail_in) + 64);
+    stream->next_out = (unsigned char*)output->bytes + output->length;
+    stream->avail_out = output->capacity - output->length;
+    deflate(stream, Z_SYNC_FLUSH);
+    output->length = output->capacity - stream->avail_out;
+  } while (stream->avail_out == 0);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &after);
+
+  compressor->rawLength += length;
+  compressor->compressedLength += output->length - start;
+  compressor->cpuTime += (after.tv_sec - before.tv_sec) * 1000000000LL + after.tv_nsec - before.tv_nsec;
+}
+
+
+/*******************************************************************************
+ *   void finishDataFrame(struct session*, struct buffer*, size_t start)
+ * Description: completes a DATA frame built in a buffer for stripe 0. The
+ *   payload after the offset is added to the stripe's digest. If the
+ *   request is compressed, the payload is deflated in place
+ *   and the frame is flagged as compressed, unless a sample of the payload
+ *   shows it is compressed already
+ * Input:
+ *   struct session* session - the session sending the frame
+ *   struct buffer* buffer - the buffer the frame was built in
+ *   size_t start - where the frame starts, as returned by beginFrame()
+ * Output: none
+*******************************************************************************/
+void finishDataFrame(struct session* session, struct buffer* buffer, size_t start) {
+  struct compressor* compressor = session->stripes[0].compressor;
+  size_t payload = start + FRAME_HEADER_LENGTH + DATA_OFFSET_LENGTH;
+  updateDigest(&session->stripes[0], buffer->bytes + payload, buffer->length - payload);
+  if (compressor != NULL &&
+      byteEntropy((unsigned char*)buffer->bytes + payload,
+                  min(buffer->length - payload, ENTROPY_SAMPLES * ENTROPY_SAMPLE_SIZE)) < COMPRESSION_ENTROPY_LIMIT) {
+    resetBuffer(&compressor->input);
+    appendBuffer(&compressor->input, buffer->bytes + payload, buffer->length - payload);
+    buffer->length = payload;
+    compressBytes(compressor, buffer, compressor->input.bytes, compressor->input.length);
+    putUint16((unsigned char*)buffer->bytes + start + 6, FLAG_COMPRESSED);
+  }
+  finishFrame(buffer, start);
+}
+
+
+/*******************************************************************************
+ *   void addCompressionStats(struct buffer* buffer, struct compressor*)
+ * Description: adds what compression achieved and cost to an END frame
+ *   being built: the bytes before and after compression and the server CPU
+ *   time spent compressing, in microseconds
+ * Input:
+ *   struct buffer* buffer - the buffer the END frame is being built in
+ *   struct compressor* compressor - the stripe's deflate stream, or NULL
+ * Output: none
+*******************************************************************************/
+void addCompressionStats(struct buffer* buffer, struct compressor* compressor) {
+  if (compressor == NULL) {
+    return;
+  }
+  addUintAttribute(buffer, ATTR_RAW_LENGTH, compressor->rawLength, 8);
+  addUintAttribute(buffer, ATTR_COMPRESSED_LENGTH, compressor->compressedLength, 8);
+  addUintAttribute(buffer, ATTR_CPU_TIME, compressor->cpuTime / 1000, 8);
+}
+
+
+/*******************************************************************************
+ *     void addTrailerAttributes(struct buffer*, struct stripe* stripe)
+ * Description: adds what ftclient needs to check the data a stripe sent to
+ *   the END frame being built: the stripe's compression stats and digest
+ * Input:
+ *   struct buffer* buffer - the buffer the END frame is being built in
+ *   struct stripe* stripe - the stripe the data was sent on
+ * Output: none
+*******************************************************************************/
+void addTrailerAttributes(struct buffer* buffer, struct stripe* stripe) {
+  addCompressionStats(buffer, stripe->compressor);
+  if (stripe->checksum) {
+    addUintAttribute(buffer, ATTR_DIGEST, stripe->digest, 4);
+  }
+}
+
+
+/*******************************************************************************
+ *       void queueTrailer(struct session*, struct stripe* stripe)
+ * Description: builds the END frame that follows a get's range of the file
+ *   on a stripe. It is only built once the range has been sent, since it
+ *   carries the digest of the bytes
+ * Input:
+ *   struct session* session - the session sending the file
+ *   struct stripe* stripe - the stripe that finished sending
+ * Output: none
+*******************************************************************************/
+void queueTrailer(struct session* session, struct stripe* stripe) {
+  struct buffer trailer;
+  memset(&trailer, '\0', sizeof(trailer));
+  size_t start = beginFrame(&trailer, FRAME_END, STATUS_OK, session->request.id);
+  addTrailerAttributes(&trailer, stripe);
+  finishFrame(&trailer, start);
+  memcpy(stripe->trailer, trailer.bytes, trailer.length);
+  stripe->trailerLength = trailer.length;
+  freeBuffer(&trailer);
+}
+
+
+/*******************************************************************************
+ *   int sendCompressed(struct server*, struct session*, struct stripe*)
+ * Description: sends a stripe's range of the file compressed. Each call
+ *   reads and deflates at most one CHUNK_SIZE piece into a DATA frame and
+ *   sends as much of it as the socket will take
+ * Input:
+ *   struct server* server - the event loop, whose copy buffer is used
+ *   struct session* session - the session sending the file
+ *   struct stripe* stripe - the stripe to send on
+ * Output: TRUE once the range has been sent, FALSE if more remains, or -1 if
+ *   the connection or the file failed
+*******************************************************************************/
+int sendCompressed(struct server* server, struct session* session, struct stripe* stripe) {
+  struct compressor* compressor = stripe->compressor;
+  struct buffer* output = &compressor->output;
+  int compressed = FALSE;
+
+  while (TRUE) {
+    while (output->sent < output->length) {
+      off_t allowance = sendAllowance(server, session, stripe);
+      if (allowance == 0) {
+        return FALSE;
+      }
+      ssize_t sent = send(stripe->q.fd, output->bytes + output->sent,
+                          min(output->length - output->sent, allowance), MSG_NOSIGNAL | MSG_MORE);
+      if (sent < 0) {
+        return errno == EAGAIN || errno == EINTR ? FALSE : -1;
+      }
+      output->sent += sent;
+      chargeBandwidth(session, sent);
+    }
+    if (stripe->offset >= stripe->end) {
+      return TRUE;
+    }
+    if (compressed) {
+      return FALSE;
+    }
+
+    // a cached file is compressed straight from memory
+    char* bytes = server->copyBuffer;
+    ssize_t readAmt = min(stripe->end - stripe->offset, CHUNK_SIZE);
+    if (session->cachedFile != NULL) {
+      bytes = session->cachedFile->bytes + stripe->offset;
+    }
+    else {
+      readAmt = pread(session->fileFD, bytes, readAmt, stripe->offset);
+    }
+    if (readAmt <= 0) {
+      logMessage(LOG_ERROR, "ERROR: file send error: %s", readAmt < 0 ? strerror(errno) : "file truncated");
+      countMetric(&WORKER_METRICS->fileErrors, 1);
+      return -1;
+    }
+    updateDigest(stripe, bytes, readAmt);
+    resetBuffer(output);
+    size_t start = beginFrame(output, FRAME_DATA, STATUS_OK, session->request.id);
+    unsigned char offset[DATA_OFFSET_LENGTH];
+    putUint64(offset, stripe->offset + stripe->dataBase);
+    appendBuffer(output, offset, DATA_OFFSET_LENGTH);
+    compressBytes(compressor, output, bytes, readAmt);
+    putUint16((unsigned char*)output->bytes + start + 6, FLAG_COMPRESSED);
+    finishFrame(output, start);
+    stripe->offset += readAmt;
+    compressed = TRUE;
+  }
+}
+
+
+/*******************************************************************************
+ *     ssize_t transmitChunk(int fileFD, int socketFD, off_t* offset,
+ *                           size_t count, int* method, int* splicePipe,
+ *                           char* copyBuffer)
+ * sources cited: man 2 sendfile, man 2 splice
+ *
+ * Description: sends up to count bytes of the file open on fileFD, starting at
+ *   *offset, to the socket socketFD. The fastest available transmit method is
+ *   used: sendfile(2) copies straight from the page cache to the socket,
+ *   splice(2) moves the pages through a pipe when sendfile is not supported
+ *   for the file, and a read/send loop through copyBuffer is the last resort
+ *   for filesystems that support neither. If the pipe can't be opened, this
+ *   chunk is copied and splice is tried again on the next one.
+ * Input:
+ *   int fileFD - file descriptor of the open file
+ *   int socketFD - file descriptor of the socket to send on
+ *   off_t* offset - position in the file to send from. Advanced by the number
+ *     of bytes sent
+ *   size_t count - the maximum number of bytes to send
+ *   int* method - the transmit method to try first. Downgraded in place when
+ *     the kernel reports the method is unsupported for this file
+ *   int* splicePipe - the worker's pipe for the splice method, -1 until it is
+ *     opened here. Closed and reset to -1 if bytes are left stranded in it
+ *   char* copyBuffer - CHUNK_SIZE bytes of scratch space for the copy method
+ * Output:
+ *   the number of bytes sent, 0 at end of file, or -1 on error. A
+ *   non-blocking socket that is full fails with errno set to EAGAIN
+*******************************************************************************/
+ssize_t transmitChunk(int fileFD, int socketFD, off_t* offset, size_t count, int* method, int* splicePipe,
+                      char* copyBuffer) {
+  ssize_t sent;
+
+  if (*method == TRANSMIT_SENDFILE) {
+    sent = sendfile(socketFD, fileFD, offset, count);
+    if (sent >= 0 || (errno != EINVAL && errno != ENOSYS)) {
+      return sent;
+    }
+    *method = TRANSMIT_SPLICE;
+  }
+
+  if (*method == TRANSMIT_SPLICE) {
+    if (splicePipe[0] < 0 && pipe2(splicePipe, O_CLOEXEC) != 0) {
+      splicePipe[0] = splicePipe[1] = -1;
+    }
+    if (splicePipe[0] >= 0) {
+      sent = splice(fileFD, offset, splicePipe[1], NULL, count, SPLICE_F_MOVE);
+      ssize_t moved = 0;
+      while (sent > 0 && moved < sent) {
+        ssize_t out = splice(splicePipe[0], NULL, socketFD, NULL, sent - moved, SPLICE_F_MOVE);
+        if (out <= 0) {
+          break;
+        }
+        moved += out;
+      }
+      if (sent > 0) {
+        if (moved < sent) {
+          // anything stranded in the pipe is dropped with it and resent from
+          // the file next call
+          int savedErrno = errno;
+          close(splicePipe[0]);
+          close(splicePipe[1]);
+          splicePipe[0] = splicePipe[1] = -1;
+          errno = savedErrno;
+          *offset -= sent - moved;
+        }
+        if (moved == 0) {
+          return -1;
+        }
+        return moved;
+      }
+      if (sent == 0 || (errno != EINVAL && errno != ENOSYS)) {
+        return sent;
+      }
+      *method = TRANSMIT_COPY;
+    }
+  }
+
+  ssize_t readAmt = pread(fileFD, copyBuffer, min(count, CHUNK_SIZE), *offset);
+  if (readAmt <= 0) {
+    return readAmt;
+  }
+  ssize_t totalSent = 0;
+  while (totalSent < readAmt) {
+    sent = send(socketFD, copyBuffer + totalSent, readAmt - totalSent, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (totalSent == 0) {
+        return -1;
+      }
+      break;
+    }
+    totalSent += sent;
+  }
+  *offset += totalSent;
+  return totalSent;
+}
+
+
+/*******************************************************************************
+ *                     void closeRing(struct ring* ring)
+ * Description: closes a worker's io_uring, cancelling anything still in
+ *   flight, and frees its rings and buffers
+ * Input: struct ring* ring - the ring, possibly only partly set up, or NULL
+ * Output: none
+*******************************************************************************/
+void closeRing(struct ring* ring) {
+  if (ring == NULL) {
+    return;
+  }
+  if (ring->endpoint.fd >= 0) {
+    close(ring->endpoint.fd);
+  }
+  if (ring->sqRing != NULL) {
+    munmap(ring->sqRing, ring->sqRingSize);
+  }
+  if (ring->cqRing != NULL) {
+    munmap(ring->cqRing, ring->cqRingSize);
+  }
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqesSize);
+  }
+  if (ring->buffers != NULL) {
+    munmap(ring->buffers, (size_t)URING_SLOTS * URING_BUFFER_SIZE);
+  }
+  free(ring);
+}
+
+
+/*******************************************************************************
+ *                     int ringSupports(int ringFD)
+ * Description: asks the kernel whether an io_uring supports the operations
+ *   the server uses. Kernels before 5.6 have neither the probe nor SEND
+ * Input: int ringFD - the io_uring
+ * Output: TRUE if registered reads, sends and file updates are all supported
+*******************************************************************************/
+int ringSupports(int ringFD) {
+  int operations[] = {IORING_OP_READ_FIXED, IORING_OP_SEND, IORING_OP_FILES_UPDATE};
+  size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = calloc(1, size);
+  int supported = TRUE;
+  unsigned i;
+  assert(probe != NULL);
+  if (syscall(__NR_io_uring_register, ringFD, IORING_REGISTER_PROBE, probe, 256) < 0) {
+    supported = FALSE;
+  }
+  for (i = 0; i < sizeof(operations) / sizeof(operations[0]) && supported; i++) {
+    supported = operations[i] <= probe->last_op &&
+                (probe->ops[operations[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  return supported;
+}
+
+
+/*******************************************************************************
+ *                         struct ring* setupRing()
+ * sources cited: https://kernel.dk/io_uring.pdf
+ *
+ * Description: creates a worker's io_uring, maps its rings and registers its
+ *   buffers and an empty table of URING_SLOTS file and socket pairs
+ * Input: none
+ * Output: the ring, or NULL with the reason printed if the kernel can't
+ *   provide one
+*******************************************************************************/
+struct ring* setupRing() {
+  struct io_uring_params params;
+  struct iovec buffers;
+  int files[2 * URING_SLOTS];
+  struct ring* ring = calloc(1, sizeof(struct ring));
+  char* failure = NULL;
+  int i;
+  assert(ring != NULL);
+
+  memset(&params, '\0', sizeof(params));
+  ring->endpoint.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  ring->endpoint.role = ROLE_RING;
+  if (ring->endpoint.fd < 0) {
+    logMessage(LOG_ERROR, "ERROR: io_uring is unavailable: %s", strerror(errno));
+    closeRing(ring);
+    return NULL;
+  }
+  ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->endpoint.fd, IORING_OFF_SQ_RING);
+  ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->endpoint.fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->endpoint.fd, IORING_OFF_SQES);
+  ring->buffers = mmap(NULL, (size_t)URING_SLOTS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ring->sqRing = ring->sqRing == MAP_FAILED ? NULL : ring->sqRing;
+  ring->cqRing = ring->cqRing == MAP_FAILED ? NULL : ring->cqRing;
+  ring->sqes = ring->sqes == MAP_FAILED ? NULL : ring->sqes;
+  ring->buffers = ring->buffers == MAP_FAILED ? NULL : ring->buffers;
+  if (ring->sqRing == NULL || ring->cqRing == NULL || ring->sqes == NULL || ring->buffers == NULL) {
+    failure = "could not map its rings";
+  }
+  else if (!ringSupports(ring->endpoint.fd)) {
+    failure = "the kernel is too old";
+  }
+  else {
+    buffers.iov_base = ring->buffers;
+    buffers.iov_len = (size_t)URING_SLOTS * URING_BUFFER_SIZE;
+    for (i = 0; i < 2 * URING_SLOTS; i++) {
+      files[i] = -1;
+    }
+    if (syscall(__NR_io_uring_register, ring->endpoint.fd, IORING_REGISTER_BUFFERS, &buffers, 1) < 0 ||
+        syscall(__NR_io_uring_register, ring->endpoint.fd, IORING_REGISTER_FILES,
+                files, 2 * URING_SLOTS) < 0) {
+      failure = strerror(errno);
+    }
+  }
+  if (failure != NULL) {
+    logMessage(LOG_ERROR, "ERROR: io_uring is unavailable: %s", failure);
+    closeRing(ring);
+    return NULL;
+  }
+
+  ring->sqHead = (unsigned*)((char*)ring->sqRing + params.sq_off.head);
+  ring->sqTail = (unsigned*)((char*)ring->sqRing + params.sq_off.tail);
+  ring->sqMask = (unsigned*)((char*)ring->sqRing + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned*)((char*)ring->sqRing + params.sq_off.array);
+  ring->sqEntries = params.sq_entries;
+  ring->cqHead = (unsigned*)((char*)ring->cqRing + params.cq_off.head);
+  ring->cqTail = (unsigned*)((char*)ring->cqRing + params.cq_off.tail);
+  ring->cqMask = (unsigned*)((char*)ring->cqRing + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)((char*)ring->cqRing + params.cq_off.cqes);
+  ring->tail = *ring->sqTail;
+  ring->clearFiles[0] = -1;
+  ring->clearFiles[1] = -1;
+  for (i = 0; i < URING_SLOTS; i++) {
+    ring->slots[i].buffer = ring->buffers + (size_t)i * URING_BUFFER_SIZE;
+  }
+  return ring;
+}
+
+
+/*******************************************************************************
+ *      struct io_uring_sqe* nextRingEntry(struct ring*, int slot, int op)
+ * Description: takes the next free submission entry of a ring for an
+ *   operation of one slot. The entry goes to the kernel with the rest of the
+ *   batch at the next submitRing()
+ * Input:
+ *   struct ring* ring - the ring
+ *   int slot - the slot the operation belongs to
+ *   int op - the URING_OP_ kind of operation
+ * Output: the zeroed entry, with its user data filled in
+*******************************************************************************/
+struct io_uring_sqe* nextRingEntry(struct ring* ring, int slot, int op) {
+  // each slot has at most four operations queued, so the ring never fills
+  assert(ring->tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) < ring->sqEntries);
+  unsigned index = ring->tail & *ring->sqMask;
+  struct io_uring_sqe* entry = &ring->sqes[index];
+  memset(entry, '\0', sizeof(*entry));
+  entry->user_data = (uint64_t)slot * URING_OPS + op;
+  ring->sqArray[index] = index;
+  ring->tail++;
+  ring->slots[slot].pending++;
+  return entry;
+}
+
+
+/*******************************************************************************
+ *                   void submitRing(struct ring* ring)
+ * Description: hands the kernel every operation queued since the last call
+ *   in one io_uring_enter(2). The event loop calls this once per turn, so
+ *   the reads and sends of all of the worker's transfers share one system
+ *   call
+ * Input: struct ring* ring - the ring
+ * Output: none
+*******************************************************************************/
+void submitRing(struct ring* ring) {
+  unsigned count = ring->tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  if (count == 0) {
+    return;
+  }
+  __atomic_store_n(ring->sqTail, ring->tail, __ATOMIC_RELEASE);
+  while (syscall(__NR_io_uring_enter, ring->endpoint.fd, count, 0, 0, NULL, 0) < 0) {
+    if (errno != EINTR && errno != EAGAIN) {
+      logMessage(LOG_ERROR, "ERROR submitting to io_uring: %s", strerror(errno));
+      exit(1);
+    }
+  }
+}
+
+
+/*******************************************************************************
+ *         int acquireRingSlot(struct ring*, struct stripe*, int fileFD)
+ * Description: gives a stripe a free slot of the ring to send its range
+ *   through. The slot's file and socket are registered with its first chunk
+ * Input:
+ *   struct ring* ring - the worker's ring
+ *   struct stripe* stripe - the stripe about to send a range of the file
+ *   int fileFD - the file
+ * Output: TRUE if a slot was free
+*******************************************************************************/
+int acquireRingSlot(struct ring* ring, struct stripe* stripe, int fileFD) {
+  int i;
+  for (i = 0; i < URING_SLOTS; i++) {
+    struct ringSlot* slot = &ring->slots[i];
+    if (slot->owner == NULL && slot->pending == 0) {
+      slot->owner = stripe;
+      slot->files[0] = fileFD;
+      slot->files[1] = stripe->q.fd;
+      slot->registered = FALSE;
+      slot->length = 0;
+      slot->sent = 0;
+      slot->failed = 0;
+      stripe->ringSlot = i;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+
+/*******************************************************************************
+ *          void releaseRingSlot(struct ring*, struct stripe* stripe)
+ * Description: gives up a stripe's slot once its range is sent, or when the
+ *   stripe is closed. The slot's registered files are cleared so the file
+ *   and socket are really closed when the server closes them. A send still
+ *   in flight is made to fail by shutting the socket down
+ * Input:
+ *   struct ring* ring - the worker's ring, or NULL
+ *   struct stripe* stripe - the stripe
+ * Output: none
+*******************************************************************************/
+void releaseRingSlot(struct ring* ring, struct stripe* stripe) {
+  if (ring == NULL || stripe->ringSlot < 0) {
+    return;
+  }
+  struct ringSlot* slot = &ring->slots[stripe->ringSlot];
+  if (slot->pending > 0) {
+    shutdown(stripe->q.fd, SHUT_RDWR);
+  }
+  if (slot->registered) {
+    struct io_uring_sqe* entry = nextRingEntry(ring, stripe->ringSlot, URING_OP_CLEAR);
+    entry->opcode = IORING_OP_FILES_UPDATE;
+    entry->fd = -1;
+    entry->addr = (uintptr_t)ring->clearFiles;
+    entry->len = 2;
+    entry->off = 2 * stripe->ringSlot;
+  }
+  slot->owner = NULL;
+  stripe->ringSlot = -1;
+}
+
+
+/*******************************************************************************
+ *        size_t queueRingChunk(struct ring* ring, struct stripe* stripe)
+ * Description: queues the next chunk of a stripe's range on its slot: a read
+ *   of up to URING_BUFFER_SIZE bytes into the slot's registered buffer,
+ *   linked to a send of the buffer on the stripe's socket. The first chunk
+ *   registers the file and socket ahead of the read. If a short read
+ *   cancelled the last send, what was read is sent instead. Nothing is
+ *   queued while the slot's operations are in flight
+ * Input:
+ *   struct ring* ring - the worker's ring
+ *   struct stripe* stripe - the stripe, which holds a slot
+ * Output: the number of bytes of the file a new read was queued for, or 0
+*******************************************************************************/
+size_t queueRingChunk(struct ring* ring, struct stripe* stripe) {
+  int index = stripe->ringSlot;
+  struct ringSlot* slot = &ring->slots[index];
+  struct io_uring_sqe* entry;
+  size_t queued = 0;
+  if (slot->pending > 0) {
+    return 0;
+  }
+
+  if (slot->sent >= slot->length) {
+    if (!slot->registered) {
+      entry = nextRingEntry(ring, index, URING_OP_UPDATE);
+      entry->opcode = IORING_OP_FILES_UPDATE;
+      entry->fd = -1;
+      entry->flags = IOSQE_IO_LINK;
+      entry->addr = (uintptr_t)slot->files;
+      entry->len = 2;
+      entry->off = 2 * index;
+      slot->registered = TRUE;
+    }
+    slot->length = min(stripe->dataEnd - stripe->offset, URING_BUFFER_SIZE);
+    slot->sent = 0;
+    entry = nextRingEntry(ring, index, URING_OP_READ);
+    entry->opcode = IORING_OP_READ_FIXED;
+    entry->fd = 2 * index;
+    entry->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    entry->addr = (uintptr_t)slot->buffer;
+    entry->len = slot->length;
+    entry->off = stripe->offset;
+    entry->buf_index = 0;
+    queued = slot->length;
+  }
+
+  // MSG_WAITALL has the kernel wait for room on the socket until the whole
+  // buffer is sent
+  entry = nextRingEntry(ring, index, URING_OP_SEND);
+  entry->opcode = IORING_OP_SEND;
+  entry->fd = 2 * index + 1;
+  entry->flags = IOSQE_FIXED_FILE;
+  entry->addr = (uintptr_t)(slot->buffer + slot->sent);
+  entry->len = slot->length - slot->sent;
+  entry->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  return queued;
+}
+
+
+/*******************************************************************************
+ *             int waitingForRing(struct server*, struct stripe*)
+ * Description: tells whether a stripe is waiting for its io_uring operations
+ *   to complete, rather than for room on its socket
+ * Input:
+ *   struct server* server - the event loop
+ *   struct stripe* stripe - the stripe
+ * Output: TRUE while the stripe's slot has operations in flight
+*******************************************************************************/
+int waitingForRing(struct server* server, struct stripe* stripe) {
+  return stripe->ringSlot >= 0 && server->ring->slots[stripe->ringSlot].pending > 0;
+}
+
+
+/*******************************************************************************
+ *     void setInterest(struct server*, struct endpoint*, uint32_t events)
+ * Description: registers, updates or removes the epoll events an endpoint is
+ *   waiting for. epoll_ctl is only called when the set actually changes
+ * Input:
+ *   struct server* server - the event loop
+ *   struct endpoint* endpoint - the file descriptor to watch
+ *   uint32_t events - EPOLLIN/EPOLLOUT mask, or 0 to stop watching
+ * Output: none
+*******************************************************************************/
+void setInterest(struct server* server, struct endpoint* endpoint, uint32_t events) {
+  if (endpoint->fd < 0 || endpoint->events == events) {
+    return;
+  }
+  struct epoll_event event;
+  event.events = events;
+  event.data.ptr = endpoint;
+  if (events == 0) {
+    epoll_ctl(server->epollFD, EPOLL_CTL_DEL, endpoint->fd, NULL);
+  }
+  else if (endpoint->events == 0) {
+    epoll_ctl(server->epollFD, EPOLL_CTL_ADD, endpoint->fd, &event);
+  }
+  else {
+    epoll_ctl(server->epollFD, EPOLL_CTL_MOD, endpoint->fd, &event);
+  }
+  endpoint->events = events;
+}
+
+
+/*******************************************************************************
+ *    void appendEntry(struct buffer* entries, struct stat* entryInfo,
+ *                     char* name, size_t nameLength)
+ * Description: adds one entry to a listing
+ * Input:
+ *   struct buffer* entries - the listing to add to
+ *   struct stat* entryInfo - the entry's metadata, not following symlinks
+ *   char* name - the entry's name
+ *   size_t nameLength - the length of the name
+ * Output: none
+*******************************************************************************/
+void appendEntry(struct buffer* entries, struct stat* entryInfo, char* name, size_t nameLength) {
+  unsigned char header[ENTRY_HEADER_LENGTH];
+  int type = ENTRY_OTHER;
+  if (S_ISREG(entryInfo->st_mode)) {
+    type = ENTRY_FILE;
+  }
+  else if (S_ISDIR(entryInfo->st_mode)) {
+    type = ENTRY_DIRECTORY;
+  }
+  else if (S_ISLNK(entryInfo->st_mode)) {
+    type = ENTRY_SYMLINK;
+  }
+  header[0] = type;
+  putUint64(header + 1, entryInfo->st_size);
+  putUint64(header + 9, entryInfo->st_mtime);
+  putUint16(header + 17, nameLength);
+  appendBuffer(entries, header, ENTRY_HEADER_LENGTH);
+  appendBuffer(entries, name, nameLength);
+}
+
+
+/*******************************************************************************
+ *   void appendCachedEntry(struct buffer* entries, struct dirent64* entry,
+ *                          struct stat* entryInfo)
+ * Description: adds one entry to a cached listing. Cached entries are
+ *   prefixed with their directory position so that a paged listing can be
+ *   continued from the cache or from the directory alike
+ * Input:
+ *   struct buffer* entries - the cached listing to add to
+ *   struct dirent64* entry - the entry as read from the directory
+ *   struct stat* entryInfo - the entry's metadata
+ * Output: none
+*******************************************************************************/
+void appendCachedEntry(struct buffer* entries, struct dirent64* entry, struct stat* entryInfo) {
+  unsigned char position[CACHED_ENTRY_PREFIX_LENGTH];
+  putUint64(position, entry->d_off);
+  appendBuffer(entries, position, CACHED_ENTRY_PREFIX_LENGTH);
+  appendEntry(entries, entryInfo, entry->d_name, strlen(entry->d_name));
+}
+
+
+/*******************************************************************************
+ *        int matchesRequest(struct request* request, char* name)
+ * Description: determines whether an entry belongs in a listing. Hidden
+ *   entries are left out unless asked for, and when the request has a filter
+ *   the name must match it as a shell glob
+ * Input:
+ *   struct request* request - the LIST request
+ *   char* name - the entry's name
+ * Output: TRUE if the entry should be listed
+*******************************************************************************/
+int matchesRequest(struct request* request, char* name) {
+  if (!request->showHidden && name[0] == '.') {
+    return FALSE;
+  }
+  return request->filter[0] == '\0' || fnmatch(request->filter, name, 0) == 0;
+}
+
+
+/*******************************************************************************
+ *      int openBeneathDirectory(int directoryFD, char* name, int flags)
+ * sources cited: https://man7.org/linux/man-pages/man2/openat2.2.html
+ *
+ * Description: opens a name relative to a directory with openat2(2) and
+ *   RESOLVE_BENEATH, so that neither ".." nor a symlink can take it out of
+ *   the directory. Without openat2(2) the name is opened with openat(2),
+ *   after refusing absolute names and ".." components
+ * Input:
+ *   int directoryFD - the directory
+ *   char* name - the name, relative to the directory
+ *   int flags - the flags to open it with
+ * Output: the open descriptor, or -1 with errno set. errno is EXDEV if the
+ *   name leads out of the directory
+*******************************************************************************/
+int openBeneathDirectory(int directoryFD, char* name, int flags) {
+  struct open_how how;
+  char* part;
+
+  if (HAVE_OPENAT2) {
+    memset(&how, '\0', sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    return syscall(SYS_openat2, directoryFD, name, &how, sizeof(how));
+  }
+  for (part = name; part != NULL; part = strchr(part, '/')) {
+    part += part[0] == '/';
+    if (strncmp(part, "..", 2) == 0 && (part[2] == '/' || part[2] == '\0')) {
+      errno = EXDEV;
+      return -1;
+    }
+  }
+  if (name[0] == '/') {
+    errno = EXDEV;
+    return -1;
+  }
+  return openat(directoryFD, name, flags | O_CLOEXEC);
+}
+
+
+/*******************************************************************************
+ *       int openBeneath(struct session* session, char* name, int flags)
+ * Description: opens a name a session asked for. A relative name is opened
+ *   from the session's directory. If it climbs out of that directory through
+ *   ".." or a symlink, it is opened again from the root, which it can't
+ *   leave. An absolute name is opened from the root
+ * Input:
+ *   struct session* session - the session
+ *   char* name - the name
+ *   int flags - the flags to open it with
+ * Output: the open descriptor, or -1 with errno set
+*******************************************************************************/
+int openBeneath(struct session* session, char* name, int flags) {
+  char path[PATH_MAX];
+
+  if (name[0] == '/') {
+    while (name[0] == '/') {
+      name++;
+    }
+    return openBeneathDirectory(ROOT_FD, name[0] != '\0' ? name : ".", flags);
+  }
+  int fd = openBeneathDirectory(session->directoryFD, name, flags);
+  if (fd >= 0 || errno != EXDEV) {
+    return fd;
+  }
+  char* relative = session->directory + strlen(ROOT_PATH);
+  while (relative[0] == '/') {
+    relative++;
+  }
+  if (snprintf(path, sizeof(path), "%s%s%s", relative, relative[0] != '\0' ? "/" : "", name) >=
+      (int)sizeof(path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  return openBeneathDirectory(ROOT_FD, path, flags);
+}
+
+
+/*******************************************************************************
+ *       int directoryPath(int directoryFD, char* path, size_t size)
+ * Description: finds where an open directory is now, from its link in
+ *   /proc/self/fd. The path follows renames of the directory and of those
+ *   above it, and ends in " (deleted)" once the directory is removed
+ * Input:
+ *   int directoryFD - the directory
+ *   char* path - filled in with its absolute path
+ *   size_t size - the size of path
+ * Output: TRUE on success, FALSE if the path could not be read
+*******************************************************************************/
+int directoryPath(int directoryFD, char* path, size_t size) {
+  char link[64];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", directoryFD);
+  ssize_t length = readlink(link, path, size - 1);
+  if (length < 0 || (size_t)length == size - 1) {
+    return FALSE;
+  }
+  path[length] = '\0';
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ *    int joinPath(char* base, char* name, char* path, size_t size)
+ * Description: works out the absolute path of a name given relative to a
+ *   directory, without looking at the filesystem. Empty and "." components
+ *   are dropped; an absolute name is taken from the root. Names with ".."
+ *   are refused, because what ".." leads to depends on the symlinks on the
+ *   way
+ * Input:
+ *   char* base - the absolute path of the directory, without symlinks
+ *   char* name - the name
+ *   char* path - filled in with the absolute path
+ *   size_t size - the size of path
+ * Output: TRUE on success, FALSE if the name has a ".." component or the
+ *   path is too long
+*******************************************************************************/
+int joinPath(char* base, char* name, char* path, size_t size) {
+  size_t length = snprintf(path, size, "%s", name[0] == '/' ? ROOT_PATH : base);
+  if (length >= size) {
+    return FALSE;
+  }
+  length = length == 1 ? 0 : length;
+  while (name[0] != '\0') {
+    size_t part = strcspn(name, "/");
+    if (part == 2 && strncmp(name, "..", 2) == 0) {
+      return FALSE;
+    }
+    if (part > 0 && !(part == 1 && name[0] == '.')) {
+      if (length + 1 + part >= size) {
+        return FALSE;
+      }
+      path[length++] = '/';
+      memcpy(path + length, name, part);
+      length += part;
+    }
+    name += part;
+    while (name[0] == '/') {
+      name++;
+    }
+  }
+  if (length == 0) {
+    path[length++] = '/';
+  }
+  path[length] = '\0';
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ *   void dropDirectory(struct cachedDirectory* directory)
+ * Description: closes a directory the worker kept open and frees its entry
+ * Input: struct cachedDirectory* directory - the entry
+ * Output: none
+*******************************************************************************/
+void dropDirectory(struct cachedDirectory* directory) {
+  if (directory->path == NULL) {
+    return;
+  }
+  close(directory->fd);
+  free(directory->path);
+  directory->path = NULL;
+  directory->fd = -1;
+}
+
+
+/*******************************************************************************
+ *          int findDirectory(struct server* server, char* path)
+ * Description: looks for a directory in the worker's directory cache. An
+ *   entry is only used while its directory is still at path, so a directory
+ *   renamed or removed since, or one below a renamed directory, is opened
+ *   again. The path has no symlinks, so the directory now at path is the one
+ *   that was cached
+ * Input:
+ *   struct server* server - the worker
+ *   char* path - the absolute path of the directory, without symlinks
+ * Output: a new O_PATH descriptor of the directory, or -1 if it isn't cached
+*******************************************************************************/
+int findDirectory(struct server* server, char* path) {
+  char now[PATH_MAX];
+  int i;
+  for (i = 0; i < DIRECTORY_CACHE_ENTRIES; i++) {
+    struct cachedDirectory* directory = &server->directories[i];
+    if (directory->path == NULL || strcmp(directory->path, path) != 0) {
+      continue;
+    }
+    if (!directoryPath(directory->fd, now, sizeof(now)) || strcmp(now, path) != 0) {
+      dropDirectory(directory);
+      return -1;
+    }
+    directory->used = ++server->directoryClock;
+    return fcntl(directory->fd, F_DUPFD_CLOEXEC, 0);
+  }
+  return -1;
+}
+
+
+/*******************************************************************************
+ *    void addDirectory(struct server* server, char* path, int directoryFD)
+ * Description: keeps a directory open in the worker's directory cache, in
+ *   place of the one used least recently if it is full
+ * Input:
+ *   struct server* server - the worker
+ *   char* path - the absolute path of the directory, without symlinks
+ *   int directoryFD - the directory, open with O_PATH. The cache keeps its
+ *                     own descriptor
+ * Output: none
+*******************************************************************************/
+void addDirectory(struct server* server, char* path, int directoryFD) {
+  struct cachedDirectory* victim = &server->directories[0];
+  int i;
+  for (i = 0; i < DIRECTORY_CACHE_ENTRIES && victim->path != NULL; i++) {
+    struct cachedDirectory* directory = &server->directories[i];
+    if (directory->path == NULL || directory->used < victim->used) {
+      victim = directory;
+    }
+  }
+  dropDirectory(victim);
+  victim->fd = fcntl(directoryFD, F_DUPFD_CLOEXEC, 0);
+  if (victim->fd < 0) {
+    return;
+  }
+  victim->path = strdup(path);
+  assert(victim->path != NULL);
+  victim->used = ++server->directoryClock;
+}
+
+
+/*******************************************************************************
+ *       int createTemporary(int directoryFD, char* name)
+ * Description: creates a new file with a random name in a directory, as
+ *   mkostemp(3) does in the working directory
+ * Input:
+ *   int directoryFD - the directory
+ *   char* name - a name ending in XXXXXX, which is replaced with the name
+ *                created
+ * Output: the file, open for reading and writing, or -1 with errno set
+*******************************************************************************/
+int createTemporary(int directoryFD, char* name) {
+  static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  char* suffix = name + strlen(name) - 6;
+  unsigned char random[6];
+  int attempt, i;
+
+  for (attempt = 0; attempt < 100; attempt++) {
+    if (getrandom(random, sizeof(random), 0) != sizeof(random)) {
+      return -1;
+    }
+    for (i = 0; i < 6; i++) {
+      suffix[i] = letters[random[i] % (sizeof(letters) - 1)];
+    }
+    int fd = openat(directoryFD, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd >= 0 || errno != EEXIST) {
+      return fd;
+    }
+  }
+  return -1;
+}
+
+
+/*******************************************************************************
+ *   int readListing(struct server* server, int parentFD, struct buffer*)
+ * Description: builds a cached-format listing of every entry in a directory,
+ *   hidden ones included, with the size, modification time and type of each.
+ *   The directory is read in LISTING_BATCH_SIZE batches with getdents64(2)
+ * Input:
+ *   struct server* server - the worker, whose dirent buffer is used
+ *   int parentFD - the directory, which may be open with O_PATH
+ *   struct buffer* entries - the buffer to build the listing in
+ * Output: TRUE on success, FALSE if the directory could not be read
+*******************************************************************************/
+int readListing(struct server* server, int parentFD, struct buffer* entries) {
+  struct stat entryInfo;
+  ssize_t length;
+  int directoryFD = openat(parentFD, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (directoryFD < 0) {
+    return FALSE;
+  }
+  while ((length = getdents64(directoryFD, server->direntBuffer, LISTING_BATCH_SIZE)) > 0) {
+    ssize_t position = 0;
+    while (position < length) {
+      struct dirent64* entry = (struct dirent64*)(server->direntBuffer + position);
+      position += entry->d_reclen;
+      // skip entries removed since they were read
+      if (fstatat(directoryFD, entry->d_name, &entryInfo, AT_SYMLINK_NOFOLLOW) == 0) {
+        appendCachedEntry(entries, entry, &entryInfo);
+      }
+    }
+  }
+  close(directoryFD);
+  return length == 0;
+}
+
+
+/*******************************************************************************
+ *     void removeListing(struct server*, struct listing*, int removeWatch)
+ * Description: drops a listing from the worker's cache
+ * Input:
+ *   struct server* server - the worker owning the cache
+ *   struct listing* listing - the listing to drop
+ *   int removeWatch - FALSE if the kernel has already removed the watch
+ * Output: none
+*******************************************************************************/
+void removeListing(struct server* server, struct listing* listing, int removeWatch) {
+  if (removeWatch) {
+    inotify_rm_watch(server->inotify.fd, listing->watch);
+  }
+  if (listing->prev != NULL) {
+    listing->prev->next = listing->next;
+  }
+  else {
+    server->listings = listing->next;
+  }
+  if (listing->next != NULL) {
+    listing->next->prev = listing->prev;
+  }
+  freeBuffer(&listing->entries);
+  free(listing->path);
+  free(listing);
+  server->listingCount--;
+}
+
+
+/*******************************************************************************
+ *       struct listing* findListing(struct server* server, char* path)
+ * Description: looks for a directory in the worker's listing cache and marks
+ *   it most recently used
+ * Input:
+ *   struct server* server - the worker owning the cache
+ *   char* path - the absolute path of the directory
+ * Output: the cached listing, which may still be being built, or NULL if the
+ *   directory is not cached
+*******************************************************************************/
+struct listing* findListing(struct server* server, char* path) {
+  struct listing* listing;
+  for (listing = server->listings; listing != NULL; listing = listing->next) {
+    if (strcmp(listing->path, path) == 0) {
+      break;
+    }
+  }
+  if (listing == NULL || listing == server->listings) {
+    return listing;
+  }
+  listing->prev->next = listing->next;
+  if (listing->next != NULL) {
+    listing->next->prev = listing->prev;
+  }
+  listing->prev = NULL;
+  listing->next = server->listings;
+  server->listings->prev = listing;
+  server->listings = listing;
+  return listing;
+}
+
+
+/*******************************************************************************
+ *         struct listing* addListing(struct server*, char* path)
+ * Description: starts a new listing in the worker's cache. The directory is
+ *   watched before it is read so that no change can slip in unnoticed; a
+ *   change while the listing is being built marks it stale. The least
+ *   recently used finished listing is dropped when the cache is full
+ * Input:
+ *   struct server* server - the worker owning the cache
+ *   char* path - the absolute path of the directory
+ * Output: the new listing, marked as being built, or NULL if the directory
+ *   could not be watched
+*******************************************************************************/
+struct listing* addListing(struct server* server, char* path) {
+  int watch = inotify_add_watch(server->inotify.fd, path, LISTING_WATCH_EVENTS | IN_ONLYDIR);
+  if (watch < 0) {
+    return NULL;
+  }
+  struct listing* listing = calloc(1, sizeof(struct listing));
+  assert(listing != NULL);
+  listing->path = strdup(path);
+  assert(listing->path != NULL);
+  listing->watch = watch;
+  listing->building = TRUE;
+  listing->next = server->listings;
+  if (server->listings != NULL) {
+    server->listings->prev = listing;
+  }
+  server->listings = listing;
+  server->listingCount++;
+
+  if (server->listingCount > LISTING_CACHE_ENTRIES) {
+    struct listing* oldest = NULL;
+    struct listing* candidate;
+    for (candidate = listing->next; candidate != NULL; candidate = candidate->next) {
+      if (!candidate->building) {
+        oldest = candidate;
+      }
+    }
+    if (oldest != NULL) {
+      removeListing(server, oldest, TRUE);
+    }
+  }
+  return listing;
+}
+
+
+/*******************************************************************************
+ *        void finishListing(struct server*, struct listing*, int complete)
+ * Description: ends the building of a cached listing. It is kept if it is
+ *   complete and nothing changed in the directory while it was read
+ * Input:
+ *   struct server* server - the worker owning the cache
+ *   struct listing* listing - the listing being built
+ *   int complete - FALSE if the listing was abandoned
+ * Output: none
+*******************************************************************************/
+void finishListing(struct server* server, struct listing* listing, int complete) {
+  listing->building = FALSE;
+  if (!complete || listing->stale) {
+    removeListing(server, listing, TRUE);
+  }
+}
+
+
+/*******************************************************************************
+ *             void destroyCachedFile(struct cachedFile* file)
+ * Description: frees a file that has left the cache once no session is
+ *   sending it any more
+ * Input: struct cachedFile* file - the file
+ * Output: none
+*******************************************************************************/
+void destroyCachedFile(struct cachedFile* file) {
+  if (file->bytes != NULL) {
+    munmap(file->bytes, file->info.st_size);
+  }
+  close(file->fd);
+  free(file->path);
+  free(file);
+}
+
+
+/*******************************************************************************
+ *             void unwatchFile(struct server* server, int watch)
+ * Description: removes the inotify watch of a file that has left the cache,
+ *   unless another cached path names the same file, since inotify gives
+ *   every path to one file the same watch
+ * Input:
+ *   struct server* server - the worker owning the cache
+ *   int watch - the watch, or -1 if the file wasn't watched
+ * Output: none
+*******************************************************************************/
+void unwatchFile(struct server* server, int watch) {
+  struct cachedFile* file;
+  for (file = server->cachedFiles; file != NULL; file = file->next) {
+    if (file->watch == watch) {
+      return;
+    }
+  }
+  if (watch >= 0) {
+    inotify_rm_watch(server->inotify.fd, watch);
+  }
+}
+
+
+/*******************************************************************************
+ *   void removeCachedFile(struct server*, struct cachedFile*, int removeWatch)
+ * Description: drops a file from the worker's cache
+ * Input:
+ *   struct server* server - the worker owning the cache
+ *   struct cachedFile* file - the file to drop
+ *   int removeWatch - FALSE if the kernel has already removed the watch
+ * Output: none
+*******************************************************************************/
+void removeCachedFile(struct server* server, struct cachedFile* file, int removeWatch) {
+  if (file->prev != NULL) {
+    file->prev->next = file->next;
+  }
+  else {
+    server->cachedFiles = file->next;
+  }
+  if (file->next != NULL) {
+    file->next->prev = file->prev;
+  }
+  if (removeWatch) {
+    unwatchFile(server, file->watch);
+  }
+  server->cachedFileCount--;
+  __atomic_sub_fetch(&server->cachedFileBytes, file->info.st_size, __ATOMIC_RELAXED);
+  file->cached = FALSE;
+  if (file->users == 0) {
+    destroyCachedFile(file);
+  }
+}
+
+
+/*******************************************************************************
+ *      struct cachedFile* findCachedFile(struct server*, char* path)
+ * Description: looks for a file in the worker's cache and marks it most
+ *   recently used. Without inotify the file is checked with stat() and
+ *   dropped if it is no longer the file that was cached, or has changed
+ * Input:
+ *   struct server* server - the worker owning the cache
+ *   char* path - the absolute path of the file
+ * Output: the cached file, or NULL if it is not cached
+*******************************************************************************/
+struct cachedFile* findCachedFile(struct server* server, char* path) {
+  struct cachedFile* file;
+  struct stat now;
+  for (file = server->cachedFiles; file != NULL; file = file->next) {
+    if (strcmp(file->path, path) == 0) {
+      break;
+    }
+  }
+  if (file == NULL) {
+    return NULL;
+  }
+  if (file->watch < 0 &&
+      (stat(path, &now) < 0 || now.st_dev != file->info.st_dev || now.st_ino != file->info.st_ino ||
+       now.st_size != file->info.st_size ||
+       now.st_mtim.tv_sec != file->info.st_mtim.tv_sec || now.st_mtim.tv_nsec != file->info.st_mtim.tv_nsec ||
+       now.st_ctim.tv_sec != file->info.st_ctim.tv_sec || now.st_ctim.tv_nsec != file->info.st_ctim.tv_nsec)) {
+    removeCachedFile(server, file, FALSE);
+    countMetric(&server->metrics.fileCacheInvalidations, 1);
+    return NULL;
+  }
+  if (file == server->cachedFiles) {
+    return file;
+  }
+  file->prev->next = file->next;
+  if (file->next != NULL) {
+    file->next->prev = file->prev;
+  }
+  file->prev = NULL;
+  file->next = server->cachedFiles;
+  server->cachedFiles->prev = file;
+  server->cachedFiles = file;
+  return file;
+}
+
+
+/*******************************************************************************
+ *  struct cachedFile* addCachedFile(struct server*, char* path, int fileFD,
+ *                                   struct stat* info)
+ * sources cited: man 7 inotify, man 2 mmap
+ *
+ * Description: copies a file that was just opened into the worker's cache.
+ *   The path is watched before the file is read, and the copy is only kept
+ *   if the path still names the file and it didn't change while it was read.
+ *   Sparse files aren't cached, so they are sent by their extents of data
+ *   and don't take their holes' size in memory. The least recently used
+ *   files are dropped to make room
+ * Input:
+ *   struct server* server - the worker owning the cache
+ *   char* path - the absolute path of the file
+ *   int fileFD - the open file, which the cache takes over if it is added
+ *   struct stat* info - the file's metadata when it was opened
+ * Output: the new cached file, or NULL if the file is not cached
+*******************************************************************************/
+struct cachedFile* addCachedFile(struct server* server, char* path, int fileFD, struct stat* info) {
+  size_t budget = FILE_CACHE_SIZE / WORKERS;
+  struct stat now;
+  off_t length = 0;
+  int watch = -1;
+
+  if (info->st_size > MAX_CACHED_FILE_SIZE || (size_t)info->st_size > budget ||
+      info->st_blocks * 512 < info->st_size) {
+    return NULL;
+  }
+  if (server->inotify.fd >= 0) {
+    watch = inotify_add_watch(server->inotify.fd, path, FILE_WATCH_EVENTS);
+    if (watch < 0) {
+      return NULL;
+    }
+  }
+  struct cachedFile* file = calloc(1, sizeof(struct cachedFile));
+  assert(file != NULL);
+  file->path = strdup(path);
+  assert(file->path != NULL);
+  file->fd = fileFD;
+  file->info = *info;
+  file->watch = watch;
+  file->entropy = -1;
+  if (info->st_size > 0) {
+    file->bytes = mmap(NULL, info->st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (file->bytes == MAP_FAILED) {
+      file->bytes = NULL;
+      length = -1;
+    }
+  }
+  while (length >= 0 && length < info->st_size) {
+    ssize_t readAmt = pread(fileFD, file->bytes + length, info->st_size - length, length);
+    length = readAmt > 0 ? length + readAmt : -1;
+  }
+  if (length < 0 || stat(path, &now) < 0 || now.st_dev != info->st_dev || now.st_ino != info->st_ino ||
+      fstat(fileFD, &now) < 0 || now.st_size != info->st_size ||
+      now.st_mtim.tv_sec != info->st_mtim.tv_sec || now.st_mtim.tv_nsec != info->st_mtim.tv_nsec ||
+      now.st_ctim.tv_sec != info->st_ctim.tv_sec || now.st_ctim.tv_nsec != info->st_ctim.tv_nsec) {
+    unwatchFile(server, watch);
+    if (file->bytes != NULL) {
+      munmap(file->bytes, info->st_size);
+    }
+    free(file->path);
+    free(file);
+    return NULL;
+  }
+  if (file->bytes != NULL) {
+    mprotect(file->bytes, info->st_size, PROT_READ);
+  }
+
+  file->cached = TRUE;
+  file->next = server->cachedFiles;
+  if (server->cachedFiles != NULL) {
+    server->cachedFiles->prev = file;
+  }
+  server->cachedFiles = file;
+  server->cachedFileCount++;
+  __atomic_add_fetch(&server->cachedFileBytes, info->st_size, __ATOMIC_RELAXED);
+  while (server->cachedFileBytes > budget || server->cachedFileCount > MAX_CACHED_FILES) {
+    struct cachedFile* oldest = file;
+    while (oldest->next != NULL) {
+      oldest = oldest->next;
+    }
+    removeCachedFile(server, oldest, TRUE);
+    countMetric(&server->metrics.fileCacheEvictions, 1);
+  }
+  return file;
+}
+
+
+/*******************************************************************************
+ *              void handleDirectoryChanges(struct server* server)
+ * sources cited: man 7 inotify
+ *
+ * Description: drops the cached listing of every directory inotify reports
+ *   a change in, and every cached file that changed, or everything if the
+ *   kernel's event queue overflowed. Listings still being built are marked
+ *   stale and dropped when finished
+ * Input: struct server* server - the worker owning the caches
+ * Output: none
+*******************************************************************************/
+void handleDirectoryChanges(struct server* server) {
+  char events[INOTIFY_BUFFER_LENGTH] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t length;
+
+  while ((length = read(server->inotify.fd, events, sizeof(events))) > 0) {
+    char* position = events;
+    while (position < events + length) {
+      struct inotify_event* event = (struct inotify_event*)position;
+      struct listing* listing = server->listings;
+      while (listing != NULL) {
+        struct listing* next = listing->next;
+        if (listing->watch == event->wd || (event->mask & IN_Q_OVERFLOW)) {
+          if (listing->building) {
+            listing->stale = TRUE;
+          }
+          else {
+            removeListing(server, listing, !(event->mask & IN_IGNORED));
+          }
+        }
+        listing = next;
+      }
+      struct cachedFile* file = server->cachedFiles;
+      while (file != NULL) {
+        struct cachedFile* next = file->next;
+        if (file->watch == event->wd || (event->mask & IN_Q_OVERFLOW)) {
+          removeCachedFile(server, file, !(event->mask & IN_IGNORED));
+          countMetric(&server->metrics.fileCacheInvalidations, 1);
+        }
+        file = next;
+      }
+      position += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+
+/*******************************************************************************
+ *  int openRequestedFile(struct server*, struct session*, char* name,
+ *                        struct stat* info, int admit)
+ * Description: opens a file a get asked for. A file in the worker's cache is
+ *   taken from there without opening or checking it again, and the session
+ *   sends it from memory. Otherwise the file is opened and, if admit is set,
+ *   added to the cache
+ * Input:
+ *   struct server* server - the worker owning the cache
+ *   struct session* session - the session that will send the file
+ *   char* name - the file's name, relative to the session's directory
+ *   struct stat* info - filled in with the file's metadata
+ *   int admit - whether the file may be added to the cache
+ * Output: the open file, or -1 if it can't be opened or isn't a regular file
+*******************************************************************************/
+int openRequestedFile(struct server* server, struct session* session, char* name,
+                      struct stat* info, int admit) {
+  char directory[PATH_MAX];
+  char path[PATH_MAX];
+  // the session's directory may have moved since it changed into it
+  int cacheable = FILE_CACHE_SIZE > 0 && directoryPath(session->directoryFD, directory, sizeof(directory)) &&
+                  joinPath(directory, name, path, sizeof(path));
+  if (cacheable) {
+    if (server->inotify.fd >= 0) {
+      handleDirectoryChanges(server);
+    }
+    struct cachedFile* file = findCachedFile(server, path);
+    if (file != NULL) {
+      countMetric(&server->metrics.fileCacheHits, 1);
+      file->users++;
+      session->cachedFile = file;
+      *info = file->info;
+      return file->fd;
+    }
+    countMetric(&server->metrics.fileCacheMisses, 1);
+  }
+
+  int fileFD = openBeneath(session, name, O_RDONLY);
+  if (fileFD >= 0 && (fstat(fileFD, info) < 0 || !S_ISREG(info->st_mode))) {
+    close(fileFD);
+    return -1;
+  }
+  if (fileFD >= 0 && cacheable && admit) {
+    struct cachedFile* file = addCachedFile(server, path, fileFD, info);
+    if (file != NULL) {
+      file->users++;
+      session->cachedFile = file;
+    }
+  }
+  return fileFD;
+}
+
+
+/*******************************************************************************
+ *            void releaseFile(struct session* session, int fileFD)
+ * Description: closes the file a get was sending, or lets go of the cached
+ *   file it was sent from, freeing it if it has left the cache meanwhile
+ * Input:
+ *   struct session* session - the session that sent the file
+ *   int fileFD - the file, as returned by openRequestedFile()
+ * Output: none
+*******************************************************************************/
+void releaseFile(struct session* session, int fileFD) {
+  struct cachedFile* file = session->cachedFile;
+  if (file == NULL) {
+    close(fileFD);
+    return;
+  }
+  session->cachedFile = NULL;
+  file->users--;
+  if (!file->cached && file->users == 0) {
+    destroyCachedFile(file);
+  }
+}
+
+
+/*******************************************************************************
+ *      int compareEntries(const void* a, const void* b, void* argument)
+ * Description: orders two cached entries by the sort key of a LIST request.
+ *   Ties are broken by name so the order is stable between pages
+ * Input:
+ *   const void* a, b - pointers to the entries' addresses
+ *   void* argument - the request's sort key
+ * Output: negative, zero or positive as for qsort(3)
+*******************************************************************************/
+int compareEntries(const void* a, const void* b, void* argument) {
+  const unsigned char* first = *(const unsigned char* const*)a + CACHED_ENTRY_PREFIX_LENGTH;
+  const unsigned char* second = *(const unsigned char* const*)b + CACHED_ENTRY_PREFIX_LENGTH;
+  int sort = *(int*)argument;
+  int result = 0;
+
+  if ((sort & SORT_KEY_MASK) == SORT_SIZE || (sort & SORT_KEY_MASK) == SORT_MTIME) {
+    int field = (sort & SORT_KEY_MASK) == SORT_SIZE ? 1 : 9;
+    uint64_t firstValue = getUint(first + field, 8);
+    uint64_t secondValue = getUint(second + field, 8);
+    result = firstValue < secondValue ? -1 : firstValue > secondValue;
+  }
+  if (result == 0) {
+    size_t firstLength = getUint(first + 17, 2);
+    size_t secondLength = getUint(second + 17, 2);
+    result = memcmp(first + ENTRY_HEADER_LENGTH, second + ENTRY_HEADER_LENGTH,
+                    min(firstLength, secondLength));
+    if (result == 0) {
+      result = firstLength < secondLength ? -1 : firstLength > secondLength;
+    }
+  }
+  return sort & SORT_REVERSE ? -result : result;
+}
+
+
+/*******************************************************************************
+ *     void endListing(struct session* session, int more, uint64_t cursor)
+ * Description: queues the END frame of a listing. When the page filled up
+ *   before the directory ran out, the END frame carries the cursor to send
+ *   in the LIST request for the next page
+ * Input:
+ *   struct session* session - the session sending the listing
+ *   int more - TRUE if there may be more entries after this page
+ *   uint64_t cursor - where the next page starts
+ * Output: none
+*******************************************************************************/
+void endListing(struct session* session, int more, uint64_t cursor) {
+  size_t start = beginFrame(&session->data, FRAME_END, STATUS_OK, session->request.id);
+  if (more) {
+    addUintAttribute(&session->data, ATTR_CURSOR, cursor, 8);
+  }
+  addTrailerAttributes(&session->data, &session->stripes[0]);
+  finishFrame(&session->data, start);
+}
+
+
+/*******************************************************************************
+ *    void sendListingPage(struct session* session, struct buffer* entries)
+ * Description: queues one page of a listing held in memory. The entries that
+ *   match the request are sorted if asked, the page starting at the
+ *   request's cursor is sent as one DATA frame and the END frame follows. For
+ *   a sorted listing the cursor is the position in the sorted list; for an
+ *   unsorted one it is the directory position of the last entry sent
+ * Input:
+ *   struct session* session - the session requesting the listing
+ *   struct buffer* entries - a cached-format listing of the whole directory
+ * Output: none
+*******************************************************************************/
+void sendListingPage(struct session* session, struct buffer* entries) {
+  struct request* request = &session->request;
+  char name[MAX_FILE_NAME_LENGTH + 1];
+  size_t count = 0;
+  size_t capacity = 0;
+  unsigned char** matches = NULL;
+  size_t position, first = 0, i;
+
+  for (position = 0; position < entries->length; ) {
+    unsigned char* entry = (unsigned char*)entries->bytes + position;
+    size_t nameLength = getUint(entry + CACHED_ENTRY_PREFIX_LENGTH + 17, 2);
+    memcpy(name, entry + CACHED_ENTRY_PREFIX_LENGTH + ENTRY_HEADER_LENGTH, nameLength);
+    name[nameLength] = '\0';
+    if (matchesRequest(request, name)) {
+      if (count == capacity) {
+        capacity = capacity == 0 ? 1024 : capacity * 2;
+        matches = realloc(matches, capacity * sizeof(*matches));
+        assert(matches != NULL);
+      }
+      matches[count++] = entry;
+    }
+    position += CACHED_ENTRY_PREFIX_LENGTH + ENTRY_HEADER_LENGTH + nameLength;
+  }
+
+  if (request->sort != SORT_NONE) {
+    qsort_r(matches, count, sizeof(*matches), compareEntries, &request->sort);
+    first = min(request->cursor, count);
+  }
+  else if (request->cursor != 0) {
+    // continue after the entry whose position the cursor holds
+    first = count;
+    for (i = 0; i < count; i++) {
+      if (getUint(matches[i], CACHED_ENTRY_PREFIX_LENGTH) == request->cursor) {
+        first = i + 1;
+        break;
+      }
+    }
+  }
+  size_t last = count;
+  if (request->pageSize > 0) {
+    last = min(first + request->pageSize, count);
+  }
+
+  size_t start = beginFrame(&session->data, FRAME_DATA, STATUS_OK, request->id);
+  unsigned char offset[DATA_OFFSET_LENGTH] = {0};
+  appendBuffer(&session->data, offset, DATA_OFFSET_LENGTH);
+  for (i = first; i < last; i++) {
+    unsigned char* entry = matches[i] + CACHED_ENTRY_PREFIX_LENGTH;
+    appendBuffer(&session->data, entry, ENTRY_HEADER_LENGTH + getUint(entry + 17, 2));
+  }
+  finishDataFrame(session, &session->data, start);
+  if (request->sort != SORT_NONE) {
+    endListing(session, last < count, last);
+  }
+  else {
+    endListing(session, last < count, last > 0 ? getUint(matches[last - 1], CACHED_ENTRY_PREFIX_LENGTH) : 0);
+  }
+  free(matches);
+}
+
+
+/*******************************************************************************
+ *   int startListingStream(struct server*, struct session*, char* path)
+ * Description: starts streaming an unsorted listing straight from the
+ *   directory. The entries are read and sent one batch at a time by
+ *   streamListing(), so the first entries go out straight away and memory
+ *   use doesn't grow with the size of the directory. A plain listing of the
+ *   whole directory is also collected for the cache, unless it grows past
+ *   MAX_CACHED_LISTING_SIZE or another session is already collecting it
+ * Input:
+ *   struct server* server - the worker owning the cache
+ *   struct session* session - the session requesting the listing
+ *   char* path - the absolute path of the directory
+ * Output: TRUE on success, FALSE if the directory could not be opened
+*******************************************************************************/
+int startListingStream(struct server* server, struct session* session, char* path) {
+  struct request* request = &session->request;
+  struct listStream* list = &session->list;
+
+  list->fd = openat(session->directoryFD, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (list->fd < 0) {
+    return FALSE;
+  }
+  if (request->cursor != 0 && lseek(list->fd, request->cursor, SEEK_SET) < 0) {
+    close(list->fd);
+    list->fd = -1;
+    return FALSE;
+  }
+  list->sent = 0;
+  list->remaining = request->pageSize;
+  list->build = NULL;
+  if (LISTING_CACHE_ENTRIES > 0 && server->inotify.fd >= 0 && request->filter[0] == '\0' &&
+      request->cursor == 0 && request->pageSize == 0 && findListing(server, path) == NULL) {
+    list->build = addListing(server, path);
+  }
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ *        void stopListingStream(struct server*, struct session*, int)
+ * Description: closes the directory of a streamed listing and finishes or
+ *   abandons the listing being collected for the cache
+ * Input:
+ *   struct server* server - the worker owning the cache
+ *   struct session* session - the session streaming the listing
+ *   int complete - TRUE if the whole directory was read
+ * Output: none
+*******************************************************************************/
+void stopListingStream(struct server* server, struct session* session, int complete) {
+  struct listStream* list = &session->list;
+  if (list->fd < 0) {
+    return;
+  }
+  close(list->fd);
+  list->fd = -1;
+  if (list->build != NULL) {
+    finishListing(server, list->build, complete);
+    list->build = NULL;
+  }
+}
+
+
+/*******************************************************************************
+ *           void streamListing(struct server*, struct session*)
+ * Description: reads the next getdents64(2) batch of a streamed listing and
+ *   queues the entries that match the request as one DATA frame. Once the
+ *   directory runs out or the page is full the END frame is queued too
+ * Input:
+ *   struct server* server - the worker, whose dirent buffer is used
+ *   struct session* session - the session streaming the listing, with its
+ *     data buffer fully sent
+ * Output: none
+*******************************************************************************/
+void streamListing(struct server* server, struct session* session) {
+  struct listStream* list = &session->list;
+  struct buffer* data = &session->data;
+  struct stat entryInfo;
+  uint64_t cursor = 0;
+  int pageFull = FALSE;
+
+  resetBuffer(data);
+  ssize_t length = getdents64(list->fd, server->direntBuffer, LISTING_BATCH_SIZE);
+  if (length <= 0) {
+    if (length < 0) {
+      logMessage(LOG_ERROR, "ERROR reading directory: %s", strerror(errno));
+    }
+    stopListingStream(server, session, length == 0);
+    endListing(session, FALSE, 0);
+    return;
+  }
+
+  size_t start = beginFrame(data, FRAME_DATA, STATUS_OK, session->request.id);
+  unsigned char offset[DATA_OFFSET_LENGTH];
+  putUint64(offset, list->sent);
+  appendBuffer(data, offset, DATA_OFFSET_LENGTH);
+  size_t entriesStart = data->length;
+  ssize_t position = 0;
+  while (position < length && !pageFull) {
+    struct dirent64* entry = (struct dirent64*)(server->direntBuffer + position);
+    position += entry->d_reclen;
+    int matches = matchesRequest(&session->request, entry->d_name);
+    if (!matches && list->build == NULL) {
+      continue;
+    }
+    // skip entries removed since they were read
+    if (fstatat(list->fd, entry->d_name, &entryInfo, AT_SYMLINK_NOFOLLOW) < 0) {
+      continue;
+    }
+    if (list->build != NULL) {
+      appendCachedEntry(&list->build->entries, entry, &entryInfo);
+      if (list->build->entries.length > MAX_CACHED_LISTING_SIZE) {
+        finishListing(server, list->build, FALSE);
+        list->build = NULL;
+      }
+    }
+    if (matches) {
+      appendEntry(data, &entryInfo, entry->d_name, strlen(entry->d_name));
+      if (list->remaining > 0 && --list->remaining == 0) {
+        pageFull = TRUE;
+        cursor = entry->d_off;
+      }
+    }
+  }
+
+  if (data->length == entriesStart) {
+    // nothing in this batch matched
+    data->length = start;
+  }
+  else {
+    list->sent += data->length - entriesStart;
+    finishDataFrame(session, data, start);
+  }
+  if (pageFull) {
+    stopListingStream(server, session, FALSE);
+    endListing(session, TRUE, cursor);
+  }
+}
+
+
+/*******************************************************************************
+ *      void sendDirectoryContents(struct server*, struct session* session)
+ * Description: This function queues a listing of the files in the current
+ *   directory to be sent to ftclient on connection Q. Each entry carries its
+ *   type, size and modification time. The request may ask for only the
+ *   names matching a glob, for a sort order and for one page of entries.
+ *   Unsorted listings of directories that aren't cached are streamed from
+ *   the directory as they are read. Sorted listings need the whole
+ *   directory, which comes from the worker's cache when the directory is
+ *   unchanged since it was last listed, and is cached otherwise
+ * Input:
+ *   struct server* server - the worker owning the cache
+ *   struct session* session - the session requesting the listing
+ * Output:
+ *   none
+*******************************************************************************/
+void sendDirectoryContents(struct server* server, struct session* session) {
+  struct request* request = &session->request;
+  char path[PATH_MAX];
+  struct listing* listing = NULL;
+
+  logMessage(LOG_DEBUG, "List directory requested on port %d", session->hostPort);
+  if (!directoryPath(session->directoryFD, path, sizeof(path))) {
+    queueResponse(session, STATUS_IO_ERROR, "Error opening directory");
+    return;
+  }
+  startChecksum(session);
+  if (chooseCompression(session) != COMPRESS_NONE) {
+    startCompressor(session, &session->stripes[0]);
+  }
+  if (server->inotify.fd >= 0) {
+    // apply changes that are queued but not yet seen by the event loop
+    handleDirectoryChanges(server);
+    listing = findListing(server, path);
+  }
+
+  if (listing != NULL && !listing->building) {
+    sendListingPage(session, &listing->entries);
+  }
+  else if (request->sort == SORT_NONE || (listing != NULL && listing->building)) {
+    if (request->sort != SORT_NONE) {
+      // another session is still collecting this directory, so read it here
+      struct buffer scratch;
+      memset(&scratch, '\0', sizeof(scratch));
+      int success = readListing(server, session->directoryFD, &scratch);
+      if (success) {
+        sendListingPage(session, &scratch);
+      }
+      freeBuffer(&scratch);
+      if (!success) {
+        queueResponse(session, STATUS_IO_ERROR, "Error opening directory");
+        return;
+      }
+    }
+    else if (!startListingStream(server, session, path)) {
+      queueResponse(session, STATUS_IO_ERROR, "Error opening directory");
+      return;
+    }
+  }
+  else {
+    struct buffer scratch;
+    struct buffer* entries = &scratch;
+    memset(&scratch, '\0', sizeof(scratch));
+    if (LISTING_CACHE_ENTRIES > 0 && server->inotify.fd >= 0) {
+      listing = addListing(server, path);
+    }
+    if (listing != NULL) {
+      entries = &listing->entries;
+    }
+    int success = readListing(server, session->directoryFD, entries);
+    if (success) {
+      sendListingPage(session, entries);
+    }
+    if (listing != NULL) {
+      finishListing(server, listing, success && entries->length <= MAX_CACHED_LISTING_SIZE);
+    }
+    freeBuffer(&scratch);
+    if (!success) {
+      queueResponse(session, STATUS_IO_ERROR, "Error opening directory");
+      return;
+    }
+  }
+
+  logMessage(LOG_INFO, "Sending directory contents to %s:%d", session->clientIP, session->clientPort);
+  queueResponse(session, STATUS_OK, NULL);
+}
+
+
+/*******************************************************************************
+ *          void queueExtent(struct session*, struct stripe* stripe)
+ * sources cited: https://man7.org/linux/man-pages/man2/lseek.2.html
+ *
+ * Description: prepares a stripe of a sparse file to send its next extent of
+ *   data, found from the stripe's offset with SEEK_DATA and SEEK_HOLE. The
+ *   hole before it is queued as a HOLE frame and added to the digest as the
+ *   zeros it reads as, then the extent is queued as a DATA frame. Holes
+ *   shorter than MIN_HOLE_LENGTH are sent as part of the extent
+ * Input:
+ *   struct session* session - the session sending the file
+ *   struct stripe* stripe - the stripe, with offset at the end of the last
+ *     extent
+ * Output: none
+*******************************************************************************/
+void queueExtent(struct session* session, struct stripe* stripe) {
+  int fileFD = session->fileFD;
+  off_t data = lseek(fileFD, stripe->offset, SEEK_DATA);
+  if (data < 0) {
+    // ENXIO means there is only a hole left; anything else is sent as data
+    data = errno == ENXIO ? stripe->end : stripe->offset;
+  }
+  data = min(data, stripe->end);
+  if (stripe->headerSent == stripe->headerLength) {
+    stripe->headerLength = 0;
+    stripe->headerSent = 0;
+  }
+
+  if (data > stripe->offset) {
+    unsigned char* header = stripe->header + stripe->headerLength;
+    putFrameHeader(header, FRAME_HOLE, STATUS_OK, session->request.id, HOLE_PAYLOAD_LENGTH);
+    putUint64(header + FRAME_HEADER_LENGTH, stripe->offset);
+    putUint64(header + FRAME_HEADER_LENGTH + 8, data - stripe->offset);
+    stripe->headerLength += FRAME_HEADER_LENGTH + HOLE_PAYLOAD_LENGTH;
+    if (stripe->checksum && !stripe->digestKnown) {
+      stripe->digest = crc32Zeros(stripe->digest, data - stripe->offset);
+    }
+    countMetric(&WORKER_METRICS->holeBytes, data - stripe->offset);
+    stripe->offset = data;
+  }
+
+  off_t dataEnd = data;
+  while (dataEnd < stripe->end) {
+    off_t hole = lseek(fileFD, dataEnd, SEEK_HOLE);
+    if (hole < 0 || hole >= stripe->end) {
+      dataEnd = stripe->end;
+      break;
+    }
+    off_t next = lseek(fileFD, hole, SEEK_DATA);
+    next = next < 0 ? stripe->end : min(next, stripe->end);
+    if (next - hole >= MIN_HOLE_LENGTH) {
+      dataEnd = hole;
+      break;
+    }
+    dataEnd = next;
+  }
+  stripe->dataEnd = dataEnd;
+  if (data < stripe->end) {
+    queueData(session, stripe, data, dataEnd - data);
+  }
+}
+
+
+/*******************************************************************************
+ *      void splitRange(struct server*, struct session*, off_t, off_t)
+ * Description: divides the bytes [start, end) of the file between the
+ *   session's stripes. Every stripe but the last gets the same share, rounded
+ *   up to STRIPE_ALIGNMENT bytes. Each stripe's frames are built: stripes
+ *   after the first announce their index in a STRIPE frame, then every stripe
+ *   sends its share as one DATA frame
+ * Input:
+ *   struct server* server - the event loop, which picks the transmit method
+ *   struct session* session - the session sending the file
+ *   off_t start - the first byte to send
+ *   off_t end - one past the last byte to send
+ * Output: none
+*******************************************************************************/
+void splitRange(struct server* server, struct session* session, off_t start, off_t end) {
+  off_t share = (end - start + session->stripeCount - 1) / session->stripeCount;
+  share = (share + STRIPE_ALIGNMENT - 1) / STRIPE_ALIGNMENT * STRIPE_ALIGNMENT;
+  int i;
+  for (i = 0; i < session->stripeCount; i++) {
+    struct stripe* stripe = &session->stripes[i];
+    stripe->offset = min(start + i * share, end);
+    stripe->end = min(stripe->offset + share, end);
+    stripe->dataEnd = stripe->end;
+    stripe->method = session->cachedFile != NULL ? TRANSMIT_MEMORY : server->transmitMethod;
+    stripe->headerLength = 0;
+    if (i > 0) {
+      putFrameHeader(stripe->header, FRAME_STRIPE, STATUS_OK, session->request.id,
+                     ATTRIBUTE_HEADER_LENGTH + 2);
+      putUint16(stripe->header + FRAME_HEADER_LENGTH, ATTR_STRIPE_INDEX);
+      putUint32(stripe->header + FRAME_HEADER_LENGTH + 2, 2);
+      putUint16(stripe->header + FRAME_HEADER_LENGTH + ATTRIBUTE_HEADER_LENGTH, i);
+      stripe->headerLength = FRAME_HEADER_LENGTH + ATTRIBUTE_HEADER_LENGTH + 2;
+    }
+    if (session->sparse) {
+      queueExtent(session, stripe);
+    }
+    else if (!stripe->compressFile) {
+      queueData(session, stripe, stripe->offset, stripe->end - stripe->offset);
+    }
+  }
+}
+
+
+/*******************************************************************************
+ *                int openStripes(struct server*, struct session*)
+ * Description: connects the extra connections Q of a striped get. They finish
+ *   connecting in the event loop. In passive mode they are left for ftclient
+ *   to connect instead
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session with stripeCount set
+ * Output: TRUE on success. On failure the stripes already opened are closed
+ *   and FALSE is returned
+*******************************************************************************/
+int openStripes(struct server* server, struct session* session) {
+  int i;
+  for (i = 1; i < session->stripeCount; i++) {
+    struct stripe* stripe = &session->stripes[i];
+    if (session->dataListener.fd >= 0) {
+      // in passive mode ftclient connects the stripes
+      stripe->accepting = TRUE;
+      continue;
+    }
+    stripe->q.fd = openConnectionQ(&session->clientAddress, session->clientAddressLength,
+                                   session->clientPort);
+    if (stripe->q.fd < 0) {
+      while (--i > 0) {
+        setInterest(server, &session->stripes[i].q, 0);
+        close(session->stripes[i].q.fd);
+        session->stripes[i].q.fd = -1;
+      }
+      session->stripeCount = 1;
+      return FALSE;
+    }
+    setInterest(server, &stripe->q, EPOLLOUT);
+  }
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ *    int startDelta(struct session* session, off_t fileSize)
+ * sources cited: Tridgell and Mackerras, "The rsync algorithm", 1996
+ *
+ * Description: sets up a delta get from the block signatures in the request.
+ *   Each block's signature is added to a hash table keyed by its Adler-32
+ * Input:
+ *   struct session* session - the session requesting the file
+ *   off_t fileSize - the size of the file to scan
+ * Output: TRUE if the signatures are valid
+*******************************************************************************/
+int startDelta(struct session* session, off_t fileSize) {
+  struct request* request = &session->request;
+  uint32_t i;
+  if (request->blockSize < DELTA_MIN_BLOCK_SIZE || request->blockSize > DELTA_MAX_BLOCK_SIZE ||
+      request->signatureLength % DELTA_SIGNATURE_LENGTH != 0 ||
+      request->signatureLength / DELTA_SIGNATURE_LENGTH > DELTA_MAX_BLOCKS) {
+    return FALSE;
+  }
+  struct deltaScan* delta = calloc(1, sizeof(struct deltaScan));
+  assert(delta != NULL);
+  delta->blockSize = request->blockSize;
+  delta->blockCount = request->signatureLength / DELTA_SIGNATURE_LENGTH;
+  delta->weak = malloc(delta->blockCount * sizeof(uint32_t) + 1);
+  delta->strong = malloc(delta->blockCount * sizeof(uint32_t) + 1);
+  delta->next = malloc(delta->blockCount * sizeof(int32_t) + 1);
+  delta->heads = malloc(sizeof(int32_t) << DELTA_HASH_BITS);
+  delta->windowCapacity = DELTA_LITERAL_LIMIT + 2 * (size_t)delta->blockSize;
+  delta->window = malloc(delta->windowCapacity);
+  assert(delta->weak != NULL && delta->strong != NULL && delta->next != NULL &&
+         delta->heads != NULL && delta->window != NULL);
+  memset(delta->heads, 0xff, sizeof(int32_t) << DELTA_HASH_BITS);
+  for (i = 0; i < delta->blockCount; i++) {
+    unsigned char* signature = request->signatures + i * DELTA_SIGNATURE_LENGTH;
+    delta->weak[i] = getUint(signature, 4);
+    delta->strong[i] = getUint(signature + 4, 4);
+    uint32_t bucket = (delta->weak[i] * 2654435761U) >> (32 - DELTA_HASH_BITS);
+    delta->next[i] = delta->heads[bucket];
+    delta->heads[bucket] = i;
+  }
+  delta->end = fileSize;
+  session->delta = delta;
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ *                 void stopDelta(struct session* session)
+ * Description: releases the scan of a delta get
+ * Input: struct session* session - the session that was sending the file
+ * Output: none
+*******************************************************************************/
+void stopDelta(struct session* session) {
+  struct deltaScan* delta = session->delta;
+  if (delta == NULL) {
+    return;
+  }
+  free(delta->weak);
+  free(delta->strong);
+  free(delta->next);
+  free(delta->heads);
+  free(delta->window);
+  free(delta);
+  session->delta = NULL;
+}
+
+
+/*******************************************************************************
+ *  int32_t findBlock(struct deltaScan*, uint32_t weak, unsigned char* bytes)
+ * Description: looks for a block of ftclient's copy that matches the bytes at
+ *   the scan position. A block whose Adler-32 matches is confirmed with its
+ *   CRC-32. The block already at the position is preferred, then one that
+ *   extends the pending copy
+ * Input:
+ *   struct deltaScan* delta - the scan
+ *   uint32_t weak - the Adler-32 of the bytes
+ *   unsigned char* bytes - blockSize bytes of the file at the scan position
+ * Output: the index of the matching block, or -1 if there is none
+*******************************************************************************/
+int32_t findBlock(struct deltaScan* delta, uint32_t weak, unsigned char* bytes) {
+  uint32_t bucket = (weak * 2654435761U) >> (32 - DELTA_HASH_BITS);
+  uint32_t strong = 0;
+  int hashed = FALSE;
+  int32_t found = -1;
+  int32_t i;
+  for (i = delta->heads[bucket]; i >= 0; i = delta->next[i]) {
+    off_t source = (off_t)i * delta->blockSize;
+    // a block before the scan position may already have been overwritten
+    if (delta->weak[i] != weak || source < delta->position) {
+      continue;
+    }
+    if (!hashed) {
+      strong = crc32Update(0, bytes, delta->blockSize);
+      hashed = TRUE;
+    }
+    if (delta->strong[i] != strong) {
+      continue;
+    }
+    if (source == delta->position ||
+        (delta->copyLength > 0 && source == delta->copySource + delta->copyLength)) {
+      return i;
+    }
+    if (found < 0) {
+      found = i;
+    }
+  }
+  return found;
+}
+
+
+/*******************************************************************************
+ *  off_t rollChecksum(struct deltaScan*, const unsigned char* bytes,
+ *                     off_t count)
+ * Description: rolls the Adler-32 of the block at the scan position on one
+ *   byte at a time until it equals the Adler-32 of one of ftclient's
+ *   blocks. Most positions in a changed region match nothing, so they are
+ *   skipped here in a tight loop. Like crc32Pclmul(), this loop runs once
+ *   per byte and is optimized even in a debug build
+ * Input:
+ *   struct deltaScan* delta - the scan, whose a and b hold the checksum of
+ *     the block at bytes
+ *   const unsigned char* bytes - the file at the scan position, with at
+ *     least count + blockSize bytes available
+ *   off_t count - the most bytes to roll on by
+ * Output: the number of bytes rolled. a and b hold the checksum there
+*******************************************************************************/
+__attribute__((optimize("O2")))
+off_t rollChecksum(struct deltaScan* delta, const unsigned char* bytes, off_t count) {
+  uint32_t a = delta->a;
+  uint32_t b = delta->b;
+  uint32_t blockSize = delta->blockSize % ADLER_BASE;
+  off_t rolled = 0;
+  for (; rolled < count; rolled++) {
+    uint32_t weak = b << 16 | a;
+    int32_t i = delta->heads[(weak * 2654435761U) >> (32 - DELTA_HASH_BITS)];
+    while (i >= 0 && delta->weak[i] != weak) {
+      i = delta->next[i];
+    }
+    if (i >= 0) {
+      break;
+    }
+    uint32_t out = bytes[rolled];
+    uint32_t in = bytes[rolled + delta->blockSize];
+    a = (a + ADLER_BASE - out + in) % ADLER_BASE;
+    b = (b + 2 * ADLER_BASE - blockSize * out % ADLER_BASE + a - 1) % ADLER_BASE;
+  }
+  delta->a = a;
+  delta->b = b;
+  return rolled;
+}
+
+
+/*******************************************************************************
+ *                void queueDeltaCopy(struct session* session)
+ * Description: queues the pending copy of a delta get as a COPY frame: the
+ *   offset to write at, the offset in ftclient's copy to read from and the
+ *   length
+ * Input: struct session* session - the session sending the file
+ * Output: none
+*******************************************************************************/
+void queueDeltaCopy(struct session* session) {
+  struct deltaScan* delta = session->delta;
+  unsigned char copy[3 * 8];
+  if (delta->copyLength == 0) {
+    return;
+  }
+  size_t start = beginFrame(&session->data, FRAME_COPY, STATUS_OK, session->request.id);
+  putUint64(copy, delta->copyTarget);
+  putUint64(copy + 8, delta->copySource);
+  putUint64(copy + 16, delta->copyLength);
+  appendBuffer(&session->data, copy, sizeof(copy));
+  finishFrame(&session->data, start);
+  delta->copied += delta->copyLength;
+  delta->copyLength = 0;
+}
+
+
+/*******************************************************************************
+ *              void queueDeltaLiteral(struct session* session)
+ * Description: queues the bytes between the last copy and the scan position
+ *   as a DATA frame, after the pending copy that comes before them
+ * Input: struct session* session - the session sending the file
+ * Output: none
+*******************************************************************************/
+void queueDeltaLiteral(struct session* session) {
+  struct deltaScan* delta = session->delta;
+  unsigned char offset[DATA_OFFSET_LENGTH];
+  if (delta->position == delta->literalStart) {
+    return;
+  }
+  queueDeltaCopy(session);
+  size_t start = beginFrame(&session->data, FRAME_DATA, STATUS_OK, session->request.id);
+  putUint64(offset, delta->literalStart);
+  appendBuffer(&session->data, offset, DATA_OFFSET_LENGTH);
+  appendBuffer(&session->data, delta->window + (delta->literalStart - delta->windowStart),
+               delta->position - delta->literalStart);
+  finishDataFrame(session, &session->data, start);
+  delta->literal += delta->position - delta->literalStart;
+  delta->literalStart = delta->position;
+}
+
+
+/*******************************************************************************
+ *              int fillDeltaWindow(struct session* session)
+ * Description: moves the pending literal to the front of the window and
+ *   reads as much of the rest of the file after it as fits. A literal that
+ *   has grown to DELTA_LITERAL_LIMIT bytes is queued first
+ * Input: struct session* session - the session sending the file
+ * Output: TRUE on success, FALSE if the file could not be read
+*******************************************************************************/
+int fillDeltaWindow(struct session* session) {
+  struct deltaScan* delta = session->delta;
+  if (delta->position - delta->literalStart >= DELTA_LITERAL_LIMIT) {
+    queueDeltaLiteral(session);
+  }
+  size_t keep = delta->windowStart + delta->windowLength - delta->literalStart;
+  memmove(delta->window, delta->window + (delta->literalStart - delta->windowStart), keep);
+  delta->windowStart = delta->literalStart;
+  delta->windowLength = keep;
+  ssize_t readAmt = pread(session->fileFD, delta->window + keep, delta->windowCapacity - keep,
+                          delta->windowStart + keep);
+  if (readAmt <= 0) {
+    logMessage(LOG_ERROR, "ERROR: file send error: %s", readAmt < 0 ? strerror(errno) : "file truncated");
+    countMetric(&WORKER_METRICS->fileErrors, 1);
+    return FALSE;
+  }
+  delta->windowLength += readAmt;
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ *                 int streamDelta(struct session* session)
+ * Description: scans the next part of a delta get's file, queueing COPY
+ *   frames for the blocks ftclient already has and DATA frames for the rest.
+ *   At each position the rolling Adler-32 of the next block is looked up;
+ *   on a match the scan jumps a whole block, otherwise it rolls on by one
+ *   byte. Fewer than a block's worth of bytes at the end are sent as they
+ *   are. Each call scans at most DELTA_SCAN_LIMIT bytes
+ * Input: struct session* session - the session sending the file
+ * Output: TRUE on success, FALSE if the file could not be read
+*******************************************************************************/
+int streamDelta(struct session* session) {
+  struct deltaScan* delta = session->delta;
+  struct buffer* data = &session->data;
+  off_t scanned = 0;
+  off_t blockSize = delta->blockSize;
+
+  resetBuffer(data);
+  while (!delta->done && scanned < DELTA_SCAN_LIMIT && data->length < DELTA_LITERAL_LIMIT) {
+    off_t windowEnd = delta->windowStart + delta->windowLength;
+    if (windowEnd < delta->end && delta->position + blockSize >= windowEnd) {
+      if (!fillDeltaWindow(session)) {
+        return FALSE;
+      }
+      continue;
+    }
+    if (delta->blockCount == 0 || delta->position + blockSize > delta->end) {
+      delta->position = delta->end;
+      queueDeltaLiteral(session);
+      queueDeltaCopy(session);
+      delta->done = TRUE;
+      break;
+    }
+
+    unsigned char* block = (unsigned char*)delta->window + (delta->position - delta->windowStart);
+    if (!delta->rolling) {
+      uint32_t adler = adler32(1, block, blockSize);
+      delta->a = adler & 0xffff;
+      delta->b = adler >> 16;
+      delta->rolling = TRUE;
+    }
+    else {
+      // skip ahead to the next position that may match
+      off_t rolled = rollChecksum(delta, block, min(windowEnd - delta->position - blockSize - 1,
+                                                    DELTA_SCAN_LIMIT - scanned));
+      delta->position += rolled;
+      scanned += rolled;
+      block += rolled;
+    }
+    int32_t match = findBlock(delta, delta->b << 16 | delta->a, block);
+    if (match >= 0) {
+      off_t source = (off_t)match * blockSize;
+      queueDeltaLiteral(session);
+      if (delta->copyLength > 0 && source != delta->copySource + delta->copyLength) {
+        queueDeltaCopy(session);
+      }
+      if (delta->copyLength == 0) {
+        delta->copyTarget = delta->position;
+        delta->copySource = source;
+      }
+      delta->copyLength += blockSize;
+      updateDigest(&session->stripes[0], block, blockSize);
+      delta->position += blockSize;
+      delta->literalStart = delta->position;
+      delta->rolling = FALSE;
+      scanned += blockSize;
+    }
+    else if (delta->position + blockSize == delta->end) {
+      delta->position++;
+    }
+    else {
+      // roll the checksum on by one byte
+      uint32_t out = block[0];
+      uint32_t in = block[blockSize];
+      delta->a = (delta->a + ADLER_BASE - out + in) % ADLER_BASE;
+      delta->b = (delta->b + ADLER_BASE - (uint32_t)(blockSize * out % ADLER_BASE) +
+                  delta->a + ADLER_BASE - 1) % ADLER_BASE;
+      delta->position++;
+      scanned++;
+    }
+  }
+
+  if (delta->done) {
+    logMessage(LOG_INFO, "Delta of \"%s\" to %s:%d: %llu Bytes copied from the client's copy, %llu Bytes sent",
+               session->request.name, session->clientIP, session->clientPort,
+               (unsigned long long)delta->copied, (unsigned long long)delta->literal);
+  }
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ *          void sendFile(struct server* server, struct session* session)
+ * sources cited: https://www.programmingsimplified.com/c-program-read-file
+ *                https://stackoverflow.com/questions/25634483/send-binary-file-over-tcp-ip-connection
+ *
+ * Description: this function opens a file to be sent over connection Q to
+ *   ftclient. The file is opened read-only; the event loop then hands it to
+ *   the kernel in CHUNK_SIZE pieces with transmitChunk() whenever connection Q
+ *   is writable. Only the requested range is sent, divided between the
+ *   requested number of stripes. The response tells ftclient the size of the
+ *   file and the range it will receive before any data arrives. If ftclient
+ *   sent the block signatures of its old copy, only a delta against it is
+ *   sent
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session requesting the file
+ * Output:
+ *   none
+ * Preconditions:
+ *   - connectionP and connectionQ have been established
+ * Postconditions:
+ *   - the file is open on session->fileFD and an OK response is queued, or an
+ *     error response is queued if the file cannot be sent
+*******************************************************************************/
+void sendFile(struct server* server, struct session* session) {
+  struct request* request = &session->request;
+  logMessage(LOG_DEBUG, "File \"%s\" requested on port %d.", request->name, session->hostPort);
+
+  if (((request->offset != 0 || request->length != 0) && !(session->capabilities & CAP_RANGE)) ||
+      (request->stripes > 1 && !(session->capabilities & CAP_STRIPES))) {
+    queueResponse(session, STATUS_UNSUPPORTED, "Ranged and striped gets were not negotiated");
+    return;
+  }
+  if (request->stripes < 1 || request->stripes > MAX_STRIPES ||
+      request->offset < 0 || request->length < 0) {
+    queueResponse(session, STATUS_BAD_REQUEST, "Invalid range");
+    return;
+  }
+  // a range whose end doesn't fit in an off_t can't be in any file
+  if (request->length > INT64_MAX - request->offset) {
+    queueResponse(session, STATUS_INVALID_RANGE, "Invalid range");
+    return;
+  }
+  int delta = request->signatures != NULL && (session->capabilities & CAP_DELTA);
+  if (delta && (request->offset != 0 || request->length != 0 || request->stripes != 1)) {
+    queueResponse(session, STATUS_BAD_REQUEST, "Delta gets cannot be ranged or striped");
+    return;
+  }
+
+  struct stat fileInfo;
+  // open the file to be sent read-only, or find it in the file cache. Only
+  // whole files are added to the cache
+  int fileFD = openRequestedFile(server, session, request->name, &fileInfo,
+                                 request->offset == 0 && request->length == 0);
+  // send an error message if the file cannot be sent
+  if(fileFD < 0) {
+    logMessage(LOG_INFO, "Requested file not found. Sending error message to %s:%d", session->clientIP, session->hostPort);
+    queueResponse(session, STATUS_NOT_FOUND, "File not found");
+    return;
+  }
+  if (request->offset > fileInfo.st_size) {
+    logMessage(LOG_INFO, "Requested range is outside the file. Sending error message to %s:%d", session->clientIP, session->hostPort);
+    queueResponse(session, STATUS_INVALID_RANGE, "Invalid range");
+    releaseFile(session, fileFD);
+    return;
+  }
+  session->stripeCount = request->stripes;
+  if (!openStripes(server, session)) {
+    queueResponse(session, STATUS_IO_ERROR, "Could not connect the stripes");
+    releaseFile(session, fileFD);
+    return;
+  }
+  if (delta && !startDelta(session, fileInfo.st_size)) {
+    queueResponse(session, STATUS_BAD_REQUEST, "Invalid block signatures");
+    releaseFile(session, fileFD);
+    return;
+  }
+
+  // otherwise the event loop sends the file in chunks until it's all sent
+  off_t end = fileInfo.st_size;
+  // compared without adding, as offset + length can overflow
+  if (request->length > 0 && request->length < fileInfo.st_size - request->offset) {
+    end = request->offset + request->length;
+  }
+  session->fileFD = fileFD;
+  session->fileSize = fileInfo.st_size;
+  session->fileInfo = fileInfo;
+  // a delta is always checked, since ftclient rebuilds it from two sources.
+  // A repeat get of a whole file on one stripe needn't be hashed again
+  if (delta) {
+    request->checksum = CHECKSUM_CRC32;
+  }
+  startChecksum(session);
+  if (session->stripes[0].checksum && request->offset == 0 && end == fileInfo.st_size) {
+    if (session->stripeCount == 1 && lookupDigest(&fileInfo, &session->stripes[0].digest)) {
+      session->stripes[0].digestKnown = TRUE;
+    }
+    else {
+      session->cacheDigest = TRUE;
+    }
+  }
+  // a file with fewer blocks than its size has holes, which are described
+  // rather than read and sent. It isn't compressed, since deflating the
+  // zeros would cost more than skipping them
+  struct cachedFile* cached = session->cachedFile;
+  session->sparse = (session->capabilities & CAP_SPARSE) && !delta && cached == NULL &&
+                    fileInfo.st_blocks * 512 < fileInfo.st_size;
+  // compress only what is likely to shrink. A cached file's entropy is
+  // sampled once
+  int compression = session->sparse ? COMPRESS_NONE : chooseCompression(session);
+  if (compression != COMPRESS_NONE && cached != NULL && request->offset == 0 && end == fileInfo.st_size) {
+    if (cached->entropy < 0) {
+      cached->entropy = sampleEntropy(fileFD, 0, end);
+    }
+    if (cached->entropy >= COMPRESSION_ENTROPY_LIMIT) {
+      compression = COMPRESS_NONE;
+    }
+  }
+  else if (compression != COMPRESS_NONE &&
+           sampleEntropy(fileFD, request->offset, end) >= COMPRESSION_ENTROPY_LIMIT) {
+    compression = COMPRESS_NONE;
+  }
+  int i;
+  for (i = 0; i < session->stripeCount && compression != COMPRESS_NONE; i++) {
+    startCompressor(session, &session->stripes[i]);
+    session->stripes[i].compressFile = !delta;
+  }
+  if (!delta) {
+    splitRange(server, session, request->offset, end);
+  }
+
+  size_t start = beginFrame(&session->reply, FRAME_RESPONSE, STATUS_OK, request->id);
+  addUintAttribute(&session->reply, ATTR_FILE_SIZE, session->fileSize, 8);
+  addUintAttribute(&session->reply, ATTR_OFFSET, request->offset, 8);
+  addUintAttribute(&session->reply, ATTR_LENGTH, end - request->offset, 8);
+  addUintAttribute(&session->reply, ATTR_STRIPES, session->stripeCount, 2);
+  addUintAttribute(&session->reply, ATTR_COMPRESSION, compression, 1);
+  if (session->stripes[0].checksum) {
+    addUintAttribute(&session->reply, ATTR_CHECKSUM, CHECKSUM_CRC32, 1);
+  }
+  if (delta) {
+    addUintAttribute(&session->reply, ATTR_BLOCK_SIZE, session->delta->blockSize, 4);
+  }
+  finishFrame(&session->reply, start);
+
+  logMessage(LOG_INFO, "Sending %sbytes %ld-%ld of \"%s\" (%ld Bytes%s) to %s:%d on %d stripe(s)",
+             delta ? "a delta of " : "", (long)request->offset, (long)end, request->name, (long)session->fileSize,
+             session->sparse ? ", sparse" : "", session->clientIP, session->clientPort, session->stripeCount);
+  if (cached == NULL) {
+    posix_fadvise(fileFD, request->offset, end - request->offset,
+                  session->stripeCount > 1 ? POSIX_FADV_NORMAL : POSIX_FADV_SEQUENTIAL);
+  }
+}
+
+
+/*******************************************************************************
+ *                  void receiveFile(struct session* session)
+ * Description: accepts a PUT. The file is uploaded into a temporary file in
+ *   the working directory, made as big as ftclient says the file is up
+ *   front, so that a full disk is reported before any data is sent and the
+ *   file isn't fragmented as it grows. Once the OK response reaches ftclient
+ *   it sends the file on connection Q
+ * Input: struct session* session - the session making the request
+ * Output: none
+ * Postconditions: session->upload is waiting for the file and an OK response
+ *   is queued, or an error response is queued
+*******************************************************************************/
+void receiveFile(struct session* session) {
+  struct request* request = &session->request;
+  struct stat targetInfo;
+  mode_t mode = 0644;
+  logMessage(LOG_DEBUG, "Upload of \"%s\" requested on port %d.", request->name, session->hostPort);
+
+  if (!(session->capabilities & CAP_PUT)) {
+    queueResponse(session, STATUS_UNSUPPORTED, "Uploads were not negotiated");
+    return;
+  }
+  // uploads only go into the session's directory
+  if (request->name[0] == '\0' || strchr(request->name, '/') != NULL ||
+      strlen(request->name) > MAX_FILE_NAME_LENGTH ||
+      strcmp(request->name, ".") == 0 || strcmp(request->name, "..") == 0) {
+    queueResponse(session, STATUS_BAD_REQUEST, "Invalid file name");
+    return;
+  }
+  if (request->fileSize < 0) {
+    queueResponse(session, STATUS_BAD_REQUEST, "Invalid file size");
+    return;
+  }
+  if (fstatat(session->directoryFD, request->name, &targetInfo, AT_SYMLINK_NOFOLLOW) == 0) {
+    if (!S_ISREG(targetInfo.st_mode)) {
+      queueResponse(session, STATUS_BAD_REQUEST, "Only a regular file can be replaced");
+      return;
+    }
+    mode = targetInfo.st_mode & 07777;
+  }
+
+  struct upload* upload = calloc(1, sizeof(struct upload));
+  assert(upload != NULL);
+  strcpy(upload->path, UPLOAD_TEMPLATE);
+  upload->fd = createTemporary(session->directoryFD, upload->path);
+  upload->pipeFDs[0] = -1;
+  upload->pipeFDs[1] = -1;
+  upload->size = request->fileSize;
+  session->upload = upload;
+  if (upload->fd < 0) {
+    upload->path[0] = '\0';
+    queueResponse(session, STATUS_IO_ERROR, "Could not create the file");
+    return;
+  }
+  fchmod(upload->fd, mode);
+  if (upload->size > 0 && fallocate(upload->fd, 0, 0, upload->size) != 0 &&
+      errno != EOPNOTSUPP && errno != ENOSYS) {
+    queueResponse(session, STATUS_IO_ERROR, errno == ENOSPC ? "Not enough space for the file" :
+                                                             "Could not create the file");
+    return;
+  }
+  if (pipe2(upload->pipeFDs, O_CLOEXEC) != 0) {
+    queueResponse(session, STATUS_IO_ERROR, "Could not receive the file");
+    return;
+  }
+  // a bigger pipe moves more per splice; the default is 64 KiB
+  fcntl(upload->pipeFDs[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+
+  startChecksum(session);
+  upload->checksum = session->stripes[0].checksum;
+  queueResponse(session, STATUS_OK, NULL);
+  logMessage(LOG_INFO, "Receiving \"%s\" (%ld Bytes) from %s:%d", request->name, (long)upload->size,
+             session->clientIP, session->clientPort);
+}
+
+
+/*******************************************************************************
+ *                   void stopUpload(struct session* session)
+ * Description: frees a session's upload, removing its temporary file unless
+ *   it has already replaced the target
+ * Input: struct session* session - the session
+ * Output: none
+*******************************************************************************/
+void stopUpload(struct session* session) {
+  struct upload* upload = session->upload;
+  if (upload == NULL) {
+    return;
+  }
+  if (upload->fd >= 0) {
+    close(upload->fd);
+  }
+  if (upload->pipeFDs[0] >= 0) {
+    close(upload->pipeFDs[0]);
+    close(upload->pipeFDs[1]);
+  }
+  if (upload->path[0] != '\0') {
+    unlinkat(session->directoryFD, upload->path, 0);
+  }
+  free(upload);
+  session->upload = NULL;
+}
+
+
+/*******************************************************************************
+ *           int receivingUpload(struct session* session)
+ * Description: tells whether a session is waiting for an upload to arrive
+ *   on connection Q
+ * Input: struct session* session - the session
+ * Output: TRUE until the upload's END frame has been read
+*******************************************************************************/
+int receivingUpload(struct session* session) {
+  return session->upload != NULL && session->upload->pipeFDs[0] >= 0 && !session->upload->done;
+}
+
+
+/*******************************************************************************
+ *        int drainUploadPipe(struct server*, struct upload* upload)
+ * Description: moves the bytes waiting in an upload's pipe into its file at
+ *   the current offset. If the upload asked for a checksum they are read back
+ *   from the page cache they were just written to and hashed. Once a write
+ *   has failed, the bytes are read out of the pipe and dropped
+ * Input:
+ *   struct server* server - the event loop, whose copy buffer is used
+ *   struct upload* upload - the upload
+ * Output: none
+*******************************************************************************/
+void drainUploadPipe(struct server* server, struct upload* upload) {
+  while (upload->piped > 0) {
+    off_t offset = upload->offset;
+    ssize_t moved;
+    if (upload->failed) {
+      moved = read(upload->pipeFDs[0], server->copyBuffer, min(upload->piped, CHUNK_SIZE));
+      if (moved <= 0 && errno != EINTR) {
+        // the pipe can't fail while it holds bytes, but never spin on it
+        upload->piped = 0;
+      }
+      upload->piped -= moved > 0 ? moved : 0;
+      continue;
+    }
+    moved = splice(upload->pipeFDs[0], NULL, upload->fd, &upload->offset, upload->piped, SPLICE_F_MOVE);
+    if (moved <= 0) {
+      if (moved < 0 && errno == EINTR) {
+        continue;
+      }
+      upload->failed = moved < 0 ? errno : EIO;
+      continue;
+    }
+    upload->piped -= moved;
+    while (upload->checksum && offset < upload->offset) {
+      ssize_t readAmt = pread(upload->fd, server->copyBuffer, min(upload->offset - offset, CHUNK_SIZE), offset);
+      if (readAmt <= 0) {
+        upload->failed = readAmt < 0 ? errno : EIO;
+        break;
+      }
+      upload->digest = crc32Update(upload->digest, server->copyBuffer, readAmt);
+      offset += readAmt;
+    }
+  }
+}
+
+
+/*******************************************************************************
+ *     void finishUpload(struct session*, unsigned char* attributes, size_t)
+ * Description: completes an upload once its END frame has arrived. If every
+ *   byte arrived and was written, and matches ftclient's CRC-32 if it sent
+ *   one, the temporary file is renamed over the target. Either way ftserver
+ *   answers with an END frame of its own on connection Q, whose status says
+ *   whether the file was stored
+ * Input:
+ *   struct session* session - the session receiving the upload
+ *   unsigned char* attributes - the attributes of ftclient's END frame
+ *   size_t length - the length of the attributes
+ * Output: none
+*******************************************************************************/
+void finishUpload(struct session* session, unsigned char* attributes, size_t length) {
+  struct upload* upload = session->upload;
+  struct frame trailer;
+  struct stat info;
+  int status = STATUS_OK;
+  char* message = NULL;
+  memset(&trailer, '\0', sizeof(trailer));
+  trailer.type = FRAME_END;
+  trailer.length = length;
+  trailer.payload = attributes;
+  upload->done = TRUE;
+
+  if (upload->failed) {
+    status = STATUS_IO_ERROR;
+    message = strerror(upload->failed);
+  }
+  else if (upload->received != (uint64_t)upload->size) {
+    status = STATUS_BAD_REQUEST;
+    message = "The upload is not the size that was announced";
+  }
+  // an END frame without a digest isn't checked
+  else if (upload->checksum && getUintAttribute(&trailer, ATTR_DIGEST, upload->digest) != upload->digest) {
+    status = STATUS_IO_ERROR;
+    message = "Checksum mismatch, the file was corrupted in transit";
+  }
+  else if (renameat(session->directoryFD, upload->path, session->directoryFD, session->request.name) != 0) {
+    status = STATUS_IO_ERROR;
+    message = strerror(errno);
+  }
+  else {
+    upload->path[0] = '\0';
+    // the next get of the file needn't hash it again
+    if (upload->checksum && fstat(upload->fd, &info) == 0) {
+      storeDigest(&info, upload->digest);
+    }
+  }
+
+  size_t start = beginFrame(&session->data, FRAME_END, status, session->request.id);
+  addUintAttribute(&session->data, ATTR_LENGTH, upload->received, 8);
+  if (message != NULL) {
+    addAttribute(&session->data, ATTR_MESSAGE, message, strlen(message));
+  }
+  finishFrame(&session->data, start);
+  if (status == STATUS_OK) {
+    logMessage(LOG_INFO, "Stored \"%s\" (%lu Bytes) from %s:%d", session->request.name,
+               (unsigned long)upload->received, session->clientIP, session->clientPort);
+  }
+  else {
+    logMessage(LOG_INFO, "Upload of \"%s\" from %s:%d failed: %s", session->request.name,
+               session->clientIP, session->clientPort, message);
+  }
+}
+
+
+/*******************************************************************************
+ *          int receiveUpload(struct server*, struct session* session)
+ * Description: reads as much of an upload from connection Q as has arrived.
+ *   Frame headers are read with recv(); the bytes of each DATA frame are
+ *   spliced from the socket into the upload's pipe and on into the file
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - a session receiving an upload
+ * Output: TRUE if the connection is still good, FALSE if it closed or
+ *   ftclient sent something other than the upload's frames
+*******************************************************************************/
+int receiveUpload(struct server* server, struct session* session) {
+  struct upload* upload = session->upload;
+  int socketFD = session->stripes[0].q.fd;
+
+  while (!upload->done) {
+    if (upload->piped > 0) {
+      drainUploadPipe(server, upload);
+      continue;
+    }
+    if (upload->remaining > 0) {
+      ssize_t moved = splice(socketFD, NULL, upload->pipeFDs[1], NULL,
+                             min(upload->remaining, UPLOAD_PIPE_SIZE), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (moved <= 0) {
+        return moved < 0 && (errno == EAGAIN || errno == EINTR);
+      }
+      upload->remaining -= moved;
+      upload->piped += moved;
+      countMetric(&WORKER_METRICS->bytesReceived, moved);
+      continue;
+    }
+
+    // the next frame's header, then the offset of a DATA frame or the
+    // attributes of the END frame
+    unsigned char* header = upload->frame;
+    size_t wanted = FRAME_HEADER_LENGTH;
+    if (upload->frameLength >= FRAME_HEADER_LENGTH) {
+      wanted += header[3] == FRAME_DATA ? DATA_OFFSET_LENGTH : getUint(header + 12, 8);
+    }
+    if (upload->frameLength < wanted) {
+      ssize_t readAmt = recv(socketFD, header + upload->frameLength, wanted - upload->frameLength, 0);
+      if (readAmt <= 0) {
+        return readAmt < 0 && (errno == EAGAIN || errno == EINTR);
+      }
+      upload->frameLength += readAmt;
+      if (upload->frameLength < FRAME_HEADER_LENGTH) {
+        continue;
+      }
+      if (upload->frameLength == FRAME_HEADER_LENGTH) {
+        uint64_t length = getUint(header + 12, 8);
+        if (getUint(header, 2) != PROTOCOL_MAGIC || header[2] != PROTOCOL_VERSION ||
+            (header[3] == FRAME_DATA && (length < DATA_OFFSET_LENGTH || getUint(header + 6, 2) != 0)) ||
+            (header[3] == FRAME_END && length > MAX_UPLOAD_TRAILER) ||
+            (header[3] != FRAME_DATA && header[3] != FRAME_END)) {
+          logMessage(LOG_ERROR, "ERROR: malformed upload from %s", session->clientIP);
+          return FALSE;
+        }
+      }
+      continue;
+    }
+
+    upload->frameLength = 0;
+    if (header[3] == FRAME_END) {
+      finishUpload(session, header + FRAME_HEADER_LENGTH, wanted - FRAME_HEADER_LENGTH);
+      break;
+    }
+    uint64_t offset = getUint(header + FRAME_HEADER_LENGTH, DATA_OFFSET_LENGTH);
+    uint64_t length = getUint(header + 12, 8) - DATA_OFFSET_LENGTH;
+    if (offset > (uint64_t)upload->size || length > upload->size - offset) {
+      logMessage(LOG_ERROR, "ERROR: upload from %s goes past its size", session->clientIP);
+      return FALSE;
+    }
+    // frames must follow each other, so the bytes received are the bytes
+    // written and an upload of the announced size covers the whole file
+    if (offset != upload->received) {
+      logMessage(LOG_ERROR, "ERROR: upload from %s is out of order", session->clientIP);
+      return FALSE;
+    }
+    upload->offset = offset;
+    upload->remaining = length;
+    upload->received += length;
+  }
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ *                      size_t tarPadding(uint64_t size)
+ * Description: finds the number of zero bytes that pad size bytes of member
+ *   data out to a whole number of tar blocks
+ * Input: uint64_t size - the size of the data
+ * Output: the number of padding bytes
+*******************************************************************************/
+size_t tarPadding(uint64_t size) {
+  return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+
+/*******************************************************************************
+ *     void putOctal(unsigned char* field, size_t width, uint64_t value)
+ * Description: writes a number into a tar header field as zero-padded octal
+ *   digits followed by a NUL
+ * Input:
+ *   unsigned char* field - the field to write
+ *   size_t width - the width of the field, including the NUL
+ *   uint64_t value - the number to write
+ * Output: none
+*******************************************************************************/
+void putOctal(unsigned char* field, size_t width, uint64_t value) {
+  snprintf((char*)field, width, "%0*llo", (int)width - 1, (unsigned long long)value);
+}
+
+
+/*******************************************************************************
+ *   void appendPaxRecord(struct buffer* records, char* key, char* value)
+ * Description: adds a "length key=value" record to a pax extended header.
+ *   The length counts the whole record, its own digits included
+ * Input:
+ *   struct buffer* records - the extended header being built
+ *   char* key - the name of the field, such as "path"
+ *   char* value - the value of the field
+ * Output: none
+*******************************************************************************/
+void appendPaxRecord(struct buffer* records, char* key, char* value) {
+  char length[24];
+  size_t recordLength = strlen(key) + strlen(value) + 3;
+  int digits = 1;
+  while (snprintf(length, sizeof(length), "%zu", recordLength + digits) != digits) {
+    digits++;
+  }
+  appendBuffer(records, length, digits);
+  appendBuffer(records, " ", 1);
+  appendBuffer(records, key, strlen(key));
+  appendBuffer(records, "=", 1);
+  appendBuffer(records, value, strlen(value));
+  appendBuffer(records, "\n", 1);
+}
+
+
+/*******************************************************************************
+ *     void appendTarBlock(struct buffer* archive, char* name, int type,
+ *                         struct stat* info, uint64_t size, char* linkName)
+ * Description: adds one ustar header block to an archive
+ * Input:
+ *   struct buffer* archive - the archive being built
+ *   char* name - the member's name, cut off at 100 bytes
+ *   int type - the member's tar type flag
+ *   struct stat* info - the member's metadata, or NULL for an extended header
+ *   uint64_t size - the size of the data following the header
+ *   char* linkName - a symbolic link's target, cut off at 100 bytes, or NULL
+ * Output: none
+*******************************************************************************/
+void appendTarBlock(struct buffer* archive, char* name, int type, struct stat* info,
+                    uint64_t size, char* linkName) {
+  unsigned char block[TAR_BLOCK_SIZE];
+  unsigned int checksum = 0;
+  size_t i;
+
+  memset(block, '\0', sizeof(block));
+  strncpy((char*)block, name, 100);
+  putOctal(block + 100, 8, info != NULL ? info->st_mode & 07777 : 0644);
+  putOctal(block + 108, 8, info != NULL && info->st_uid <= 07777777 ? info->st_uid : 0);
+  putOctal(block + 116, 8, info != NULL && info->st_gid <= 07777777 ? info->st_gid : 0);
+  putOctal(block + 124, 12, size <= TAR_MAX_OCTAL_SIZE ? size : 0);
+  putOctal(block + 136, 12, info != NULL && info->st_mtime > 0 ? info->st_mtime : 0);
+  block[156] = type;
+  if (linkName != NULL) {
+    strncpy((char*)block + 157, linkName, 100);
+  }
+  memcpy(block + 257, "ustar", 6);
+  memcpy(block + 263, "00", 2);
+  // the checksum is taken with its own field filled with spaces
+  memset(block + 148, ' ', 8);
+  for (i = 0; i < sizeof(block); i++) {
+    checksum += block[i];
+  }
+  snprintf((char*)block + 148, 8, "%06o", checksum);
+  appendBuffer(archive, block, sizeof(block));
+}
+
+
+/*******************************************************************************
+ *    void appendTarHeader(struct buffer* archive, char* name,
+ *                         struct stat* info, char* linkName)
+ * sources cited: https://pubs.opengroup.org/onlinepubs/9699919799/utilities/pax.html
+ *
+ * Description: adds the header of one member to a tar archive. Names and
+ *   link targets longer than a ustar header holds, and files too big for its
+ *   size field, get a pax extended header first
+ * Input:
+ *   struct buffer* archive - the archive being built
+ *   char* name - the member's path in the archive. Directories end in /
+ *   struct stat* info - the member's metadata
+ *   char* linkName - a symbolic link's target, or NULL
+ * Output: none
+*******************************************************************************/
+void appendTarHeader(struct buffer* archive, char* name, struct stat* info, char* linkName) {
+  int type = S_ISDIR(info->st_mode) ? '5' : S_ISLNK(info->st_mode) ? '2' : '0';
+  uint64_t size = S_ISREG(info->st_mode) ? info->st_size : 0;
+
+  if (strlen(name) > 100 || (linkName != NULL && strlen(linkName) > 100) || size > TAR_MAX_OCTAL_SIZE) {
+    struct buffer records;
+    char number[24];
+    memset(&records, '\0', sizeof(records));
+    if (strlen(name) > 100) {
+      appendPaxRecord(&records, "path", name);
+    }
+    if (linkName != NULL && strlen(linkName) > 100) {
+      appendPaxRecord(&records, "linkpath", linkName);
+    }
+    if (size > TAR_MAX_OCTAL_SIZE) {
+      snprintf(number, sizeof(number), "%llu", (unsigned long long)size);
+      appendPaxRecord(&records, "size", number);
+    }
+    appendTarBlock(archive, "././@PaxHeader", 'x', NULL, records.length, NULL);
+    appendBuffer(archive, records.bytes, records.length);
+    appendZeros(archive, tarPadding(records.length));
+    freeBuffer(&records);
+  }
+  appendTarBlock(archive, name, type, info, size, linkName);
+}
+
+
+/*******************************************************************************
+ *               int readTreeBatch(struct treeWalk* tree)
+ * Description: reads the next batch of entries of the directory being
+ *   walked. When the directory runs out, the next directory waiting to be
+ *   read is opened instead
+ * Input: struct treeWalk* tree - the walk
+ * Output: TRUE if there may be more entries, FALSE once every directory in
+ *   the tree has been read
+*******************************************************************************/
+int readTreeBatch(struct treeWalk* tree) {
+  tree->direntPosition = 0;
+  tree->direntLength = 0;
+  if (tree->directoryFD >= 0) {
+    ssize_t length = getdents64(tree->directoryFD, tree->dirents, TREE_DIRENT_BUFFER_SIZE);
+    if (length > 0) {
+      tree->direntLength = length;
+      return TRUE;
+    }
+    if (length < 0) {
+      logMessage(LOG_ERROR, "ERROR reading directory %s: %s", tree->directory, strerror(errno));
+    }
+    close(tree->directoryFD);
+    tree->directoryFD = -1;
+  }
+
+  // directories are read in the order they were found
+  while (tree->pending.sent < tree->pending.length) {
+    char* path = tree->pending.bytes + tree->pending.sent;
+    tree->pending.sent += strlen(path) + 1;
+    tree->directoryFD = openBeneathDirectory(tree->rootFD, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (tree->directoryFD >= 0) {
+      snprintf(tree->directory, sizeof(tree->directory), "%s", path);
+      return TRUE;
+    }
+  }
+  resetBuffer(&tree->pending);
+  return FALSE;
+}
+
+
+/*******************************************************************************
+ *     int addTreeFile(struct server*, struct session*, char* name,
+ *                     struct dirent64* entry, struct stat* info)
+ * Description: adds a regular file to the archive. A small file is read
+ *   into the data buffer straight after its header, so many small files go
+ *   out in one batch. A large file is sent from the page cache on its own
+ *   with transmitChunk() once the data buffer has been sent
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session sending the tree
+ *   char* name - the file's path in the archive
+ *   struct dirent64* entry - the file's directory entry
+ *   struct stat* info - the file's metadata
+ * Output: TRUE if the file is a large one left for transmitChunk() to send
+*******************************************************************************/
+int addTreeFile(struct server* server, struct session* session, char* name,
+                struct dirent64* entry, struct stat* info) {
+  struct treeWalk* tree = session->tree;
+  struct buffer* data = &session->data;
+  int fileFD = openat(tree->directoryFD, entry->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fileFD < 0) {
+    return FALSE;
+  }
+  appendTarHeader(data, name, info, NULL);
+  tree->files++;
+  tree->bytes += info->st_size;
+
+  if (info->st_size > TREE_SMALL_FILE_SIZE) {
+    struct stripe* stripe = &session->stripes[0];
+    session->fileFD = fileFD;
+    stripe->offset = 0;
+    stripe->end = info->st_size;
+    stripe->dataEnd = info->st_size;
+    stripe->method = server->transmitMethod;
+    stripe->compressFile = stripe->compressor != NULL &&
+      sampleEntropy(fileFD, 0, info->st_size) < COMPRESSION_ENTROPY_LIMIT;
+    tree->padding = tarPadding(info->st_size);
+    posix_fadvise(fileFD, 0, info->st_size, POSIX_FADV_SEQUENTIAL);
+    return TRUE;
+  }
+
+  // the header promised st_size bytes, so a file that shrank is padded out
+  size_t length = 0;
+  growBuffer(data, info->st_size);
+  while (length < (size_t)info->st_size) {
+    ssize_t readAmt = read(fileFD, data->bytes + data->length + length, info->st_size - length);
+    if (readAmt <= 0) {
+      break;
+    }
+    length += readAmt;
+  }
+  close(fileFD);
+  data->length += length;
+  appendZeros(data, info->st_size - length + tarPadding(info->st_size));
+  return FALSE;
+}
+
+
+/*******************************************************************************
+ *              void streamTree(struct server*, struct session*)
+ * Description: builds the next batch of a directory tree's archive. The
+ *   tree is walked breadth first with getdents64(2), and members are added
+ *   until the batch reaches TREE_BATCH_SIZE or a large file is found. The
+ *   batch goes out as one DATA frame, followed by the large file's DATA
+ *   frame. This way walking, reading and sending overlap: the next batch is
+ *   built while the kernel is still sending the last one. Once the whole
+ *   tree is sent the archive's end blocks and the END frame are queued
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session sending the tree, with its data
+ *     buffer and any large file fully sent
+ * Output: none
+*******************************************************************************/
+void streamTree(struct server* server, struct session* session) {
+  struct treeWalk* tree = session->tree;
+  struct buffer* data = &session->data;
+  struct stat info;
+  char name[PATH_MAX + 1];
+  char linkName[PATH_MAX + 1];
+  int largeFile = FALSE;
+  int finished = FALSE;
+
+  resetBuffer(data);
+  if (session->fileFD >= 0) {
+    close(session->fileFD);
+    session->fileFD = -1;
+    session->stripes[0].compressFile = FALSE;
+  }
+  size_t start = beginFrame(data, FRAME_DATA, STATUS_OK, session->request.id);
+  unsigned char offset[DATA_OFFSET_LENGTH];
+  putUint64(offset, tree->archiveOffset);
+  appendBuffer(data, offset, DATA_OFFSET_LENGTH);
+  size_t archiveStart = data->length;
+  appendZeros(data, tree->padding);
+  tree->padding = 0;
+  if (tree->archiveOffset == 0 && fstat(tree->rootFD, &info) == 0) {
+    snprintf(name, sizeof(name), "%s/", tree->root);
+    appendTarHeader(data, name, &info, NULL);
+  }
+
+  while (!largeFile && !finished && data->length - archiveStart < TREE_BATCH_SIZE) {
+    if (tree->direntPosition >= tree->direntLength) {
+      finished = !readTreeBatch(tree);
+      continue;
+    }
+    struct dirent64* entry = (struct dirent64*)(tree->dirents + tree->direntPosition);
+    tree->direntPosition += entry->d_reclen;
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+        fstatat(tree->directoryFD, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) < 0) {
+      continue;
+    }
+    int nameLength = snprintf(name, sizeof(name), "%s/%s%s%s%s", tree->root, tree->directory,
+                              tree->directory[0] != '\0' ? "/" : "", entry->d_name,
+                              S_ISDIR(info.st_mode) ? "/" : "");
+    if (nameLength >= (int)sizeof(name)) {
+      logMessage(LOG_ERROR, "ERROR: path too long, skipping %s", entry->d_name);
+      continue;
+    }
+
+    if (S_ISDIR(info.st_mode)) {
+      // queue the directory's path relative to the root, without the /
+      appendTarHeader(data, name, &info, NULL);
+      appendBuffer(&tree->pending, name + strlen(tree->root) + 1, nameLength - strlen(tree->root) - 2);
+      appendBuffer(&tree->pending, "", 1);
+    }
+    else if (S_ISLNK(info.st_mode)) {
+      ssize_t linkLength = readlinkat(tree->directoryFD, entry->d_name, linkName, PATH_MAX);
+      if (linkLength >= 0) {
+        linkName[linkLength] = '\0';
+        appendTarHeader(data, name, &info, linkName);
+      }
+    }
+    else if (S_ISREG(info.st_mode)) {
+      largeFile = addTreeFile(server, session, name, entry, &info);
+    }
+  }
+
+  if (finished) {
+    // an archive ends with two empty blocks
+    appendZeros(data, 2 * TAR_BLOCK_SIZE);
+  }
+  tree->archiveOffset += data->length - archiveStart;
+  if (data->length == archiveStart) {
+    data->length = start;
+  }
+  else {
+    finishDataFrame(session, data, start);
+  }
+
+  if (largeFile) {
+    struct stripe* stripe = &session->stripes[0];
+    off_t size = stripe->end;
+    if (stripe->compressFile) {
+      stripe->dataBase = tree->archiveOffset;
+    }
+    else {
+      unsigned char header[FRAME_HEADER_LENGTH + DATA_OFFSET_LENGTH];
+      putFrameHeader(header, FRAME_DATA, STATUS_OK, session->request.id, DATA_OFFSET_LENGTH + size);
+      putUint64(header + FRAME_HEADER_LENGTH, tree->archiveOffset);
+      appendBuffer(data, header, sizeof(header));
+    }
+    tree->archiveOffset += size;
+  }
+  if (finished) {
+    start = beginFrame(data, FRAME_END, STATUS_OK, session->request.id);
+    addTrailerAttributes(data, &session->stripes[0]);
+    finishFrame(data, start);
+    tree->done = TRUE;
+    logMessage(LOG_INFO, "Sent %llu files (%llu Bytes) under \"%s\" to %s:%d", (unsigned long long)tree->files,
+               (unsigned long long)tree->bytes, session->request.name, session->clientIP, session->clientPort);
+  }
+}
+
+
+/*******************************************************************************
+ *                 void stopTree(struct session* session)
+ * Description: releases the walk of a directory tree
+ * Input: struct session* session - the session that was sending the tree
+ * Output: none
+*******************************************************************************/
+void stopTree(struct session* session) {
+  struct treeWalk* tree = session->tree;
+  if (tree == NULL) {
+    return;
+  }
+  if (tree->directoryFD >= 0) {
+    close(tree->directoryFD);
+  }
+  close(tree->rootFD);
+  freeBuffer(&tree->pending);
+  free(tree);
+  session->tree = NULL;
+}
+
+
+/*******************************************************************************
+ *              void sendTree(struct server*, struct session*)
+ * Description: starts sending the directory named in a recursive GET, with
+ *   everything under it, as a tar archive on connection Q. The archive's
+ *   members are named relative to the directory's parent, so it unpacks
+ *   into a directory of the same name
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session requesting the tree
+ * Output: none
+*******************************************************************************/
+void sendTree(struct server* server, struct session* session) {
+  struct request* request = &session->request;
+  char path[PATH_MAX];
+  logMessage(LOG_DEBUG, "Directory tree \"%s\" requested on port %d.", request->name, session->hostPort);
+
+  if (!(session->capabilities & CAP_TREE)) {
+    queueResponse(session, STATUS_UNSUPPORTED, "Recursive gets were not negotiated");
+    return;
+  }
+  int rootFD = openBeneath(session, request->name, O_RDONLY | O_DIRECTORY);
+  if (rootFD < 0) {
+    queueResponse(session, STATUS_NOT_FOUND, "Directory not found");
+    return;
+  }
+  struct treeWalk* tree = calloc(1, sizeof(struct treeWalk));
+  assert(tree != NULL);
+  tree->rootFD = rootFD;
+  tree->directoryFD = openat(rootFD, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  // name the top of the archive after the directory itself, even for "."
+  char* base = "tree";
+  if (directoryPath(rootFD, path, sizeof(path)) && strrchr(path, '/')[1] != '\0') {
+    base = strrchr(path, '/') + 1;
+  }
+  snprintf(tree->root, sizeof(tree->root), "%s", base);
+  session->tree = tree;
+  startChecksum(session);
+  if (chooseCompression(session) != COMPRESS_NONE) {
+    startCompressor(session, &session->stripes[0]);
+  }
+
+  logMessage(LOG_INFO, "Sending \"%s\" to %s:%d", request->name, session->clientIP, session->clientPort);
+  queueResponse(session, STATUS_OK, NULL);
+}
+
+
+/*******************************************************************************
+ *            int compareNames(const void* a, const void* b)
+ * Description: orders the names a glob matched alphabetically
+ * Input: const void* a, b - pointers to the two names
+ * Output: negative, zero or positive as for qsort(3)
+*******************************************************************************/
+int compareNames(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+
+/*******************************************************************************
+ *  int expandBatchName(struct server*, struct session*, char* pattern)
+ * Description: adds the files one name of a batch get stands for. A name
+ *   without glob characters is added as it is. A glob is matched against the
+ *   entries of its directory, which are read with getdents64(2), and the
+ *   matches are added in alphabetical order. As in a shell, a leading . must
+ *   be matched explicitly and directories are left out
+ * Input:
+ *   struct server* server - the worker, whose dirent buffer is used
+ *   struct session* session - the session building the batch
+ *   char* pattern - the name or glob, which may have a directory part
+ * Output: the number of names added, or -1 if the batch grew too big
+*******************************************************************************/
+int expandBatchName(struct server* server, struct session* session, char* pattern) {
+  struct batchGet* batch = session->batch;
+  char* slash = strrchr(pattern, '/');
+  char* glob = slash != NULL ? slash + 1 : pattern;
+  char directory[PATH_MAX + 1];
+  char** matches = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  ssize_t length;
+
+  if (strpbrk(glob, "*?[") == NULL) {
+    appendBuffer(&batch->names, pattern, strlen(pattern) + 1);
+    return ++batch->count > MAX_BATCH_FILES ? -1 : 1;
+  }
+  snprintf(directory, sizeof(directory), "%.*s", slash != NULL ? (int)(slash - pattern + 1) : 1,
+           slash != NULL ? pattern : ".");
+  int directoryFD = openBeneath(session, directory, O_RDONLY | O_DIRECTORY);
+  if (directoryFD < 0) {
+    return 0;
+  }
+  while ((length = getdents64(directoryFD, server->direntBuffer, LISTING_BATCH_SIZE)) > 0) {
+    ssize_t position = 0;
+    while (position < length) {
+      struct dirent64* entry = (struct dirent64*)(server->direntBuffer + position);
+      position += entry->d_reclen;
+      if (entry->d_type == DT_DIR || fnmatch(glob, entry->d_name, FNM_PERIOD) != 0) {
+        continue;
+      }
+      if (count == capacity) {
+        capacity = capacity > 0 ? 2 * capacity : 64;
+        matches = realloc(matches, capacity * sizeof(char*));
+        assert(matches != NULL);
+      }
+      matches[count] = strdup(entry->d_name);
+      assert(matches[count] != NULL);
+      count++;
+    }
+  }
+  close(directoryFD);
+
+  qsort(matches, count, sizeof(char*), compareNames);
+  size_t i;
+  for (i = 0; i < count; i++) {
+    if (slash != NULL) {
+      appendBuffer(&batch->names, pattern, slash - pattern + 1);
+    }
+    appendBuffer(&batch->names, matches[i], strlen(matches[i]) + 1);
+    free(matches[i]);
+  }
+  free(matches);
+  batch->count += count;
+  return batch->count > MAX_BATCH_FILES ? -1 : (int)count;
+}
+
+
+/*******************************************************************************
+ *               void openBatchFile(struct session* session)
+ * Description: opens the next file of a session's batch and starts reading
+ *   its first BATCH_READAHEAD bytes into the page cache in the background
+ * Input: struct session* session - the session sending the batch
+ * Output: none
+ * Postconditions: nextName is the next name, or NULL once every file has
+ *   been opened, and nextFD is its file or -1 if it can't be sent
+*******************************************************************************/
+void openBatchFile(struct session* session) {
+  struct batchGet* batch = session->batch;
+  batch->nextFD = -1;
+  batch->nextName = NULL;
+  if (batch->names.sent >= batch->names.length) {
+    return;
+  }
+  batch->nextName = batch->names.bytes + batch->names.sent;
+  batch->names.sent += strlen(batch->nextName) + 1;
+  batch->nextFD = openBeneath(session, batch->nextName, O_RDONLY);
+  if (batch->nextFD >= 0 && (fstat(batch->nextFD, &batch->nextInfo) < 0 ||
+                             !S_ISREG(batch->nextInfo.st_mode))) {
+    close(batch->nextFD);
+    batch->nextFD = -1;
+  }
+  if (batch->nextFD >= 0) {
+    posix_fadvise(batch->nextFD, 0, min(batch->nextInfo.st_size, BATCH_READAHEAD), POSIX_FADV_WILLNEED);
+  }
+}
+
+
+/*******************************************************************************
+ *               void endBatchFile(struct session* session)
+ * Description: queues the END frame of a file of a batch, with the file's
+ *   digest if the request asked for one
+ * Input: struct session* session - the session sending the batch
+ * Output: none
+*******************************************************************************/
+void endBatchFile(struct session* session) {
+  struct stripe* stripe = &session->stripes[0];
+  size_t start = beginFrame(&session->data, FRAME_END, STATUS_OK, session->request.id);
+  if (stripe->checksum) {
+    addUintAttribute(&session->data, ATTR_DIGEST, stripe->digest, 4);
+  }
+  finishFrame(&session->data, start);
+}
+
+
+/*******************************************************************************
+ *           int addBatchFile(struct server*, struct session*)
+ * Description: adds the file opened next to the batch being built, as a
+ *   FILE frame holding its name and size followed by its data. A small file
+ *   is read into the data buffer with its END frame straight away. A large
+ *   file is left for transmitChunk() to send once the data buffer has been
+ *   sent, and its digest may come from the digest cache. A file that can't
+ *   be sent gets a FILE frame with an error status and nothing else. The
+ *   file after it is then opened, so it is read ahead meanwhile
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session sending the batch
+ * Output: TRUE if the file is a large one left for transmitChunk() to send
+*******************************************************************************/
+int addBatchFile(struct server* server, struct session* session) {
+  struct batchGet* batch = session->batch;
+  struct stripe* stripe = &session->stripes[0];
+  struct buffer* data = &session->data;
+  struct stat info = batch->nextInfo;
+  int fileFD = batch->nextFD;
+  size_t start = beginFrame(data, FRAME_FILE, fileFD >= 0 ? STATUS_OK : STATUS_NOT_FOUND, session->request.id);
+  addAttribute(data, ATTR_NAME, batch->nextName, strlen(batch->nextName));
+  if (fileFD < 0) {
+    addAttribute(data, ATTR_MESSAGE, "File not found", strlen("File not found"));
+    finishFrame(data, start);
+    batch->missing++;
+    openBatchFile(session);
+    return FALSE;
+  }
+  addUintAttribute(data, ATTR_FILE_SIZE, info.st_size, 8);
+  finishFrame(data, start);
+  openBatchFile(session);
+  batch->files++;
+  batch->bytes += info.st_size;
+  stripe->digest = 0;
+  stripe->digestKnown = FALSE;
+
+  if (info.st_size > TREE_SMALL_FILE_SIZE) {
+    session->fileFD = fileFD;
+    session->fileInfo = info;
+    stripe->offset = 0;
+    stripe->end = info.st_size;
+    stripe->dataEnd = info.st_size;
+    stripe->dataBase = 0;
+    stripe->method = server->transmitMethod;
+    stripe->compressFile = stripe->compressor != NULL &&
+      sampleEntropy(fileFD, 0, info.st_size) < COMPRESSION_ENTROPY_LIMIT;
+    if (stripe->checksum && lookupDigest(&info, &stripe->digest)) {
+      stripe->digestKnown = TRUE;
+    }
+    if (!stripe->compressFile) {
+      unsigned char header[FRAME_HEADER_LENGTH + DATA_OFFSET_LENGTH];
+      putFrameHeader(header, FRAME_DATA, STATUS_OK, session->request.id, DATA_OFFSET_LENGTH + info.st_size);
+      putUint64(header + FRAME_HEADER_LENGTH, 0);
+      appendBuffer(data, header, sizeof(header));
+    }
+    batch->endOwed = TRUE;
+    posix_fadvise(fileFD, 0, info.st_size, POSIX_FADV_SEQUENTIAL);
+    return TRUE;
+  }
+
+  if (info.st_size > 0) {
+    start = beginFrame(data, FRAME_DATA, STATUS_OK, session->request.id);
+    appendZeros(data, DATA_OFFSET_LENGTH);
+    size_t length = 0;
+    growBuffer(data, info.st_size);
+    while (length < (size_t)info.st_size) {
+      ssize_t readAmt = read(fileFD, data->bytes + data->length + length, info.st_size - length);
+      if (readAmt <= 0) {
+        break;
+      }
+      length += readAmt;
+    }
+    data->length += length;
+    finishDataFrame(session, data, start);
+  }
+  close(fileFD);
+  endBatchFile(session);
+  return FALSE;
+}
+
+
+/*******************************************************************************
+ *              void streamBatch(struct server*, struct session*)
+ * Description: builds the next batch of a batch get. The END frame owed to
+ *   the large file just sent comes first, then files are added until the
+ *   batch reaches TREE_BATCH_SIZE or a large file is found. Once every file
+ *   is sent the END frame closing the batch is queued, with the number of
+ *   files sent and the compression stats
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session sending the batch, with its data
+ *     buffer and any large file fully sent
+ * Output: none
+*******************************************************************************/
+void streamBatch(struct server* server, struct session* session) {
+  struct batchGet* batch = session->batch;
+  struct buffer* data = &session->data;
+  int largeFile = FALSE;
+
+  resetBuffer(data);
+  if (session->fileFD >= 0) {
+    // the next get of the file needn't hash it again
+    if (session->stripes[0].checksum && !session->stripes[0].digestKnown) {
+      saveFileDigest(session);
+    }
+    close(session->fileFD);
+    session->fileFD = -1;
+    session->stripes[0].compressFile = FALSE;
+  }
+  if (batch->endOwed) {
+    endBatchFile(session);
+    batch->endOwed = FALSE;
+  }
+  while (!largeFile && batch->nextName != NULL && data->length < TREE_BATCH_SIZE) {
+    largeFile = addBatchFile(server, session);
+  }
+
+  if (!largeFile && batch->nextName == NULL) {
+    size_t start = beginFrame(data, FRAME_END, STATUS_OK, session->request.id);
+    addUintAttribute(data, ATTR_FILES, batch->files, 4);
+    addCompressionStats(data, session->stripes[0].compressor);
+    finishFrame(data, start);
+    batch->done = TRUE;
+    if (batch->missing > 0) {
+      logMessage(LOG_INFO, "Sent %llu files (%llu Bytes) to %s:%d, %llu not found",
+                 (unsigned long long)batch->files, (unsigned long long)batch->bytes,
+                 session->clientIP, session->clientPort, (unsigned long long)batch->missing);
+    }
+    else {
+      logMessage(LOG_INFO, "Sent %llu files (%llu Bytes) to %s:%d", (unsigned long long)batch->files,
+                 (unsigned long long)batch->bytes, session->clientIP, session->clientPort);
+    }
+  }
+}
+
+
+/*******************************************************************************
+ *                 void stopBatch(struct session* session)
+ * Description: releases a batch get, closing the file it had read ahead
+ * Input: struct session* session - the session that was sending the batch
+ * Output: none
+*******************************************************************************/
+void stopBatch(struct session* session) {
+  struct batchGet* batch = session->batch;
+  if (batch == NULL) {
+    return;
+  }
+  if (batch->nextFD >= 0) {
+    close(batch->nextFD);
+  }
+  freeBuffer(&batch->names);
+  free(batch);
+  session->batch = NULL;
+}
+
+
+/*******************************************************************************
+ *              void sendBatch(struct server*, struct session*)
+ * Description: starts a batch get, which sends every file named in the
+ *   request back to back on connection Q. Names may be globs, which are
+ *   expanded here; the response gives the number of files the batch holds
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session requesting the files
+ * Output: none
+*******************************************************************************/
+void sendBatch(struct server* server, struct session* session) {
+  struct request* request = &session->request;
+  logMessage(LOG_DEBUG, "Batch of files requested on port %d.", session->hostPort);
+
+  if (!(session->capabilities & CAP_BATCH)) {
+    queueResponse(session, STATUS_UNSUPPORTED, "Batch gets were not negotiated");
+    return;
+  }
+  if (request->offset != 0 || request->length != 0 || request->stripes != 1 ||
+      request->signatures != NULL || request->recursive) {
+    queueResponse(session, STATUS_BAD_REQUEST, "Batch gets cannot be ranged, striped, delta or recursive");
+    return;
+  }
+  if (request->namesLength == 0 || request->names[request->namesLength - 1] != '\0') {
+    queueResponse(session, STATUS_BAD_REQUEST, "Invalid names");
+    return;
+  }
+
+  struct batchGet* batch = calloc(1, sizeof(struct batchGet));
+  assert(batch != NULL);
+  batch->nextFD = -1;
+  session->batch = batch;
+  size_t position = 0;
+  while (position < request->namesLength) {
+    char* name = (char*)request->names + position;
+    size_t nameLength = strlen(name);
+    position += nameLength + 1;
+    if (nameLength == 0 || nameLength > PATH_MAX) {
+      queueResponse(session, STATUS_BAD_REQUEST, "Invalid names");
+      return;
+    }
+    if (expandBatchName(server, session, name) < 0) {
+      queueResponse(session, STATUS_BAD_REQUEST, "Too many files");
+      return;
+    }
+  }
+  if (batch->count == 0) {
+    queueResponse(session, STATUS_NOT_FOUND, "No files match");
+    return;
+  }
+  startChecksum(session);
+  if (chooseCompression(session) != COMPRESS_NONE) {
+    startCompressor(session, &session->stripes[0]);
+  }
+  openBatchFile(session);
+
+  size_t start = beginFrame(&session->reply, FRAME_RESPONSE, STATUS_OK, request->id);
+  addUintAttribute(&session->reply, ATTR_FILES, batch->count, 4);
+  if (session->stripes[0].compressor != NULL) {
+    addUintAttribute(&session->reply, ATTR_COMPRESSION, COMPRESS_DEFLATE, 1);
+  }
+  if (session->stripes[0].checksum) {
+    addUintAttribute(&session->reply, ATTR_CHECKSUM, CHECKSUM_CRC32, 1);
+  }
+  finishFrame(&session->reply, start);
+  logMessage(LOG_INFO, "Sending %u files to %s:%d", batch->count, session->clientIP, session->clientPort);
+}
+
+
+/*******************************************************************************
+ *       void changeDirectory(struct server* server, struct session* session)
+ * Description: changes the session's working directory to the requested one.
+ *   Only the session's own directory changes; other sessions and the server
+ *   keep theirs. The directory must be beneath the root, and is opened with
+ *   O_PATH so the session holds on to it even if it is renamed. Directories
+ *   changed into recently are taken from the worker's directory cache
+ *   without walking their path again
+ * Input:
+ *   struct server* server - the worker owning the directory cache
+ *   struct session* session - the session requesting the change
+ * Output: none
+*******************************************************************************/
+void changeDirectory(struct server* server, struct session* session) {
+  char* name = session->request.name;
+  char path[PATH_MAX];
+  char resolved[PATH_MAX];
+  int directoryFD = -1;
+
+  logMessage(LOG_DEBUG, "Change directory request received from %s:%d", session->clientIP, session->hostPort);
+  int cacheable = joinPath(session->directory, name, path, sizeof(path));
+  if (cacheable) {
+    directoryFD = findDirectory(server, path);
+    countMetric(directoryFD >= 0 ? &server->metrics.directoryCacheHits : &server->metrics.directoryCacheMisses, 1);
+    strcpy(resolved, path);
+  }
+  if (directoryFD < 0) {
+    directoryFD = openBeneath(session, name, O_PATH | O_DIRECTORY);
+    if (directoryFD >= 0 && !directoryPath(directoryFD, resolved, sizeof(resolved))) {
+      close(directoryFD);
+      directoryFD = -1;
+    }
+    // only a path without symlinks can be checked on later hits
+    if (directoryFD >= 0 && cacheable && strcmp(resolved, path) == 0) {
+      addDirectory(server, path, directoryFD);
+    }
+  }
+  if (directoryFD < 0) {
+    logMessage(LOG_INFO, "Error switching to requested directory. Sending error message to %s:%d", session->clientIP, session->hostPort);
+    queueResponse(session, STATUS_NOT_FOUND, "Error changing directory");
+    return;
+  }
+  close(session->directoryFD);
+  session->directoryFD = directoryFD;
+  strcpy(session->directory, resolved);
+  logMessage(LOG_INFO, "Working directory of %s:%d changed to %s", session->clientIP, session->clientPort, resolved);
+  queueResponse(session, STATUS_OK, NULL);
+}
+
+
+/*******************************************************************************
+ *   struct session* createSession(int connectionP_FD,
+ *                                 struct sockaddr_storage*, socklen_t, int)
+ * Description: allocates the state for a newly accepted client connection
+ * Input:
+ *   int connectionP_FD - the accepted connection P socket
+ *   struct sockaddr_storage* clientAddress - where connection P came from
+ *   socklen_t addressLength - the length of the address
+ *   int hostPort - the port the server is listening on
+ * Output: the new session
+*******************************************************************************/
+struct session* createSession(int connectionP_FD, struct sockaddr_storage* clientAddress,
+                              socklen_t addressLength, int hostPort) {
+  struct session* session = calloc(1, sizeof(struct session));
+  assert(session != NULL);
+  session->p.fd = connectionP_FD;
+  session->p.role = ROLE_P;
+  session->p.owner = session;
+  session->dataListener.fd = -1;
+  session->dataListener.role = ROLE_DATA_LISTEN;
+  session->dataListener.owner = session;
+  session->clientAddress = *clientAddress;
+  session->clientAddressLength = addressLength;
+  if (clientAddress->ss_family == AF_INET6) {
+    session->clientKey = ((struct sockaddr_in6*)clientAddress)->sin6_addr;
+  }
+  else {
+    // the IPv4-mapped IPv6 address, as a dual-stack socket would give
+    session->clientKey.s6_addr[10] = 0xff;
+    session->clientKey.s6_addr[11] = 0xff;
+    memcpy(&session->clientKey.s6_addr[12], &((struct sockaddr_in*)clientAddress)->sin_addr, 4);
+  }
+  session->bucket = -1;
+  session->requestKind = -1;
+  session->acceptedAt = monotonicNanos();
+  setSocketPriority(connectionP_FD, CLASS_INTERACTIVE);
+  int i;
+  for (i = 0; i < MAX_STRIPES; i++) {
+    session->stripes[i].q.fd = -1;
+    session->stripes[i].q.role = ROLE_Q;
+    session->stripes[i].q.index = i;
+    session->stripes[i].q.owner = session;
+    session->stripes[i].ringSlot = -1;
+  }
+  session->stripeCount = 1;
+  session->fileFD = -1;
+  session->list.fd = -1;
+  session->directoryFD = fcntl(ROOT_FD, F_DUPFD_CLOEXEC, 0);
+  strcpy(session->directory, ROOT_PATH);
+  session->state = STATE_HELLO;
+  session->hostPort = hostPort;
+  formatAddress(clientAddress, session->clientIP, sizeof(session->clientIP));
+  return session;
+}
+
+
+/*******************************************************************************
+ *          void addSession(struct server* server, struct session* session)
+ * Description: adds a session to the server's list of open sessions
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the new session
+ * Output: none
+*******************************************************************************/
+void addSession(struct server* server, struct session* session) {
+  session->prev = NULL;
+  session->next = server->sessions;
+  if (server->sessions != NULL) {
+    server->sessions->prev = session;
+  }
+  server->sessions = session;
+  server->sessionCount++;
+}
+
+
+/*******************************************************************************
+ *         void closeSession(struct server* server, struct session* session)
+ * Description: closes every connection and any open file. The session is
+ *   freed by freeClosedSessions() once the current batch of events is done
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session to close
+ * Output: none
+*******************************************************************************/
+void closeSession(struct server* server, struct session* session) {
+  int i;
+  setInterest(server, &session->p, 0);
+  close(session->p.fd);
+  if (session->dataListener.fd >= 0) {
+    setInterest(server, &session->dataListener, 0);
+    close(session->dataListener.fd);
+  }
+  for (i = 0; i < session->stripeCount; i++) {
+    setInterest(server, &session->stripes[i].q, 0);
+    releaseRingSlot(server->ring, &session->stripes[i]);
+    if (session->stripes[i].q.fd >= 0) {
+      close(session->stripes[i].q.fd);
+    }
+    stopCompressor(&session->stripes[i]);
+  }
+  if (session->fileFD >= 0) {
+    releaseFile(session, session->fileFD);
+  }
+  stopListingStream(server, session, FALSE);
+  stopTree(session);
+  stopBatch(session);
+  stopDelta(session);
+  stopUpload(session);
+  close(session->directoryFD);
+  freeBuffer(&session->input);
+  freeBuffer(&session->reply);
+  freeBuffer(&session->data);
+  if (session->prev != NULL) {
+    session->prev->next = session->next;
+  }
+  else {
+    server->sessions = session->next;
+  }
+  if (session->next != NULL) {
+    session->next->prev = session->prev;
+  }
+  // events for the session may still be waiting in the current batch
+  session->state = STATE_CLOSED;
+  session->next = server->closed;
+  server->closed = session;
+  server->sessionCount--;
+}
+
+
+/*******************************************************************************
+ *               void freeClosedSessions(struct server* server)
+ * Description: frees the sessions closed while handling a batch of events
+ * Input: struct server* server - the event loop
+ * Output: none
+*******************************************************************************/
+void freeClosedSessions(struct server* server) {
+  while (server->closed != NULL) {
+    struct session* session = server->closed;
+    server->closed = session->next;
+    free(session);
+  }
+}
+
+
+/*******************************************************************************
+ *           void finishRequest(struct server*, struct session*)
+ * Description: clears the state of the request the session just finished,
+ *   ready for the next one. The extra connections of a striped get are closed,
+ *   the digest of a whole file that was sent is cached, and the request's
+ *   latency is recorded
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session whose response was delivered
+ * Output: none
+*******************************************************************************/
+void finishRequest(struct server* server, struct session* session) {
+  int i;
+  if (session->requestStart != 0) {
+    recordLatency(session);
+    session->requestStart = 0;
+  }
+  if (session->cacheDigest) {
+    saveFileDigest(session);
+    session->cacheDigest = FALSE;
+  }
+  if (session->fileFD >= 0) {
+    releaseFile(session, session->fileFD);
+    session->fileFD = -1;
+  }
+  stopListingStream(server, session, FALSE);
+  stopTree(session);
+  stopBatch(session);
+  stopDelta(session);
+  stopUpload(session);
+  for (i = 0; i < session->stripeCount; i++) {
+    struct stripe* stripe = &session->stripes[i];
+    if (i > 0) {
+      setInterest(server, &stripe->q, 0);
+      if (stripe->q.fd >= 0) {
+        close(stripe->q.fd);
+      }
+      stripe->q.fd = -1;
+      stripe->connected = FALSE;
+      stripe->accepting = FALSE;
+    }
+    stripe->offset = 0;
+    stripe->end = 0;
+    stripe->dataEnd = 0;
+    stripe->headerLength = 0;
+    stripe->headerSent = 0;
+    stripe->trailerLength = 0;
+    stripe->trailerSent = 0;
+    stripe->dataBase = 0;
+    stripe->checksum = FALSE;
+    stripe->digestKnown = FALSE;
+    stripe->throttledUntil = 0;
+    stopCompressor(stripe);
+  }
+  session->stripeCount = 1;
+  session->sparse = FALSE;
+  setRequestClass(session, CLASS_INTERACTIVE);
+  resetBuffer(&session->reply);
+  resetBuffer(&session->data);
+}
+
+
+/*******************************************************************************
+ *                  int isStreaming(struct session* session)
+ * Description: tells whether a listing, directory tree, batch or delta is
+ *   still being read for connection Q, so there is more to send than what is
+ *   queued, or an upload is still arriving on it
+ * Input: struct session* session - the session to check
+ * Output: TRUE while more data is still to be produced
+*******************************************************************************/
+int isStreaming(struct session* session) {
+  return session->list.fd >= 0 || (session->tree != NULL && !session->tree->done) ||
+         (session->batch != NULL && !session->batch->done) ||
+         (session->delta != NULL && !session->delta->done) || receivingUpload(session);
+}
+
+
+/*******************************************************************************
+ *        int flushConnectionQ(struct server*, struct session*, int index)
+ * Description: sends as much of the pending frames, listing or file on
+ *   one connection Q as the socket will take without blocking. At most one
+ *   CHUNK_SIZE piece of a file or one directory batch of a streamed listing
+ *   is sent per call so that one large transfer can't starve the others, and
+ *   no more than the rate limits allow
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session to send for
+ *   int index - the stripe to send on
+ * Output: TRUE once everything has been sent, FALSE if more remains, or -1 if
+ *   the connection failed
+*******************************************************************************/
+int flushConnectionQ(struct server* server, struct session* session, int index) {
+  struct stripe* stripe = &session->stripes[index];
+  struct buffer* data = &session->data;
+  int streamed = FALSE;
+  off_t allowance = 0;
+  if (!stripe->connected) {
+    // a connection Q that was never opened has nothing to send
+    return stripe->q.fd < 0 && !stripe->accepting;
+  }
+  // in a sparse file the next hole and extent follow each extent sent
+  if (session->sparse && stripe->offset == stripe->dataEnd && stripe->offset < stripe->end) {
+    queueExtent(session, stripe);
+  }
+
+  while (stripe->headerSent < stripe->headerLength) {
+    ssize_t sent = send(stripe->q.fd, stripe->header + stripe->headerSent,
+                        stripe->headerLength - stripe->headerSent, MSG_NOSIGNAL | MSG_MORE);
+    if (sent < 0) {
+      return errno == EAGAIN || errno == EINTR ? FALSE : -1;
+    }
+    stripe->headerSent += sent;
+    chargeBandwidth(session, sent);
+  }
+
+  while (index == 0) {
+    while (data->sent < data->length) {
+      if (allowance <= 0 && (allowance = sendAllowance(server, session, stripe)) == 0) {
+        return FALSE;
+      }
+      // the last frames of a response aren't corked, or they would wait
+      // for the kernel's 200 ms cork timeout on a persistent session
+      int more = session->fileFD >= 0 || isStreaming(session) ? MSG_MORE : 0;
+      ssize_t sent = send(stripe->q.fd, data->bytes + data->sent,
+                          min(data->length - data->sent, allowance), MSG_NOSIGNAL | more);
+      if (sent < 0) {
+        return errno == EAGAIN || errno == EINTR ? FALSE : -1;
+      }
+      data->sent += sent;
+      allowance -= sent;
+      chargeBandwidth(session, sent);
+    }
+    if (streamed || !isStreaming(session) ||
+        (session->fileFD >= 0 && (stripe->offset < stripe->end ||
+                                  (stripe->compressFile && stripe->compressor->output.sent <
+                                   stripe->compressor->output.length)))) {
+      break;
+    }
+    if (session->list.fd >= 0) {
+      streamListing(server, session);
+    }
+    else if (session->delta != NULL) {
+      if (!streamDelta(session)) {
+        return -1;
+      }
+    }
+    else if (session->upload != NULL) {
+      // an upload arrives on connection Q rather than being sent on it
+      break;
+    }
+    else if (session->batch != NULL) {
+      streamBatch(server, session);
+    }
+    else {
+      streamTree(server, session);
+    }
+    streamed = TRUE;
+  }
+
+  if (session->fileFD >= 0 && stripe->compressFile) {
+    int sent = sendCompressed(server, session, stripe);
+    if (sent != TRUE) {
+      return sent;
+    }
+  }
+  else if (session->fileFD >= 0 && stripe->offset < stripe->end) {
+    if (allowance <= 0 && (allowance = sendAllowance(server, session, stripe)) == 0) {
+      return FALSE;
+    }
+    if (stripe->method == TRANSMIT_URING && stripe->ringSlot < 0 &&
+        !acquireRingSlot(server->ring, stripe, session->fileFD)) {
+      // every buffer of the ring is taken, so this range is sent directly
+      stripe->method = TRANSMIT_SENDFILE;
+    }
+    if (stripe->method == TRANSMIT_URING) {
+      chargeBandwidth(session, queueRingChunk(server->ring, stripe));
+      return FALSE;
+    }
+    off_t offset = stripe->offset;
+    size_t count = min(min(stripe->dataEnd - stripe->offset, CHUNK_SIZE), allowance);
+    ssize_t sent;
+    if (stripe->method == TRANSMIT_MEMORY) {
+      // a cached file is sent straight from memory
+      sent = send(stripe->q.fd, session->cachedFile->bytes + offset, count, MSG_NOSIGNAL | MSG_MORE);
+      stripe->offset += sent > 0 ? sent : 0;
+    }
+    else {
+      sent = transmitChunk(session->fileFD, stripe->q.fd, &stripe->offset, count,
+                           &stripe->method, server->splicePipe, server->copyBuffer);
+    }
+    if (sent < 0) {
+      return errno == EAGAIN || errno == EINTR ? FALSE : -1;
+    }
+    chargeBandwidth(session, sent);
+    if (sent == 0) {
+      logMessage(LOG_ERROR, "ERROR: file send error: file truncated");
+      countMetric(&WORKER_METRICS->fileErrors, 1);
+      return -1;
+    }
+    if (!digestFileRange(server, session, stripe, offset, sent)) {
+      return -1;
+    }
+    if (stripe->offset < stripe->end) {
+      return FALSE;
+    }
+  }
+  if (index == 0 && isStreaming(session)) {
+    return FALSE;
+  }
+  if (session->fileFD >= 0 && session->tree == NULL && session->batch == NULL && stripe->trailerLength == 0) {
+    queueTrailer(session, stripe);
+  }
+
+  while (stripe->trailerSent < stripe->trailerLength) {
+    ssize_t sent = send(stripe->q.fd, stripe->trailer + stripe->trailerSent,
+                        stripe->trailerLength - stripe->trailerSent, MSG_NOSIGNAL);
+    if (sent < 0) {
+      return errno == EAGAIN || errno == EINTR ? FALSE : -1;
+    }
+    stripe->trailerSent += sent;
+    chargeBandwidth(session, sent);
+  }
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ *            int flushConnectionP(struct session* session)
+ * Description: sends as much of the queued frames on connection P as the
+ *   socket will take without blocking
+ * Input: struct session* session - the session to send for
+ * Output: TRUE once the frames have been sent, FALSE if more remains, or -1 if
+ *   the connection failed
+*******************************************************************************/
+int flushConnectionP(struct session* session) {
+  struct buffer* reply = &session->reply;
+  while (reply->sent < reply->length) {
+    ssize_t sent = send(session->p.fd, reply->bytes + reply->sent,
+                        reply->length - reply->sent, MSG_NOSIGNAL);
+    if (sent < 0) {
+      return errno == EAGAIN || errno == EINTR ? FALSE : -1;
+    }
+    reply->sent += sent;
+  }
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ *            int flushSession(struct server*, struct session*)
+ * Description: pushes the session's pending output on every connection and
+ *   updates the events the session waits for. Connection P is read whenever
+ *   there is room for more requests and written while frames are waiting
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session to send for
+ * Output: TRUE once everything has been delivered, FALSE if more remains, or
+ *   -1 if the session was closed because a connection failed
+*******************************************************************************/
+int flushSession(struct server* server, struct session* session) {
+  int allDone = TRUE;
+  int i;
+  int pDone = flushConnectionP(session);
+  for (i = 0; i < session->stripeCount && pDone >= 0; i++) {
+    int qDone = flushConnectionQ(server, session, i);
+    if (qDone < 0) {
+      pDone = -1;
+    }
+    else if (session->stripes[i].connected) {
+      uint32_t events = qDone || waitingForRing(server, &session->stripes[i]) ||
+                        session->stripes[i].throttledUntil != 0 ? 0 : EPOLLOUT;
+      if (i == 0 && receivingUpload(session)) {
+        events = EPOLLIN;
+      }
+      setInterest(server, &session->stripes[i].q, events);
+    }
+    allDone = allDone && qDone;
+  }
+  if (pDone < 0) {
+    logMessage(LOG_ERROR, "ERROR: connection to %s lost", session->clientIP);
+    countMetric(&WORKER_METRICS->connectionErrors, 1);
+    closeSession(server, session);
+    return -1;
+  }
+  uint32_t events = 0;
+  if (!session->requestsClosed && session->state != STATE_CLOSING &&
+      session->input.length - session->input.sent < MAX_INPUT_LENGTH) {
+    events |= EPOLLIN;
+  }
+  if (!pDone) {
+    events |= EPOLLOUT;
+  }
+  setInterest(server, &session->p, events);
+  return allDone && pDone;
+}
+
+
+/*******************************************************************************
+ *     void runRequest(struct server*, struct session*, struct frame*)
+ * Description: decodes a request frame and carries it out. Its response is
+ *   queued for connection P, and any listing or file for connection Q. The
+ *   request is then put in its scheduling class
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session the request belongs to
+ *   struct frame* frame - the request
+ * Output: none
+*******************************************************************************/
+void runRequest(struct server* server, struct session* session, struct frame* frame) {
+  struct request* request = &session->request;
+  unsigned char* name;
+  size_t nameLength;
+
+  session->requestStart = monotonicNanos();
+  request->type = frame->type;
+  request->id = frame->requestId;
+  request->offset = getUintAttribute(frame, ATTR_OFFSET, 0);
+  request->length = getUintAttribute(frame, ATTR_LENGTH, 0);
+  request->stripes = getUintAttribute(frame, ATTR_STRIPES, 1);
+  request->fileSize = getUintAttribute(frame, ATTR_FILE_SIZE, 0);
+  request->recursive = getUintAttribute(frame, ATTR_RECURSIVE, FALSE);
+  request->compression = getUintAttribute(frame, ATTR_COMPRESSION, COMPRESS_NONE);
+  request->compressionLevel = getUintAttribute(frame, ATTR_COMPRESSION_LEVEL, DEFAULT_COMPRESSION_LEVEL);
+  request->checksum = getUintAttribute(frame, ATTR_CHECKSUM, CHECKSUM_NONE);
+  request->blockSize = getUintAttribute(frame, ATTR_BLOCK_SIZE, 0);
+  if (!findAttribute(frame, ATTR_SIGNATURES, &request->signatures, &request->signatureLength)) {
+    request->signatures = NULL;
+  }
+  if (!findAttribute(frame, ATTR_NAMES, &request->names, &request->namesLength)) {
+    request->names = NULL;
+    request->namesLength = 0;
+  }
+  request->showHidden = getUintAttribute(frame, ATTR_SHOW_HIDDEN, FALSE);
+  request->sort = getUintAttribute(frame, ATTR_SORT, SORT_NONE);
+  request->cursor = getUintAttribute(frame, ATTR_CURSOR, 0);
+  request->pageSize = getUintAttribute(frame, ATTR_PAGE_SIZE, 0);
+  session->requestKind = requestKind(request);
+  session->firstByteSent = FALSE;
+  if (session->requestKind >= 0) {
+    countMetric(&WORKER_METRICS->requests[session->requestKind], 1);
+  }
+  request->name[0] = '\0';
+  request->filter[0] = '\0';
+  if (findAttribute(frame, ATTR_NAME, &name, &nameLength)) {
+    if (nameLength > PATH_MAX || memchr(name, '\0', nameLength) != NULL) {
+      queueResponse(session, STATUS_BAD_REQUEST, "Invalid name");
+      return;
+    }
+    memcpy(request->name, name, nameLength);
+    request->name[nameLength] = '\0';
+  }
+  if (findAttribute(frame, ATTR_FILTER, &name, &nameLength)) {
+    if (nameLength > MAX_FILE_NAME_LENGTH || memchr(name, '\0', nameLength) != NULL) {
+      queueResponse(session, STATUS_BAD_REQUEST, "Invalid filter");
+      return;
+    }
+    memcpy(request->filter, name, nameLength);
+    request->filter[nameLength] = '\0';
+  }
+  if ((request->sort & SORT_KEY_MASK) > SORT_MTIME) {
+    queueResponse(session, STATUS_BAD_REQUEST, "Invalid sort order");
+    return;
+  }
+
+  switch (request->type) {
+    case FRAME_LIST:
+      sendDirectoryContents(server, session);
+      break;
+    case FRAME_GET:
+      if (request->recursive) {
+        sendTree(server, session);
+      }
+      else if (request->names != NULL) {
+        sendBatch(server, session);
+      }
+      else {
+        sendFile(server, session);
+      }
+      break;
+    case FRAME_CD:
+      changeDirectory(server, session);
+      break;
+    case FRAME_PUT:
+      receiveFile(session);
+      break;
+    case -1:
+      queueResponse(session, STATUS_VERSION_MISMATCH, "Unsupported protocol version");
+      break;
+    default:
+      queueResponse(session, STATUS_UNSUPPORTED, "Invalid command");
+      break;
+  }
+  setRequestClass(session, classifyRequest(session));
+}
+
+
+/*******************************************************************************
+ *           void startNextRequest(struct server*, struct session*)
+ * Description: runs the pipelined requests of a session in order. Each
+ *   request frame is taken from the data received on connection P and run.
+ *   Responses that can be sent right away are finished here; otherwise the
+ *   event loop continues them. When no complete request is waiting the
+ *   session goes idle, and once ftclient has closed its side of connection P
+ *   the session is closed
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - a connected session with nothing in flight
+ * Output: none
+*******************************************************************************/
+void startNextRequest(struct server* server, struct session* session) {
+  struct frame frame;
+  int taken;
+
+  while ((taken = takeFrame(session, &frame)) == TRUE) {
+    session->state = STATE_SEND;
+    runRequest(server, session, &frame);
+    int done = flushSession(server, session);
+    if (done != TRUE) {
+      return;
+    }
+    finishRequest(server, session);
+  }
+
+  if (taken < 0) {
+    logMessage(LOG_ERROR, "ERROR: malformed frame from %s", session->clientIP);
+    closeSession(server, session);
+    return;
+  }
+  if (session->requestsClosed) {
+    closeSession(server, session);
+    return;
+  }
+  session->state = STATE_IDLE;
+  flushSession(server, session);
+}
+
+
+/*******************************************************************************
+ *         void continueSending(struct server*, struct session*)
+ * Description: pushes the session's pending output and, once everything has
+ *   been delivered, moves the session on to its next request, or closes it
+ *   if it was rejected
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - a session in STATE_SEND or STATE_CLOSING
+ * Output: none
+*******************************************************************************/
+void continueSending(struct server* server, struct session* session) {
+  int done = flushSession(server, session);
+  if (done != TRUE) {
+    return;
+  }
+  if (session->state == STATE_CLOSING) {
+    closeSession(server, session);
+    return;
+  }
+  finishRequest(server, session);
+  startNextRequest(server, session);
+}
+
+
+/*******************************************************************************
+ *               void resumeThrottled(struct server* server)
+ * Description: carries on sending for the sessions whose stripes were held
+ *   back by a rate limit and whose wait is over, and works out when the next
+ *   of the others is due. Each session that gets to send moves to the back of
+ *   the list, so sessions sharing a bucket take turns at the tokens that
+ *   built up
+ * Input: struct server* server - the event loop
+ * Output: none
+*******************************************************************************/
+void resumeThrottled(struct server* server) {
+  int64_t now = monotonicNanos();
+  struct session* session;
+  struct session* next;
+  struct session* last;
+  struct session* tail;
+
+  if (server->throttleDeadline == 0 || now < server->throttleDeadline) {
+    return;
+  }
+  server->throttleDeadline = 0;
+  now += THROTTLE_SLACK;
+  tail = server->sessions;
+  while (tail != NULL && tail->next != NULL) {
+    tail = tail->next;
+  }
+  last = tail;
+  for (session = server->sessions; session != NULL; session = next) {
+    int due = 0;
+    int sent = FALSE;
+    int i;
+    next = session == last ? NULL : session->next;
+    for (i = 0; i < session->stripeCount; i++) {
+      struct stripe* stripe = &session->stripes[i];
+      if (stripe->throttledUntil != 0 && stripe->throttledUntil <= now) {
+        stripe->throttledUntil = 0;
+        due |= 1 << i;
+      }
+      else if (stripe->throttledUntil != 0 &&
+               (server->throttleDeadline == 0 || stripe->throttledUntil < server->throttleDeadline)) {
+        server->throttleDeadline = stripe->throttledUntil;
+      }
+    }
+    if (!due) {
+      continue;
+    }
+    continueSending(server, session);
+    for (i = 0; i < session->stripeCount; i++) {
+      sent = sent || ((due & (1 << i)) && session->stripes[i].throttledUntil == 0);
+    }
+    if (sent && session->state != STATE_CLOSED && session != tail) {
+      if (session->prev != NULL) {
+        session->prev->next = session->next;
+      }
+      else {
+        server->sessions = session->next;
+      }
+      session->next->prev = session->prev;
+      session->prev = tail;
+      session->next = NULL;
+      tail->next = session;
+      tail = session;
+    }
+  }
+}
+
+
+/*******************************************************************************
+ *              void handleRingCompletions(struct server* server)
+ * Description: collects the completed operations of the worker's io_uring.
+ *   A read adds the bytes it brought into the buffer to the stripe's digest.
+ *   Once all of a slot's operations are done, a fully sent chunk moves the
+ *   stripe on. Then each session whose chunk finished carries on sending,
+ *   which queues its next chunk, or is closed if the chunk failed
+ * Input: struct server* server - the event loop
+ * Output: none
+*******************************************************************************/
+void handleRingCompletions(struct server* server) {
+  struct ring* ring = server->ring;
+  struct session* sessions[URING_SLOTS];
+  int failures[URING_SLOTS];
+  int count = 0;
+  unsigned head = *ring->cqHead;
+  int i;
+
+  while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* completion = &ring->cqes[head & *ring->cqMask];
+    struct ringSlot* slot = &ring->slots[completion->user_data / URING_OPS];
+    struct stripe* stripe = slot->owner;
+    int op = completion->user_data % URING_OPS;
+    int result = completion->res;
+    head++;
+    slot->pending--;
+    if (op == URING_OP_READ && result > 0) {
+      slot->length = result;
+      if (stripe != NULL) {
+        updateDigest(stripe, slot->buffer, result);
+      }
+    }
+    else if (op == URING_OP_READ && result == 0) {
+      slot->failed = -1;
+    }
+    else if (op == URING_OP_SEND && result >= 0) {
+      slot->sent += result;
+    }
+    // a short read cancels the send linked to it, which is then sent again
+    else if (result < 0 && op != URING_OP_CLEAR && !(op == URING_OP_SEND && result == -ECANCELED)) {
+      slot->failed = -result;
+    }
+    if (slot->pending > 0 || stripe == NULL) {
+      continue;
+    }
+
+    sessions[count] = stripe->q.owner;
+    failures[count] = slot->failed;
+    count++;
+    if (!slot->failed && slot->sent == slot->length) {
+      stripe->offset += slot->length;
+      slot->length = 0;
+      slot->sent = 0;
+      if (stripe->offset >= stripe->dataEnd) {
+        releaseRingSlot(ring, stripe);
+      }
+    }
+  }
+  __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+  for (i = 0; i < count; i++) {
+    // carrying on with one session may have closed another
+    if (sessions[i]->state == STATE_CLOSED) {
+      continue;
+    }
+    if (failures[i]) {
+      logMessage(LOG_ERROR, "ERROR: file send error: %s",
+                 failures[i] < 0 ? "file truncated" : strerror(failures[i]));
+      countMetric(&WORKER_METRICS->fileErrors, 1);
+      closeSession(server, sessions[i]);
+      continue;
+    }
+    continueSending(server, sessions[i]);
+  }
+}
+
+
+/*******************************************************************************
+ *          int openDataListener(struct server*, struct session*)
+ * Description: opens the socket a passive-mode session's connections Q are
+ *   made to. It listens on a port chosen by the kernel, on the address
+ *   ftclient reached connection P at, so it works through NAT and firewalls
+ *   that only let connections in to the server
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session
+ * Output: the port listened on, or -1 if no socket could be opened
+*******************************************************************************/
+int openDataListener(struct server* server, struct session* session) {
+  struct sockaddr_storage address;
+  socklen_t length = sizeof(address);
+  int disable = 0;
+
+  if (getsockname(session->p.fd, (struct sockaddr*)&address, &length) < 0) {
+    return -1;
+  }
+  if (address.ss_family == AF_INET6) {
+    ((struct sockaddr_in6*)&address)->sin6_port = 0;
+  }
+  else {
+    ((struct sockaddr_in*)&address)->sin_port = 0;
+  }
+  int socketFD = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (socketFD < 0) {
+    return -1;
+  }
+  if (address.ss_family == AF_INET6) {
+    setsockopt(socketFD, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(disable));
+  }
+  if (bind(socketFD, (struct sockaddr*)&address, length) < 0 || listen(socketFD, MAX_STRIPES) < 0 ||
+      getsockname(socketFD, (struct sockaddr*)&address, &length) < 0) {
+    close(socketFD);
+    return -1;
+  }
+  session->dataListener.fd = socketFD;
+  setInterest(server, &session->dataListener, EPOLLIN);
+  return ntohs(address.ss_family == AF_INET6 ? ((struct sockaddr_in6*)&address)->sin6_port :
+                                               ((struct sockaddr_in*)&address)->sin_port);
+}
+
+
+/*******************************************************************************
+ *        void acceptDataConnections(struct server*, struct session*)
+ * Description: accepts the connections Q ftclient makes to a passive-mode
+ *   session. The first becomes the session's connection Q, and later ones
+ *   become the stripes of a striped get in turn. A connection from another
+ *   host, or one nothing is waiting for, is closed. An accepted connection is
+ *   already connected, so it is handed to the event loop as a connect that
+ *   has completed
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session
+ * Output: none
+*******************************************************************************/
+void acceptDataConnections(struct server* server, struct session* session) {
+  struct sockaddr_storage address;
+  socklen_t length;
+
+  while (TRUE) {
+    length = sizeof(address);
+    int socketFD = accept4(session->dataListener.fd, (struct sockaddr*)&address, &length,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (socketFD < 0) {
+      return;
+    }
+    struct stripe* stripe = NULL;
+    int i;
+    for (i = 0; i < MAX_STRIPES && stripe == NULL; i++) {
+      if (session->stripes[i].accepting) {
+        stripe = &session->stripes[i];
+      }
+    }
+    if (stripe == NULL || !sameHost(&address, &session->clientAddress)) {
+      close(socketFD);
+      continue;
+    }
+    setNoDelay(socketFD);
+    stripe->accepting = FALSE;
+    stripe->q.fd = socketFD;
+    setInterest(server, &stripe->q, EPOLLOUT);
+  }
+}
+
+
+/*******************************************************************************
+ *     void processHello(struct server*, struct session*, struct frame*)
+ * Description: answers the HELLO frame that opens every session. The server
+ *   replies with its own HELLO holding the capabilities both ends share and
+ *   starts connecting on connection Q. A passive-mode client sends port 0
+ *   instead of its data port; the server then listens for connection Q and
+ *   puts that port in its HELLO. A client speaking another protocol
+ *   version, or one that doesn't say where to connect, is told so and the
+ *   session is closed
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - a session in STATE_HELLO
+ *   struct frame* frame - the first frame received on connection P
+ * Output: none
+*******************************************************************************/
+void processHello(struct server* server, struct session* session, struct frame* frame) {
+  int port = getUintAttribute(frame, ATTR_DATA_PORT, 0);
+  size_t start;
+
+  session->request.id = frame->requestId;
+  session->capabilities = getUintAttribute(frame, ATTR_CAPABILITIES, 0) & SERVER_CAPABILITIES;
+  if (frame->type == FRAME_HELLO && port == 0 && (session->capabilities & CAP_PASSIVE)) {
+    // passive mode: ftclient connects to the server for connection Q
+    port = openDataListener(server, session);
+  }
+  else if (port < MIN_PORT_NUMBER || port > MAX_PORT_NUMBER) {
+    port = -1;
+  }
+  if (frame->type != FRAME_HELLO || port < 0) {
+    int status = frame->type == -1 ? STATUS_VERSION_MISMATCH : STATUS_BAD_REQUEST;
+    char* message = frame->type == -1 ? "Unsupported protocol version" : "Expected HELLO";
+    logMessage(LOG_ERROR, "ERROR: %s from %s", message, session->clientIP);
+    start = beginFrame(&session->reply, FRAME_HELLO, status, frame->requestId);
+    addAttribute(&session->reply, ATTR_MESSAGE, message, strlen(message));
+    finishFrame(&session->reply, start);
+    session->state = STATE_CLOSING;
+    continueSending(server, session);
+    return;
+  }
+
+  session->clientPort = port;
+  start = beginFrame(&session->reply, FRAME_HELLO, STATUS_OK, frame->requestId);
+  addUintAttribute(&session->reply, ATTR_CAPABILITIES, session->capabilities, 4);
+  addUintAttribute(&session->reply, ATTR_STRIPES, MAX_STRIPES, 2);
+  if (session->dataListener.fd >= 0) {
+    addUintAttribute(&session->reply, ATTR_DATA_PORT, port, 2);
+  }
+  finishFrame(&session->reply, start);
+
+  session->state = STATE_CONNECT_Q;
+  if (session->dataListener.fd >= 0) {
+    session->stripes[0].accepting = TRUE;
+  }
+  else {
+    session->stripes[0].q.fd = openConnectionQ(&session->clientAddress, session->clientAddressLength,
+                                               session->clientPort);
+    if (session->stripes[0].q.fd < 0) {
+      closeSession(server, session);
+      return;
+    }
+    setInterest(server, &session->stripes[0].q, EPOLLOUT);
+  }
+  flushSession(server, session);
+}
+
+
+/*******************************************************************************
+ *                void acceptClients(struct server* server)
+ * Description: accepts every pending connection on the listen socket and
+ *   creates a session for each one
+ * Input: struct server* server - the event loop
+ * Output: none
+*******************************************************************************/
+void acceptClients(struct server* server) {
+  struct sockaddr_storage clientAddress;
+  socklen_t sizeOfClientInfo;
+
+  while (TRUE) {
+    sizeOfClientInfo = sizeof(clientAddress);
+    int connectionP_FD = accept4(server->listener.fd, (struct sockaddr*)&clientAddress,
+                                 &sizeOfClientInfo, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (connectionP_FD < 0) {
+      if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+        logMessage(LOG_ERROR, "ERROR on accepting incoming connection: %s", strerror(errno));
+      }
+      return;
+    }
+    setNoDelay(connectionP_FD);
+    /* Source for getting clientIP address from an established connection
+       https://stackoverflow.com/questions/4282369/determining-the-ip-address-
+                                             of-a-connected-client-on-the-server
+    */
+    struct session* session = createSession(connectionP_FD, &clientAddress, sizeOfClientInfo,
+                                            server->portNumber);
+    logMessage(LOG_DEBUG, "Connection from %s", session->clientIP);
+    countMetric(&server->metrics.connections, 1);
+
+    addSession(server, session);
+    setInterest(server, &session->p, EPOLLIN);
+  }
+}
+
+
+/*******************************************************************************
+ *                int readConnectionP(struct session* session)
+ * Description: reads whatever has arrived on connection P into the session's
+ *   input buffer. Frames already consumed are discarded first, and the buffer
+ *   grows as needed up to the size of the largest allowed frame
+ * Input: struct session* session - the session to read for
+ * Output: TRUE if anything changed, FALSE if nothing was ready to read.
+ *   requestsClosed is set once ftclient has closed its side of connection P
+*******************************************************************************/
+int readConnectionP(struct session* session) {
+  struct buffer* input = &session->input;
+  if (input->sent > 0) {
+    memmove(input->bytes, input->bytes + input->sent, input->length - input->sent);
+    input->length -= input->sent;
+    input->sent = 0;
+  }
+  if (input->length == input->capacity) {
+    size_t capacity = input->capacity == 0 ? INPUT_BLOCK_SIZE : input->capacity * 2;
+    input->bytes = realloc(input->bytes, min(capacity, MAX_INPUT_LENGTH));
+    assert(input->bytes != NULL);
+    input->capacity = min(capacity, MAX_INPUT_LENGTH);
+  }
+
+  ssize_t charsRead = recv(session->p.fd, input->bytes + input->length,
+                           input->capacity - input->length, 0);
+  if (charsRead < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return FALSE;
+  }
+  if (charsRead <= 0) {
+    session->requestsClosed = TRUE;
+  }
+  else {
+    input->length += charsRead;
+  }
+  return TRUE;
+}
+
+
+/*******************************************************************************
+ *        void handleConnectionP(struct server*, struct session*, uint32_t)
+ * Description: sends queued frames when connection P becomes writable, and
+ *   reads the HELLO or the next pipelined requests arriving on it
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session the event belongs to
+ *   uint32_t events - the epoll events that occurred
+ * Output: none
+*******************************************************************************/
+void handleConnectionP(struct server* server, struct session* session, uint32_t events) {
+  if (events & EPOLLOUT) {
+    if (session->state == STATE_SEND || session->state == STATE_CLOSING) {
+      continueSending(server, session);
+      return;
+    }
+    if (flushSession(server, session) < 0) {
+      return;
+    }
+  }
+  if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)) || session->requestsClosed ||
+      !readConnectionP(session)) {
+    return;
+  }
+
+  if (session->state == STATE_HELLO) {
+    struct frame frame;
+    int taken = takeFrame(session, &frame);
+    if (taken == TRUE) {
+      processHello(server, session, &frame);
+    }
+    else if (taken < 0 || session->requestsClosed) {
+      logMessage(LOG_ERROR, "ERROR: malformed HELLO from %s", session->clientIP);
+      closeSession(server, session);
+    }
+  }
+  else if (session->state == STATE_IDLE) {
+    startNextRequest(server, session);
+  }
+  else {
+    // the next requests wait in the buffer until the current one is sent
+    flushSession(server, session);
+  }
+}
+
+
+/*******************************************************************************
+ *     void handleConnectionQ(struct server*, struct session*, int, uint32_t)
+ * Description: finishes connecting a connection Q, or sends more data when a
+ *   connection Q becomes writable. Once the session's connection Q is
+ *   established the requests that have arrived in the meantime are run
+ * Input:
+ *   struct server* server - the event loop
+ *   struct session* session - the session the event belongs to
+ *   int index - the stripe the event belongs to
+ *   uint32_t events - the epoll events that occurred
+ * Output: none
+*******************************************************************************/
+void handleConnectionQ(struct server* server, struct session* session, int index, uint32_t events) {
+  struct stripe* stripe = &session->stripes[index];
+  if (stripe->q.fd < 0) {
+    // the stripe was closed earlier in this batch of events
+    return;
+  }
+  if (!stripe->connected) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(stripe->q.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error != 0) {
+      logMessage(LOG_ERROR, "ERROR: Could not connect on socket connetion Q: %s", strerror(error));
+      countMetric(&WORKER_METRICS->connectionErrors, 1);
+      closeSession(server, session);
+      return;
+    }
+    stripe->connected = TRUE;
+    setSocketPriority(stripe->q.fd, session->requestClass);
+    if (session->state == STATE_CONNECT_Q) {
+      setInterest(server, &stripe->q, 0);
+      startNextRequest(server, session);
+      return;
+    }
+  }
+  if (index == 0 && receivingUpload(session) && !receiveUpload(server, session)) {
+    logMessage(LOG_ERROR, "ERROR: connection to %s lost", session->clientIP);
+    countMetric(&WORKER_METRICS->connectionErrors, 1);
+    closeSession(server, session);
+    return;
+  }
+  continueSending(server, session);
+}
+
+
+/*******************************************************************************
+ *                  void beginShutdown(struct server* server)
+ * Description: stops the server accepting new connections. Sessions already
+ *   in progress are allowed to finish
+ * Input: struct server* server - the event loop
+ * Output: none
+*******************************************************************************/
+void beginShutdown(struct server* server) {
+  uint64_t value;
+  read(server->wake.fd, &value, sizeof(value));
+  if (server->draining) {
+    return;
+  }
+  server->draining = TRUE;
+  setInterest(server, &server->listener, 0);
+  close(server->listener.fd);
+  server->listener.fd = -1;
+  logMessage(LOG_INFO, "Worker %d shutting down, waiting for %d session(s) to finish",
+             server->workerIndex, server->sessionCount);
+}
+
+
+/*******************************************************************************
+ *                    void* runServer(void* argument)
+ * Description: the event loop of one worker thread. Waits for activity on the
+ *   worker's listen socket and on every session's connections and dispatches
+ *   it, so that any number of clients are served at once on a single thread.
+ *   In each batch of events the connections Q of bulk transfers go last, so
+ *   interactive requests are served first. The wait ends early when a stripe
+ *   held back by a rate limit may send again.
+ *   Once shutdown begins the loop keeps running until the open sessions have
+ *   finished, or until SHUTDOWN_GRACE_SECONDS pass and they are closed
+ * Input: void* argument - the worker's struct server, with the listener active
+ * Output: NULL once the worker has shut down
+*******************************************************************************/
+void* runServer(void* argument) {
+  struct server* server = argument;
+  struct epoll_event events[MAX_EVENTS];
+  int deferred[MAX_EVENTS];
+  time_t deadline = 0;
+
+  WORKER_METRICS = &server->metrics;
+  WORKER_LOG = server->log;
+  if (PIN_CPUS) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(server->workerIndex % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+      logMessage(LOG_ERROR, "ERROR: could not pin worker %d to a CPU", server->workerIndex);
+    }
+  }
+
+  while(!server->draining || server->sessionCount > 0) {
+    int timeout = -1;
+    if (server->draining) {
+      if (deadline == 0) {
+        deadline = time(NULL) + SHUTDOWN_GRACE_SECONDS;
+      }
+      if (time(NULL) >= deadline) {
+        logMessage(LOG_ERROR, "Worker %d closing %d unfinished session(s)",
+                   server->workerIndex, server->sessionCount);
+        while (server->sessions != NULL) {
+          closeSession(server, server->sessions);
+        }
+        freeClosedSessions(server);
+        break;
+      }
+      timeout = 1000;
+    }
+    if (server->throttleDeadline != 0) {
+      int64_t wait = (server->throttleDeadline - monotonicNanos() + 999999) / 1000000;
+      wait = wait < 0 ? 0 : wait;
+      timeout = timeout < 0 || wait < timeout ? wait : timeout;
+    }
+    if (server->ring != NULL) {
+      submitRing(server->ring);
+    }
+    int count = epoll_wait(server->epollFD, events, MAX_EVENTS, timeout);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "ERROR waiting for events: %s\n", strerror(errno));
+      exit(1);
+    }
+    int i, pass;
+    for (pass = 0; pass < 2; pass++) {
+      for (i = 0; i < count; i++) {
+        struct endpoint* endpoint = events[i].data.ptr;
+        if (pass == 0) {
+          deferred[i] = endpoint->role == ROLE_Q && endpoint->owner->requestClass == CLASS_BULK;
+        }
+        if (deferred[i] != (pass == 1) ||
+            (endpoint->owner != NULL && endpoint->owner->state == STATE_CLOSED)) {
+          continue;
+        }
+        switch (endpoint->role) {
+          case ROLE_LISTEN:
+            acceptClients(server);
+            break;
+          case ROLE_WAKE:
+            beginShutdown(server);
+            break;
+          case ROLE_INOTIFY:
+            handleDirectoryChanges(server);
+            break;
+          case ROLE_RING:
+            handleRingCompletions(server);
+            break;
+          case ROLE_P:
+            handleConnectionP(server, endpoint->owner, events[i].events);
+            break;
+          case ROLE_Q:
+            handleConnectionQ(server, endpoint->owner, endpoint->index, events[i].events);
+            break;
+          case ROLE_DATA_LISTEN:
+            acceptDataConnections(server, endpoint->owner);
+            break;
+        }
+      }
+    }
+    resumeThrottled(server);
+    freeClosedSessions(server);
+  }
+  return NULL;
+}
+
+
+/*******************************************************************************
+ *           void startWorker(struct server* server, int workerIndex, int)
+ * Description: sets up a worker's event loop and listen socket and starts its
+ *   thread
+ * Input:
+ *   struct server* server - the worker's zeroed state
+ *   int workerIndex - the worker's number, used for CPU pinning and messages
+ *   int portNumber - the port to listen on
+ * Output: none
+*******************************************************************************/
+void startWorker(struct server* server, int workerIndex, int portNumber) {
+  server->workerIndex = workerIndex;
+  server->portNumber = portNumber;
+  server->copyBuffer = (char*)malloc(sizeof(char) * CHUNK_SIZE);
+  assert(server->copyBuffer != NULL);
+  server->splicePipe[0] = server->splicePipe[1] = -1;
+  server->direntBuffer = (char*)malloc(LISTING_BATCH_SIZE);
+  assert(server->direntBuffer != NULL);
+  if (LOG_LEVEL > LOG_NONE) {
+    server->log = calloc(1, sizeof(struct logRing));
+    assert(server->log != NULL);
+  }
+  server->epollFD = epoll_create1(EPOLL_CLOEXEC);
+  server->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (server->epollFD < 0 || server->wake.fd < 0) {
+    fprintf(stderr, "ERROR creating epoll instance\n");
+    exit(1);
+  }
+  server->wake.role = ROLE_WAKE;
+  setInterest(server, &server->wake, EPOLLIN);
+  server->inotify.fd = -1;
+  if (LISTING_CACHE_ENTRIES > 0 || FILE_CACHE_SIZE > 0) {
+    server->inotify.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (server->inotify.fd < 0) {
+      fprintf(stderr, "ERROR creating inotify instance, listings will not be cached and cached "
+              "files will be checked with stat()\n");
+    }
+    server->inotify.role = ROLE_INOTIFY;
+    setInterest(server, &server->inotify, EPOLLIN);
+  }
+  server->transmitMethod = TRANSMIT_SENDFILE;
+  if (USE_IO_URING) {
+    server->ring = setupRing();
+    if (server->ring != NULL) {
+      server->transmitMethod = TRANSMIT_URING;
+      setInterest(server, &server->ring->endpoint, EPOLLIN);
+    }
+    else {
+      fprintf(stderr, "Worker %d will send files with sendfile\n", workerIndex);
+    }
+  }
+
+  /* activate the socket */
+  activateListenSocket(&server->listener.fd, &server->portNumber);
+  server->listener.role = ROLE_LISTEN;
+  setInterest(server, &server->listener, EPOLLIN);
+
+  if (pthread_create(&server->thread, NULL, runServer, server) != 0) {
+    fprintf(stderr, "ERROR starting worker thread\n");
+    exit(1);
+  }
+}
+
+
+/*******************************************************************************
+ *                   void* runStatsSocket(void* argument)
+ * Description: the thread that answers on STATS_SOCKET_PATH. Each client that
+ *   connects is sent a JSON snapshot of the workers' metrics and the
+ *   connection is closed, so the snapshot can be read with any tool that
+ *   speaks Unix sockets. Runs until the reporters are told to stop
+ * Input: void* argument - the array of WORKERS workers
+ * Output: NULL once it has stopped
+*******************************************************************************/
+void* runStatsSocket(void* argument) {
+  struct server* workers = argument;
+  struct pollfd listener = {REPORTERS.statsFD, POLLIN, 0};
+  struct timeval timeout = {1, 0};
+  struct buffer reply;
+
+  memset(&reply, '\0', sizeof(reply));
+  while (!__atomic_load_n(&REPORTERS.stop, __ATOMIC_ACQUIRE)) {
+    if (poll(&listener, 1, 100) <= 0) {
+      continue;
+    }
+    int clientFD = accept4(REPORTERS.statsFD, NULL, NULL, SOCK_CLOEXEC);
+    if (clientFD < 0) {
+      continue;
+    }
+    // a client that doesn't read its snapshot can't hold the thread up
+    setsockopt(clientFD, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    resetBuffer(&reply);
+    formatStats(workers, WORKERS, &reply);
+    while (reply.sent < reply.length) {
+      ssize_t sent = send(clientFD, reply.bytes + reply.sent, reply.length - reply.sent, MSG_NOSIGNAL);
+      if (sent <= 0) {
+        break;
+      }
+      reply.sent += sent;
+    }
+    close(clientFD);
+  }
+  freeBuffer(&reply);
+  return NULL;
+}
+
+
+/*******************************************************************************
+ *               void startReporters(struct server* workers)
+ * Description: starts the logger thread, unless logging is turned off, and
+ *   the thread that answers on STATS_SOCKET_PATH if there is one
+ * Input: struct server* workers - the array of WORKERS started workers
+ * Output: none
+ * Postconditions: the program is terminated if the stats socket can't be
+ *   opened
+*******************************************************************************/
+void startReporters(struct server* workers) {
+  if (LOG_LEVEL > LOG_NONE) {
+    if (pthread_create(&REPORTERS.logger, NULL, runLogger, workers) != 0) {
+      fprintf(stderr, "ERROR starting logger thread\n");
+      exit(1);
+    }
+    REPORTERS.logging = TRUE;
+  }
+  if (STATS_SOCKET_PATH == NULL) {
+    return;
+  }
+
+  struct sockaddr_un address;
+  memset(&address, '\0', sizeof(address));
+  address.sun_family = AF_UNIX;
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", STATS_SOCKET_PATH);
+  // a socket left behind by a server that was killed is replaced
+  unlink(STATS_SOCKET_PATH);
+  REPORTERS.statsFD = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (REPORTERS.statsFD < 0 ||
+      bind(REPORTERS.statsFD, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+      listen(REPORTERS.statsFD, SOMAXCONN) < 0) {
+    fprintf(stderr, "ERROR opening stats socket %s: %s\n", STATS_SOCKET_PATH, strerror(errno));
+    exit(1);
+  }
+  if (pthread_create(&REPORTERS.stats, NULL, runStatsSocket, workers) != 0) {
+    fprintf(stderr, "ERROR starting stats thread\n");
+    exit(1);
+  }
+}
+
+
+/*******************************************************************************
+ *                        void stopReporters()
+ * Description: stops the stats thread and removes its socket, then stops
+ *   the logger thread once it has written out what the workers logged
+ * Input: none
+ * Output: none
+*******************************************************************************/
+void stopReporters() {
+  __atomic_store_n(&REPORTERS.stop, TRUE, __ATOMIC_RELEASE);
+  if (REPORTERS.statsFD >= 0) {
+    pthread_join(REPORTERS.stats, NULL);
+    close(REPORTERS.statsFD);
+    unlink(STATS_SOCKET_PATH);
+  }
+  if (REPORTERS.logging) {
+    pthread_join(REPORTERS.logger, NULL);
+  }
+}
+
+
+/*******************************************************************************
+ *           void waitForShutdown(struct server* workers, int count)
+ * Description: runs on the main thread while the workers serve clients. Waits
+ *   for SIGINT or SIGTERM, then wakes every worker so it stops accepting and
+ *   finishes its open sessions, and waits for the workers to exit. A second
+ *   SIGINT or SIGTERM exits immediately. SIGUSR1 prints the request latencies
+ *   and file cache counters at any time, and they are printed again once the
+ *   workers have exited and the logger thread has written out their last
+ *   messages
+ * Input:
+ *   struct server* workers - the array of running workers
+ *   int count - the number of workers
+ * Output: none
+*******************************************************************************/
+void waitForShutdown(struct server* workers, int count) {
+  sigset_t shutdownSignals;
+  int signalNumber, i, j;
+  uint64_t one = 1;
+
+  sigset_t waitSignals;
+  sigemptyset(&shutdownSignals);
+  sigaddset(&shutdownSignals, SIGINT);
+  sigaddset(&shutdownSignals, SIGTERM);
+  waitSignals = shutdownSignals;
+  sigaddset(&waitSignals, SIGUSR1);
+  // SIGUSR1 prints the request latencies and file cache counters and carries on
+  sigwait(&waitSignals, &signalNumber);
+  while (signalNumber == SIGUSR1) {
+    printLatencyStats(workers, count);
+    printFileCacheStats(workers, count);
+    sigwait(&waitSignals, &signalNumber);
+  }
+
+  printf("\nShutting down. Interrupt again to exit immediately\n");
+  fflush(stdout);
+  for (i = 0; i < count; i++) {
+    write(workers[i].wake.fd, &one, sizeof(one));
+  }
+
+  // a second signal while draining exits without waiting for the workers
+  pthread_sigmask(SIG_UNBLOCK, &shutdownSignals, NULL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  for (i = 0; i < count; i++) {
+    pthread_join(workers[i].thread, NULL);
+    close(workers[i].epollFD);
+    close(workers[i].wake.fd);
+    free(workers[i].copyBuffer);
+    if (workers[i].splicePipe[0] >= 0) {
+      close(workers[i].splicePipe[0]);
+      close(workers[i].splicePipe[1]);
+    }
+    free(workers[i].direntBuffer);
+    closeRing(workers[i].ring);
+  }
+  stopReporters();
+  for (i = 0; i < count; i++) {
+    free(workers[i].log);
+    for (j = 0; j < DIRECTORY_CACHE_ENTRIES; j++) {
+      dropDirectory(&workers[i].directories[j]);
+    }
+  }
+  printLatencyStats(workers, count);
+  printFileCacheStats(workers, count);
+}
+
+
+/*******************************************************************************
+ *                    int main(int argc, char* argv[])
+ * Description: this is the main function that runs ftserver. It takes a port
+ *   number passed in fromt he command line and starts the worker threads, each
+ *   listening on the supplied port number. The workers carry out the ft protol
+ *   as specified in Programming Assignment #2 CS372 for every client that
+ *   connects, until a SIGINT or SIGTERM shuts the server down
+ *
  * Input:
  *   -argv[1] - the port number that ftserver will listen on for incoming
  *              connections
@@ -544,49 +7942,29 @@ void processClientRequest(int connectionP_FD, char* clientIP, int hostPort) {
 int main(int argc, char *argv[])
 {
   /* variables */
-  int listenSocketFD,
-      connectionP_FD,
-      portNumber;
-
-  socklen_t sizeOfClientInfo;
-  struct sockaddr_in serverAddress, clientAddress;
-  char* clientIP;
-  buffer = (char*)malloc(sizeof(char) * BUFFER_LENGTH);
-  assert(buffer != NULL);
+  struct server* workers;
+  int portNumber, i;
 
   /* validate argument and get port number*/
   validateArgs(argc, argv);
   setSignalHandler();
+  raiseFileLimit();
+  loadDigestCache();
+  openRoot();
   portNumber = atoi(argv[1]);
 
-  /* activate the socket */
-  activateListenSocket(&listenSocketFD, &portNumber, &serverAddress);
-  sizeOfClientInfo = sizeof(clientAddress);
-
-  /* run the serer */
-  while(TRUE) {
-    
-    printf("\nServer open on port %d\n", portNumber);
-    fflush(stdout);
-    connectionP_FD = accept(listenSocketFD, 
-                                     (struct sockaddr*) &clientAddress,
-                                     &sizeOfClientInfo);
-    /* Source for getting clientIP address from an established connection
-       https://stackoverflow.com/questions/4282369/determining-the-ip-address-
-                                             of-a-connected-client-on-the-server
-    */
-    clientIP = inet_ntoa(clientAddress.sin_addr);
-    printf("Connection from %s\n", clientIP);
-    fflush(stdout);
-
-    if(connectionP_FD < 0) {
-      fprintf(stderr, "ERROR on accepting incoming connection.\n");
-      exit(1);
-    }
-    else {
-      processClientRequest(connectionP_FD, clientIP, portNumber);
-    }
+  /* start the workers */
+  workers = calloc(WORKERS, sizeof(struct server));
+  assert(workers != NULL);
+  for (i = 0; i < WORKERS; i++) {
+    startWorker(&workers[i], i, portNumber);
   }
+  startReporters(workers);
+  printf("\nServer open on port %d with %d worker(s)\n", portNumber, WORKERS);
+  fflush(stdout);
+
+  waitForShutdown(workers, WORKERS);
+  free(workers);
 
   return 0;
 }